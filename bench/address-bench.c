@@ -0,0 +1,203 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+
+/*
+ * Compare the sscanf() based address classification previously used
+ * by the normalize plugin with manager_address_parse(), over alerts
+ * carrying many addresses. IPv4 mapped IPv6 addresses are remapped as
+ * normalize does by default.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libprelude/prelude.h>
+
+#include "prelude-manager.h"
+
+
+#define ALERT_COUNT       1000
+#define ADDRESS_PER_ALERT 64
+#define ITERATIONS        20
+
+
+static char addresses[ALERT_COUNT * ADDRESS_PER_ALERT][64];
+
+
+
+static double get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static void build_addresses(void)
+{
+        size_t i;
+        uint32_t r = 2463534242U;
+
+        for ( i = 0; i < sizeof(addresses) / sizeof(*addresses); i++ ) {
+                r ^= r << 13;
+                r ^= r >> 17;
+                r ^= r << 5;
+
+                switch ( r % 10 ) {
+                case 0:
+                        snprintf(addresses[i], sizeof(addresses[i]), "2001:db8::%x:%x", r & 0xffff, r >> 16);
+                        break;
+
+                case 1:
+                        snprintf(addresses[i], sizeof(addresses[i]), "::ffff:192.168.%u.%u", r & 0xff, (r >> 8) & 0xff);
+                        break;
+
+                case 2:
+                        snprintf(addresses[i], sizeof(addresses[i]), "user%u@example.com", r % 1000);
+                        break;
+
+                default:
+                        snprintf(addresses[i], sizeof(addresses[i]), "10.%u.%u.%u", r & 0xff, (r >> 8) & 0xff, r >> 24);
+                        break;
+                }
+        }
+}
+
+
+
+static int classify_sscanf(const char *str, prelude_string_t **out)
+{
+        int ret;
+        int a, b, c, d;
+        char buf1[256], buf2[256];
+        prelude_bool_t ipv6_prefix = FALSE;
+
+        if ( strncmp(str, "::ffff:", 7) == 0 )
+                ipv6_prefix = TRUE;
+
+        ret = sscanf(str + ((ipv6_prefix) ? 7 : 0), "%d.%d.%d.%d", &a, &b, &c, &d);
+        if ( ret == 4 ) {
+                if ( ipv6_prefix && prelude_string_new_dup(out, str + 7) < 0 )
+                        return -1;
+
+                return IDMEF_ADDRESS_CATEGORY_IPV4_ADDR;
+        }
+
+        ret = sscanf(str, "%255[^@]@%255s", buf1, buf2);
+        if ( ret == 2 )
+                return IDMEF_ADDRESS_CATEGORY_E_MAIL;
+
+        if ( (str = strchr(str, ':')) && strchr(str + 1, ':') )
+                return IDMEF_ADDRESS_CATEGORY_IPV6_ADDR;
+
+        return IDMEF_ADDRESS_CATEGORY_UNKNOWN;
+}
+
+
+
+static int classify_parser(const char *str, prelude_string_t **out)
+{
+        size_t len;
+        char buf[16];
+        manager_address_t parsed;
+
+        manager_address_parse(&parsed, str);
+
+        if ( parsed.ipv4_mapped ) {
+                len = manager_address_ipv4_to_string(parsed.addr, buf);
+                if ( prelude_string_new_dup_fast(out, buf, len) < 0 )
+                        return -1;
+        }
+
+        return parsed.category;
+}
+
+
+
+static void run(const char *name, int (*classify)(const char *str, prelude_string_t **out))
+{
+        int ret;
+        double start, elapsed;
+        size_t i, j, total = 0;
+        prelude_string_t *out;
+        unsigned long category[IDMEF_ADDRESS_CATEGORY_IPV6_NET_MASK + 1];
+
+        memset(category, 0, sizeof(category));
+
+        start = get_time();
+
+        for ( j = 0; j < ITERATIONS; j++ ) {
+                for ( i = 0; i < sizeof(addresses) / sizeof(*addresses); i++ ) {
+                        out = NULL;
+                        total++;
+
+                        ret = classify(addresses[i], &out);
+                        if ( ret >= 0 )
+                                category[ret]++;
+
+                        if ( out )
+                                prelude_string_destroy(out);
+                }
+        }
+
+        elapsed = get_time() - start;
+
+        printf("%-8s %8.1f ns/address %10.1f ns/alert (ipv4=%lu ipv6=%lu e-mail=%lu)\n", name,
+               elapsed * 1e9 / total, elapsed * 1e9 / (total / ADDRESS_PER_ALERT),
+               category[IDMEF_ADDRESS_CATEGORY_IPV4_ADDR] / ITERATIONS,
+               category[IDMEF_ADDRESS_CATEGORY_IPV6_ADDR] / ITERATIONS,
+               category[IDMEF_ADDRESS_CATEGORY_E_MAIL] / ITERATIONS);
+}
+
+
+
+int main(int argc, char **argv)
+{
+        int ret;
+
+        ret = prelude_init(&argc, argv);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error initializing libprelude");
+                return 1;
+        }
+
+        build_addresses();
+
+        printf("%u alerts of %u addresses\n", ALERT_COUNT, ADDRESS_PER_ALERT);
+
+        run("sscanf", classify_sscanf);
+        run("parser", classify_parser);
+
+        prelude_deinit();
+
+        return 0;
+}
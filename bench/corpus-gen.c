@@ -0,0 +1,384 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+
+/*
+ * Write a corpus of alerts and heartbeats, as the raw message stream a
+ * sensor would send, for use by the pipeline benchmark.
+ *
+ * Messages vary in size: number of sources and targets, addresses per
+ * node, classification references and additional data payloads from a
+ * few bytes up to 16 kilobytes. The generator is deterministic for a
+ * given seed.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+
+#define DEFAULT_COUNT 10000
+#define DEFAULT_HEARTBEAT_PERCENT 10
+#define MAX_PAYLOAD 16384
+
+
+static FILE *out;
+static uint32_t seed = 2463534242U;
+
+static const char *protocols[] = { "tcp", "udp", "icmp", "TCP", "ipv6-icmp", "sctp" };
+static const char *severities[] = { "info", "low", "medium", "high" };
+static const char *classifications[] = {
+        "Remote Login", "Web server directory traversal", "SQL injection attempt",
+        "Port scan", "Brute force login attempt", "Buffer overflow attempt"
+};
+
+
+
+static uint32_t get_random(void)
+{
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+
+        return seed;
+}
+
+
+
+static int write_msg(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+{
+        size_t ret;
+
+        ret = fwrite(prelude_msg_get_message_data(msg), 1, prelude_msg_get_len(msg), out);
+        if ( ret != prelude_msg_get_len(msg) )
+                return prelude_error_from_errno(errno);
+
+        return 0;
+}
+
+
+
+static int set_string(idmef_message_t *idmef, const char *path, const char *value)
+{
+        int ret;
+        idmef_path_t *ipath;
+        idmef_value_t *ivalue;
+
+        ret = idmef_path_new_fast(&ipath, path);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_value_new_from_path(&ivalue, ipath, value);
+        if ( ret < 0 ) {
+                idmef_path_destroy(ipath);
+                return ret;
+        }
+
+        ret = idmef_path_set(ipath, idmef, ivalue);
+
+        idmef_value_destroy(ivalue);
+        idmef_path_destroy(ipath);
+
+        return ret;
+}
+
+
+
+/*
+ * Mostly IPv4, with some IPv6 and IPv4 mapped IPv6 addresses.
+ */
+static void get_address(char *buf, size_t size)
+{
+        uint32_t r = get_random();
+
+        switch ( r % 8 ) {
+        case 0:
+                snprintf(buf, size, "2001:db8::%x:%x", (r >> 8) & 0xffff, (r >> 16) & 0xff);
+                break;
+
+        case 1:
+                snprintf(buf, size, "::ffff:192.168.%u.%u", (r >> 8) & 0xff, (r >> 16) & 0xff);
+                break;
+
+        default:
+                snprintf(buf, size, "10.%u.%u.%u", (r >> 8) & 0xff, (r >> 16) & 0xff, (r >> 24) & 0xff);
+                break;
+        }
+}
+
+
+
+/*
+ * Payload sizes follow a roughly exponential distribution, so that
+ * most of them are small.
+ */
+static size_t get_payload_size(void)
+{
+        return (16U << (get_random() % 11)) % MAX_PAYLOAD + get_random() % 16;
+}
+
+
+
+static void add_additional_data(idmef_message_t *idmef, const char *root, unsigned int count)
+{
+        size_t len;
+        unsigned int i;
+        char path[128];
+        static char buf[MAX_PAYLOAD + 16];
+
+        for ( i = 0; i < count; i++ ) {
+                len = get_payload_size();
+                memset(buf, 'A' + get_random() % 26, len);
+                buf[len] = 0;
+
+                snprintf(path, sizeof(path), "%s.additional_data(%u).meaning", root, i);
+                set_string(idmef, path, (i == 0) ? "payload" : "context");
+
+                snprintf(path, sizeof(path), "%s.additional_data(%u).data", root, i);
+                set_string(idmef, path, buf);
+        }
+}
+
+
+
+static void add_node(idmef_message_t *idmef, const char *root, unsigned int index)
+{
+        char path[128], buf[128];
+        unsigned int i, naddr = 1 + get_random() % 3;
+
+        snprintf(path, sizeof(path), "%s(%u).node.name", root, index);
+        snprintf(buf, sizeof(buf), "host%u.example.com", get_random() % 1000);
+        set_string(idmef, path, buf);
+
+        for ( i = 0; i < naddr; i++ ) {
+                snprintf(path, sizeof(path), "%s(%u).node.address(%u).address", root, index, i);
+                get_address(buf, sizeof(buf));
+                set_string(idmef, path, buf);
+        }
+
+        snprintf(path, sizeof(path), "%s(%u).service.port", root, index);
+        snprintf(buf, sizeof(buf), "%u", 1 + get_random() % 65535);
+        set_string(idmef, path, buf);
+
+        snprintf(path, sizeof(path), "%s(%u).service.protocol", root, index);
+        set_string(idmef, path, protocols[get_random() % (sizeof(protocols) / sizeof(*protocols))]);
+}
+
+
+
+static int build_alert(idmef_message_t **idmef, unsigned int index)
+{
+        int ret;
+        char path[128], buf[128];
+        unsigned int i, count;
+        idmef_alert_t *alert;
+        idmef_time_t *create_time;
+
+        ret = idmef_message_new(idmef);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_message_new_alert(*idmef, &alert);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_alert_new_create_time(alert, &create_time);
+        if ( ret < 0 )
+                return ret;
+
+        idmef_time_set_from_gettimeofday(create_time);
+
+        snprintf(buf, sizeof(buf), "%u", index);
+        set_string(*idmef, "alert.messageid", buf);
+
+        snprintf(buf, sizeof(buf), "%u", 1000 + get_random() % 32);
+        set_string(*idmef, "alert.analyzer(0).analyzerid", buf);
+        set_string(*idmef, "alert.analyzer(0).name", "corpus-gen");
+        set_string(*idmef, "alert.analyzer(0).model", "Prelude Manager corpus generator");
+
+        i = get_random() % (sizeof(classifications) / sizeof(*classifications));
+        set_string(*idmef, "alert.classification.text", classifications[i]);
+
+        count = get_random() % 4;
+        for ( i = 0; i < count; i++ ) {
+                snprintf(path, sizeof(path), "alert.classification.reference(%u).origin", i);
+                set_string(*idmef, path, "cve");
+
+                snprintf(path, sizeof(path), "alert.classification.reference(%u).name", i);
+                snprintf(buf, sizeof(buf), "CVE-2010-%04u", get_random() % 10000);
+                set_string(*idmef, path, buf);
+        }
+
+        set_string(*idmef, "alert.assessment.impact.severity",
+                   severities[get_random() % (sizeof(severities) / sizeof(*severities))]);
+
+        count = 1 + get_random() % 4;
+        for ( i = 0; i < count; i++ )
+                add_node(*idmef, "alert.source", i);
+
+        count = 1 + get_random() % 4;
+        for ( i = 0; i < count; i++ )
+                add_node(*idmef, "alert.target", i);
+
+        add_additional_data(*idmef, "alert", get_random() % 7);
+
+        return 0;
+}
+
+
+
+static int build_heartbeat(idmef_message_t **idmef, unsigned int index)
+{
+        int ret;
+        char buf[128];
+        idmef_heartbeat_t *heartbeat;
+        idmef_time_t *create_time;
+
+        ret = idmef_message_new(idmef);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_message_new_heartbeat(*idmef, &heartbeat);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_heartbeat_new_create_time(heartbeat, &create_time);
+        if ( ret < 0 )
+                return ret;
+
+        idmef_time_set_from_gettimeofday(create_time);
+
+        snprintf(buf, sizeof(buf), "%u", index);
+        set_string(*idmef, "heartbeat.messageid", buf);
+
+        snprintf(buf, sizeof(buf), "%u", 1000 + get_random() % 32);
+        set_string(*idmef, "heartbeat.analyzer(0).analyzerid", buf);
+        set_string(*idmef, "heartbeat.analyzer(0).name", "corpus-gen");
+        set_string(*idmef, "heartbeat.heartbeat_interval", "600");
+
+        add_additional_data(*idmef, "heartbeat", get_random() % 3);
+
+        return 0;
+}
+
+
+
+static void print_usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-n count] [-b heartbeat-percent] [-s seed] output\n", prog);
+}
+
+
+
+int main(int argc, char **argv)
+{
+        int ret, c;
+        unsigned int i;
+        prelude_msgbuf_t *msgbuf;
+        idmef_message_t *idmef;
+        unsigned int count = DEFAULT_COUNT, heartbeat_percent = DEFAULT_HEARTBEAT_PERCENT;
+
+        while ( (c = getopt(argc, argv, "n:b:s:")) != -1 ) {
+                switch ( c ) {
+                case 'n':
+                        count = strtoul(optarg, NULL, 0);
+                        break;
+
+                case 'b':
+                        heartbeat_percent = strtoul(optarg, NULL, 0);
+                        break;
+
+                case 's':
+                        seed = strtoul(optarg, NULL, 0);
+                        if ( ! seed )
+                                seed = 1;
+                        break;
+
+                default:
+                        print_usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if ( optind + 1 != argc ) {
+                print_usage(argv[0]);
+                return 1;
+        }
+
+        ret = prelude_init(NULL, NULL);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error initializing libprelude");
+                return 1;
+        }
+
+        out = fopen(argv[optind], "w");
+        if ( ! out ) {
+                fprintf(stderr, "could not open '%s' for writing: %s.\n", argv[optind], strerror(errno));
+                return 1;
+        }
+
+        ret = prelude_msgbuf_new(&msgbuf);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error creating message buffer");
+                return 1;
+        }
+
+        prelude_msgbuf_set_callback(msgbuf, write_msg);
+
+        for ( i = 0; i < count; i++ ) {
+                if ( get_random() % 100 < heartbeat_percent )
+                        ret = build_heartbeat(&idmef, i);
+                else
+                        ret = build_alert(&idmef, i);
+
+                if ( ret < 0 ) {
+                        prelude_perror(ret, "error building message %u", i);
+                        return 1;
+                }
+
+                idmef_message_write(idmef, msgbuf);
+                prelude_msgbuf_mark_end(msgbuf);
+
+                idmef_message_destroy(idmef);
+        }
+
+        prelude_msgbuf_destroy(msgbuf);
+
+        if ( fclose(out) != 0 ) {
+                fprintf(stderr, "error writing '%s': %s.\n", argv[optind], strerror(errno));
+                return 1;
+        }
+
+        printf("wrote %u messages to %s.\n", count, argv[optind]);
+        prelude_deinit();
+
+        return 0;
+}
@@ -0,0 +1,337 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+
+
+/*
+ * Compare idmef_criteria_match() with the compiled criteria program
+ * used by the idmef-criteria plugin, for a rule set similar to a rule
+ * file: many rules sharing the same paths and criteria, combined with
+ * OR.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <libprelude/prelude.h>
+
+#include "criteria-program.h"
+
+
+#define DEFAULT_RULE_COUNT 200
+#define DEFAULT_ITERATIONS 10
+
+
+static size_t corpus_count = 0;
+static idmef_message_t **corpus = NULL;
+static unsigned int iterations = DEFAULT_ITERATIONS;
+
+static const char *severities[] = { "info", "low", "medium", "high" };
+static const char *classifications[] = {
+        "Remote Login", "Web server directory traversal", "SQL injection attempt",
+        "Port scan", "Brute force login attempt", "Buffer overflow attempt"
+};
+
+
+
+static double get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static int read_corpus(const char *filename)
+{
+        int ret;
+        FILE *fd;
+        prelude_io_t *fdi;
+        prelude_msg_t *msg;
+        idmef_message_t *idmef, **tmp;
+
+        fd = fopen(filename, "r");
+        if ( ! fd ) {
+                fprintf(stderr, "could not open corpus '%s'.\n", filename);
+                return -1;
+        }
+
+        ret = prelude_io_new(&fdi);
+        if ( ret < 0 ) {
+                fclose(fd);
+                return ret;
+        }
+
+        prelude_io_set_file_io(fdi, fd);
+
+        do {
+                msg = NULL;
+
+                ret = prelude_msg_read(&msg, fdi);
+                if ( ret < 0 ) {
+                        if ( msg )
+                                prelude_msg_destroy(msg);
+                        break;
+                }
+
+                ret = idmef_message_new(&idmef);
+                if ( ret < 0 ) {
+                        prelude_msg_destroy(msg);
+                        break;
+                }
+
+                ret = idmef_message_read(idmef, msg);
+                if ( ret < 0 ) {
+                        idmef_message_destroy(idmef);
+                        prelude_msg_destroy(msg);
+                        break;
+                }
+
+                idmef_message_set_pmsg(idmef, msg);
+
+                tmp = realloc(corpus, (corpus_count + 1) * sizeof(*corpus));
+                if ( ! tmp ) {
+                        idmef_message_destroy(idmef);
+                        break;
+                }
+
+                corpus = tmp;
+                corpus[corpus_count++] = idmef;
+        } while ( 1 );
+
+        prelude_io_close(fdi);
+        prelude_io_destroy(fdi);
+
+        if ( prelude_error_get_code(ret) != PRELUDE_ERROR_EOF ) {
+                prelude_perror(ret, "error reading corpus '%s'", filename);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * Rules use the values found in corpus-gen messages, so that part of
+ * them match, along with indicator lists on the classification text.
+ */
+static int build_criteria(idmef_criteria_t **criteria, unsigned int count)
+{
+        int ret;
+        char buf[512];
+        unsigned int i;
+        idmef_criteria_t *new;
+
+        *criteria = NULL;
+
+        for ( i = 0; i < count; i++ ) {
+                switch ( i % 5 ) {
+                case 0:
+                        snprintf(buf, sizeof(buf), "alert.assessment.impact.severity == '%s' && "
+                                 "alert.classification.text == '%s' && alert.analyzer(0).analyzerid == '%u'",
+                                 severities[i % 4], classifications[(i / 4) % 6], 1000 + i % 32);
+                        break;
+
+                case 1:
+                        snprintf(buf, sizeof(buf), "alert.assessment.impact.severity == 'high' && "
+                                 "alert.source(0).node.name == 'host%u.example.com'", i % 1000);
+                        break;
+
+                case 2:
+                        snprintf(buf, sizeof(buf), "alert.classification.text <> 'attempt' && "
+                                 "alert.target(0).service.port == %u", 1 + i * 331 % 65535);
+                        break;
+
+                case 3:
+                        snprintf(buf, sizeof(buf), "alert.classification.text <>* 'ioc-%u' || "
+                                 "alert.classification.text == 'Indicator %u'", i, i);
+                        break;
+
+                default:
+                        snprintf(buf, sizeof(buf), "(alert.assessment.impact.severity == 'high' || "
+                                 "alert.assessment.impact.severity == 'medium') && ! alert.classification.reference(0).name "
+                                 "&& alert.analyzer(0).analyzerid == '%u'", 1000 + i % 32);
+                        break;
+                }
+
+                ret = idmef_criteria_new_from_string(&new, buf);
+                if ( ret < 0 ) {
+                        prelude_perror(ret, "error parsing criteria '%s'", buf);
+                        return ret;
+                }
+
+                if ( *criteria )
+                        idmef_criteria_or_criteria(*criteria, new);
+                else
+                        *criteria = new;
+        }
+
+        return 0;
+}
+
+
+
+static void run(const char *name, int (*match)(void *data, idmef_message_t *message), void *data, unsigned int *result)
+{
+        int ret;
+        size_t i;
+        unsigned int iter, matched = 0;
+        double start, elapsed;
+
+        start = get_time();
+
+        for ( iter = 0; iter < iterations; iter++ ) {
+                for ( i = 0; i < corpus_count; i++ ) {
+                        ret = match(data, corpus[i]);
+                        if ( ret > 0 )
+                                matched++;
+
+                        if ( iter == 0 )
+                                result[i] = ret;
+                }
+        }
+
+        elapsed = get_time() - start;
+
+        printf("%-16s %10.0f msgs/s %9.1f ns/msg %u matched\n", name,
+               corpus_count * iterations / elapsed, elapsed * 1e9 / (corpus_count * iterations), matched / iterations);
+}
+
+
+
+static int match_criteria(void *data, idmef_message_t *message)
+{
+        return idmef_criteria_match(data, message);
+}
+
+
+
+static int match_program(void *data, idmef_message_t *message)
+{
+        return criteria_program_match(data, message);
+}
+
+
+
+static void print_usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-i iterations] [-n rules] corpus\n", prog);
+}
+
+
+
+int main(int argc, char **argv)
+{
+        size_t i;
+        int ret, c;
+        idmef_criteria_t *criteria, *compiled;
+        criteria_program_t *program;
+        unsigned int *expected, *result, mismatch = 0, rules = DEFAULT_RULE_COUNT;
+
+        while ( (c = getopt(argc, argv, "i:n:")) != -1 ) {
+                switch ( c ) {
+                case 'i':
+                        iterations = strtoul(optarg, NULL, 0);
+                        break;
+
+                case 'n':
+                        rules = strtoul(optarg, NULL, 0);
+                        break;
+
+                default:
+                        print_usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if ( optind >= argc || iterations == 0 || rules == 0 ) {
+                print_usage(argv[0]);
+                return 1;
+        }
+
+        ret = prelude_init(NULL, NULL);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error initializing libprelude");
+                return 1;
+        }
+
+        ret = read_corpus(argv[optind]);
+        if ( ret < 0 )
+                return 1;
+
+        if ( build_criteria(&criteria, rules) < 0 || build_criteria(&compiled, rules) < 0 )
+                return 1;
+
+        ret = criteria_program_new(&program, compiled, NULL);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error compiling criteria");
+                return 1;
+        }
+
+        expected = calloc(corpus_count, sizeof(*expected));
+        result = calloc(corpus_count, sizeof(*result));
+        if ( ! expected || ! result ) {
+                fprintf(stderr, "memory exhausted.\n");
+                return 1;
+        }
+
+        printf("corpus: %" PRELUDE_PRIu64 " messages, %u rules, %u iterations\n",
+               (uint64_t) corpus_count, rules, iterations);
+
+        run("criteria_match", match_criteria, criteria, expected);
+        run("program", match_program, program, result);
+
+        for ( i = 0; i < corpus_count; i++ ) {
+                if ( expected[i] != result[i] )
+                        mismatch++;
+        }
+
+        if ( mismatch )
+                printf("%u messages with a different result.\n", mismatch);
+
+        criteria_program_print_stats(program, "program");
+
+        for ( i = 0; i < corpus_count; i++ )
+                idmef_message_destroy(corpus[i]);
+
+        criteria_program_destroy(program);
+        idmef_criteria_destroy(criteria);
+
+        free(expected);
+        free(result);
+        free(corpus);
+
+        prelude_deinit();
+
+        return (mismatch) ? 1 : 0;
+}
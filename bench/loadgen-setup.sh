@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Create the profiles used for load testing on a single host: the
+# manager profile (and its certificate authority) if it does not exist
+# yet, and the prelude-manager-loadgen sensor profile, registered to it
+# with a one-time password.
+#
+# Usage: loadgen-setup.sh [manager-profile] [loadgen-profile]
+#
+# The manager is then started with the sink plugin, e.g.
+#   prelude-manager --sink --interval=10
+# and the load generator run as the same user:
+#   prelude-manager-loadgen -c 1000 -r 20000 bench-corpus.raw
+
+manager_profile=${1:-prelude-manager}
+loadgen_profile=${2:-prelude-manager-loadgen}
+passwd=loadgen-$$
+
+uid=`id -u`
+gid=`id -g`
+
+prelude-admin add "$manager_profile" --uid "$uid" --gid "$gid" 2>/dev/null
+
+prelude-admin registration-server "$manager_profile" --passwd="$passwd" --no-confirm &
+server=$!
+
+# Leave the registration server time to listen.
+sleep 2
+
+prelude-admin register "$loadgen_profile" "idmef:w" 127.0.0.1 --uid "$uid" --gid "$gid" --passwd="$passwd"
+ret=$?
+
+kill $server 2>/dev/null
+wait $server 2>/dev/null
+
+exit $ret
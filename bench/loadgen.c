@@ -0,0 +1,752 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+
+/*
+ * prelude-manager-loadgen: simulate a large number of sensors sending
+ * the messages of a corpus written by corpus-gen to a manager, over
+ * TCP with TLS, or over the manager unix socket.
+ *
+ * Every message carry a CLOCK_MONOTONIC send timestamp as additional
+ * data, from which the manager sink report plugin compute the ingest
+ * to report latency. Both should run on the same host.
+ *
+ * Beside the steady rate, periodic reconnect storms can be simulated:
+ * a fraction of the sensors disconnect, reconnect all at once, then
+ * flush a backlog of messages without pacing, as a sensor would after
+ * a manager restart.
+ *
+ * The sensor profile is expected to be registered to the manager, see
+ * loadgen-setup.sh.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "pmsg-index.h"
+
+
+/*
+ * Should match the definition in plugins/reports/sink/sink.c.
+ */
+#define SINK_TIMESTAMP_MEANING "loadgen-timestamp"
+
+#define DEFAULT_PROFILE "prelude-manager-loadgen"
+#define DEFAULT_ADDRESS "127.0.0.1"
+#define DEFAULT_SENSORS 1000
+#define DEFAULT_COUNT 100000
+
+#define PRIORITY_END 3
+
+
+/*
+ * Placeholder for the timestamp, located in the encoded message once,
+ * and overwritten before each send.
+ */
+static const unsigned char timestamp_marker[8] = { 0xa5, 0x5a, 0xc3, 0x3c, 0x96, 0x69, 0xf0, 0x0f };
+
+
+typedef struct {
+        prelude_msg_t *msg[PRIORITY_END];
+        size_t timestamp_offset[PRIORITY_END];
+} entry_t;
+
+
+typedef struct {
+        prelude_connection_t *cnx;
+        prelude_bool_t connected;
+} sensor_t;
+
+
+typedef struct {
+        uint64_t *latency;
+        size_t count;
+        size_t size;
+} latency_t;
+
+
+static const uint8_t priorities[PRIORITY_END] = {
+        PRELUDE_MSG_PRIORITY_HIGH, PRELUDE_MSG_PRIORITY_MID, PRELUDE_MSG_PRIORITY_LOW
+};
+
+static const char *profile_name = DEFAULT_PROFILE;
+static const char *address = DEFAULT_ADDRESS;
+static unsigned int nsensor = DEFAULT_SENSORS;
+static uint64_t count = DEFAULT_COUNT;
+static unsigned int rate = 0;
+static unsigned int priority_mix[PRIORITY_END] = { 10, 30, 60 };
+static unsigned int storm_interval = 0;
+static unsigned int storm_percent = 10;
+static unsigned int backlog = 0;
+
+static prelude_client_profile_t *profile;
+static sensor_t *sensors;
+
+static size_t corpus_count = 0;
+static entry_t *corpus = NULL;
+
+static unsigned char *encoded = NULL;
+static size_t encoded_len = 0, encoded_size = 0;
+
+static uint64_t sent = 0, sent_bytes = 0, send_errors = 0, connect_errors = 0;
+static latency_t connect_latency;
+
+
+
+static uint64_t get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+static void latency_add(latency_t *latency, uint64_t value)
+{
+        uint64_t *tmp;
+
+        if ( latency->count == latency->size ) {
+                tmp = realloc(latency->latency, (latency->size + 1024) * sizeof(*tmp));
+                if ( ! tmp )
+                        return;
+
+                latency->latency = tmp;
+                latency->size += 1024;
+        }
+
+        latency->latency[latency->count++] = value;
+}
+
+
+
+static int latency_cmp(const void *a, const void *b)
+{
+        const uint64_t *l1 = a, *l2 = b;
+
+        return (*l1 > *l2) - (*l1 < *l2);
+}
+
+
+
+static void latency_print(const char *name, latency_t *latency)
+{
+        if ( ! latency->count )
+                return;
+
+        qsort(latency->latency, latency->count, sizeof(*latency->latency), latency_cmp);
+
+        printf("%s: %" PRELUDE_PRIu64 " samples, p50 %.1f ms p99 %.1f ms max %.1f ms\n", name,
+               (uint64_t) latency->count, latency->latency[latency->count / 2] / 1e6,
+               latency->latency[latency->count * 99 / 100] / 1e6, latency->latency[latency->count - 1] / 1e6);
+}
+
+
+
+/*
+ * Gather the payload of every fragment written for a message.
+ */
+static int encode_msg(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+{
+        unsigned char *tmp;
+        size_t len = prelude_msg_get_len(msg) - PMSG_HEADER_SIZE;
+
+        if ( encoded_len + len > encoded_size ) {
+                tmp = realloc(encoded, encoded_len + len);
+                if ( ! tmp )
+                        return prelude_error_from_errno(errno);
+
+                encoded = tmp;
+                encoded_size = encoded_len + len;
+        }
+
+        memcpy(encoded + encoded_len, prelude_msg_get_message_data(msg) + PMSG_HEADER_SIZE, len);
+        encoded_len += len;
+
+        return 0;
+}
+
+
+
+static int add_timestamp_marker(idmef_message_t *idmef)
+{
+        int ret;
+        idmef_alert_t *alert;
+        idmef_heartbeat_t *heartbeat;
+        prelude_string_t *meaning;
+        idmef_additional_data_t *ad;
+
+        alert = idmef_message_get_alert(idmef);
+        heartbeat = idmef_message_get_heartbeat(idmef);
+
+        if ( alert )
+                ret = idmef_alert_new_additional_data(alert, &ad, IDMEF_LIST_APPEND);
+        else if ( heartbeat )
+                ret = idmef_heartbeat_new_additional_data(heartbeat, &ad, IDMEF_LIST_APPEND);
+        else
+                return -1;
+
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_additional_data_new_meaning(ad, &meaning);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_string_set_constant(meaning, SINK_TIMESTAMP_MEANING);
+        if ( ret < 0 )
+                return ret;
+
+        return idmef_additional_data_set_byte_string_dup(ad, timestamp_marker, sizeof(timestamp_marker));
+}
+
+
+
+static int find_timestamp_marker(prelude_msg_t *msg, size_t *offset)
+{
+        size_t i, len = prelude_msg_get_len(msg);
+        const unsigned char *data = prelude_msg_get_message_data(msg);
+
+        for ( i = len - sizeof(timestamp_marker) + 1; i > 0; i-- ) {
+                if ( memcmp(data + i - 1, timestamp_marker, sizeof(timestamp_marker)) == 0 ) {
+                        *offset = i - 1;
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+
+
+/*
+ * Build one message per priority from the encoded payload.
+ */
+static int build_entry(entry_t *entry)
+{
+        int ret;
+        size_t i, j, len = 0;
+        pmsg_index_t index;
+
+        ret = pmsg_index_build(&index, encoded, encoded_len);
+        if ( ret < 0 ) {
+                pmsg_index_destroy(&index);
+                return ret;
+        }
+
+        for ( j = 0; j < index.count; j++ )
+                len += index.tlv[j].len;
+
+        for ( i = 0; i < PRIORITY_END; i++ ) {
+                ret = prelude_msg_new(&entry->msg[i], index.count, len, PRELUDE_MSG_IDMEF, priorities[i]);
+                if ( ret < 0 )
+                        break;
+
+                for ( j = 0; j < index.count; j++ )
+                        prelude_msg_set(entry->msg[i], index.tlv[j].tag, index.tlv[j].len, index.tlv[j].value);
+
+                prelude_msg_mark_end(entry->msg[i]);
+
+                ret = find_timestamp_marker(entry->msg[i], &entry->timestamp_offset[i]);
+                if ( ret < 0 )
+                        break;
+        }
+
+        pmsg_index_destroy(&index);
+
+        return ret;
+}
+
+
+
+static int load_message(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+{
+        int ret;
+        entry_t *tmp;
+        idmef_message_t *idmef;
+
+        ret = idmef_message_new(&idmef);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_message_read(idmef, msg);
+        if ( ret < 0 ) {
+                idmef_message_destroy(idmef);
+                return ret;
+        }
+
+        ret = add_timestamp_marker(idmef);
+        if ( ret < 0 ) {
+                idmef_message_destroy(idmef);
+                return ret;
+        }
+
+        encoded_len = 0;
+        idmef_message_write(idmef, msgbuf);
+        prelude_msgbuf_mark_end(msgbuf);
+        idmef_message_destroy(idmef);
+
+        tmp = realloc(corpus, (corpus_count + 1) * sizeof(*corpus));
+        if ( ! tmp )
+                return prelude_error_from_errno(errno);
+
+        corpus = tmp;
+        memset(&corpus[corpus_count], 0, sizeof(*corpus));
+
+        ret = build_entry(&corpus[corpus_count]);
+        if ( ret < 0 )
+                return ret;
+
+        corpus_count++;
+
+        return 0;
+}
+
+
+
+static int read_corpus(const char *filename)
+{
+        int ret;
+        FILE *fd;
+        prelude_io_t *fdi;
+        prelude_msg_t *msg;
+        prelude_msgbuf_t *msgbuf;
+
+        fd = fopen(filename, "r");
+        if ( ! fd ) {
+                fprintf(stderr, "could not open corpus '%s'.\n", filename);
+                return -1;
+        }
+
+        ret = prelude_io_new(&fdi);
+        if ( ret < 0 ) {
+                fclose(fd);
+                return ret;
+        }
+
+        prelude_io_set_file_io(fdi, fd);
+
+        ret = prelude_msgbuf_new(&msgbuf);
+        if ( ret < 0 ) {
+                prelude_io_close(fdi);
+                prelude_io_destroy(fdi);
+                return ret;
+        }
+
+        prelude_msgbuf_set_callback(msgbuf, encode_msg);
+
+        do {
+                msg = NULL;
+
+                ret = prelude_msg_read(&msg, fdi);
+                if ( ret < 0 ) {
+                        if ( msg )
+                                prelude_msg_destroy(msg);
+                        break;
+                }
+
+                ret = load_message(msgbuf, msg);
+                prelude_msg_destroy(msg);
+
+                if ( ret < 0 )
+                        break;
+        } while ( 1 );
+
+        prelude_msgbuf_destroy(msgbuf);
+        prelude_io_close(fdi);
+        prelude_io_destroy(fdi);
+        free(encoded);
+
+        if ( prelude_error_get_code(ret) != PRELUDE_ERROR_EOF ) {
+                prelude_perror(ret, "error reading corpus '%s'", filename);
+                return -1;
+        }
+
+        if ( ! corpus_count ) {
+                fprintf(stderr, "corpus '%s' is empty.\n", filename);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+
+static int sensor_connect(sensor_t *sensor)
+{
+        int ret;
+        uint64_t start = get_time();
+
+        ret = prelude_connection_connect(sensor->cnx, profile, PRELUDE_CONNECTION_PERMISSION_IDMEF_WRITE);
+        if ( ret < 0 ) {
+                connect_errors++;
+                return ret;
+        }
+
+        latency_add(&connect_latency, get_time() - start);
+        sensor->connected = TRUE;
+
+        return 0;
+}
+
+
+
+static void sensor_disconnect(sensor_t *sensor)
+{
+        prelude_connection_close(sensor->cnx);
+        sensor->connected = FALSE;
+}
+
+
+
+static unsigned int get_priority(uint64_t n)
+{
+        unsigned int i, total = 0, value;
+
+        for ( i = 0; i < PRIORITY_END; i++ )
+                total += priority_mix[i];
+
+        value = (n * 2654435761U) % total;
+
+        for ( i = 0; i < PRIORITY_END - 1; i++ ) {
+                if ( value < priority_mix[i] )
+                        break;
+
+                value -= priority_mix[i];
+        }
+
+        return i;
+}
+
+
+
+/*
+ * The send timestamp is written in place, right before the message.
+ */
+static int sensor_send(sensor_t *sensor)
+{
+        int ret;
+        uint64_t timestamp;
+        entry_t *entry = &corpus[sent % corpus_count];
+        unsigned int priority = get_priority(sent);
+
+        if ( ! sensor->connected && sensor_connect(sensor) < 0 )
+                return -1;
+
+        timestamp = get_time();
+        memcpy((unsigned char *) prelude_msg_get_message_data(entry->msg[priority]) + entry->timestamp_offset[priority],
+               &timestamp, sizeof(timestamp));
+
+        ret = prelude_connection_send(sensor->cnx, entry->msg[priority]);
+        if ( ret < 0 ) {
+                send_errors++;
+                sensor_disconnect(sensor);
+                return ret;
+        }
+
+        sent++;
+        sent_bytes += prelude_msg_get_len(entry->msg[priority]);
+
+        return 0;
+}
+
+
+
+static void wait_until(uint64_t target)
+{
+        struct timespec ts;
+        uint64_t now = get_time();
+
+        if ( now >= target )
+                return;
+
+        ts.tv_sec = (target - now) / 1000000000;
+        ts.tv_nsec = (target - now) % 1000000000;
+
+        nanosleep(&ts, NULL);
+}
+
+
+
+/*
+ * Disconnect a fraction of the sensors, reconnect them all at once,
+ * then have each of them flush its backlog unpaced.
+ */
+static void run_storm(void)
+{
+        uint64_t start;
+        unsigned int i, j, n = nsensor * storm_percent / 100;
+        latency_t storm_latency;
+
+        if ( ! n )
+                return;
+
+        for ( i = 0; i < n; i++ )
+                sensor_disconnect(&sensors[i]);
+
+        start = get_time();
+        storm_latency = connect_latency;
+        memset(&connect_latency, 0, sizeof(connect_latency));
+
+        for ( i = 0; i < n; i++ )
+                sensor_connect(&sensors[i]);
+
+        printf("reconnect storm: %u sensors in %.1f ms\n", n, (get_time() - start) / 1e6);
+        latency_print("storm connect", &connect_latency);
+        free(connect_latency.latency);
+        connect_latency = storm_latency;
+
+        start = get_time();
+
+        for ( i = 0; i < n; i++ ) {
+                for ( j = 0; j < backlog && sent < count; j++ )
+                        sensor_send(&sensors[i]);
+        }
+
+        if ( backlog )
+                printf("backlog flush: %u messages in %.1f ms\n", n * backlog, (get_time() - start) / 1e6);
+}
+
+
+
+static void run(void)
+{
+        unsigned int failures = 0;
+        uint64_t n = 0, start, next_storm, now;
+
+        start = get_time();
+        next_storm = start + (uint64_t) storm_interval * 1000000000;
+
+        while ( sent < count ) {
+                if ( rate )
+                        wait_until(start + n * 1000000000 / rate);
+
+                /*
+                 * Give up once every sensor failed in a row.
+                 */
+                if ( sensor_send(&sensors[n++ % nsensor]) == 0 )
+                        failures = 0;
+
+                else if ( ++failures == nsensor ) {
+                        fprintf(stderr, "no sensor could send, giving up.\n");
+                        break;
+                }
+
+                if ( storm_interval ) {
+                        now = get_time();
+                        if ( now >= next_storm ) {
+                                run_storm();
+                                next_storm = now + (uint64_t) storm_interval * 1000000000;
+                        }
+                }
+        }
+
+        now = get_time();
+
+        printf("sent %" PRELUDE_PRIu64 " messages, %" PRELUDE_PRIu64 " bytes in %.2f s: %.0f msgs/s, %.1f MB/s\n",
+               sent, sent_bytes, (now - start) / 1e9, sent / ((now - start) / 1e9),
+               sent_bytes / ((now - start) / 1e9) / 1e6);
+
+        printf("%" PRELUDE_PRIu64 " send errors, %" PRELUDE_PRIu64 " connection errors\n", send_errors, connect_errors);
+}
+
+
+
+/*
+ * Each sensor use a descriptor.
+ */
+static void raise_fd_limit(void)
+{
+        struct rlimit rl;
+
+        if ( getrlimit(RLIMIT_NOFILE, &rl) < 0 )
+                return;
+
+        if ( rl.rlim_cur < nsensor + 64 ) {
+                rl.rlim_cur = (rl.rlim_max < nsensor + 64) ? rl.rlim_max : nsensor + 64;
+                setrlimit(RLIMIT_NOFILE, &rl);
+        }
+}
+
+
+
+static int parse_priority_mix(const char *arg)
+{
+        int ret;
+
+        ret = sscanf(arg, "%u:%u:%u", &priority_mix[0], &priority_mix[1], &priority_mix[2]);
+        if ( ret != 3 || priority_mix[0] + priority_mix[1] + priority_mix[2] == 0 )
+                return -1;
+
+        return 0;
+}
+
+
+
+static void print_usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [options] corpus\n\n"
+                "  -a address     Manager address, or \"unix\" for the local socket (default %s)\n"
+                "  -p profile     Sensor profile to use (default %s)\n"
+                "  -c sensors     Number of simulated sensors (default %u)\n"
+                "  -n count       Number of messages to send (default %u)\n"
+                "  -r rate        Messages per second, 0 for unpaced (default 0)\n"
+                "  -m h:m:l       High, medium and low priority mix (default 10:30:60)\n"
+                "  -s seconds     Interval between reconnect storms, 0 to disable (default 0)\n"
+                "  -S percent     Percentage of sensors reconnecting in a storm (default 10)\n"
+                "  -b count       Backlog flushed by each reconnected sensor (default 0)\n",
+                prog, DEFAULT_ADDRESS, DEFAULT_PROFILE, DEFAULT_SENSORS, DEFAULT_COUNT);
+}
+
+
+
+int main(int argc, char **argv)
+{
+        int ret, c;
+        uint64_t start;
+        unsigned int i;
+
+        while ( (c = getopt(argc, argv, "a:p:c:n:r:m:s:S:b:")) != -1 ) {
+                switch ( c ) {
+                case 'a':
+                        address = optarg;
+                        break;
+
+                case 'p':
+                        profile_name = optarg;
+                        break;
+
+                case 'c':
+                        nsensor = strtoul(optarg, NULL, 0);
+                        break;
+
+                case 'n':
+                        count = strtoull(optarg, NULL, 0);
+                        break;
+
+                case 'r':
+                        rate = strtoul(optarg, NULL, 0);
+                        break;
+
+                case 'm':
+                        if ( parse_priority_mix(optarg) < 0 ) {
+                                fprintf(stderr, "invalid priority mix '%s'.\n", optarg);
+                                return 1;
+                        }
+                        break;
+
+                case 's':
+                        storm_interval = strtoul(optarg, NULL, 0);
+                        break;
+
+                case 'S':
+                        storm_percent = strtoul(optarg, NULL, 0);
+                        break;
+
+                case 'b':
+                        backlog = strtoul(optarg, NULL, 0);
+                        break;
+
+                default:
+                        print_usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if ( optind + 1 != argc || nsensor == 0 || storm_percent > 100 ) {
+                print_usage(argv[0]);
+                return 1;
+        }
+
+        ret = prelude_init(NULL, NULL);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error initializing libprelude");
+                return 1;
+        }
+
+        ret = read_corpus(argv[optind]);
+        if ( ret < 0 )
+                return 1;
+
+        ret = prelude_client_profile_new(&profile, profile_name);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error loading profile '%s'", profile_name);
+                return 1;
+        }
+
+        sensors = calloc(nsensor, sizeof(*sensors));
+        if ( ! sensors ) {
+                fprintf(stderr, "memory exhausted.\n");
+                return 1;
+        }
+
+        raise_fd_limit();
+
+        start = get_time();
+
+        for ( i = 0; i < nsensor; i++ ) {
+                ret = prelude_connection_new(&sensors[i].cnx, address);
+                if ( ret < 0 ) {
+                        prelude_perror(ret, "error creating connection to '%s'", address);
+                        return 1;
+                }
+
+                sensor_connect(&sensors[i]);
+        }
+
+        printf("connected %u sensors to %s in %.1f ms, %" PRELUDE_PRIu64 " errors\n",
+               nsensor - (unsigned int) connect_errors, address, (get_time() - start) / 1e6, connect_errors);
+        latency_print("connect", &connect_latency);
+
+        run();
+
+        for ( i = 0; i < nsensor; i++ )
+                prelude_connection_destroy(sensors[i].cnx);
+
+        for ( i = 0; i < corpus_count; i++ ) {
+                for ( c = 0; c < PRIORITY_END; c++ )
+                        prelude_msg_destroy(corpus[i].msg[c]);
+        }
+
+        free(corpus);
+        free(sensors);
+        free(connect_latency.latency);
+
+        prelude_client_profile_destroy(profile);
+        prelude_deinit();
+
+        return 0;
+}
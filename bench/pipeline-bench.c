@@ -0,0 +1,562 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+
+/*
+ * Drive each stage of the manager processing pipeline over a corpus
+ * written by corpus-gen:
+ *
+ * - decode: pmsg_to_idmef()
+ * - decode plugins: decode_plugins_run()
+ * - reporting filters: filter_plugins_run_by_category()
+ * - each report plugin instance, individually
+ *
+ * Plugins are configured the same way as in prelude-manager, from the
+ * remaining command line arguments and the optional configuration file,
+ * e.g. "pipeline-bench corpus.raw --textmod --logfile=/dev/null".
+ *
+ * For every stage, the throughput, mean and p50/p99 latency and the
+ * number of allocations per message are reported. Allocation counting
+ * rely on the glibc allocator entry points, and is not available
+ * elsewhere.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "prelude-manager.h"
+#include "pmsg-to-idmef.h"
+#include "decode-plugins.h"
+#include "filter-plugins.h"
+#include "manager-options.h"
+#include "report-plugins.h"
+#include "rcu.h"
+#include "pmsg-index.h"
+#include "path-memo.h"
+
+
+#define DEFAULT_ITERATIONS 5
+
+
+/*
+ * A stage function process the corpus message at index, its optional
+ * preparation function is called first, outside of the measurement.
+ */
+typedef int (*stage_func_t)(size_t index, void *data);
+
+
+/*
+ * Required by pmsg_to_idmef(), which add the manager analyzer to the
+ * decoded messages.
+ */
+prelude_client_t *manager_client;
+
+
+/*
+ * Referenced by the filter reordering timer, which is left disabled.
+ */
+struct ev_loop *manager_event_loop = NULL;
+
+
+/*
+ * Required by the plugin subsystems, which are not reloaded here.
+ */
+void manager_plugin_set_reload_safe(prelude_plugin_generic_t *plugin)
+{
+}
+
+
+
+prelude_bool_t manager_plugin_is_reload_safe(prelude_plugin_instance_t *pi)
+{
+        return TRUE;
+}
+
+
+static size_t corpus_count = 0;
+static prelude_msg_t **corpus = NULL;
+static prelude_msg_t **pending = NULL;
+static idmef_message_t **decoded = NULL;
+static unsigned int iterations = DEFAULT_ITERATIONS;
+
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int counting = 0;
+static uint64_t allocations = 0;
+
+void *malloc(size_t size)
+{
+        allocations += counting;
+        return __libc_malloc(size);
+}
+
+
+void *calloc(size_t nmemb, size_t size)
+{
+        allocations += counting;
+        return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+        allocations += counting;
+        return __libc_realloc(ptr, size);
+}
+
+# define start_counting() do { allocations = 0; counting = 1; } while (0)
+# define stop_counting() (counting = 0, allocations)
+#else
+# define start_counting() do { } while (0)
+# define stop_counting() ((uint64_t) 0)
+#endif
+
+
+
+static uint64_t get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+static int latency_cmp(const void *a, const void *b)
+{
+        const uint64_t *l1 = a, *l2 = b;
+
+        return (*l1 > *l2) - (*l1 < *l2);
+}
+
+
+
+/*
+ * Only the time spent within func is accounted, so that the figures
+ * are not skewed by the preparation of the next message.
+ */
+static void bench_stage(const char *name, stage_func_t prepare, stage_func_t func, void *data)
+{
+        int ret;
+        size_t i, count = 0;
+        unsigned int iter;
+        uint64_t start, *latency, elapsed = 0, allocs = 0;
+
+        latency = malloc(corpus_count * iterations * sizeof(*latency));
+        if ( ! latency ) {
+                fprintf(stderr, "memory exhausted.\n");
+                return;
+        }
+
+        for ( iter = 0; iter < iterations; iter++ ) {
+                for ( i = 0; i < corpus_count; i++ ) {
+                        if ( prepare && prepare(i, data) < 0 )
+                                continue;
+
+                        start_counting();
+                        start = get_time();
+
+                        ret = func(i, data);
+
+                        latency[count] = get_time() - start;
+                        allocs += stop_counting();
+
+                        if ( ret < 0 )
+                                continue;
+
+                        elapsed += latency[count++];
+                }
+        }
+
+        if ( ! count ) {
+                printf("%-32s no message processed\n", name);
+                free(latency);
+                return;
+        }
+
+        qsort(latency, count, sizeof(*latency), latency_cmp);
+
+        printf("%-32s %10.0f msgs/s %9.1f ns/msg %7.1f allocs/msg p50 %7" PRELUDE_PRIu64 " ns p99 %8" PRELUDE_PRIu64 " ns\n",
+               name, count * 1e9 / elapsed, (double) elapsed / count, (double) allocs / count,
+               latency[count / 2], latency[count * 99 / 100]);
+
+        free(latency);
+}
+
+
+
+static int read_corpus(const char *filename)
+{
+        int ret;
+        FILE *fd;
+        prelude_io_t *fdi;
+        prelude_msg_t *msg, **tmp;
+
+        fd = fopen(filename, "r");
+        if ( ! fd ) {
+                fprintf(stderr, "could not open corpus '%s'.\n", filename);
+                return -1;
+        }
+
+        ret = prelude_io_new(&fdi);
+        if ( ret < 0 ) {
+                fclose(fd);
+                return ret;
+        }
+
+        prelude_io_set_file_io(fdi, fd);
+
+        do {
+                msg = NULL;
+
+                ret = prelude_msg_read(&msg, fdi);
+                if ( ret < 0 ) {
+                        if ( msg )
+                                prelude_msg_destroy(msg);
+                        break;
+                }
+
+                tmp = realloc(corpus, (corpus_count + 1) * sizeof(*corpus));
+                if ( ! tmp ) {
+                        prelude_msg_destroy(msg);
+                        break;
+                }
+
+                corpus = tmp;
+                corpus[corpus_count++] = msg;
+        } while ( 1 );
+
+        prelude_io_close(fdi);
+        prelude_io_destroy(fdi);
+
+        if ( prelude_error_get_code(ret) != PRELUDE_ERROR_EOF ) {
+                prelude_perror(ret, "error reading corpus '%s'", filename);
+                return -1;
+        }
+
+        pending = calloc(corpus_count, sizeof(*pending));
+        decoded = calloc(corpus_count, sizeof(*decoded));
+        if ( ! pending || ! decoded ) {
+                fprintf(stderr, "memory exhausted.\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+
+
+static void release_decoded(size_t i)
+{
+        if ( decoded[i] ) {
+                idmef_message_destroy(decoded[i]);
+                decoded[i] = NULL;
+        }
+}
+
+
+
+/*
+ * Decoding consume the message read position: each iteration decode a
+ * fresh copy of the corpus message.
+ */
+static int copy_msg(prelude_msg_t *msg, prelude_msg_t **out)
+{
+        int ret;
+        size_t i, len = 0;
+        pmsg_index_t index;
+
+        ret = pmsg_index_build_from_msg(&index, msg);
+        if ( ret < 0 ) {
+                pmsg_index_destroy(&index);
+                return ret;
+        }
+
+        for ( i = 0; i < index.count; i++ )
+                len += index.tlv[i].len;
+
+        ret = prelude_msg_new(out, index.count, len, prelude_msg_get_tag(msg), prelude_msg_get_priority(msg));
+        if ( ret < 0 ) {
+                pmsg_index_destroy(&index);
+                return ret;
+        }
+
+        for ( i = 0; i < index.count; i++ )
+                prelude_msg_set(*out, index.tlv[i].tag, index.tlv[i].len, index.tlv[i].value);
+
+        prelude_msg_mark_end(*out);
+        pmsg_index_destroy(&index);
+
+        return 0;
+}
+
+
+
+static int prepare_decode(size_t i, void *data)
+{
+        release_decoded(i);
+
+        return copy_msg(corpus[i], &pending[i]);
+}
+
+
+
+/*
+ * As done by the scheduler, the decoded message take ownership of the
+ * message it reference. The last iteration result is kept for the
+ * following stages.
+ */
+static int run_decode(size_t i, void *data)
+{
+        int ret;
+
+        ret = pmsg_to_idmef(&decoded[i], pending[i]);
+        if ( ret < 0 ) {
+                decoded[i] = NULL;
+                prelude_msg_destroy(pending[i]);
+                return ret;
+        }
+
+        idmef_message_set_pmsg(decoded[i], pending[i]);
+
+        return 0;
+}
+
+
+
+static int prepare_decoded(size_t i, void *data)
+{
+        return decoded[i] ? 0 : -1;
+}
+
+
+
+static int run_decode_plugins(size_t i, void *data)
+{
+        return decode_plugins_run(0, NULL, decoded[i]);
+}
+
+
+
+static int run_filters(size_t i, void *data)
+{
+        filter_plugins_run_by_category(data, decoded[i], MANAGER_FILTER_CATEGORY_REPORTING);
+
+        /*
+         * A filtered out message was processed as well.
+         */
+        return 0;
+}
+
+
+
+static int run_report_plugin(size_t i, void *data)
+{
+        prelude_plugin_instance_t *pi = data;
+
+        return prelude_plugin_run(pi, manager_report_plugin_t, run, pi, decoded[i]);
+}
+
+
+
+/*
+ * The whole reporting stage, with path values shared between the
+ * filters and reporting plugins as done by the scheduler, or not.
+ */
+static int run_reporting(size_t i, void *data)
+{
+        report_plugins_run(data, decoded[i]);
+
+        return 0;
+}
+
+
+
+static int run_reporting_memo(size_t i, void *data)
+{
+        path_memo_t *memo;
+
+        memo = path_memo_begin(decoded[i]);
+        report_plugins_run(data, decoded[i]);
+        path_memo_end(memo);
+
+        return 0;
+}
+
+
+
+static void bench_report_plugins(void)
+{
+        size_t i;
+        char name[128];
+        unsigned int rcu;
+        report_graph_t *graph;
+        prelude_plugin_instance_t *pi;
+        prelude_plugin_generic_t *plugin;
+
+        rcu = rcu_read_lock();
+
+        graph = report_plugins_get_graph();
+        if ( ! graph ) {
+                printf("no report plugin configured.\n");
+                goto out;
+        }
+
+        bench_stage("filter_plugins_run_by_category", prepare_decoded, run_filters, report_plugins_get_filters(graph));
+
+        for ( i = 0; i < report_plugins_get_count(graph); i++ ) {
+                pi = report_plugins_get_instance(graph, i);
+                plugin = prelude_plugin_instance_get_plugin(pi);
+
+                snprintf(name, sizeof(name), "report %s[%s]", plugin->name, prelude_plugin_instance_get_name(pi));
+                bench_stage(name, prepare_decoded, run_report_plugin, pi);
+        }
+
+        bench_stage("report_plugins_run", prepare_decoded, run_reporting, graph);
+        bench_stage("report_plugins_run (path memo)", prepare_decoded, run_reporting_memo, graph);
+
+ out:
+        rcu_read_unlock(rcu);
+}
+
+
+
+static void print_usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-i iterations] [-c config] corpus [plugin options]\n", prog);
+}
+
+
+
+int main(int argc, char **argv)
+{
+        int ret, c;
+        size_t i;
+        prelude_string_t *err;
+        prelude_option_t *rootopt;
+        const char *config_file = NULL;
+
+        /*
+         * Stop at the first non option argument: what follow the corpus
+         * are plugin options.
+         */
+        while ( (c = getopt(argc, argv, "+i:c:")) != -1 ) {
+                switch ( c ) {
+                case 'i':
+                        iterations = strtoul(optarg, NULL, 0);
+                        break;
+
+                case 'c':
+                        config_file = optarg;
+                        break;
+
+                default:
+                        print_usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if ( optind >= argc || iterations == 0 ) {
+                print_usage(argv[0]);
+                return 1;
+        }
+
+        ret = prelude_init(NULL, NULL);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error initializing libprelude");
+                return 1;
+        }
+
+        ret = read_corpus(argv[optind]);
+        if ( ret < 0 )
+                return 1;
+
+        ret = prelude_client_new(&manager_client, "pipeline-bench");
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error creating prelude-client object");
+                return 1;
+        }
+
+        prelude_option_new_root(&rootopt);
+
+        PRELUDE_PLUGIN_SET_PRELOADED_SYMBOLS();
+
+        if ( report_plugins_init(REPORT_PLUGIN_DIR, rootopt) < 0 ||
+             decode_plugins_init(DECODE_PLUGIN_DIR, rootopt) < 0 ||
+             filter_plugins_init(FILTER_PLUGIN_DIR, rootopt) < 0 )
+                return 1;
+
+        /*
+         * argv[optind] is handled as the program name by the option parser.
+         */
+        argc -= optind;
+        argv += optind;
+
+        ret = prelude_option_read(rootopt, &config_file, &argc, argv, &err, manager_client);
+        if ( ret < 0 ) {
+                if ( err )
+                        fprintf(stderr, "Option error: %s.\n", prelude_string_get_string(err));
+                else
+                        prelude_perror(ret, "error processing options");
+
+                return 1;
+        }
+
+        report_plugins_publish_graph();
+
+        printf("corpus: %" PRELUDE_PRIu64 " messages, %u iterations\n", (uint64_t) corpus_count, iterations);
+
+        bench_stage("pmsg_to_idmef", prepare_decode, run_decode, NULL);
+        bench_stage("decode_plugins_run", prepare_decoded, run_decode_plugins, NULL);
+        bench_report_plugins();
+
+        for ( i = 0; i < corpus_count; i++ ) {
+                release_decoded(i);
+                prelude_msg_destroy(corpus[i]);
+        }
+
+        free(decoded);
+        free(pending);
+        free(corpus);
+
+        report_plugins_close();
+        prelude_client_destroy(manager_client, PRELUDE_CLIENT_EXIT_STATUS_SUCCESS);
+        prelude_deinit();
+
+        return 0;
+}
@@ -0,0 +1,411 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+/*
+ * Check the TLV index of raw messages against libprelude's own reader:
+ * a message is built with prelude_msg_set(), sent through a file as a
+ * sensor would, and the index of the received message is compared with
+ * what prelude_msg_get() returns.
+ *
+ * Well formed alerts and heartbeats, as written by libprelude, should
+ * then pass the ingest check, while misnested or unterminated IDMEF
+ * classes should not.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+#include <libprelude/idmef-message-id.h>
+
+#include "pmsg-index.h"
+
+
+#define TLV_COUNT 200
+#define MAX_LEN   1024
+
+
+static unsigned int errors = 0;
+static unsigned int ingest_count = 0;
+
+
+
+static void check(int cond, const char *fmt, unsigned int i)
+{
+        if ( cond )
+                return;
+
+        errors++;
+        fprintf(stderr, fmt, i);
+        fputc('\n', stderr);
+}
+
+
+
+static uint32_t get_tlv_len(unsigned int i)
+{
+        /*
+         * Empty values, values larger than 255 bytes so that the length
+         * high bytes are used, and everything in between.
+         */
+        return (i * 37) % MAX_LEN;
+}
+
+
+
+static int build_msg(prelude_msg_t **msg, unsigned char *buf)
+{
+        int ret;
+        unsigned int i;
+        size_t total = 0;
+
+        for ( i = 0; i < TLV_COUNT; i++ )
+                total += get_tlv_len(i);
+
+        ret = prelude_msg_new(msg, TLV_COUNT, total, PRELUDE_MSG_IDMEF, PRELUDE_MSG_PRIORITY_HIGH);
+        if ( ret < 0 )
+                return ret;
+
+        for ( i = 0; i < TLV_COUNT; i++ ) {
+                ret = prelude_msg_set(*msg, i % 256, get_tlv_len(i), buf + i);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        prelude_msg_mark_end(*msg);
+
+        return 0;
+}
+
+
+
+/*
+ * Go through a file, so that the message is read back with
+ * prelude_msg_read(), the way sensor-server receive it.
+ */
+static int transmit_msg(prelude_msg_t *msg, prelude_msg_t **out)
+{
+        int ret;
+        FILE *fd;
+        prelude_io_t *fdi;
+
+        fd = tmpfile();
+        if ( ! fd )
+                return -1;
+
+        if ( fwrite(prelude_msg_get_message_data(msg), 1, prelude_msg_get_len(msg), fd) != prelude_msg_get_len(msg) ) {
+                fclose(fd);
+                return -1;
+        }
+
+        rewind(fd);
+
+        ret = prelude_io_new(&fdi);
+        if ( ret < 0 ) {
+                fclose(fd);
+                return ret;
+        }
+
+        prelude_io_set_file_io(fdi, fd);
+
+        *out = NULL;
+        ret = prelude_msg_read(out, fdi);
+
+        prelude_io_close(fdi);
+        prelude_io_destroy(fdi);
+
+        return ret;
+}
+
+
+
+static void check_index(prelude_msg_t *msg, const char *what)
+{
+        int ret;
+        void *value;
+        uint8_t tag;
+        uint32_t len;
+        size_t i = 0;
+        pmsg_index_t index;
+
+        ret = pmsg_index_build_from_msg(&index, msg);
+        check(ret == 0, "%u: indexing failed", __LINE__);
+        if ( ret < 0 ) {
+                fprintf(stderr, "%s message could not be indexed.\n", what);
+                return;
+        }
+
+        check(index.count == TLV_COUNT, "%u: wrong TLV count", __LINE__);
+
+        /*
+         * Building the index should not have moved the read position.
+         */
+        while ( prelude_msg_get(msg, &tag, &len, &value) == 0 ) {
+                if ( i == index.count ) {
+                        check(0, "%u: TLV missing from the index", __LINE__);
+                        break;
+                }
+
+                check(index.tlv[i].tag == tag, "TLV %u: wrong tag", i);
+                check(index.tlv[i].len == len, "TLV %u: wrong length", i);
+                check(index.tlv[i].len == get_tlv_len(i), "TLV %u: length differ from the one set", i);
+                check(index.tlv[i].value == value, "TLV %u: wrong value pointer", i);
+                i++;
+        }
+
+        check(i == index.count, "%u: index has extra TLV", __LINE__);
+
+        pmsg_index_destroy(&index);
+}
+
+
+
+static int set_string(idmef_message_t *idmef, const char *path, const char *value)
+{
+        int ret;
+        idmef_path_t *ipath;
+        idmef_value_t *ivalue;
+
+        ret = idmef_path_new_fast(&ipath, path);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_value_new_from_path(&ivalue, ipath, value);
+        if ( ret < 0 ) {
+                idmef_path_destroy(ipath);
+                return ret;
+        }
+
+        ret = idmef_path_set(ipath, idmef, ivalue);
+
+        idmef_value_destroy(ivalue);
+        idmef_path_destroy(ipath);
+
+        return ret;
+}
+
+
+
+static int check_ingest_msg(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+{
+        int ret;
+        unsigned char *data;
+        prelude_msg_t *received;
+
+        ingest_count++;
+
+        ret = transmit_msg(msg, &received);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error reading IDMEF message back");
+                errors++;
+                return 0;
+        }
+
+        check(pmsg_check(received) == 0, "%u: well formed IDMEF message rejected", __LINE__);
+
+        /*
+         * The same message, with an unknown first tag.
+         */
+        data = (unsigned char *) prelude_msg_get_message_data(received);
+        data[PMSG_HEADER_SIZE] = IDMEF_MSG_END_OF_TAG;
+        check(pmsg_check(received) < 0, "%u: unknown first tag accepted", __LINE__);
+
+        prelude_msg_destroy(received);
+
+        return 0;
+}
+
+
+
+/*
+ * Run the ingest check on a message made of the given empty TLVs.
+ */
+static int check_raw_tags(const uint8_t *tags, size_t count)
+{
+        int ret;
+        size_t i;
+        prelude_msg_t *msg;
+
+        ret = prelude_msg_new(&msg, count, 0, PRELUDE_MSG_IDMEF, PRELUDE_MSG_PRIORITY_HIGH);
+        if ( ret < 0 )
+                return ret;
+
+        for ( i = 0; i < count; i++ )
+                prelude_msg_set(msg, tags[i], 0, NULL);
+
+        prelude_msg_mark_end(msg);
+
+        ret = pmsg_check(msg);
+        prelude_msg_destroy(msg);
+
+        return ret;
+}
+
+
+
+static void check_nesting(void)
+{
+        const uint8_t valid[] = {
+                IDMEF_MSG_ALERT_TAG, IDMEF_MSG_SOURCE_TAG, IDMEF_MSG_NODE_TAG, IDMEF_MSG_ADDRESS_TAG,
+                IDMEF_MSG_END_OF_TAG, IDMEF_MSG_END_OF_TAG, IDMEF_MSG_END_OF_TAG, IDMEF_MSG_END_OF_TAG,
+                IDMEF_MSG_END_OF_TAG
+        };
+        const uint8_t unterminated[] = {
+                IDMEF_MSG_ALERT_TAG, IDMEF_MSG_ANALYZER_TAG, IDMEF_MSG_END_OF_TAG
+        };
+        const uint8_t misplaced[] = {
+                IDMEF_MSG_ALERT_TAG, IDMEF_MSG_ADDRESS_TAG, IDMEF_MSG_END_OF_TAG, IDMEF_MSG_END_OF_TAG
+        };
+        const uint8_t nested_toplevel[] = {
+                IDMEF_MSG_HEARTBEAT_TAG, IDMEF_MSG_ALERT_TAG, IDMEF_MSG_END_OF_TAG, IDMEF_MSG_END_OF_TAG
+        };
+        const uint8_t orphan_class[] = {
+                IDMEF_MSG_NODE_TAG, IDMEF_MSG_END_OF_TAG
+        };
+
+        check(check_raw_tags(valid, sizeof(valid)) == 0, "%u: well nested classes rejected", __LINE__);
+        check(check_raw_tags(unterminated, sizeof(unterminated)) < 0, "%u: unterminated class accepted", __LINE__);
+        check(check_raw_tags(misplaced, sizeof(misplaced)) < 0, "%u: misplaced class accepted", __LINE__);
+        check(check_raw_tags(nested_toplevel, sizeof(nested_toplevel)) < 0, "%u: nested alert accepted", __LINE__);
+        check(check_raw_tags(orphan_class, sizeof(orphan_class)) < 0, "%u: class outside of a message accepted", __LINE__);
+}
+
+
+
+static int check_ingest(void)
+{
+        int ret;
+        idmef_message_t *idmef;
+        prelude_msgbuf_t *msgbuf;
+
+        ret = prelude_msgbuf_new(&msgbuf);
+        if ( ret < 0 )
+                return ret;
+
+        prelude_msgbuf_set_callback(msgbuf, check_ingest_msg);
+
+        ret = idmef_message_new(&idmef);
+        if ( ret < 0 )
+                return ret;
+
+        set_string(idmef, "alert.messageid", "check");
+        set_string(idmef, "alert.classification.text", "Check alert");
+        set_string(idmef, "alert.analyzer(0).name", "pmsg-index-check");
+        set_string(idmef, "alert.source(0).node.address(0).address", "192.168.0.1");
+        set_string(idmef, "alert.additional_data(0).data", "payload");
+
+        idmef_message_write(idmef, msgbuf);
+        prelude_msgbuf_mark_end(msgbuf);
+        idmef_message_destroy(idmef);
+
+        ret = idmef_message_new(&idmef);
+        if ( ret < 0 )
+                return ret;
+
+        set_string(idmef, "heartbeat.messageid", "check");
+        set_string(idmef, "heartbeat.analyzer(0).name", "pmsg-index-check");
+
+        idmef_message_write(idmef, msgbuf);
+        prelude_msgbuf_mark_end(msgbuf);
+        idmef_message_destroy(idmef);
+
+        prelude_msgbuf_destroy(msgbuf);
+
+        check(ingest_count == 2, "%u: IDMEF messages not all checked", __LINE__);
+
+        return 0;
+}
+
+
+
+int main(int argc, char **argv)
+{
+        int ret;
+        unsigned int i;
+        pmsg_index_t index;
+        unsigned char buf[TLV_COUNT + MAX_LEN];
+        prelude_msg_t *msg, *received;
+
+        ret = prelude_init(&argc, argv);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error initializing libprelude");
+                return 1;
+        }
+
+        for ( i = 0; i < sizeof(buf); i++ )
+                buf[i] = i * 7;
+
+        ret = build_msg(&msg, buf);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error building message");
+                return 1;
+        }
+
+        ret = transmit_msg(msg, &received);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error reading message back");
+                return 1;
+        }
+
+        check_index(received, "received");
+
+        /*
+         * The index of the message as built locally should point at the
+         * same offsets.
+         */
+        ret = pmsg_index_build_from_msg(&index, msg);
+        check(ret == 0 && index.count == TLV_COUNT, "%u: local message not indexed", __LINE__);
+        pmsg_index_destroy(&index);
+
+        /*
+         * A truncated message should be rejected.
+         */
+        ret = pmsg_index_build(&index, prelude_msg_get_message_data(received) + PMSG_HEADER_SIZE,
+                               prelude_msg_get_len(received) - PMSG_HEADER_SIZE - 1);
+        check(ret < 0 && index.count == 0, "%u: truncated message accepted", __LINE__);
+
+        prelude_msg_destroy(received);
+        prelude_msg_destroy(msg);
+
+        check_nesting();
+
+        ret = check_ingest();
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error building IDMEF messages");
+                return 1;
+        }
+
+        prelude_deinit();
+
+        if ( errors ) {
+                fprintf(stderr, "%u error(s).\n", errors);
+                return 1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,289 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+/*
+ * Compare the single pass TLV index with the per-site walks it replace,
+ * over a corpus of alerts of varying size.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+#include <libprelude/idmef-message-id.h>
+
+#include "pmsg-index.h"
+
+
+#define CORPUS_SIZE 1000
+#define ITERATIONS  200
+
+
+typedef struct {
+        size_t len;
+        unsigned char *data;
+} corpus_entry_t;
+
+
+static size_t corpus_count = 0;
+static corpus_entry_t corpus[CORPUS_SIZE];
+
+
+
+static double get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static int store_msg(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+{
+        corpus_entry_t *entry;
+
+        if ( corpus_count == CORPUS_SIZE )
+                return 0;
+
+        entry = &corpus[corpus_count++];
+
+        entry->len = prelude_msg_get_len(msg) - PMSG_HEADER_SIZE;
+
+        entry->data = malloc(entry->len);
+        if ( ! entry->data )
+                return -1;
+
+        memcpy(entry->data, prelude_msg_get_message_data(msg) + PMSG_HEADER_SIZE, entry->len);
+
+        return 0;
+}
+
+
+
+static int set_string(idmef_message_t *idmef, const char *path, const char *value)
+{
+        int ret;
+        idmef_path_t *ipath;
+        idmef_value_t *ivalue;
+
+        ret = idmef_path_new_fast(&ipath, path);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_value_new_from_path(&ivalue, ipath, value);
+        if ( ret < 0 ) {
+                idmef_path_destroy(ipath);
+                return ret;
+        }
+
+        ret = idmef_path_set(ipath, idmef, ivalue);
+
+        idmef_value_destroy(ivalue);
+        idmef_path_destroy(ipath);
+
+        return ret;
+}
+
+
+
+/*
+ * Alerts with a varying number of sources, targets and additional data,
+ * the later carrying payloads from a few bytes up to a few kilobytes.
+ */
+static int build_corpus(prelude_msgbuf_t *msgbuf)
+{
+        int ret;
+        char buf[4096], path[128];
+        unsigned int i, j, nsource, nad;
+        idmef_message_t *idmef;
+
+        for ( i = 0; i < CORPUS_SIZE; i++ ) {
+                ret = idmef_message_new(&idmef);
+                if ( ret < 0 )
+                        return ret;
+
+                set_string(idmef, "alert.messageid", "bench");
+                set_string(idmef, "alert.classification.text", "Benchmark alert");
+                set_string(idmef, "alert.analyzer(0).name", "tlv-scan-bench");
+                set_string(idmef, "alert.assessment.impact.severity", (i % 3) ? "low" : "high");
+
+                nsource = 1 + i % 4;
+                for ( j = 0; j < nsource; j++ ) {
+                        snprintf(path, sizeof(path), "alert.source(%u).node.address(0).address", j);
+                        snprintf(buf, sizeof(buf), "10.%u.%u.%u", j, (i >> 8) & 0xff, i & 0xff);
+                        set_string(idmef, path, buf);
+
+                        snprintf(path, sizeof(path), "alert.target(%u).service.port", j);
+                        snprintf(buf, sizeof(buf), "%u", 1 + i % 65535);
+                        set_string(idmef, path, buf);
+                }
+
+                nad = i % 6;
+                for ( j = 0; j < nad; j++ ) {
+                        size_t len = (16 << (i % 9)) % sizeof(buf);
+
+                        memset(buf, 'A' + j, len);
+                        buf[len] = 0;
+
+                        snprintf(path, sizeof(path), "alert.additional_data(%u).meaning", j);
+                        set_string(idmef, path, "payload");
+
+                        snprintf(path, sizeof(path), "alert.additional_data(%u).data", j);
+                        set_string(idmef, path, buf);
+                }
+
+                idmef_message_write(idmef, msgbuf);
+                prelude_msgbuf_mark_end(msgbuf);
+
+                idmef_message_destroy(idmef);
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * One of the per-site walks, as done by the ingest check, the option
+ * request classification and the additional_data trimming.
+ */
+static int walk(const unsigned char *data, size_t len, uint8_t wanted)
+{
+        uint32_t tlen;
+        size_t i = 0, found = 0;
+
+        while ( i + sizeof(uint8_t) + sizeof(uint32_t) <= len ) {
+                if ( data[i] == wanted )
+                        found++;
+
+                memcpy(&tlen, data + i + sizeof(uint8_t), sizeof(tlen));
+                i += sizeof(uint8_t) + sizeof(uint32_t);
+
+                tlen = ntohl(tlen);
+                if ( tlen > len - i )
+                        return -1;
+
+                i += tlen;
+        }
+
+        return found;
+}
+
+
+
+int main(int argc, char **argv)
+{
+        int ret;
+        double start, elapsed;
+        pmsg_index_t index;
+        prelude_msgbuf_t *msgbuf;
+        size_t i, j, bytes = 0, tlvs = 0, found = 0;
+
+        ret = prelude_init(&argc, argv);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error initializing libprelude");
+                return 1;
+        }
+
+        ret = prelude_msgbuf_new(&msgbuf);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error creating message buffer");
+                return 1;
+        }
+
+        prelude_msgbuf_set_callback(msgbuf, store_msg);
+
+        ret = build_corpus(msgbuf);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error building corpus");
+                return 1;
+        }
+
+        for ( i = 0; i < corpus_count; i++ ) {
+                bytes += corpus[i].len;
+
+                pmsg_index_build(&index, corpus[i].data, corpus[i].len);
+                tlvs += index.count;
+                pmsg_index_destroy(&index);
+        }
+
+        printf("corpus: %" PRELUDE_PRIu64 " messages, %" PRELUDE_PRIu64 " bytes, %" PRELUDE_PRIu64 " TLV\n",
+               (uint64_t) corpus_count, (uint64_t) bytes, (uint64_t) tlvs);
+
+        start = get_time();
+        for ( j = 0; j < ITERATIONS; j++ ) {
+                for ( i = 0; i < corpus_count; i++ ) {
+                        found += walk(corpus[i].data, corpus[i].len, IDMEF_MSG_ALERT_TAG);
+                        found += walk(corpus[i].data, corpus[i].len, IDMEF_MSG_ADDITIONAL_DATA_TAG);
+                        found += walk(corpus[i].data, corpus[i].len, IDMEF_MSG_END_OF_TAG);
+                }
+        }
+        elapsed = get_time() - start;
+
+        printf("3 walks:     %8.1f ns/msg %8.1f MB/s\n",
+               elapsed * 1e9 / (corpus_count * ITERATIONS), bytes * ITERATIONS / elapsed / 1e6);
+
+        start = get_time();
+        for ( j = 0; j < ITERATIONS; j++ ) {
+                for ( i = 0; i < corpus_count; i++ ) {
+                        size_t k;
+
+                        pmsg_index_build(&index, corpus[i].data, corpus[i].len);
+
+                        for ( k = 0; k < index.count; k++ )
+                                found += (index.tlv[k].tag == IDMEF_MSG_ALERT_TAG ||
+                                          index.tlv[k].tag == IDMEF_MSG_ADDITIONAL_DATA_TAG ||
+                                          index.tlv[k].tag == IDMEF_MSG_END_OF_TAG);
+
+                        pmsg_index_destroy(&index);
+                }
+        }
+        elapsed = get_time() - start;
+
+        printf("index+query: %8.1f ns/msg %8.1f MB/s\n",
+               elapsed * 1e9 / (corpus_count * ITERATIONS), bytes * ITERATIONS / elapsed / 1e6);
+
+        /*
+         * Keep the compiler from discarding the walks.
+         */
+        if ( found == 0 )
+                printf("no tag found.\n");
+
+        for ( i = 0; i < corpus_count; i++ )
+                free(corpus[i].data);
+
+        prelude_msgbuf_destroy(msgbuf);
+        prelude_deinit();
+
+        return 0;
+}
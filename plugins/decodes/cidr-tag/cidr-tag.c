@@ -0,0 +1,586 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "glthread/lock.h"
+#include "prelude-manager.h"
+
+
+#define DEFAULT_RELOAD_INTERVAL 10
+#define LOCATION_ATTRIBUTE "location"
+
+/*
+ * Alerts relayed to parent managers are stamped with this additional
+ * data once tagged, so that these do not tag them again.
+ */
+#define TAGGED_MEANING "prelude-manager-cidr-tagged"
+
+
+int cidr_tag_LTX_prelude_plugin_version(void);
+int cidr_tag_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *root_opt);
+
+
+/*
+ * Attributes attached to a network block. A location attribute is
+ * stored apart since it set the node location rather than producing
+ * additional data.
+ */
+typedef struct {
+        char *key;
+        char *value;
+} tag_attribute_t;
+
+
+typedef struct {
+        char *location;
+        size_t nattr;
+        tag_attribute_t attr[];
+} tag_entry_t;
+
+
+typedef struct {
+        manager_radix_trie_t *ipv4;
+        manager_radix_trie_t *ipv6;
+} tag_table_t;
+
+
+/*
+ * The table is replaced as a whole on reload: messages being tagged
+ * keep using the previous table, which is released through
+ * manager_defer_free().
+ */
+static tag_table_t *table = NULL;
+static gl_lock_t table_lock = gl_lock_initializer;
+
+static char *table_file = NULL;
+static unsigned int reload_interval = DEFAULT_RELOAD_INTERVAL;
+static manager_file_watch_t *table_watch = NULL;
+
+
+
+static void tag_entry_destroy(void *data)
+{
+        size_t i;
+        tag_entry_t *entry = data;
+
+        for ( i = 0; i < entry->nattr; i++ ) {
+                free(entry->attr[i].key);
+                free(entry->attr[i].value);
+        }
+
+        free(entry->location);
+        free(entry);
+}
+
+
+
+static void tag_table_destroy(void *data)
+{
+        tag_table_t *t = data;
+
+        if ( t->ipv4 )
+                manager_radix_trie_destroy(t->ipv4, tag_entry_destroy);
+
+        if ( t->ipv6 )
+                manager_radix_trie_destroy(t->ipv6, tag_entry_destroy);
+
+        free(t);
+}
+
+
+
+static int tag_table_new(tag_table_t **new)
+{
+        int ret;
+
+        *new = calloc(1, sizeof(**new));
+        if ( ! *new )
+                return prelude_error_from_errno(errno);
+
+        ret = manager_radix_trie_new(&(*new)->ipv4, 32);
+        if ( ret < 0 ) {
+                tag_table_destroy(*new);
+                return ret;
+        }
+
+        ret = manager_radix_trie_new(&(*new)->ipv6, 128);
+        if ( ret < 0 ) {
+                tag_table_destroy(*new);
+                return ret;
+        }
+
+        return 0;
+}
+
+
+
+static char *next_token(char **ptr)
+{
+        char *start;
+
+        while ( isspace((unsigned char) **ptr) )
+                (*ptr)++;
+
+        if ( ! **ptr )
+                return NULL;
+
+        start = *ptr;
+
+        while ( **ptr && ! isspace((unsigned char) **ptr) )
+                (*ptr)++;
+
+        if ( **ptr )
+                *(*ptr)++ = 0;
+
+        return start;
+}
+
+
+
+static int parse_attribute(tag_entry_t *entry, char *token)
+{
+        char *value;
+
+        value = strchr(token, '=');
+        if ( ! value || value == token || ! value[1] )
+                return -1;
+
+        *value++ = 0;
+
+        if ( strcmp(token, LOCATION_ATTRIBUTE) == 0 ) {
+                free(entry->location);
+                entry->location = strdup(value);
+                return entry->location ? 0 : -1;
+        }
+
+        entry->attr[entry->nattr].key = strdup(token);
+        entry->attr[entry->nattr].value = strdup(value);
+        entry->nattr++;
+
+        if ( ! entry->attr[entry->nattr - 1].key || ! entry->attr[entry->nattr - 1].value )
+                return -1;
+
+        return 0;
+}
+
+
+
+static int parse_line(tag_table_t *t, const char *filename, unsigned int line, char *buf)
+{
+        int ret;
+        char *ptr, *token;
+        size_t nattr = 0;
+        unsigned int bits;
+        tag_entry_t *entry;
+        manager_address_t addr;
+
+        ptr = strchr(buf, '#');
+        if ( ptr )
+                *ptr = 0;
+
+        ptr = buf;
+        token = next_token(&ptr);
+        if ( ! token )
+                return 0;
+
+        ret = manager_address_parse_prefix(&addr, token, &bits);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_WARN, "%s:%u: invalid network '%s'.\n", filename, line, token);
+                return -1;
+        }
+
+        for ( token = ptr; *token; token++ )
+                if ( *token == '=' )
+                        nattr++;
+
+        entry = calloc(1, sizeof(*entry) + nattr * sizeof(*entry->attr));
+        if ( ! entry )
+                return prelude_error_from_errno(errno);
+
+        while ( (token = next_token(&ptr)) ) {
+                ret = parse_attribute(entry, token);
+                if ( ret < 0 ) {
+                        prelude_log(PRELUDE_LOG_WARN, "%s:%u: invalid attribute '%s'.\n", filename, line, token);
+                        tag_entry_destroy(entry);
+                        return -1;
+                }
+        }
+
+        if ( addr.category == IDMEF_ADDRESS_CATEGORY_IPV4_ADDR )
+                ret = manager_radix_trie_insert(t->ipv4, addr.addr, bits, entry);
+        else
+                ret = manager_radix_trie_insert(t->ipv6, addr.addr, bits, entry);
+
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_WARN, "%s:%u: duplicate network.\n", filename, line);
+                tag_entry_destroy(entry);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * Each line hold a network followed by its attributes:
+ *
+ * 192.168.0.0/16 location=paris site=hq
+ * 2001:db8::/32  owner=lab
+ */
+static int tag_table_load(tag_table_t **out, const char *filename)
+{
+        FILE *fd;
+        int ret = 0;
+        char buf[8192];
+        tag_table_t *t;
+        unsigned int line = 0;
+
+        fd = fopen(filename, "r");
+        if ( ! fd ) {
+                prelude_log(PRELUDE_LOG_WARN, "could not open '%s': %s.\n", filename, strerror(errno));
+                return -1;
+        }
+
+        ret = tag_table_new(&t);
+        if ( ret < 0 ) {
+                fclose(fd);
+                return ret;
+        }
+
+        while ( fgets(buf, sizeof(buf), fd) ) {
+                line++;
+
+                ret = parse_line(t, filename, line, buf);
+                if ( ret < 0 )
+                        break;
+        }
+
+        fclose(fd);
+
+        if ( ret < 0 ) {
+                tag_table_destroy(t);
+                return ret;
+        }
+
+        prelude_log(PRELUDE_LOG_INFO, "loaded %" PRELUDE_PRIu64 " networks from '%s'.\n",
+                    (uint64_t) (manager_radix_trie_get_count(t->ipv4) + manager_radix_trie_get_count(t->ipv6)), filename);
+
+        *out = t;
+
+        return 0;
+}
+
+
+
+/*
+ * On failure, the table in use is kept.
+ */
+static int tag_table_reload(const char *filename, void *data)
+{
+        int ret;
+        tag_table_t *new, *old;
+
+        ret = tag_table_load(&new, filename);
+        if ( ret < 0 )
+                return ret;
+
+        gl_lock_lock(table_lock);
+        old = table;
+        table = new;
+        gl_lock_unlock(table_lock);
+
+        if ( old )
+                manager_defer_free(tag_table_destroy, old);
+
+        return 0;
+}
+
+
+
+static int add_node_data(idmef_alert_t *alert, const char *direction, int index, tag_attribute_t *attr)
+{
+        int ret;
+        prelude_string_t *meaning;
+        idmef_additional_data_t *ad;
+
+        ret = idmef_alert_new_additional_data(alert, &ad, IDMEF_LIST_APPEND);
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_additional_data_new_meaning(ad, &meaning);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_string_sprintf(meaning, "%s(%d).%s", direction, index, attr->key);
+        if ( ret < 0 )
+                return ret;
+
+        return idmef_additional_data_set_string_dup(ad, attr->value);
+}
+
+
+
+static tag_entry_t *lookup_address(tag_table_t *t, idmef_address_t *address)
+{
+        int ret;
+        prelude_string_t *str;
+        manager_address_t addr;
+        idmef_address_category_t category;
+
+        category = idmef_address_get_category(address);
+        if ( category != IDMEF_ADDRESS_CATEGORY_UNKNOWN &&
+             category != IDMEF_ADDRESS_CATEGORY_IPV4_ADDR &&
+             category != IDMEF_ADDRESS_CATEGORY_IPV6_ADDR )
+                return NULL;
+
+        str = idmef_address_get_address(address);
+        if ( ! str || prelude_string_is_empty(str) )
+                return NULL;
+
+        ret = manager_address_parse(&addr, prelude_string_get_string(str));
+        if ( ret < 0 )
+                return NULL;
+
+        if ( addr.category == IDMEF_ADDRESS_CATEGORY_IPV4_ADDR || addr.ipv4_mapped )
+                return manager_radix_trie_lookup(t->ipv4, addr.addr, 32);
+
+        return manager_radix_trie_lookup(t->ipv6, addr.addr, 128);
+}
+
+
+
+/*
+ * The first address of the node found in the table is used.
+ */
+static void tag_node(tag_table_t *t, idmef_alert_t *alert, idmef_node_t *node, const char *direction, int index)
+{
+        int ret;
+        size_t i;
+        tag_entry_t *entry = NULL;
+        prelude_string_t *location;
+        idmef_address_t *address = NULL;
+
+        while ( ! entry && (address = idmef_node_get_next_address(node, address)) )
+                entry = lookup_address(t, address);
+
+        if ( ! entry )
+                return;
+
+        if ( entry->location && ! idmef_node_get_location(node) ) {
+                ret = idmef_node_new_location(node, &location);
+                if ( ret >= 0 )
+                        prelude_string_set_dup(location, entry->location);
+        }
+
+        for ( i = 0; i < entry->nattr; i++ ) {
+                ret = add_node_data(alert, direction, index, &entry->attr[i]);
+                if ( ret < 0 )
+                        return;
+        }
+}
+
+
+
+static tag_table_t *get_table(void)
+{
+        tag_table_t *t;
+
+        gl_lock_lock(table_lock);
+        t = table;
+        gl_lock_unlock(table_lock);
+
+        return t;
+}
+
+
+
+static prelude_bool_t is_tagged(idmef_message_t *idmef)
+{
+        return idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT && get_table();
+}
+
+
+
+/*
+ * Remove the stamp from the alert, so that it is not reported, and
+ * return whether it was there.
+ */
+static prelude_bool_t take_tagged_stamp(idmef_alert_t *alert)
+{
+        prelude_string_t *meaning;
+        idmef_additional_data_t *ad = NULL;
+
+        while ( (ad = idmef_alert_get_next_additional_data(alert, ad)) ) {
+                meaning = idmef_additional_data_get_meaning(ad);
+                if ( meaning && strcmp(prelude_string_get_string_or_default(meaning, ""), TAGGED_MEANING) == 0 ) {
+                        idmef_additional_data_destroy(ad);
+                        return TRUE;
+                }
+        }
+
+        return FALSE;
+}
+
+
+
+static int cidr_tag_run(prelude_msg_t *msg, idmef_message_t *idmef)
+{
+        int i;
+        tag_table_t *t;
+        idmef_node_t *node;
+        idmef_alert_t *alert;
+        idmef_source_t *source = NULL;
+        idmef_target_t *target = NULL;
+
+        if ( idmef_message_get_type(idmef) != IDMEF_MESSAGE_TYPE_ALERT )
+                return 0;
+
+        alert = idmef_message_get_alert(idmef);
+
+        /*
+         * Alerts relayed by a child manager were already tagged.
+         */
+        if ( take_tagged_stamp(alert) )
+                return 0;
+
+        t = get_table();
+        if ( ! t )
+                return 0;
+
+        for ( i = 0; (source = idmef_alert_get_next_source(alert, source)); i++ ) {
+                node = idmef_source_get_node(source);
+                if ( node )
+                        tag_node(t, alert, node, "source", i);
+        }
+
+        for ( i = 0; (target = idmef_alert_get_next_target(alert, target)); i++ ) {
+                node = idmef_target_get_node(target);
+                if ( node )
+                        tag_node(t, alert, node, "target", i);
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * The same file is only reloaded if it changed. The previous watch is
+ * destroyed first, so that it does not replace the new table.
+ */
+static int cidr_tag_set_file(prelude_option_t *option, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+        char *new;
+
+        if ( table_watch && strcmp(table_file, arg) == 0 )
+                return manager_file_watch_check(table_watch);
+
+        new = strdup(arg);
+        if ( ! new )
+                return prelude_error_from_errno(errno);
+
+        if ( table_watch ) {
+                manager_file_watch_destroy(table_watch);
+                table_watch = NULL;
+        }
+
+        ret = manager_file_watch_new(&table_watch, new, reload_interval, tag_table_reload, NULL);
+        if ( ret < 0 ) {
+                free(new);
+                prelude_string_sprintf(err, "error loading network table '%s'", arg);
+                return -1;
+        }
+
+        free(table_file);
+        table_file = new;
+
+        return 0;
+}
+
+
+
+static int cidr_tag_set_reload_interval(prelude_option_t *option, const char *arg, prelude_string_t *err, void *context)
+{
+        reload_interval = atoi(arg);
+
+        if ( table_watch )
+                return manager_file_watch_set_interval(table_watch, reload_interval);
+
+        return 0;
+}
+
+
+
+int cidr_tag_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *root_opt)
+{
+        int ret;
+        prelude_option_t *opt;
+        prelude_plugin_instance_t *pi;
+        static manager_decode_plugin_t cidr_tag;
+
+        ret = manager_idmef_add_relay_stamp(TAGGED_MEANING, is_tagged);
+        if ( ret < 0 )
+                return ret;
+
+        memset(&cidr_tag, 0, sizeof(cidr_tag));
+
+        prelude_plugin_set_name(&cidr_tag, "CIDR-Tag");
+        manager_decode_plugin_set_running_func(&cidr_tag, cidr_tag_run);
+        manager_decode_plugin_set_order(&cidr_tag, MANAGER_DECODE_ORDER_ENRICH);
+        manager_plugin_set_reload_safe((void *) &cidr_tag);
+        prelude_plugin_entry_set_plugin(pe, (void *) &cidr_tag);
+
+        prelude_option_add(root_opt, &opt, PRELUDE_OPTION_TYPE_CFG,
+                           0, "cidr-tag", "Option for the cidr-tag plugin", PRELUDE_OPTION_ARGUMENT_NONE, NULL, NULL);
+
+        prelude_option_add(opt, NULL, PRELUDE_OPTION_TYPE_CFG,
+                           'i', "reload-interval",
+                           "Interval, in seconds, between checks for network table changes (0 to disable)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, cidr_tag_set_reload_interval, NULL);
+
+        prelude_option_add(opt, NULL, PRELUDE_OPTION_TYPE_CFG,
+                           'f', "file", "Network table used to tag alert source and target nodes",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, cidr_tag_set_file, NULL);
+
+        return prelude_plugin_new_instance(&pi, (void *) &cidr_tag, NULL, NULL);
+}
+
+
+
+int cidr_tag_LTX_prelude_plugin_version(void)
+{
+        return PRELUDE_PLUGIN_API_VERSION;
+}
@@ -24,7 +24,9 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
 # include <netdb.h>
@@ -39,8 +41,197 @@ int normalize_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *root_opt
 
 
 
+/*
+ * Protocol table, built once from the protocols database at
+ * initialization: getprotobynumber() and getprotobyname() go through
+ * NSS, use static buffers and are not thread safe.
+ *
+ * Names (including aliases) are found through a perfect hash: the seed
+ * is chosen so that no two names share a slot.
+ */
+#define PROTOCOL_MAX 256
+
+typedef struct {
+        const char *name;
+        uint8_t number;
+} protocol_name_t;
+
+
+static const char *protocol_by_number[PROTOCOL_MAX];
+
+static uint32_t protocol_hash_seed = 0;
+static size_t protocol_hash_size = 0;
+static protocol_name_t *protocol_by_name = NULL;
+
+/*
+ * Messages relayed to parent managers are stamped with this additional
+ * data, so that these can skip normalizing them again.
+ */
+#define NORMALIZED_MEANING "prelude-manager-normalized"
+
+
 static prelude_bool_t no_ipv6_prefix = TRUE;
 static prelude_bool_t normalize_to_ipv6 = FALSE;
+static prelude_bool_t trust_relayed = FALSE;
+
+
+
+static uint32_t protocol_hash(const char *name, uint32_t seed)
+{
+        uint32_t hash = 2166136261U ^ seed;
+
+        while ( *name ) {
+                hash ^= (unsigned char) *name++;
+                hash *= 16777619;
+        }
+
+        return hash;
+}
+
+
+
+static const protocol_name_t *get_protocol_by_name(const char *name)
+{
+        protocol_name_t *entry;
+
+        if ( ! protocol_hash_size )
+                return NULL;
+
+        entry = &protocol_by_name[protocol_hash(name, protocol_hash_seed) & (protocol_hash_size - 1)];
+        if ( ! entry->name || strcmp(entry->name, name) != 0 )
+                return NULL;
+
+        return entry;
+}
+
+
+
+static prelude_bool_t protocol_hash_fill(protocol_name_t *table, size_t size, uint32_t seed,
+                                         protocol_name_t *names, size_t count)
+{
+        size_t i;
+        protocol_name_t *entry;
+
+        memset(table, 0, size * sizeof(*table));
+
+        for ( i = 0; i < count; i++ ) {
+                entry = &table[protocol_hash(names[i].name, seed) & (size - 1)];
+
+                /*
+                 * A name listed twice keep its first number, as getprotobyname() do.
+                 */
+                if ( entry->name && strcmp(entry->name, names[i].name) == 0 )
+                        continue;
+
+                if ( entry->name )
+                        return FALSE;
+
+                *entry = names[i];
+        }
+
+        return TRUE;
+}
+
+
+
+static int protocol_hash_build(protocol_name_t *names, size_t count)
+{
+        uint32_t seed;
+        size_t size = 1;
+        protocol_name_t *table;
+
+        if ( ! count )
+                return 0;
+
+        while ( size < count * 2 )
+                size <<= 1;
+
+        while ( 1 ) {
+                table = malloc(size * sizeof(*table));
+                if ( ! table )
+                        return prelude_error_from_errno(errno);
+
+                for ( seed = 1; seed <= 64; seed++ ) {
+                        if ( protocol_hash_fill(table, size, seed, names, count) ) {
+                                protocol_by_name = table;
+                                protocol_hash_size = size;
+                                protocol_hash_seed = seed;
+                                return 0;
+                        }
+                }
+
+                free(table);
+                size <<= 1;
+        }
+}
+
+
+
+static int protocol_names_add(protocol_name_t **names, size_t *count, size_t *size, const char *name, uint8_t number)
+{
+        protocol_name_t *tmp;
+
+        if ( *count == *size ) {
+                tmp = realloc(*names, (*size + 64) * sizeof(*tmp));
+                if ( ! tmp )
+                        return prelude_error_from_errno(errno);
+
+                *names = tmp;
+                *size += 64;
+        }
+
+        (*names)[*count].name = strdup(name);
+        if ( ! (*names)[*count].name )
+                return prelude_error_from_errno(errno);
+
+        (*names)[*count].number = number;
+        (*count)++;
+
+        return 0;
+}
+
+
+
+/*
+ * Strings referenced by the table are never released: they are used
+ * by reference in the normalized messages.
+ */
+static int protocol_table_init(void)
+{
+        int ret = 0;
+        size_t count = 0, size = 0;
+        protocol_name_t *names = NULL;
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+        char **alias;
+        struct protoent *proto;
+
+        setprotoent(1);
+
+        while ( ret == 0 && (proto = getprotoent()) ) {
+                if ( proto->p_proto < 0 || proto->p_proto >= PROTOCOL_MAX )
+                        continue;
+
+                ret = protocol_names_add(&names, &count, &size, proto->p_name, proto->p_proto);
+                if ( ret < 0 )
+                        break;
+
+                if ( ! protocol_by_number[proto->p_proto] )
+                        protocol_by_number[proto->p_proto] = names[count - 1].name;
+
+                for ( alias = proto->p_aliases; alias && *alias && ret == 0; alias++ )
+                        ret = protocol_names_add(&names, &count, &size, *alias, proto->p_proto);
+        }
+
+        endprotoent();
+#endif
+
+        if ( ret == 0 )
+                ret = protocol_hash_build(names, count);
+
+        free(names);
+
+        return ret;
+}
 
 
 
@@ -48,30 +239,29 @@ static int sanitize_service_protocol(idmef_service_t *service)
 {
         int ret;
         uint8_t *ipn;
-        struct protoent *proto;
         prelude_string_t *str;
+        const protocol_name_t *proto;
 
         if ( ! service )
                 return 0;
 
         ipn = idmef_service_get_iana_protocol_number(service);
         if ( ipn ) {
-                proto = getprotobynumber(*ipn);
-                if ( proto ) {
+                if ( protocol_by_number[*ipn] ) {
                         ret = idmef_service_new_iana_protocol_name(service, &str);
                         if ( ret < 0 )
                                 return ret;
 
-                        ret = prelude_string_set_dup(str, proto->p_name);
+                        ret = prelude_string_set_ref(str, protocol_by_number[*ipn]);
                         if ( ret < 0 )
                                 return ret;
                 }
         }
 
         else if ( (str = idmef_service_get_iana_protocol_name(service)) && ! prelude_string_is_empty(str) ) {
-                proto = getprotobyname(prelude_string_get_string(str));
+                proto = get_protocol_by_name(prelude_string_get_string(str));
                 if ( proto )
-                        idmef_service_set_iana_protocol_number(service, proto->p_proto);
+                        idmef_service_set_iana_protocol_number(service, proto->number);
         }
 
         if ( ! idmef_service_get_port(service) && ! idmef_service_get_name(service) ) {
@@ -90,72 +280,61 @@ static int sanitize_service_protocol(idmef_service_t *service)
 
 
 
-static void sanitize_address_string(idmef_address_t *addr, const char *str, prelude_bool_t have_v6_prefix)
+/*
+ * The replacement string is built from the binary form on the stack,
+ * only the resulting string is allocated.
+ */
+static void sanitize_address_string(idmef_address_t *addr, manager_address_t *parsed)
 {
         int ret;
+        size_t len;
         prelude_string_t *pstr;
+        char buf[sizeof("::ffff:255.255.255.255")];
 
-        if ( have_v6_prefix && no_ipv6_prefix && ! normalize_to_ipv6 ) {
-                ret = prelude_string_new_dup(&pstr, str + 7);
-                if ( ret < 0 )
-                        return;
+        if ( parsed->ipv4_mapped && no_ipv6_prefix && ! normalize_to_ipv6 )
+                len = manager_address_ipv4_to_string(parsed->addr, buf);
 
-                idmef_address_set_address(addr, pstr);
+        else if ( ! parsed->ipv4_mapped && normalize_to_ipv6 ) {
+                memcpy(buf, "::ffff:", 7);
+                len = 7 + manager_address_ipv4_to_string(parsed->addr, buf + 7);
         }
 
-        else if ( ! have_v6_prefix && normalize_to_ipv6 ) {
-                ret = prelude_string_new_dup(&pstr, "::ffff:");
-                if ( ret < 0 )
-                        return;
+        else
+                return;
 
-                ret = prelude_string_cat(pstr, str);
-                if ( ret < 0 ) {
-                        prelude_string_destroy(pstr);
-                        return;
-                }
+        ret = prelude_string_new_dup_fast(&pstr, buf, len);
+        if ( ret < 0 )
+                return;
 
-                idmef_address_set_address(addr, pstr);
-                idmef_address_set_category(addr, IDMEF_ADDRESS_CATEGORY_IPV6_ADDR);
-        }
+        idmef_address_set_address(addr, pstr);
 
-        return;
+        if ( normalize_to_ipv6 )
+                idmef_address_set_category(addr, IDMEF_ADDRESS_CATEGORY_IPV6_ADDR);
 }
 
 
+
+/*
+ * The category set here also serve as a cache: addresses with a known
+ * category are not parsed again.
+ */
 static void sanitize_address(idmef_address_t *addr)
 {
         int ret;
-        const char *str;
-        int a, b, c, d;
-        char buf1[256], buf2[256];
-        prelude_bool_t ipv6_prefix = FALSE;
+        manager_address_t parsed;
 
         if ( idmef_address_get_category(addr) != IDMEF_ADDRESS_CATEGORY_UNKNOWN ||
              ! idmef_address_get_address(addr) )
                 return;
 
-
-        str = prelude_string_get_string(idmef_address_get_address(addr));
-
-        if ( strncmp(str, "::ffff:", 7) == 0 )
-                ipv6_prefix = TRUE;
-
-        ret = sscanf(str + ((ipv6_prefix) ? 7 : 0), "%d.%d.%d.%d", &a, &b, &c, &d);
-        if ( ret == 4 ) {
-                idmef_address_set_category(addr, IDMEF_ADDRESS_CATEGORY_IPV4_ADDR);
-                return sanitize_address_string(addr, str, ipv6_prefix);
-        }
-
-        ret = sscanf(str, "%255[^@]@%255s", buf1, buf2);
-        if ( ret == 2 ) {
-                idmef_address_set_category(addr, IDMEF_ADDRESS_CATEGORY_E_MAIL);
+        ret = manager_address_parse(&parsed, prelude_string_get_string(idmef_address_get_address(addr)));
+        if ( ret < 0 && parsed.category == IDMEF_ADDRESS_CATEGORY_UNKNOWN )
                 return;
-        }
 
-        if ( (str = strchr(str, ':')) && strchr(str + 1, ':') ) {
-                idmef_address_set_category(addr, IDMEF_ADDRESS_CATEGORY_IPV6_ADDR);
-                return;
-        }
+        idmef_address_set_category(addr, parsed.category);
+
+        if ( parsed.category == IDMEF_ADDRESS_CATEGORY_IPV4_ADDR )
+                sanitize_address_string(addr, &parsed);
 }
 
 
@@ -261,9 +440,54 @@ static void sanitize_heartbeat(idmef_heartbeat_t *heartbeat)
 
 
 
-static int normalize_run(prelude_msg_t *msg, idmef_message_t *idmef)
+static idmef_additional_data_t *get_next_additional_data(idmef_message_t *idmef, idmef_additional_data_t *ad)
 {
         if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT )
+                return idmef_alert_get_next_additional_data(idmef_message_get_alert(idmef), ad);
+
+        return idmef_heartbeat_get_next_additional_data(idmef_message_get_heartbeat(idmef), ad);
+}
+
+
+
+/*
+ * Remove the stamp from the message, so that it is not reported, and
+ * return whether it was there.
+ */
+static prelude_bool_t take_normalized_stamp(idmef_message_t *idmef)
+{
+        prelude_string_t *meaning;
+        idmef_additional_data_t *ad = NULL;
+
+        while ( (ad = get_next_additional_data(idmef, ad)) ) {
+                meaning = idmef_additional_data_get_meaning(ad);
+                if ( meaning && prelude_string_get_len(meaning) == sizeof(NORMALIZED_MEANING) - 1 &&
+                     memcmp(prelude_string_get_string(meaning), NORMALIZED_MEANING, sizeof(NORMALIZED_MEANING) - 1) == 0 ) {
+                        idmef_additional_data_destroy(ad);
+                        return TRUE;
+                }
+        }
+
+        return FALSE;
+}
+
+
+
+static int normalize_run(prelude_msg_t *msg, idmef_message_t *idmef)
+{
+        idmef_message_type_t type = idmef_message_get_type(idmef);
+
+        if ( type != IDMEF_MESSAGE_TYPE_ALERT && type != IDMEF_MESSAGE_TYPE_HEARTBEAT )
+                return 0;
+
+        /*
+         * Messages relayed by a trusted child manager were already
+         * normalized.
+         */
+        if ( take_normalized_stamp(idmef) && trust_relayed )
+                return 0;
+
+        if ( type == IDMEF_MESSAGE_TYPE_ALERT )
                 sanitize_alert(idmef_message_get_alert(idmef));
         else
                 sanitize_heartbeat(idmef_message_get_heartbeat(idmef));
@@ -287,20 +511,34 @@ static int normalize_keep_ipv6(prelude_option_t *option, const char *arg, prelud
 }
 
 
+static int normalize_trust_relayed_cb(prelude_option_t *option, const char *arg, prelude_string_t *err, void *context)
+{
+        trust_relayed = TRUE;
+        return 0;
+}
+
+
 int normalize_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *root_opt)
 {
+        int ret;
         prelude_option_t *opt;
         prelude_plugin_instance_t *pi;
         static manager_decode_plugin_t normalize;
 
-#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
-        setprotoent(1);
-#endif
+        ret = protocol_table_init();
+        if ( ret < 0 )
+                return ret;
+
+        ret = manager_idmef_add_relay_stamp(NORMALIZED_MEANING, NULL);
+        if ( ret < 0 )
+                return ret;
 
         memset(&normalize, 0, sizeof(normalize));
 
         prelude_plugin_set_name(&normalize, "Normalize");
         manager_decode_plugin_set_running_func(&normalize, normalize_run);
+        manager_decode_plugin_set_order(&normalize, MANAGER_DECODE_ORDER_NORMALIZE);
+        manager_plugin_set_reload_safe((void *) &normalize);
         prelude_plugin_entry_set_plugin(pe, (void *) &normalize);
 
         prelude_option_add(root_opt, &opt, PRELUDE_OPTION_TYPE_CFG,
@@ -315,6 +553,11 @@ int normalize_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *root_opt
                            "Do not normalize IPv4 mapped IPv6 address to IPv4",
                            PRELUDE_OPTION_ARGUMENT_NONE, normalize_keep_ipv6, NULL);
 
+        prelude_option_add(opt, NULL, PRELUDE_OPTION_TYPE_CFG,
+                           't', "trust-relayed",
+                           "Do not normalize again messages relayed by child managers",
+                           PRELUDE_OPTION_ARGUMENT_NONE, normalize_trust_relayed_cb, NULL);
+
         return prelude_plugin_new_instance(&pi, (void *) &normalize, NULL, NULL);
 }
 
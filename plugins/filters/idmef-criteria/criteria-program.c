@@ -0,0 +1,1069 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "prelude-manager.h"
+#include "criteria-program.h"
+#include "string-matcher.h"
+#include "value-list.h"
+
+
+/*
+ * Branch targets below zero are terminals.
+ */
+#define NODE_NO_MATCH -1
+#define NODE_MATCH    -2
+
+#define HASH_INITIAL_SIZE 64
+
+/*
+ * Below this number of string criteria on a path, evaluating them one
+ * by one is cheaper than running the string matcher.
+ */
+#define MATCHER_MIN_PATTERNS 4
+
+
+/*
+ * libprelude evaluate a criteria by matching its criterion, then
+ * continue with the "and" criteria on success, or the "or" criteria on
+ * failure, the result of the last criterion matched being the result
+ * of the whole. idmef_criteria_and_criteria() copy the right hand side
+ * into every alternative of the left hand side, so that a rule file
+ * hold many duplicates of the same criteria, which the compilation
+ * merge back.
+ *
+ * Negation is applied at compile time by swapping the node branches.
+ */
+typedef struct {
+        int predicate;
+        int next[2];
+} program_node_t;
+
+
+typedef struct {
+        int path;
+        int result_id;
+        idmef_criterion_t *criterion;
+        idmef_criterion_value_t *value;
+        idmef_criterion_operator_t operator;
+
+        int matcher;
+        prelude_bool_t negated;
+        value_list_t *list;
+} program_predicate_t;
+
+
+/*
+ * Equality, substring and literal regex criteria on the same path are
+ * matched at once: a single pass over the value compute the result of
+ * all of them.
+ */
+typedef struct {
+        int path;
+        prelude_bool_t nocase;
+
+        size_t count;
+        size_t alloc;
+        int *predicate;
+
+        string_matcher_t *matcher;
+} program_matcher_t;
+
+
+struct criteria_program {
+        idmef_criteria_t *criteria;
+        value_list_table_t *lists;
+
+        int root;
+
+        size_t node_count;
+        program_node_t *node;
+
+        size_t predicate_count;
+        program_predicate_t *predicate;
+        int *predicate_result;
+        unsigned int *predicate_stamp;
+
+        size_t matcher_count;
+        program_matcher_t *matcher;
+
+        size_t path_count;
+        idmef_path_t **path;
+        int *path_id;
+        idmef_value_t **path_value;
+        unsigned int *path_stamp;
+
+        /*
+         * Cached results are valid for the current stamp only.
+         */
+        unsigned int stamp;
+        size_t fetched_count;
+        int *fetched;
+
+        uint64_t evaluated;
+        uint64_t predicate_evaluated;
+        uint64_t matcher_evaluated;
+        uint64_t path_fetched;
+};
+
+
+/*
+ * Chained hash of indexes, the keys are stored by the caller at the
+ * same index.
+ */
+typedef struct {
+        size_t size;
+        size_t count;
+        int *bucket;
+        int *chain;
+        uint32_t *hash;
+} index_hash_t;
+
+
+typedef struct {
+        criteria_program_t *program;
+        value_list_table_t *lists;
+
+        index_hash_t node_hash;
+        index_hash_t predicate_hash;
+        char **predicate_key;
+        index_hash_t path_hash;
+
+        size_t node_alloc;
+        size_t predicate_alloc;
+        size_t predicate_key_alloc;
+        size_t path_alloc;
+
+        prelude_string_t *buf;
+} program_compiler_t;
+
+
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len)
+{
+        size_t i;
+        const unsigned char *ptr = data;
+
+        for ( i = 0; i < len; i++ ) {
+                hash ^= ptr[i];
+                hash *= 16777619U;
+        }
+
+        return hash;
+}
+
+
+
+static int grow_array(void **array, size_t *alloc, size_t count, size_t elsize)
+{
+        void *ptr;
+        size_t new_alloc;
+
+        if ( count < *alloc )
+                return 0;
+
+        new_alloc = (*alloc) ? *alloc * 2 : HASH_INITIAL_SIZE;
+
+        ptr = realloc(*array, new_alloc * elsize);
+        if ( ! ptr )
+                return prelude_error_from_errno(errno);
+
+        *array = ptr;
+        *alloc = new_alloc;
+
+        return 0;
+}
+
+
+
+static int index_hash_resize(index_hash_t *h, size_t size)
+{
+        size_t i;
+        int *bucket;
+
+        bucket = malloc(size * sizeof(*bucket));
+        if ( ! bucket )
+                return prelude_error_from_errno(errno);
+
+        for ( i = 0; i < size; i++ )
+                bucket[i] = -1;
+
+        for ( i = 0; i < h->count; i++ ) {
+                h->chain[i] = bucket[h->hash[i] & (size - 1)];
+                bucket[h->hash[i] & (size - 1)] = i;
+        }
+
+        free(h->bucket);
+        h->bucket = bucket;
+        h->size = size;
+
+        return 0;
+}
+
+
+
+static int index_hash_first(index_hash_t *h, uint32_t hash)
+{
+        int i;
+
+        if ( ! h->size )
+                return -1;
+
+        for ( i = h->bucket[hash & (h->size - 1)]; i >= 0 && h->hash[i] != hash; i = h->chain[i] );
+
+        return i;
+}
+
+
+
+static int index_hash_next(index_hash_t *h, int i)
+{
+        uint32_t hash = h->hash[i];
+
+        for ( i = h->chain[i]; i >= 0 && h->hash[i] != hash; i = h->chain[i] );
+
+        return i;
+}
+
+
+
+/*
+ * Return the index the new key should be stored at.
+ */
+static int index_hash_add(index_hash_t *h, uint32_t hash)
+{
+        int *chain;
+        size_t size;
+        uint32_t *hashes;
+
+        if ( h->count >= h->size ) {
+                size = (h->size) ? h->size * 2 : HASH_INITIAL_SIZE;
+
+                chain = realloc(h->chain, size * sizeof(*chain));
+                if ( ! chain )
+                        return prelude_error_from_errno(errno);
+                h->chain = chain;
+
+                hashes = realloc(h->hash, size * sizeof(*hashes));
+                if ( ! hashes )
+                        return prelude_error_from_errno(errno);
+                h->hash = hashes;
+
+                if ( index_hash_resize(h, size) < 0 )
+                        return prelude_error_from_errno(errno);
+        }
+
+        h->hash[h->count] = hash;
+        h->chain[h->count] = h->bucket[hash & (h->size - 1)];
+        h->bucket[hash & (h->size - 1)] = h->count;
+
+        return h->count++;
+}
+
+
+
+static void index_hash_destroy(index_hash_t *h)
+{
+        free(h->bucket);
+        free(h->chain);
+        free(h->hash);
+}
+
+
+
+static int compile_path(program_compiler_t *compiler, idmef_path_t *path)
+{
+        int i;
+        uint32_t hash;
+        const char *name;
+        criteria_program_t *program = compiler->program;
+
+        name = idmef_path_get_name(path, -1);
+        hash = hash_bytes(2166136261U, name, strlen(name));
+
+        for ( i = index_hash_first(&compiler->path_hash, hash); i >= 0; i = index_hash_next(&compiler->path_hash, i) ) {
+                if ( strcmp(idmef_path_get_name(program->path[i], -1), name) == 0 )
+                        return i;
+        }
+
+        i = grow_array((void **) &program->path, &compiler->path_alloc, program->path_count, sizeof(*program->path));
+        if ( i < 0 )
+                return i;
+
+        i = index_hash_add(&compiler->path_hash, hash);
+        if ( i < 0 )
+                return i;
+
+        program->path[i] = path;
+        program->path_count++;
+
+        return i;
+}
+
+
+
+/*
+ * Criteria are identified by their string representation, which carry
+ * the path, operator and value, and by the list they are bound to. The
+ * same identity is registered so that the result is shared with every
+ * program evaluating the criterion for the same message.
+ */
+static int compile_predicate(program_compiler_t *compiler, idmef_criterion_t *criterion)
+{
+        int i, ret;
+        uint32_t hash;
+        const char *key;
+        value_list_t *list;
+        program_predicate_t *predicate;
+        criteria_program_t *program = compiler->program;
+
+        prelude_string_clear(compiler->buf);
+
+        ret = idmef_criterion_to_string(criterion, compiler->buf);
+        if ( ret < 0 )
+                return ret;
+
+        list = value_list_table_get(compiler->lists, criterion);
+        if ( list ) {
+                ret = prelude_string_sprintf(compiler->buf, " in @%s", value_list_get_filename(list));
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        key = prelude_string_get_string(compiler->buf);
+        hash = hash_bytes(2166136261U, key, prelude_string_get_len(compiler->buf));
+
+        for ( i = index_hash_first(&compiler->predicate_hash, hash); i >= 0; i = index_hash_next(&compiler->predicate_hash, i) ) {
+                if ( strcmp(compiler->predicate_key[i], key) == 0 )
+                        return i;
+        }
+
+        ret = grow_array((void **) &program->predicate, &compiler->predicate_alloc,
+                         program->predicate_count, sizeof(*program->predicate));
+        if ( ret < 0 )
+                return ret;
+
+        ret = grow_array((void **) &compiler->predicate_key, &compiler->predicate_key_alloc,
+                         program->predicate_count, sizeof(*compiler->predicate_key));
+        if ( ret < 0 )
+                return ret;
+
+        compiler->predicate_key[program->predicate_count] = strdup(key);
+        if ( ! compiler->predicate_key[program->predicate_count] )
+                return prelude_error_from_errno(errno);
+
+        ret = compile_path(compiler, idmef_criterion_get_path(criterion));
+        if ( ret < 0 ) {
+                free(compiler->predicate_key[program->predicate_count]);
+                return ret;
+        }
+
+        i = index_hash_add(&compiler->predicate_hash, hash);
+        if ( i < 0 ) {
+                free(compiler->predicate_key[program->predicate_count]);
+                return i;
+        }
+
+        predicate = &program->predicate[i];
+        predicate->path = ret;
+        predicate->result_id = manager_idmef_result_register(key);
+        predicate->criterion = criterion;
+        predicate->value = idmef_criterion_get_value(criterion);
+        predicate->operator = idmef_criterion_get_operator(criterion);
+        predicate->negated = (predicate->operator & IDMEF_CRITERION_OPERATOR_NOT) ? TRUE : FALSE;
+        predicate->matcher = -1;
+        predicate->list = list;
+        program->predicate_count++;
+
+        return i;
+}
+
+
+
+static int compile_node(program_compiler_t *compiler, int predicate, int next_false, int next_true)
+{
+        int i, ret;
+        uint32_t hash;
+        program_node_t *node;
+        criteria_program_t *program = compiler->program;
+        int key[3] = { predicate, next_false, next_true };
+
+        hash = hash_bytes(2166136261U, key, sizeof(key));
+
+        for ( i = index_hash_first(&compiler->node_hash, hash); i >= 0; i = index_hash_next(&compiler->node_hash, i) ) {
+                node = &program->node[i];
+                if ( node->predicate == predicate && node->next[0] == next_false && node->next[1] == next_true )
+                        return i;
+        }
+
+        ret = grow_array((void **) &program->node, &compiler->node_alloc, program->node_count, sizeof(*program->node));
+        if ( ret < 0 )
+                return ret;
+
+        i = index_hash_add(&compiler->node_hash, hash);
+        if ( i < 0 )
+                return i;
+
+        node = &program->node[i];
+        node->predicate = predicate;
+        node->next[0] = next_false;
+        node->next[1] = next_true;
+        program->node_count++;
+
+        return i;
+}
+
+
+
+/*
+ * The "or" chain is compiled from its end, so that the recursion depth
+ * only depend on the length of the "and" chains.
+ */
+static int compile_criteria(program_compiler_t *compiler, idmef_criteria_t *criteria, int *out)
+{
+        int ret, next_true, next_false = NODE_NO_MATCH, predicate, tmp;
+        size_t count = 0, alloc = 0, i;
+        idmef_criteria_t *cur, **chain = NULL;
+        idmef_criterion_t *criterion;
+
+        for ( cur = criteria; cur; cur = idmef_criteria_get_or(cur) ) {
+                ret = grow_array((void **) &chain, &alloc, count, sizeof(*chain));
+                if ( ret < 0 )
+                        goto out;
+
+                chain[count++] = cur;
+        }
+
+        for ( i = count; i > 0; i-- ) {
+                cur = chain[i - 1];
+
+                next_true = NODE_MATCH;
+                if ( idmef_criteria_get_and(cur) ) {
+                        ret = compile_criteria(compiler, idmef_criteria_get_and(cur), &next_true);
+                        if ( ret < 0 )
+                                goto out;
+                }
+
+                criterion = idmef_criteria_get_criterion(cur);
+                if ( criterion ) {
+                        ret = predicate = compile_predicate(compiler, criterion);
+                        if ( ret < 0 )
+                                goto out;
+                } else
+                        predicate = -1;
+
+                if ( idmef_criteria_is_negated(cur) ) {
+                        tmp = next_true;
+                        next_true = next_false;
+                        next_false = tmp;
+                }
+
+                ret = next_false = compile_node(compiler, predicate, next_false, next_true);
+                if ( ret < 0 )
+                        goto out;
+        }
+
+        *out = next_false;
+        ret = 0;
+
+ out:
+        free(chain);
+        return ret;
+}
+
+
+
+/*
+ * Only regex made of literal characters, optionally anchored, are
+ * handled by the string matcher.
+ */
+static prelude_bool_t is_regex_literal(const char *str, size_t len)
+{
+        size_t i;
+
+        for ( i = 0; i < len; i++ ) {
+                if ( ! isascii(str[i]) || ! isprint(str[i]) || strchr(".[]()*+?{}|^$\\", str[i]) )
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+
+
+static int get_pattern(program_compiler_t *compiler, program_predicate_t *predicate,
+                       const char **pattern, size_t *len, string_matcher_kind_t *kind)
+{
+        int ret;
+        const idmef_value_t *value;
+        prelude_string_t *str;
+        idmef_criterion_operator_t operator;
+
+        if ( ! predicate->value || predicate->list )
+                return -1;
+
+        operator = predicate->operator & ~(IDMEF_CRITERION_OPERATOR_NOT|IDMEF_CRITERION_OPERATOR_NOCASE);
+
+        if ( operator == IDMEF_CRITERION_OPERATOR_EQUAL || operator == IDMEF_CRITERION_OPERATOR_SUBSTR ) {
+                if ( idmef_criterion_value_get_type(predicate->value) != IDMEF_CRITERION_VALUE_TYPE_VALUE )
+                        return -1;
+
+                value = idmef_criterion_value_get_value(predicate->value);
+                if ( idmef_value_get_type(value) != IDMEF_VALUE_TYPE_STRING )
+                        return -1;
+
+                str = idmef_value_get_string((idmef_value_t *) value);
+                if ( ! str || ! prelude_string_get_string(str) )
+                        return -1;
+
+                *pattern = prelude_string_get_string(str);
+                *len = strlen(*pattern);
+                *kind = (operator == IDMEF_CRITERION_OPERATOR_EQUAL) ? STRING_MATCHER_EQUAL : STRING_MATCHER_SUBSTRING;
+
+                return 0;
+        }
+
+        if ( operator != IDMEF_CRITERION_OPERATOR_REGEX ||
+             idmef_criterion_value_get_type(predicate->value) != IDMEF_CRITERION_VALUE_TYPE_REGEX )
+                return -1;
+
+        prelude_string_clear(compiler->buf);
+
+        ret = idmef_criterion_value_to_string(predicate->value, compiler->buf);
+        if ( ret < 0 )
+                return ret;
+
+        *pattern = prelude_string_get_string(compiler->buf);
+        *len = prelude_string_get_len(compiler->buf);
+        *kind = STRING_MATCHER_SUBSTRING;
+
+        if ( *len && (*pattern)[0] == '^' ) {
+                (*pattern)++;
+                (*len)--;
+                *kind = STRING_MATCHER_PREFIX;
+
+                if ( *len && (*pattern)[*len - 1] == '$' ) {
+                        (*len)--;
+                        *kind = STRING_MATCHER_EQUAL;
+                }
+        }
+
+        return is_regex_literal(*pattern, *len) ? 0 : -1;
+}
+
+
+
+static int add_matcher_predicate(criteria_program_t *program, size_t *alloc, int index, prelude_bool_t nocase)
+{
+        int ret;
+        size_t i;
+        program_matcher_t *m;
+        program_predicate_t *predicate = &program->predicate[index];
+
+        for ( i = 0; i < program->matcher_count; i++ ) {
+                m = &program->matcher[i];
+                if ( m->path == predicate->path && m->nocase == nocase )
+                        break;
+        }
+
+        if ( i == program->matcher_count ) {
+                ret = grow_array((void **) &program->matcher, alloc, program->matcher_count, sizeof(*program->matcher));
+                if ( ret < 0 )
+                        return ret;
+
+                m = &program->matcher[program->matcher_count++];
+                memset(m, 0, sizeof(*m));
+                m->path = predicate->path;
+                m->nocase = nocase;
+        }
+
+        ret = grow_array((void **) &m->predicate, &m->alloc, m->count, sizeof(*m->predicate));
+        if ( ret < 0 )
+                return ret;
+
+        m->predicate[m->count++] = index;
+        predicate->matcher = i;
+
+        return 0;
+}
+
+
+
+static void matcher_destroy(program_matcher_t *m)
+{
+        free(m->predicate);
+
+        if ( m->matcher )
+                string_matcher_destroy(m->matcher);
+}
+
+
+
+static int build_matcher(program_compiler_t *compiler, program_matcher_t *m)
+{
+        int ret;
+        size_t i, len;
+        const char *pattern;
+        string_matcher_kind_t kind;
+
+        ret = string_matcher_new(&m->matcher, m->nocase);
+        if ( ret < 0 )
+                return ret;
+
+        for ( i = 0; i < m->count; i++ ) {
+                ret = get_pattern(compiler, &compiler->program->predicate[m->predicate[i]], &pattern, &len, &kind);
+                if ( ret < 0 )
+                        return ret;
+
+                ret = string_matcher_add(m->matcher, pattern, len, kind, m->predicate[i]);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        return string_matcher_compile(m->matcher);
+}
+
+
+
+/*
+ * String criteria are grouped by path and case sensitivity, groups too
+ * small to benefit from a matcher being dropped.
+ */
+static int compile_matchers(program_compiler_t *compiler)
+{
+        int ret;
+        size_t i, j, alloc = 0, len;
+        const char *pattern;
+        string_matcher_kind_t kind;
+        program_predicate_t *predicate;
+        criteria_program_t *program = compiler->program;
+
+        for ( i = 0; i < program->predicate_count; i++ ) {
+                predicate = &program->predicate[i];
+
+                ret = get_pattern(compiler, predicate, &pattern, &len, &kind);
+                if ( ret < 0 )
+                        continue;
+
+                ret = add_matcher_predicate(program, &alloc, i,
+                                            (predicate->operator & IDMEF_CRITERION_OPERATOR_NOCASE) ? TRUE : FALSE);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        for ( i = 0, j = 0; i < program->matcher_count; i++ ) {
+                if ( program->matcher[i].count < MATCHER_MIN_PATTERNS ) {
+                        for ( len = 0; len < program->matcher[i].count; len++ )
+                                program->predicate[program->matcher[i].predicate[len]].matcher = -1;
+
+                        matcher_destroy(&program->matcher[i]);
+                        continue;
+                }
+
+                program->matcher[j] = program->matcher[i];
+
+                for ( len = 0; len < program->matcher[j].count; len++ )
+                        program->predicate[program->matcher[j].predicate[len]].matcher = j;
+
+                j++;
+        }
+
+        program->matcher_count = j;
+
+        for ( i = 0; i < program->matcher_count; i++ ) {
+                ret = build_matcher(compiler, &program->matcher[i]);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        return 0;
+}
+
+
+
+static int get_path_value(criteria_program_t *program, int path, idmef_message_t *message, idmef_value_t **value)
+{
+        int ret;
+
+        if ( program->path_stamp[path] == program->stamp ) {
+                *value = program->path_value[path];
+                return 0;
+        }
+
+        *value = NULL;
+
+        ret = manager_idmef_path_get(message, program->path[path], program->path_id[path], value);
+        if ( ret < 0 )
+                return ret;
+
+        program->path_fetched++;
+        program->path_stamp[path] = program->stamp;
+        program->path_value[path] = *value;
+
+        if ( *value )
+                program->fetched[program->fetched_count++] = path;
+
+        return 0;
+}
+
+
+
+static void matcher_cb(int id, void *data)
+{
+        criteria_program_t *program = data;
+
+        program->predicate_result[id] = ! program->predicate[id].negated;
+}
+
+
+
+/*
+ * Set the result of every predicate of the matcher. Only single string
+ * values are handled, others are evaluated one predicate at a time.
+ */
+static int run_matcher(criteria_program_t *program, program_matcher_t *m, idmef_message_t *message, idmef_value_t *value)
+{
+        int id;
+        size_t i;
+        const char *str;
+        prelude_string_t *string;
+
+        if ( idmef_value_get_type(value) != IDMEF_VALUE_TYPE_STRING )
+                return -1;
+
+        string = idmef_value_get_string(value);
+        if ( ! string || ! (str = prelude_string_get_string(string)) )
+                return -1;
+
+        for ( i = 0; i < m->count; i++ ) {
+                program->predicate_stamp[m->predicate[i]] = program->stamp;
+                program->predicate_result[m->predicate[i]] = program->predicate[m->predicate[i]].negated;
+        }
+
+        string_matcher_match(m->matcher, str, strlen(str), matcher_cb, program);
+        program->matcher_evaluated++;
+
+        for ( i = 0; i < m->count; i++ ) {
+                id = m->predicate[i];
+                manager_idmef_result_set(message, program->predicate[id].result_id, program->predicate_result[id]);
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * Any of the values of a list (for paths with wildcards) might be in
+ * the value list.
+ */
+static prelude_bool_t value_list_match(value_list_t *list, idmef_value_t *value)
+{
+        int i;
+        const char *str;
+        prelude_string_t *string;
+
+        if ( idmef_value_is_list(value) ) {
+                for ( i = 0; i < idmef_value_get_count(value); i++ ) {
+                        if ( value_list_match(list, (idmef_value_t *) idmef_value_get_nth(value, i)) )
+                                return TRUE;
+                }
+
+                return FALSE;
+        }
+
+        if ( idmef_value_get_type(value) != IDMEF_VALUE_TYPE_STRING )
+                return FALSE;
+
+        string = idmef_value_get_string(value);
+        if ( ! string || ! (str = prelude_string_get_string(string)) )
+                return FALSE;
+
+        return value_list_contains(list, str);
+}
+
+
+
+/*
+ * Absent values, and criteria without value (null checks), are
+ * delegated to libprelude so that the result match idmef_criteria_match()
+ * exactly.
+ */
+static int match_predicate(criteria_program_t *program, int index, idmef_message_t *message)
+{
+        int ret;
+        idmef_value_t *value;
+        program_predicate_t *predicate;
+
+        if ( index < 0 )
+                return 1;
+
+        if ( program->predicate_stamp[index] == program->stamp )
+                return program->predicate_result[index];
+
+        predicate = &program->predicate[index];
+
+        /*
+         * Another program might have evaluated the same criterion for
+         * this message already.
+         */
+        ret = manager_idmef_result_get(message, predicate->result_id);
+        if ( ret >= 0 ) {
+                program->predicate_stamp[index] = program->stamp;
+                program->predicate_result[index] = ret;
+                return ret;
+        }
+
+        ret = get_path_value(program, predicate->path, message, &value);
+        if ( ret < 0 )
+                return ret;
+
+        if ( value && predicate->matcher >= 0 && run_matcher(program, &program->matcher[predicate->matcher], message, value) == 0 )
+                return program->predicate_result[index];
+
+        if ( value && predicate->list )
+                ret = value_list_match(predicate->list, value) ^ predicate->negated;
+        else if ( value && predicate->value )
+                ret = idmef_criterion_value_match(predicate->value, value, predicate->operator);
+        else
+                ret = idmef_criterion_match(predicate->criterion, message);
+
+        if ( ret < 0 )
+                return ret;
+
+        program->predicate_evaluated++;
+        program->predicate_stamp[index] = program->stamp;
+        program->predicate_result[index] = (ret > 0) ? 1 : 0;
+        manager_idmef_result_set(message, predicate->result_id, program->predicate_result[index]);
+
+        return program->predicate_result[index];
+}
+
+
+
+static void release_values(criteria_program_t *program)
+{
+        size_t i;
+
+        for ( i = 0; i < program->fetched_count; i++ )
+                idmef_value_destroy(program->path_value[program->fetched[i]]);
+
+        program->fetched_count = 0;
+
+        /*
+         * On wrap around, stale stamps could match again.
+         */
+        if ( ++program->stamp == 0 ) {
+                memset(program->path_stamp, 0, program->path_count * sizeof(*program->path_stamp));
+                memset(program->predicate_stamp, 0, program->predicate_count * sizeof(*program->predicate_stamp));
+                program->stamp = 1;
+        }
+}
+
+
+
+int criteria_program_match(criteria_program_t *program, idmef_message_t *message)
+{
+        int ret, node = program->root;
+
+        program->evaluated++;
+
+        while ( node >= 0 ) {
+                ret = match_predicate(program, program->node[node].predicate, message);
+                if ( ret < 0 ) {
+                        release_values(program);
+                        return ret;
+                }
+
+                node = program->node[node].next[ret];
+        }
+
+        release_values(program);
+
+        return (node == NODE_MATCH) ? 1 : 0;
+}
+
+
+
+static int program_allocate_state(criteria_program_t *program)
+{
+        size_t i;
+
+        program->stamp = 1;
+
+        program->predicate_result = calloc(program->predicate_count + 1, sizeof(*program->predicate_result));
+        program->predicate_stamp = calloc(program->predicate_count + 1, sizeof(*program->predicate_stamp));
+        program->path_value = calloc(program->path_count + 1, sizeof(*program->path_value));
+        program->path_stamp = calloc(program->path_count + 1, sizeof(*program->path_stamp));
+        program->path_id = calloc(program->path_count + 1, sizeof(*program->path_id));
+        program->fetched = calloc(program->path_count + 1, sizeof(*program->fetched));
+
+        if ( ! program->predicate_result || ! program->predicate_stamp || ! program->path_value ||
+             ! program->path_stamp || ! program->path_id || ! program->fetched )
+                return prelude_error_from_errno(errno);
+
+        /*
+         * Values are shared with the other plugins using the same paths.
+         */
+        for ( i = 0; i < program->path_count; i++ )
+                program->path_id[i] = manager_idmef_path_register(program->path[i]);
+
+        return 0;
+}
+
+
+
+static void compiler_destroy(program_compiler_t *compiler)
+{
+        size_t i;
+
+        for ( i = 0; i < compiler->program->predicate_count; i++ )
+                free(compiler->predicate_key[i]);
+
+        free(compiler->predicate_key);
+
+        index_hash_destroy(&compiler->node_hash);
+        index_hash_destroy(&compiler->predicate_hash);
+        index_hash_destroy(&compiler->path_hash);
+
+        if ( compiler->buf )
+                prelude_string_destroy(compiler->buf);
+}
+
+
+
+/*
+ * On success, the program take ownership of criteria and of the table
+ * binding some of its criteria to value lists, which might be NULL.
+ */
+int criteria_program_new(criteria_program_t **program, idmef_criteria_t *criteria, value_list_table_t *lists)
+{
+        int ret;
+        program_compiler_t compiler;
+
+        *program = calloc(1, sizeof(**program));
+        if ( ! *program )
+                return prelude_error_from_errno(errno);
+
+        memset(&compiler, 0, sizeof(compiler));
+        compiler.program = *program;
+        compiler.lists = lists;
+
+        ret = prelude_string_new(&compiler.buf);
+        if ( ret < 0 )
+                goto err;
+
+        (*program)->root = NODE_NO_MATCH;
+
+        if ( criteria ) {
+                ret = compile_criteria(&compiler, criteria, &(*program)->root);
+                if ( ret < 0 )
+                        goto err;
+
+                ret = compile_matchers(&compiler);
+                if ( ret < 0 )
+                        goto err;
+        }
+
+        ret = program_allocate_state(*program);
+        if ( ret < 0 )
+                goto err;
+
+        compiler_destroy(&compiler);
+        (*program)->criteria = criteria;
+        (*program)->lists = lists;
+
+        return 0;
+
+ err:
+        compiler_destroy(&compiler);
+        criteria_program_destroy(*program);
+
+        return ret;
+}
+
+
+
+idmef_criteria_t *criteria_program_get_criteria(criteria_program_t *program)
+{
+        return program->criteria;
+}
+
+
+
+void criteria_program_print_stats(criteria_program_t *program, const char *name)
+{
+        size_t i, states = 0;
+
+        for ( i = 0; i < program->matcher_count; i++ )
+                states += string_matcher_get_state_count(program->matcher[i].matcher);
+
+        prelude_log(PRELUDE_LOG_INFO, "%s: %" PRELUDE_PRIu64 " nodes, %" PRELUDE_PRIu64 " criteria, %" PRELUDE_PRIu64
+                    " paths, %" PRELUDE_PRIu64 " evaluations, %" PRELUDE_PRIu64 " criteria matched, %" PRELUDE_PRIu64
+                    " paths retrieved.\n", name, (uint64_t) program->node_count, (uint64_t) program->predicate_count,
+                    (uint64_t) program->path_count, program->evaluated, program->predicate_evaluated, program->path_fetched);
+
+        if ( program->matcher_count )
+                prelude_log(PRELUDE_LOG_INFO, "%s: %" PRELUDE_PRIu64 " string matchers, %" PRELUDE_PRIu64 " states, %"
+                            PRELUDE_PRIu64 " string matches.\n", name, (uint64_t) program->matcher_count,
+                            (uint64_t) states, program->matcher_evaluated);
+}
+
+
+
+void criteria_program_destroy(criteria_program_t *program)
+{
+        size_t i;
+
+        for ( i = 0; i < program->matcher_count; i++ )
+                matcher_destroy(&program->matcher[i]);
+
+        free(program->matcher);
+        free(program->node);
+        free(program->predicate);
+        free(program->predicate_result);
+        free(program->predicate_stamp);
+        free(program->path);
+        free(program->path_value);
+        free(program->path_stamp);
+        free(program->path_id);
+        free(program->fetched);
+
+        if ( program->criteria )
+                idmef_criteria_destroy(program->criteria);
+
+        if ( program->lists )
+                value_list_table_destroy(program->lists);
+
+        free(program);
+}
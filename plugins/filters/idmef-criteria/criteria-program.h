@@ -0,0 +1,53 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#ifndef _IDMEF_CRITERIA_PROGRAM_H
+#define _IDMEF_CRITERIA_PROGRAM_H
+
+#include "value-list.h"
+
+/*
+ * Criteria compiled into a decision graph: each node test a single
+ * criterion and branch on the result. Identical criteria and identical
+ * sub-graphs are shared, each path is retrieved at most once and each
+ * criterion evaluated at most once per message. String criteria sharing
+ * a path are matched together, in a single pass over the value.
+ *
+ * A program is not reentrant, callers serialize criteria_program_match()
+ * for a given program.
+ */
+typedef struct criteria_program criteria_program_t;
+
+
+int criteria_program_new(criteria_program_t **program, idmef_criteria_t *criteria, value_list_table_t *lists);
+
+int criteria_program_match(criteria_program_t *program, idmef_message_t *message);
+
+idmef_criteria_t *criteria_program_get_criteria(criteria_program_t *program);
+
+void criteria_program_print_stats(criteria_program_t *program, const char *name);
+
+void criteria_program_destroy(criteria_program_t *program);
+
+#endif /* _IDMEF_CRITERIA_PROGRAM_H */
@@ -27,9 +27,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <ctype.h>
 #include <assert.h>
 
 #include "prelude-manager.h"
+#include "criteria-program.h"
+#include "value-list.h"
 
 
 int idmef_criteria_LTX_prelude_plugin_version(void);
@@ -40,7 +43,7 @@ static manager_filter_plugin_t filter_plugin;
 
 
 typedef struct {
-        idmef_criteria_t *criteria;
+        criteria_program_t *program;
 
         char *hook_str;
         manager_filter_hook_t *hook;
@@ -53,10 +56,10 @@ static int process_message(idmef_message_t *msg, void *priv)
         filter_plugin_t *plugin = priv;
         int ret;
 
-        if ( ! plugin->criteria )
+        if ( ! plugin->program )
                 return 0;
 
-        ret = idmef_criteria_match(plugin->criteria, msg);
+        ret = criteria_program_match(plugin->program, msg);
         if ( ret < 0 )
                 prelude_perror(ret, "error matching criteria");
 
@@ -96,10 +99,28 @@ static int set_filter_hook(prelude_option_t *opt, const char *optarg, prelude_st
 
         plugin = prelude_plugin_instance_get_plugin_data(context);
 
+        /*
+         * Unchanged on configuration reload.
+         */
+        if ( plugin->hook_str && strcmp(plugin->hook_str, optarg) == 0 )
+                return 0;
+
+        if ( plugin->hook ) {
+                manager_filter_destroy_hook(plugin->hook);
+                plugin->hook = NULL;
+        }
+
         for ( i = 0; tbl[i].hook != NULL; i++ ) {
                 ret = strcasecmp(optarg, tbl[i].hook);
                 if ( ret == 0 ) {
-                        manager_filter_new_hook(&plugin->hook, context, tbl[i].cat, NULL, plugin);
+                        ret = manager_filter_new_hook(&plugin->hook, context, tbl[i].cat, NULL, plugin);
+                        if ( ret < 0 )
+                                return ret;
+
+                        /*
+                         * Matching a rule has no side effect.
+                         */
+                        manager_filter_hook_set_reorderable(plugin->hook, TRUE);
                         goto success;
                 }
         }
@@ -131,32 +152,306 @@ static int set_filter_hook(prelude_option_t *opt, const char *optarg, prelude_st
 
 
 
-static int add_criteria(filter_plugin_t *plugin, const char *criteria)
+static void destroy_program(void *data)
+{
+        criteria_program_destroy(data);
+}
+
+
+
+static void require_criteria_paths(prelude_plugin_instance_t *pi, idmef_criteria_t *criteria)
+{
+        idmef_criterion_t *criterion;
+
+        for ( ; criteria; criteria = idmef_criteria_get_or(criteria) ) {
+                criterion = idmef_criteria_get_criterion(criteria);
+                if ( criterion )
+                        manager_idmef_require_path(pi, idmef_path_get_name(idmef_criterion_get_path(criterion), -1));
+
+                require_criteria_paths(pi, idmef_criteria_get_and(criteria));
+        }
+}
+
+
+
+/*
+ * The previous program might still be in use by a message being processed.
+ */
+static int replace_criteria(prelude_plugin_instance_t *pi, idmef_criteria_t *criteria, value_list_table_t *lists)
 {
         int ret;
-        idmef_criteria_t *new;
+        criteria_program_t *new;
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(pi);
+        criteria_program_t *old = plugin->program;
+
+        ret = criteria_program_new(&new, criteria, lists);
+        if ( ret < 0 ) {
+                if ( criteria )
+                        idmef_criteria_destroy(criteria);
+
+                if ( lists )
+                        value_list_table_destroy(lists);
+
+                return ret;
+        }
+
+        manager_idmef_require_none(pi);
+        require_criteria_paths(pi, criteria);
+
+        plugin->program = new;
+
+        if ( old )
+                manager_defer_free(destroy_program, old);
+
+        return 0;
+}
+
+
+
+/*
+ * Rewrite "in @file", at *ptr, as an equality to the placeholder
+ * followed by the file name (see value-list.h). Unless quoted, the
+ * file name end at the first blank, closing parenthesis or boolean
+ * operator. Return 1 if *ptr was rewritten.
+ */
+static int expand_value_list(const char **ptr, const char *placeholder, prelude_string_t *out)
+{
+        int ret;
+        const char *start, *end, *next;
+
+        if ( strncmp(*ptr, "in", 2) != 0 || ! isspace((unsigned char) (*ptr)[2]) )
+                return 0;
+
+        for ( start = *ptr + 2; isspace((unsigned char) *start); start++ );
 
-        ret = idmef_criteria_new_from_string(&new, criteria);
+        if ( *start++ != '@' )
+                return 0;
+
+        if ( *start == '\'' || *start == '"' ) {
+                end = strchr(start + 1, *start);
+                if ( ! end )
+                        return prelude_error_verbose(PRELUDE_ERROR_GENERIC, "unterminated list file name");
+
+                start++;
+                next = end + 1;
+        } else {
+                for ( end = start; *end && ! isspace((unsigned char) *end) && ! strchr(")&|", *end); end++ );
+                next = end;
+        }
+
+        if ( end == start || memchr(start, '\'', end - start) || memchr(start, '\\', end - start) )
+                return prelude_error_verbose(PRELUDE_ERROR_GENERIC, "invalid list file name");
+
+        ret = prelude_string_sprintf(out, "== '%s%.*s'", placeholder, (int) (end - start), start);
         if ( ret < 0 )
                 return ret;
 
-        if ( plugin->criteria )
-                idmef_criteria_destroy(plugin->criteria);
+        *ptr = next;
+
+        return 1;
+}
+
+
 
-        plugin->criteria = new;
+static int expand_value_lists(const char *str, const char *placeholder, prelude_string_t *out)
+{
+        int ret;
+        char quote = 0;
+        const char *ptr = str;
+
+        while ( *ptr ) {
+                if ( quote && *ptr == '\\' && ptr[1] ) {
+                        ret = prelude_string_ncat(out, ptr, 2);
+                        if ( ret < 0 )
+                                return ret;
+
+                        ptr += 2;
+                        continue;
+                }
+
+                if ( quote && *ptr == quote )
+                        quote = 0;
+
+                else if ( ! quote && (*ptr == '\'' || *ptr == '"') )
+                        quote = *ptr;
+
+                else if ( ! quote && ptr > str && isspace((unsigned char) ptr[-1]) ) {
+                        ret = expand_value_list(&ptr, placeholder, out);
+                        if ( ret < 0 )
+                                return ret;
+
+                        if ( ret > 0 )
+                                continue;
+                }
+
+                ret = prelude_string_ncat(out, ptr++, 1);
+                if ( ret < 0 )
+                        return ret;
+        }
 
         return 0;
 }
 
 
 
-static int read_criteria_from_filename(filter_plugin_t *plugin, const char *filename, prelude_string_t *err)
+/*
+ * The placeholder does not appear in the rule, even once escapes are
+ * removed, so that no value written in the rule can be taken for it.
+ */
+static int get_placeholder(const char *str, char *buf, size_t size)
+{
+        unsigned int i;
+        char *stripped, *ptr;
+
+        stripped = malloc(strlen(str) + 1);
+        if ( ! stripped )
+                return prelude_error_from_errno(errno);
+
+        for ( ptr = stripped; *str; str++ ) {
+                if ( *str != '\\' )
+                        *ptr++ = *str;
+        }
+
+        *ptr = 0;
+
+        for ( i = 0; ; i++ ) {
+                snprintf(buf, size, "@in%u:", i);
+                if ( ! strstr(stripped, buf) )
+                        break;
+        }
+
+        free(stripped);
+
+        return 0;
+}
+
+
+
+static const char *get_list_filename(idmef_criterion_t *criterion, const char *placeholder)
+{
+        const char *str;
+        prelude_string_t *string;
+        const idmef_value_t *value;
+        idmef_criterion_value_t *cvalue = idmef_criterion_get_value(criterion);
+
+        if ( ! cvalue || idmef_criterion_value_get_type(cvalue) != IDMEF_CRITERION_VALUE_TYPE_VALUE ||
+             (idmef_criterion_get_operator(criterion) & ~IDMEF_CRITERION_OPERATOR_NOT) != IDMEF_CRITERION_OPERATOR_EQUAL )
+                return NULL;
+
+        value = idmef_criterion_value_get_value(cvalue);
+        if ( idmef_value_get_type(value) != IDMEF_VALUE_TYPE_STRING )
+                return NULL;
+
+        string = idmef_value_get_string((idmef_value_t *) value);
+        if ( ! string || ! (str = prelude_string_get_string(string)) )
+                return NULL;
+
+        if ( strncmp(str, placeholder, strlen(placeholder)) != 0 )
+                return NULL;
+
+        return str + strlen(placeholder);
+}
+
+
+
+static int bind_value_lists(idmef_criteria_t *criteria, const char *placeholder, value_list_table_t *lists)
+{
+        int ret;
+        const char *filename;
+        idmef_criterion_t *criterion;
+
+        for ( ; criteria; criteria = idmef_criteria_get_or(criteria) ) {
+                criterion = idmef_criteria_get_criterion(criteria);
+                if ( criterion && (filename = get_list_filename(criterion, placeholder)) ) {
+                        ret = value_list_table_add(lists, criterion, filename);
+                        if ( ret < 0 )
+                                return ret;
+                }
+
+                ret = bind_value_lists(idmef_criteria_get_and(criteria), placeholder, lists);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * The lists used by the rule are bound to their criteria in a new
+ * table, returned in lists.
+ */
+static int parse_criteria(idmef_criteria_t **criteria, value_list_table_t **lists, const char *str)
+{
+        int ret;
+        prelude_string_t *out;
+        char placeholder[32];
+
+        ret = value_list_table_new(lists);
+        if ( ret < 0 )
+                return ret;
+
+        if ( ! strchr(str, '@') ) {
+                ret = idmef_criteria_new_from_string(criteria, str);
+                goto out;
+        }
+
+        ret = get_placeholder(str, placeholder, sizeof(placeholder));
+        if ( ret < 0 )
+                goto out;
+
+        ret = prelude_string_new(&out);
+        if ( ret < 0 )
+                goto out;
+
+        ret = expand_value_lists(str, placeholder, out);
+        if ( ret == 0 )
+                ret = idmef_criteria_new_from_string(criteria, prelude_string_get_string(out));
+
+        prelude_string_destroy(out);
+
+        if ( ret == 0 ) {
+                ret = bind_value_lists(*criteria, placeholder, *lists);
+                if ( ret < 0 )
+                        idmef_criteria_destroy(*criteria);
+        }
+
+ out:
+        if ( ret < 0 )
+                value_list_table_destroy(*lists);
+
+        return ret;
+}
+
+
+
+static int add_criteria(prelude_plugin_instance_t *pi, const char *criteria)
+{
+        int ret;
+        idmef_criteria_t *new;
+        value_list_table_t *lists;
+
+        ret = parse_criteria(&new, &lists, criteria);
+        if ( ret < 0 )
+                return ret;
+
+        return replace_criteria(pi, new, lists);
+}
+
+
+
+/*
+ * The program in use is only replaced once the whole file parsed.
+ */
+static int read_criteria_from_filename(prelude_plugin_instance_t *pi, const char *filename, prelude_string_t *err)
 {
         int ret;
         FILE *fd;
         prelude_string_t *out;
         unsigned int line = 0;
         idmef_criteria_t *new, *criteria = NULL;
+        value_list_table_t *new_lists, *lists = NULL;
 
         fd = fopen(filename, "r");
         if ( ! fd ) {
@@ -165,37 +460,53 @@ static int read_criteria_from_filename(filter_plugin_t *plugin, const char *file
         }
 
         ret = prelude_string_new(&out);
-        if ( ret < 0 )
+        if ( ret < 0 ) {
+                fclose(fd);
                 return ret;
+        }
 
         while ( (ret = prelude_read_multiline2(fd, &line, out)) == 0 ) {
-                ret = idmef_criteria_new_from_string(&new, prelude_string_get_string(out));
+                ret = parse_criteria(&new, &new_lists, prelude_string_get_string(out));
                 if ( ret < 0 ) {
                         prelude_string_sprintf(err, "%s:%u: %s", filename, line, prelude_strerror(ret));
                         goto err;
                 }
 
+                if ( ! lists )
+                        lists = new_lists;
+
+                else if ( (ret = value_list_table_merge(lists, new_lists)) < 0 ) {
+                        value_list_table_destroy(new_lists);
+                        idmef_criteria_destroy(new);
+                        prelude_string_sprintf(err, "%s:%u: %s", filename, line, prelude_strerror(ret));
+                        goto err;
+                }
+
                 if ( criteria )
                         idmef_criteria_or_criteria(criteria, new);
                 else
                         criteria = new;
         }
 
-        if ( ret < 0 && prelude_error_get_code(ret) != PRELUDE_ERROR_EOF ) {
+        if ( prelude_error_get_code(ret) != PRELUDE_ERROR_EOF ) {
                 prelude_string_sprintf(err, "error reading '%s': %s", filename, prelude_strerror(ret));
-                return ret;
+                goto err;
         }
 
-        ret = 0;
+        prelude_string_destroy(out);
+        fclose(fd);
+
+        return replace_criteria(pi, criteria, lists);
 
-err:
+ err:
         prelude_string_destroy(out);
         fclose(fd);
 
-        if ( plugin->criteria )
-                idmef_criteria_destroy(plugin->criteria);
+        if ( criteria )
+                idmef_criteria_destroy(criteria);
 
-        plugin->criteria = criteria;
+        if ( lists )
+                value_list_table_destroy(lists);
 
         return ret;
 }
@@ -205,13 +516,12 @@ err:
 static int set_filter_rule(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
 {
         int ret;
-        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
 
         ret = access(optarg, R_OK);
         if ( ret == 0 )
-                return read_criteria_from_filename(plugin, optarg, err);
+                return read_criteria_from_filename(context, optarg, err);
 
-        return add_criteria(plugin, optarg);
+        return add_criteria(context, optarg);
 }
 
 
@@ -220,7 +530,11 @@ static int set_filter_rule(prelude_option_t *opt, const char *optarg, prelude_st
 static int get_filter_rule(prelude_option_t *opt, prelude_string_t *out, void *context)
 {
         filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
-        return idmef_criteria_to_string(plugin->criteria, out);
+
+        if ( ! plugin->program || ! criteria_program_get_criteria(plugin->program) )
+                return 0;
+
+        return idmef_criteria_to_string(criteria_program_get_criteria(plugin->program), out);
 }
 
 
@@ -234,10 +548,13 @@ static int filter_activate(prelude_option_t *opt, const char *optarg, prelude_st
         if ( ! new )
                 return prelude_error_from_errno(errno);
 
-        new->criteria = NULL;
+        new->program = NULL;
         prelude_plugin_instance_set_plugin_data(context, new);
 
-        return 0;
+        /*
+         * Only the paths of the configured criteria are used.
+         */
+        return manager_idmef_require_none(context);
 }
 
 
@@ -246,12 +563,20 @@ static void filter_destroy(prelude_plugin_instance_t *pi, prelude_string_t *out)
 {
         filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(pi);
 
-        if ( plugin->criteria )
-                idmef_criteria_destroy(plugin->criteria);
-
+        /*
+         * Instances are only destroyed while message processing is
+         * stopped, unhook first so that the plugin is not reached anymore.
+         */
         if ( plugin->hook )
                 manager_filter_destroy_hook(plugin->hook);
 
+        if ( plugin->program ) {
+                criteria_program_print_stats(plugin->program, prelude_plugin_instance_get_name(pi));
+                criteria_program_destroy(plugin->program);
+        }
+
+        manager_idmef_require_all(pi);
+
         if ( plugin->hook_str )
                 free(plugin->hook_str);
 
@@ -293,6 +618,7 @@ int idmef_criteria_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *roo
         prelude_plugin_set_name(&filter_plugin, "IDMEF-Criteria");
         prelude_plugin_set_destroy_func(&filter_plugin, filter_destroy);
         manager_filter_plugin_set_running_func(&filter_plugin, process_message);
+        manager_plugin_set_reload_safe((void *) &filter_plugin);
 
         prelude_plugin_entry_set_plugin(pe, (void *) &filter_plugin);
 
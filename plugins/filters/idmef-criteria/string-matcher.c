@@ -0,0 +1,484 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+
+#include "string-matcher.h"
+
+
+#define STATE_INITIAL_SIZE 64
+
+#define ROOT 0
+
+
+/*
+ * Patterns are stored into a trie, each state also carrying the
+ * longest proper suffix of its string found in the trie (fail), and the
+ * nearest state on the fail chain where a substring pattern end (dict).
+ *
+ * Equal and prefix patterns are anchored at the start of the value,
+ * and only looked up while the value follow the trie from its root.
+ */
+typedef struct {
+        int child;
+        int sibling;
+        unsigned char byte;
+
+        int fail;
+        int dict;
+        int substring;
+        int anchored;
+
+        unsigned int edge_first;
+        unsigned int edge_count;
+} matcher_state_t;
+
+
+typedef struct {
+        unsigned char byte;
+        int target;
+} matcher_edge_t;
+
+
+typedef struct {
+        int id;
+        int next;
+        string_matcher_kind_t kind;
+} matcher_pattern_t;
+
+
+struct string_matcher {
+        prelude_bool_t nocase;
+        prelude_bool_t compiled;
+
+        size_t state_count;
+        size_t state_alloc;
+        matcher_state_t *state;
+
+        matcher_edge_t *edge;
+
+        size_t pattern_count;
+        size_t pattern_alloc;
+        matcher_pattern_t *pattern;
+
+        /*
+         * Transitions from the root, ROOT when there is none. Bytes not
+         * starting any substring pattern are skipped while in the root
+         * state, with memchr() when a single byte start them all.
+         */
+        int root_next[256];
+        unsigned char first[256];
+        int first_byte;
+        size_t first_count;
+
+        prelude_bool_t have_substring;
+        prelude_bool_t have_anchored;
+};
+
+
+
+static inline unsigned char fold(string_matcher_t *matcher, unsigned char c)
+{
+        return (matcher->nocase) ? tolower(c) : c;
+}
+
+
+
+static int grow_array(void **array, size_t *alloc, size_t count, size_t elsize)
+{
+        void *ptr;
+        size_t new_alloc;
+
+        if ( count < *alloc )
+                return 0;
+
+        new_alloc = (*alloc) ? *alloc * 2 : STATE_INITIAL_SIZE;
+
+        ptr = realloc(*array, new_alloc * elsize);
+        if ( ! ptr )
+                return prelude_error_from_errno(errno);
+
+        *array = ptr;
+        *alloc = new_alloc;
+
+        return 0;
+}
+
+
+
+static int new_state(string_matcher_t *matcher, unsigned char byte)
+{
+        int ret;
+        matcher_state_t *state;
+
+        ret = grow_array((void **) &matcher->state, &matcher->state_alloc, matcher->state_count, sizeof(*matcher->state));
+        if ( ret < 0 )
+                return ret;
+
+        state = &matcher->state[matcher->state_count];
+        state->child = state->sibling = -1;
+        state->byte = byte;
+        state->fail = ROOT;
+        state->dict = -1;
+        state->substring = state->anchored = -1;
+        state->edge_first = state->edge_count = 0;
+
+        return matcher->state_count++;
+}
+
+
+
+int string_matcher_new(string_matcher_t **matcher, prelude_bool_t nocase)
+{
+        int ret;
+
+        *matcher = calloc(1, sizeof(**matcher));
+        if ( ! *matcher )
+                return prelude_error_from_errno(errno);
+
+        (*matcher)->nocase = nocase;
+        (*matcher)->first_byte = -1;
+
+        ret = new_state(*matcher, 0);
+        if ( ret < 0 ) {
+                free(*matcher);
+                return ret;
+        }
+
+        return 0;
+}
+
+
+
+static void set_first_byte(string_matcher_t *matcher, unsigned char c)
+{
+        unsigned char alt = (matcher->nocase) ? toupper(c) : c;
+
+        if ( ! matcher->first[c] ) {
+                matcher->first[c] = 1;
+                matcher->first_count++;
+                matcher->first_byte = c;
+        }
+
+        if ( alt != c && ! matcher->first[alt] ) {
+                matcher->first[alt] = 1;
+                matcher->first_count++;
+        }
+}
+
+
+
+int string_matcher_add(string_matcher_t *matcher, const char *pattern, size_t len, string_matcher_kind_t kind, int id)
+{
+        size_t i;
+        int ret, cur = ROOT, child;
+        unsigned char c;
+        matcher_pattern_t *p;
+
+        if ( matcher->compiled )
+                return -1;
+
+        ret = grow_array((void **) &matcher->pattern, &matcher->pattern_alloc, matcher->pattern_count, sizeof(*matcher->pattern));
+        if ( ret < 0 )
+                return ret;
+
+        for ( i = 0; i < len; i++ ) {
+                c = fold(matcher, pattern[i]);
+
+                for ( child = matcher->state[cur].child; child >= 0; child = matcher->state[child].sibling ) {
+                        if ( matcher->state[child].byte == c )
+                                break;
+                }
+
+                if ( child < 0 ) {
+                        child = new_state(matcher, c);
+                        if ( child < 0 )
+                                return child;
+
+                        matcher->state[child].sibling = matcher->state[cur].child;
+                        matcher->state[cur].child = child;
+                }
+
+                cur = child;
+        }
+
+        p = &matcher->pattern[matcher->pattern_count];
+        p->id = id;
+        p->kind = kind;
+
+        if ( kind == STRING_MATCHER_SUBSTRING ) {
+                p->next = matcher->state[cur].substring;
+                matcher->state[cur].substring = matcher->pattern_count;
+                matcher->have_substring = TRUE;
+
+                if ( len )
+                        set_first_byte(matcher, fold(matcher, pattern[0]));
+        } else {
+                p->next = matcher->state[cur].anchored;
+                matcher->state[cur].anchored = matcher->pattern_count;
+                matcher->have_anchored = TRUE;
+        }
+
+        matcher->pattern_count++;
+
+        return 0;
+}
+
+
+
+static int get_next(string_matcher_t *matcher, int cur, unsigned char c)
+{
+        unsigned int low, high, mid;
+        matcher_edge_t *edge;
+
+        if ( cur == ROOT )
+                return matcher->root_next[c];
+
+        edge = &matcher->edge[matcher->state[cur].edge_first];
+        low = 0;
+        high = matcher->state[cur].edge_count;
+
+        while ( low < high ) {
+                mid = (low + high) / 2;
+
+                if ( edge[mid].byte == c )
+                        return edge[mid].target;
+
+                if ( edge[mid].byte < c )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+
+        return -1;
+}
+
+
+
+/*
+ * The children lists built while adding patterns are turned into
+ * per state arrays of edges sorted by byte.
+ */
+static void build_edges(string_matcher_t *matcher)
+{
+        size_t i, n = 0, j;
+        int child;
+        matcher_edge_t tmp, *edge;
+
+        for ( i = 0; i < matcher->state_count; i++ ) {
+                matcher->state[i].edge_first = n;
+
+                for ( child = matcher->state[i].child; child >= 0; child = matcher->state[child].sibling ) {
+                        edge = &matcher->edge[n++];
+                        edge->byte = matcher->state[child].byte;
+                        edge->target = child;
+
+                        for ( j = n - 1; j > matcher->state[i].edge_first && edge[-1].byte > edge->byte; j--, edge-- ) {
+                                tmp = edge[-1];
+                                edge[-1] = *edge;
+                                *edge = tmp;
+                        }
+                }
+
+                matcher->state[i].edge_count = n - matcher->state[i].edge_first;
+        }
+
+        for ( i = 0; i < 256; i++ )
+                matcher->root_next[i] = ROOT;
+
+        for ( i = 0; i < matcher->state[ROOT].edge_count; i++ ) {
+                edge = &matcher->edge[matcher->state[ROOT].edge_first + i];
+                matcher->root_next[edge->byte] = edge->target;
+        }
+}
+
+
+
+/*
+ * Breadth first, so that the fail state of a state is always computed
+ * before the state itself.
+ */
+int string_matcher_compile(string_matcher_t *matcher)
+{
+        int *queue, cur, child, fail, next;
+        size_t head = 0, tail = 0, i;
+        matcher_state_t *state;
+        matcher_edge_t *edge;
+
+        matcher->edge = malloc(matcher->state_count * sizeof(*matcher->edge));
+        queue = malloc(matcher->state_count * sizeof(*queue));
+        if ( ! matcher->edge || ! queue ) {
+                free(queue);
+                return prelude_error_from_errno(errno);
+        }
+
+        build_edges(matcher);
+        queue[tail++] = ROOT;
+
+        while ( head < tail ) {
+                cur = queue[head++];
+
+                for ( i = 0; i < matcher->state[cur].edge_count; i++ ) {
+                        edge = &matcher->edge[matcher->state[cur].edge_first + i];
+                        child = edge->target;
+                        state = &matcher->state[child];
+
+                        if ( cur == ROOT )
+                                state->fail = ROOT;
+                        else {
+                                fail = matcher->state[cur].fail;
+
+                                while ( (next = get_next(matcher, fail, edge->byte)) < 0 )
+                                        fail = matcher->state[fail].fail;
+
+                                state->fail = next;
+                        }
+
+                        /*
+                         * Empty patterns, ending on the root, are reported
+                         * once per value rather than through dict.
+                         */
+                        fail = state->fail;
+                        if ( fail != ROOT && matcher->state[fail].substring >= 0 )
+                                state->dict = fail;
+                        else
+                                state->dict = matcher->state[fail].dict;
+
+                        queue[tail++] = child;
+                }
+        }
+
+        free(queue);
+        matcher->compiled = TRUE;
+
+        return 0;
+}
+
+
+
+static void report(string_matcher_t *matcher, int pattern, void (*cb)(int id, void *data), void *data)
+{
+        for ( ; pattern >= 0; pattern = matcher->pattern[pattern].next )
+                cb(matcher->pattern[pattern].id, data);
+}
+
+
+
+static void match_anchored(string_matcher_t *matcher, const unsigned char *value, size_t len,
+                           void (*cb)(int id, void *data), void *data)
+{
+        size_t i;
+        int cur = ROOT, pattern;
+
+        for ( i = 0; ; i++ ) {
+                for ( pattern = matcher->state[cur].anchored; pattern >= 0; pattern = matcher->pattern[pattern].next ) {
+                        if ( matcher->pattern[pattern].kind == STRING_MATCHER_PREFIX || i == len )
+                                cb(matcher->pattern[pattern].id, data);
+                }
+
+                if ( i == len )
+                        break;
+
+                cur = get_next(matcher, cur, fold(matcher, value[i]));
+                if ( cur <= ROOT )
+                        break;
+        }
+}
+
+
+
+static void match_substring(string_matcher_t *matcher, const unsigned char *value, size_t len,
+                            void (*cb)(int id, void *data), void *data)
+{
+        size_t i;
+        int cur = ROOT, next, out;
+        const unsigned char *ptr;
+
+        report(matcher, matcher->state[ROOT].substring, cb, data);
+
+        for ( i = 0; i < len; i++ ) {
+                if ( cur == ROOT ) {
+                        if ( matcher->first_count == 1 ) {
+                                ptr = memchr(value + i, matcher->first_byte, len - i);
+                                if ( ! ptr )
+                                        break;
+
+                                i = ptr - value;
+                        } else {
+                                while ( i < len && ! matcher->first[value[i]] )
+                                        i++;
+
+                                if ( i == len )
+                                        break;
+                        }
+                }
+
+                while ( (next = get_next(matcher, cur, fold(matcher, value[i]))) < 0 )
+                        cur = matcher->state[cur].fail;
+
+                cur = next;
+
+                out = (matcher->state[cur].substring >= 0) ? cur : matcher->state[cur].dict;
+                for ( ; out > ROOT; out = matcher->state[out].dict )
+                        report(matcher, matcher->state[out].substring, cb, data);
+        }
+}
+
+
+
+/*
+ * A pattern might be reported more than once for a given value.
+ */
+void string_matcher_match(string_matcher_t *matcher, const char *value, size_t len,
+                          void (*cb)(int id, void *data), void *data)
+{
+        if ( matcher->have_anchored )
+                match_anchored(matcher, (const unsigned char *) value, len, cb, data);
+
+        if ( matcher->have_substring )
+                match_substring(matcher, (const unsigned char *) value, len, cb, data);
+}
+
+
+
+size_t string_matcher_get_state_count(string_matcher_t *matcher)
+{
+        return matcher->state_count;
+}
+
+
+
+void string_matcher_destroy(string_matcher_t *matcher)
+{
+        free(matcher->state);
+        free(matcher->edge);
+        free(matcher->pattern);
+        free(matcher);
+}
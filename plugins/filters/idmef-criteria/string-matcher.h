@@ -0,0 +1,57 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#ifndef _IDMEF_CRITERIA_STRING_MATCHER_H
+#define _IDMEF_CRITERIA_STRING_MATCHER_H
+
+/*
+ * Set of strings matched against a value in a single pass (Aho-Corasick
+ * automaton). Each pattern is reported through the match callback, with
+ * the identifier it was added with, when the value is equal to, start
+ * with, or contain the pattern, depending on its kind.
+ */
+typedef enum {
+        STRING_MATCHER_EQUAL     = 0,
+        STRING_MATCHER_PREFIX    = 1,
+        STRING_MATCHER_SUBSTRING = 2
+} string_matcher_kind_t;
+
+
+typedef struct string_matcher string_matcher_t;
+
+
+int string_matcher_new(string_matcher_t **matcher, prelude_bool_t nocase);
+
+int string_matcher_add(string_matcher_t *matcher, const char *pattern, size_t len, string_matcher_kind_t kind, int id);
+
+int string_matcher_compile(string_matcher_t *matcher);
+
+void string_matcher_match(string_matcher_t *matcher, const char *value, size_t len,
+                          void (*cb)(int id, void *data), void *data);
+
+size_t string_matcher_get_state_count(string_matcher_t *matcher);
+
+void string_matcher_destroy(string_matcher_t *matcher);
+
+#endif /* _IDMEF_CRITERIA_STRING_MATCHER_H */
@@ -0,0 +1,851 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "glthread/lock.h"
+#include "prelude-manager.h"
+#include "value-list.h"
+
+
+/*
+ * Interval, in seconds, between checks for list file changes.
+ */
+#define RELOAD_INTERVAL 10
+
+/*
+ * Sets with at least BLOOM_MIN_ENTRIES values are fronted by a Bloom
+ * filter, so that most values absent from the set are rejected
+ * without reaching the (much larger) hash table.
+ */
+#define BLOOM_MIN_ENTRIES 65536
+#define BLOOM_BITS_PER_ENTRY 8
+#define BLOOM_HASHES 3
+
+
+/*
+ * Exact addresses are hashed by their binary form: the address family
+ * followed by the address bytes.
+ */
+#define ADDR_KEY_SIZE 17
+
+
+/*
+ * Values parsed as an exact address, and other values, are stored in
+ * open addressing hash tables (linear probing, a zero hash marking an
+ * empty slot), strings pointing into a single arena. Networks are
+ * stored in radix tries.
+ */
+typedef struct {
+        size_t addr_count;
+        size_t addr_mask;
+        uint32_t *addr_hash;
+        unsigned char *addr_key;
+
+        size_t count;
+        size_t mask;
+        uint32_t *hash;
+        uint32_t *offset;
+
+        char *arena;
+        size_t arena_len;
+        size_t arena_alloc;
+
+        size_t bloom_mask;
+        uint64_t *bloom;
+
+        manager_radix_trie_t *ipv4;
+        manager_radix_trie_t *ipv6;
+} value_set_t;
+
+
+struct value_list {
+        prelude_list_t list;
+
+        char *filename;
+        unsigned int refcount;
+        manager_file_watch_t *watch;
+
+        /*
+         * Replaced as a whole on reload, the previous set being released
+         * through manager_defer_free() once no message reference it.
+         */
+        value_set_t *set;
+};
+
+
+struct value_list_table {
+        size_t count;
+        struct {
+                idmef_criterion_t *criterion;
+                value_list_t *list;
+        } *entry;
+};
+
+
+/*
+ * Only protect the lists registry, lists are loaded without it.
+ */
+static PRELUDE_LIST(list_list);
+static gl_lock_t list_lock = gl_lock_initializer;
+
+
+
+static uint32_t hash_string(const char *str)
+{
+        uint32_t hash = 2166136261U;
+
+        for ( ; *str; str++ ) {
+                hash ^= (unsigned char) *str;
+                hash *= 16777619U;
+        }
+
+        return (hash) ? hash : 1;
+}
+
+
+
+static uint32_t hash_bytes(const unsigned char *data, size_t len)
+{
+        size_t i;
+        uint32_t hash = 2166136261U;
+
+        for ( i = 0; i < len; i++ ) {
+                hash ^= data[i];
+                hash *= 16777619U;
+        }
+
+        return (hash) ? hash : 1;
+}
+
+
+
+/*
+ * The bit positions are derived from the value hash, by double hashing.
+ */
+static inline size_t bloom_bit(value_set_t *set, uint32_t hash, unsigned int i)
+{
+        uint32_t step = ((hash >> 17) | (hash << 15)) * 0x9e3779b1U;
+
+        return (hash + i * (step | 1)) & set->bloom_mask;
+}
+
+
+
+static void value_set_destroy(void *data)
+{
+        value_set_t *set = data;
+
+        if ( set->ipv4 )
+                manager_radix_trie_destroy(set->ipv4, NULL);
+
+        if ( set->ipv6 )
+                manager_radix_trie_destroy(set->ipv6, NULL);
+
+        free(set->addr_hash);
+        free(set->addr_key);
+        free(set->hash);
+        free(set->offset);
+        free(set->arena);
+        free(set->bloom);
+        free(set);
+}
+
+
+
+static int value_set_new(value_set_t **set)
+{
+        int ret;
+
+        *set = calloc(1, sizeof(**set));
+        if ( ! *set )
+                return prelude_error_from_errno(errno);
+
+        ret = manager_radix_trie_new(&(*set)->ipv4, 32);
+        if ( ret < 0 ) {
+                value_set_destroy(*set);
+                return ret;
+        }
+
+        ret = manager_radix_trie_new(&(*set)->ipv6, 128);
+        if ( ret < 0 ) {
+                value_set_destroy(*set);
+                return ret;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * IPv4 mapped addresses share the IPv4 keys.
+ */
+static void get_addr_key(unsigned char *key, manager_address_t *addr)
+{
+        memset(key, 0, ADDR_KEY_SIZE);
+
+        if ( addr->category == IDMEF_ADDRESS_CATEGORY_IPV4_ADDR ) {
+                key[0] = 4;
+                memcpy(key + 1, addr->addr, 4);
+        } else {
+                key[0] = 6;
+                memcpy(key + 1, addr->addr, 16);
+        }
+}
+
+
+
+static prelude_bool_t lookup_addr(value_set_t *set, const unsigned char *key, uint32_t hash)
+{
+        size_t i;
+
+        for ( i = hash & set->addr_mask; set->addr_hash[i]; i = (i + 1) & set->addr_mask ) {
+                if ( set->addr_hash[i] == hash && memcmp(set->addr_key + i * ADDR_KEY_SIZE, key, ADDR_KEY_SIZE) == 0 )
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+
+
+static void insert_addr(value_set_t *set, const unsigned char *key, uint32_t hash)
+{
+        size_t i;
+
+        for ( i = hash & set->addr_mask; set->addr_hash[i]; i = (i + 1) & set->addr_mask );
+
+        set->addr_hash[i] = hash;
+        memcpy(set->addr_key + i * ADDR_KEY_SIZE, key, ADDR_KEY_SIZE);
+        set->addr_count++;
+}
+
+
+
+/*
+ * Unlike strings, addresses are hashed as they are read: the table is
+ * doubled once half full.
+ */
+static int grow_addr_table(value_set_t *set)
+{
+        size_t i, size;
+        uint32_t *ohash = set->addr_hash;
+        unsigned char *okey = set->addr_key;
+        size_t osize = (ohash) ? set->addr_mask + 1 : 0;
+
+        size = (osize) ? osize * 2 : 16;
+
+        set->addr_hash = calloc(size, sizeof(*set->addr_hash));
+        set->addr_key = malloc(size * ADDR_KEY_SIZE);
+        if ( ! set->addr_hash || ! set->addr_key ) {
+                free(set->addr_hash);
+                free(set->addr_key);
+                set->addr_hash = ohash;
+                set->addr_key = okey;
+                return prelude_error_from_errno(errno);
+        }
+
+        set->addr_mask = size - 1;
+        set->addr_count = 0;
+
+        for ( i = 0; i < osize; i++ ) {
+                if ( ohash[i] )
+                        insert_addr(set, okey + i * ADDR_KEY_SIZE, ohash[i]);
+        }
+
+        free(ohash);
+        free(okey);
+
+        return 0;
+}
+
+
+
+static int add_addr(value_set_t *set, manager_address_t *addr)
+{
+        int ret;
+        uint32_t hash;
+        unsigned char key[ADDR_KEY_SIZE];
+
+        get_addr_key(key, addr);
+        hash = hash_bytes(key, sizeof(key));
+
+        if ( set->addr_hash && lookup_addr(set, key, hash) )
+                return 0;
+
+        if ( ! set->addr_hash || (set->addr_count + 1) * 2 > set->addr_mask + 1 ) {
+                ret = grow_addr_table(set);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        insert_addr(set, key, hash);
+
+        return 0;
+}
+
+
+
+/*
+ * Return 1 if value is not an address or network, to be added as a
+ * string.
+ */
+static int add_network(value_set_t *set, char *value)
+{
+        int ret;
+        unsigned int bits;
+        manager_address_t addr;
+        char *len = strchr(value, '/');
+
+        /*
+         * The prefix length separator is restored for values that are
+         * not networks, added as strings.
+         */
+        ret = manager_address_parse_prefix(&addr, value, &bits);
+        if ( ret < 0 ) {
+                if ( len )
+                        *len = '/';
+                return 1;
+        }
+
+        if ( addr.category == IDMEF_ADDRESS_CATEGORY_IPV4_ADDR ) {
+                if ( bits == 32 )
+                        return add_addr(set, &addr);
+
+                ret = manager_radix_trie_insert(set->ipv4, addr.addr, bits, set);
+        } else {
+                if ( bits == 128 )
+                        return add_addr(set, &addr);
+
+                ret = manager_radix_trie_insert(set->ipv6, addr.addr, bits, set);
+        }
+
+        /*
+         * Duplicate networks are ignored.
+         */
+        return (ret == -1) ? 0 : ret;
+}
+
+
+
+/*
+ * Strings are appended to the arena, the hash table being built once
+ * the whole list is read.
+ */
+static int add_string(value_set_t *set, const char *value)
+{
+        char *ptr;
+        size_t len = strlen(value) + 1, alloc;
+
+        if ( set->arena_len + len > UINT32_MAX )
+                return -1;
+
+        if ( set->arena_len + len > set->arena_alloc ) {
+                alloc = (set->arena_alloc) ? set->arena_alloc * 2 : 4096;
+                while ( alloc < set->arena_len + len )
+                        alloc *= 2;
+
+                ptr = realloc(set->arena, alloc);
+                if ( ! ptr )
+                        return prelude_error_from_errno(errno);
+
+                set->arena = ptr;
+                set->arena_alloc = alloc;
+        }
+
+        memcpy(set->arena + set->arena_len, value, len);
+        set->arena_len += len;
+        set->count++;
+
+        return 0;
+}
+
+
+
+static prelude_bool_t lookup_string(value_set_t *set, const char *value, uint32_t hash)
+{
+        size_t i;
+
+        for ( i = hash & set->mask; set->hash[i]; i = (i + 1) & set->mask ) {
+                if ( set->hash[i] == hash && strcmp(set->arena + set->offset[i], value) == 0 )
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+
+
+static int build_bloom(value_set_t *set)
+{
+        size_t i, bits = 64;
+        unsigned int j;
+
+        while ( bits < set->count * BLOOM_BITS_PER_ENTRY )
+                bits *= 2;
+
+        set->bloom = calloc(bits / 64, sizeof(*set->bloom));
+        if ( ! set->bloom )
+                return prelude_error_from_errno(errno);
+
+        set->bloom_mask = bits - 1;
+
+        for ( i = 0; i <= set->mask; i++ ) {
+                if ( ! set->hash[i] )
+                        continue;
+
+                for ( j = 0; j < BLOOM_HASHES; j++ )
+                        set->bloom[bloom_bit(set, set->hash[i], j) / 64] |= (uint64_t) 1 << (bloom_bit(set, set->hash[i], j) % 64);
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * The table is kept at most half full.
+ */
+static int build_table(value_set_t *set)
+{
+        size_t size = 16, i, offset, len;
+        uint32_t hash;
+
+        while ( size < set->count * 2 )
+                size *= 2;
+
+        set->hash = calloc(size, sizeof(*set->hash));
+        set->offset = malloc(size * sizeof(*set->offset));
+        if ( ! set->hash || ! set->offset )
+                return prelude_error_from_errno(errno);
+
+        set->mask = size - 1;
+        set->count = 0;
+
+        for ( offset = 0; offset < set->arena_len; offset += len + 1 ) {
+                len = strlen(set->arena + offset);
+                hash = hash_string(set->arena + offset);
+
+                if ( lookup_string(set, set->arena + offset, hash) )
+                        continue;
+
+                for ( i = hash & set->mask; set->hash[i]; i = (i + 1) & set->mask );
+
+                set->hash[i] = hash;
+                set->offset[i] = offset;
+                set->count++;
+        }
+
+        if ( set->count >= BLOOM_MIN_ENTRIES )
+                return build_bloom(set);
+
+        return 0;
+}
+
+
+
+/*
+ * One value per line, empty lines and lines starting with '#' being
+ * ignored. Addresses and networks (address/length) match any address
+ * they contain, other values are matched exactly.
+ */
+static int value_set_load(value_set_t **out, const char *filename)
+{
+        FILE *fd;
+        int ret = 0;
+        char buf[8192], *ptr, *end;
+        value_set_t *set;
+        unsigned int line = 0;
+
+        fd = fopen(filename, "r");
+        if ( ! fd ) {
+                prelude_log(PRELUDE_LOG_WARN, "could not open '%s': %s.\n", filename, strerror(errno));
+                return -1;
+        }
+
+        ret = value_set_new(&set);
+        if ( ret < 0 ) {
+                fclose(fd);
+                return ret;
+        }
+
+        while ( fgets(buf, sizeof(buf), fd) ) {
+                line++;
+
+                for ( ptr = buf; isspace((unsigned char) *ptr); ptr++ );
+
+                end = ptr + strlen(ptr);
+                while ( end > ptr && isspace((unsigned char) end[-1]) )
+                        *--end = 0;
+
+                if ( *ptr == '\0' || *ptr == '#' )
+                        continue;
+
+                ret = add_network(set, ptr);
+                if ( ret == 1 )
+                        ret = add_string(set, ptr);
+
+                if ( ret < 0 ) {
+                        prelude_log(PRELUDE_LOG_WARN, "%s:%u: error adding value.\n", filename, line);
+                        break;
+                }
+        }
+
+        fclose(fd);
+
+        if ( ret == 0 )
+                ret = build_table(set);
+
+        if ( ret < 0 ) {
+                value_set_destroy(set);
+                return ret;
+        }
+
+        prelude_log(PRELUDE_LOG_INFO, "loaded %" PRELUDE_PRIu64 " values, %" PRELUDE_PRIu64 " addresses and %" PRELUDE_PRIu64
+                    " networks from '%s'%s.\n", (uint64_t) set->count, (uint64_t) set->addr_count,
+                    (uint64_t) (manager_radix_trie_get_count(set->ipv4) + manager_radix_trie_get_count(set->ipv6)),
+                    filename, (set->bloom) ? " (bloom filter enabled)" : "");
+
+        *out = set;
+
+        return 0;
+}
+
+
+
+/*
+ * On failure, the set in use is kept. Reloads of a list are serialized
+ * by its file watch.
+ */
+static int value_list_reload(const char *filename, void *data)
+{
+        int ret;
+        value_list_t *list = data;
+        value_set_t *new, *old;
+
+        ret = value_set_load(&new, filename);
+        if ( ret < 0 )
+                return ret;
+
+        old = list->set;
+        list->set = new;
+
+        if ( old )
+                manager_defer_free(value_set_destroy, old);
+
+        return 0;
+}
+
+
+
+static void value_list_destroy(value_list_t *list)
+{
+        if ( list->watch )
+                manager_file_watch_destroy(list->watch);
+
+        if ( list->set )
+                value_set_destroy(list->set);
+
+        free(list->filename);
+        free(list);
+}
+
+
+
+static int value_list_new(value_list_t **list, const char *filename)
+{
+        int ret;
+
+        *list = calloc(1, sizeof(**list));
+        if ( ! *list )
+                return prelude_error_from_errno(errno);
+
+        (*list)->refcount = 1;
+        (*list)->filename = strdup(filename);
+        if ( ! (*list)->filename ) {
+                value_list_destroy(*list);
+                return prelude_error_from_errno(errno);
+        }
+
+        ret = manager_file_watch_new(&(*list)->watch, filename, RELOAD_INTERVAL, value_list_reload, *list);
+        if ( ret < 0 ) {
+                value_list_destroy(*list);
+                return ret;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * Must be called with list_lock held.
+ */
+static value_list_t *search_list(const char *filename)
+{
+        prelude_list_t *tmp;
+        value_list_t *list;
+
+        prelude_list_for_each(&list_list, tmp) {
+                list = prelude_list_entry(tmp, value_list_t, list);
+
+                if ( strcmp(list->filename, filename) == 0 )
+                        return list;
+        }
+
+        return NULL;
+}
+
+
+
+/*
+ * Getting a list already in use reload it if the file changed, so
+ * that a configuration reload always pick up the latest content.
+ */
+int value_list_get(value_list_t **list, const char *filename)
+{
+        int ret;
+        value_list_t *new;
+
+        gl_lock_lock(list_lock);
+
+        *list = search_list(filename);
+        if ( *list )
+                (*list)->refcount++;
+
+        gl_lock_unlock(list_lock);
+
+        if ( *list ) {
+                manager_file_watch_check((*list)->watch);
+                return 0;
+        }
+
+        ret = value_list_new(&new, filename);
+        if ( ret < 0 )
+                return ret;
+
+        gl_lock_lock(list_lock);
+
+        *list = search_list(filename);
+        if ( *list )
+                (*list)->refcount++;
+        else {
+                *list = new;
+                prelude_list_add_tail(&list_list, &new->list);
+        }
+
+        gl_lock_unlock(list_lock);
+
+        if ( *list != new )
+                value_list_destroy(new);
+
+        return 0;
+}
+
+
+
+const char *value_list_get_filename(value_list_t *list)
+{
+        return list->filename;
+}
+
+
+
+/*
+ * Should only be called once no message can reference the list.
+ */
+void value_list_release(value_list_t *list)
+{
+        prelude_bool_t last;
+
+        gl_lock_lock(list_lock);
+
+        last = (--list->refcount == 0);
+        if ( last )
+                prelude_list_del(&list->list);
+
+        gl_lock_unlock(list_lock);
+
+        if ( last )
+                value_list_destroy(list);
+}
+
+
+
+/*
+ * Addresses are looked up in the addresses and networks only, other
+ * values in the strings.
+ */
+static prelude_bool_t contains_addr(value_set_t *set, manager_address_t *addr)
+{
+        unsigned char key[ADDR_KEY_SIZE];
+        prelude_bool_t ipv4 = (addr->category == IDMEF_ADDRESS_CATEGORY_IPV4_ADDR || addr->ipv4_mapped);
+
+        if ( set->addr_count ) {
+                get_addr_key(key, addr);
+                if ( lookup_addr(set, key, hash_bytes(key, sizeof(key))) )
+                        return TRUE;
+        }
+
+        if ( ipv4 )
+                return manager_radix_trie_lookup(set->ipv4, addr->addr, 32) ? TRUE : FALSE;
+
+        return manager_radix_trie_lookup(set->ipv6, addr->addr, 128) ? TRUE : FALSE;
+}
+
+
+
+/*
+ * Called from within the message processing read section, the set
+ * being published by value_list_reload().
+ */
+prelude_bool_t value_list_contains(value_list_t *list, const char *value)
+{
+        int ret;
+        unsigned int i;
+        uint32_t hash;
+        manager_address_t addr;
+        value_set_t *set = list->set;
+
+        if ( set->addr_count || manager_radix_trie_get_count(set->ipv4) || manager_radix_trie_get_count(set->ipv6) ) {
+                ret = manager_address_parse(&addr, value);
+                if ( ret == 0 )
+                        return contains_addr(set, &addr);
+        }
+
+        if ( ! set->count )
+                return FALSE;
+
+        hash = hash_string(value);
+
+        if ( set->bloom ) {
+                for ( i = 0; i < BLOOM_HASHES; i++ ) {
+                        if ( ! (set->bloom[bloom_bit(set, hash, i) / 64] & ((uint64_t) 1 << (bloom_bit(set, hash, i) % 64))) )
+                                return FALSE;
+                }
+        }
+
+        return lookup_string(set, value, hash);
+}
+
+
+
+int value_list_table_new(value_list_table_t **table)
+{
+        *table = calloc(1, sizeof(**table));
+        if ( ! *table )
+                return prelude_error_from_errno(errno);
+
+        return 0;
+}
+
+
+
+int value_list_table_add(value_list_table_t *table, idmef_criterion_t *criterion, const char *filename)
+{
+        int ret;
+        void *ptr;
+        value_list_t *list;
+
+        ret = value_list_get(&list, filename);
+        if ( ret < 0 )
+                return ret;
+
+        ptr = realloc(table->entry, (table->count + 1) * sizeof(*table->entry));
+        if ( ! ptr ) {
+                value_list_release(list);
+                return prelude_error_from_errno(errno);
+        }
+
+        table->entry = ptr;
+        table->entry[table->count].criterion = criterion;
+        table->entry[table->count].list = list;
+        table->count++;
+
+        return 0;
+}
+
+
+
+value_list_t *value_list_table_get(value_list_table_t *table, idmef_criterion_t *criterion)
+{
+        size_t i;
+
+        for ( i = 0; table && i < table->count; i++ ) {
+                if ( table->entry[i].criterion == criterion )
+                        return table->entry[i].list;
+        }
+
+        return NULL;
+}
+
+
+
+/*
+ * On success, other is destroyed, its lists being moved to table.
+ */
+int value_list_table_merge(value_list_table_t *table, value_list_table_t *other)
+{
+        void *ptr;
+
+        if ( ! other->count ) {
+                value_list_table_destroy(other);
+                return 0;
+        }
+
+        ptr = realloc(table->entry, (table->count + other->count) * sizeof(*table->entry));
+        if ( ! ptr )
+                return prelude_error_from_errno(errno);
+
+        table->entry = ptr;
+        memcpy(table->entry + table->count, other->entry, other->count * sizeof(*table->entry));
+        table->count += other->count;
+
+        free(other->entry);
+        free(other);
+
+        return 0;
+}
+
+
+
+void value_list_table_destroy(value_list_table_t *table)
+{
+        size_t i;
+
+        for ( i = 0; i < table->count; i++ )
+                value_list_release(table->entry[i].list);
+
+        free(table->entry);
+        free(table);
+}
@@ -0,0 +1,63 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#ifndef _IDMEF_CRITERIA_VALUE_LIST_H
+#define _IDMEF_CRITERIA_VALUE_LIST_H
+
+/*
+ * Lists are shared by filename, and reloaded when the file change.
+ */
+typedef struct value_list value_list_t;
+
+
+int value_list_get(value_list_t **list, const char *filename);
+
+prelude_bool_t value_list_contains(value_list_t *list, const char *value);
+
+const char *value_list_get_filename(value_list_t *list);
+
+void value_list_release(value_list_t *list);
+
+
+/*
+ * Criteria of the form "path in @file" are parsed by libprelude as an
+ * equality to a placeholder value, then bound to the list read from
+ * the file in a table. Only bound criteria are list lookups: whatever
+ * the placeholder, a criterion written as an equality is never taken
+ * for one.
+ */
+typedef struct value_list_table value_list_table_t;
+
+
+int value_list_table_new(value_list_table_t **table);
+
+int value_list_table_add(value_list_table_t *table, idmef_criterion_t *criterion, const char *filename);
+
+value_list_t *value_list_table_get(value_list_table_t *table, idmef_criterion_t *criterion);
+
+int value_list_table_merge(value_list_table_t *table, value_list_table_t *other);
+
+void value_list_table_destroy(value_list_table_t *table);
+
+#endif /* _IDMEF_CRITERIA_VALUE_LIST_H */
@@ -40,11 +40,12 @@ int thresholding_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *data)
 typedef struct {
         prelude_list_t list;
         idmef_path_t *path;
+        int path_id;
 } path_elem_t;
 
 
 typedef struct {
-        prelude_list_t path_list;
+        prelude_list_t *path_list;
         prelude_hash_t *path_value_hash;
 
         int threshold;
@@ -87,7 +88,7 @@ static int iter_cb(idmef_value_t *value, void *str)
 }
 
 
-static int get_value_from_path(idmef_path_t *path, idmef_message_t *message, prelude_string_t *str)
+static int get_value_from_path(path_elem_t *pelem, idmef_message_t *message, prelude_string_t *str)
 {
         int ret;
         idmef_value_t *value;
@@ -95,7 +96,7 @@ static int get_value_from_path(idmef_path_t *path, idmef_message_t *message, pre
         /*
          * Lookup path in message.
          */
-        ret = idmef_path_get(path, message, &value);
+        ret = manager_idmef_path_get(message, pelem->path, pelem->path_id, &value);
         if ( ret <= 0 )
                return 0;
 
@@ -118,12 +119,12 @@ static void hash_entry_destroy(void *data)
 
 
 
-static void destroy_filter_path(filter_plugin_t *plugin)
+static void destroy_filter_path(void *data)
 {
         path_elem_t *item;
-        prelude_list_t *tmp, *bkp;
+        prelude_list_t *tmp, *bkp, *head = data;
 
-        prelude_list_for_each_safe(&plugin->path_list, tmp, bkp) {
+        prelude_list_for_each_safe(head, tmp, bkp) {
                 item = prelude_list_entry(tmp, path_elem_t, list);
 
                 idmef_path_destroy(item->path);
@@ -131,6 +132,8 @@ static void destroy_filter_path(filter_plugin_t *plugin)
                 prelude_list_del(&item->list);
                 free(item);
         }
+
+        free(head);
 }
 
 
@@ -236,18 +239,18 @@ static int process_message(idmef_message_t *msg, void *priv)
 {
         int ret;
         path_elem_t *pelem;
-        prelude_list_t *tmp;
         prelude_string_t *key;
         filter_plugin_t *plugin = priv;
+        prelude_list_t *tmp, *path_list = plugin->path_list;
 
         ret = prelude_string_new(&key);
         if ( ret < 0 )
                 return 0;
 
-        prelude_list_for_each(&plugin->path_list, tmp) {
+        prelude_list_for_each(path_list, tmp) {
                 pelem = prelude_list_entry(tmp, path_elem_t, list);
 
-                ret = get_value_from_path(pelem->path, msg, key);
+                ret = get_value_from_path(pelem, msg, key);
                 if ( ret < 0 )
                         return 0;
         }
@@ -329,7 +332,7 @@ static int get_filter_path(prelude_option_t *opt, prelude_string_t *out, void *c
         prelude_list_t *tmp;
         filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
 
-        prelude_list_for_each(&plugin->path_list, tmp) {
+        prelude_list_for_each(plugin->path_list, tmp) {
                 item = prelude_list_entry(tmp, path_elem_t, list);
 
                 if ( ! prelude_string_is_empty(out) )
@@ -346,12 +349,21 @@ static int set_filter_path(prelude_option_t *opt, const char *optarg, prelude_st
 {
         int ret = 0;
         path_elem_t *elem;
+        prelude_list_t *old, *path_list;
         char *ptr, *start, *dup = strdup(optarg);
         filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
 
-        destroy_filter_path(plugin);
+        path_list = malloc(sizeof(*path_list));
+        if ( ! path_list ) {
+                free(dup);
+                return prelude_error_from_errno(errno);
+        }
+
+        prelude_list_init(path_list);
         start = dup;
 
+        manager_idmef_require_none(context);
+
         while ( (ptr = strsep(&dup, ", ")) ) {
                 if ( *ptr == '\0' )
                         continue;
@@ -368,10 +380,20 @@ static int set_filter_path(prelude_option_t *opt, const char *optarg, prelude_st
                         break;
                 }
 
-                prelude_list_add_tail(&plugin->path_list, &elem->list);
+                elem->path_id = manager_idmef_path_register(elem->path);
+                prelude_list_add_tail(path_list, &elem->list);
+                manager_idmef_require_path(context, ptr);
         }
 
         free(start);
+
+        /*
+         * The previous list might still be in use by a message being processed.
+         */
+        old = plugin->path_list;
+        plugin->path_list = path_list;
+        manager_defer_free(destroy_filter_path, old);
+
         return ret;
 }
 
@@ -408,10 +430,24 @@ static int set_filter_hook(prelude_option_t *opt, const char *optarg, prelude_st
 
         plugin = prelude_plugin_instance_get_plugin_data(context);
 
+        /*
+         * Unchanged on configuration reload.
+         */
+        if ( plugin->hook_str && strcmp(plugin->hook_str, optarg) == 0 )
+                return 0;
+
+        if ( plugin->hook ) {
+                manager_filter_destroy_hook(plugin->hook);
+                plugin->hook = NULL;
+        }
+
         for ( i = 0; tbl[i].hook != NULL; i++ ) {
                 ret = strcasecmp(optarg, tbl[i].hook);
                 if ( ret == 0 ) {
-                        manager_filter_new_hook(&plugin->hook, context, tbl[i].cat, NULL, plugin);
+                        ret = manager_filter_new_hook(&plugin->hook, context, tbl[i].cat, NULL, plugin);
+                        if ( ret < 0 )
+                                return ret;
+
                         goto success;
                 }
         }
@@ -458,9 +494,21 @@ static int filter_activate(prelude_option_t *opt, const char *optarg, prelude_st
                 return ret;
         }
 
-        prelude_list_init(&new->path_list);
+        new->path_list = malloc(sizeof(*new->path_list));
+        if ( ! new->path_list ) {
+                prelude_hash_destroy(new->path_value_hash);
+                free(new);
+                return prelude_error_from_errno(errno);
+        }
+
+        prelude_list_init(new->path_list);
         prelude_plugin_instance_set_plugin_data(context, new);
 
+        /*
+         * Only the configured paths are used.
+         */
+        manager_idmef_require_none(context);
+
         return 0;
 }
 
@@ -470,11 +518,16 @@ static void filter_destroy(prelude_plugin_instance_t *pi, prelude_string_t *out)
 {
         filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(pi);
 
-        destroy_filter_path(plugin);
-
+        /*
+         * Instances are only destroyed while message processing is
+         * stopped, unhook first so that the plugin is not reached anymore.
+         */
         if ( plugin->hook )
                 manager_filter_destroy_hook(plugin->hook);
 
+        destroy_filter_path(plugin->path_list);
+        manager_idmef_require_all(pi);
+
         if ( plugin->hook_str )
                 free(plugin->hook_str);
 
@@ -541,6 +594,7 @@ int thresholding_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *root_
         prelude_plugin_set_name(&filter_plugin, "Thresholding");
         prelude_plugin_set_destroy_func(&filter_plugin, filter_destroy);
         manager_filter_plugin_set_running_func(&filter_plugin, process_message);
+        manager_plugin_set_reload_safe((void *) &filter_plugin);
 
         prelude_plugin_entry_set_plugin(pe, (void *) &filter_plugin);
 
@@ -45,6 +45,7 @@ int debug_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *data);
 typedef struct {
         prelude_list_t list;
         idmef_path_t *path;
+        int path_id;
 } debug_object_t;
 
 
@@ -111,7 +112,7 @@ static int debug_run(prelude_plugin_instance_t *pi, idmef_message_t *msg)
         prelude_list_for_each(&plugin->path_list, tmp) {
                 entry = prelude_list_entry(tmp, debug_object_t, list);
 
-                ret = idmef_path_get(entry->path, msg, &val);
+                ret = manager_idmef_path_get(msg, entry->path, entry->path_id, &val);
                 if ( ret < 0 ) {
                         prelude_perror(ret, "error getting value for object '%s'", idmef_path_get_name(entry->path, -1));
                         continue;
@@ -175,6 +176,7 @@ static int set_filter_path(debug_plugin_t *plugin, const char *path)
                         break;
                 }
 
+                elem->path_id = manager_idmef_path_register(elem->path);
                 prelude_list_add_tail(&plugin->path_list, &elem->list);
         }
 
@@ -58,6 +58,7 @@ static int send_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
 static int relaying_process(prelude_plugin_instance_t *pi, idmef_message_t *idmef)
 {
         int ret;
+        idmef_message_t *full;
         relaying_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(pi);
 
         if ( ! plugin->conn_pool )
@@ -71,12 +72,16 @@ static int relaying_process(prelude_plugin_instance_t *pi, idmef_message_t *idme
                 prelude_msgbuf_set_callback(msgbuf, send_msgbuf);
         }
 
+        ret = manager_idmef_message_get_full(idmef, &full);
+        if ( ret < 0 )
+                return ret;
+
         prelude_msgbuf_set_data(msgbuf, plugin->conn_pool);
 
-        idmef_message_write(idmef, msgbuf);
-        prelude_msgbuf_mark_end(msgbuf);
+        ret = manager_idmef_message_write_relayed(full, msgbuf);
+        idmef_message_destroy(full);
 
-        return 0;
+        return ret;
 }
 
 
@@ -91,7 +96,11 @@ static int relaying_activate(prelude_option_t *opt, const char *optarg, prelude_
 
         prelude_plugin_instance_set_plugin_data(context, new);
 
-        return 0;
+        /*
+         * Messages are forwarded whole, but the decoded message is not
+         * otherwise used.
+         */
+        return manager_idmef_require_none(context);
 }
 
 
@@ -149,6 +158,7 @@ static void relaying_destroy(prelude_plugin_instance_t *pi, prelude_string_t *ou
         if ( plugin->conn_pool )
                 prelude_connection_pool_destroy(plugin->conn_pool);
 
+        manager_idmef_require_all(pi);
         free(plugin);
 }
 
@@ -0,0 +1,407 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+/*
+ * The sink plugin discard the messages it receive, and account for
+ * the delay between the timestamp embedded by prelude-manager-loadgen
+ * and the time the message reach the reporting stage.
+ *
+ * The timestamp is a CLOCK_MONOTONIC value, the load generator should
+ * run on the same host as the manager.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/idmef.h>
+
+#include "prelude-manager.h"
+
+
+/*
+ * Should match the definition in bench/loadgen.c.
+ */
+#define SINK_TIMESTAMP_MEANING "loadgen-timestamp"
+
+#define DEFAULT_INTERVAL 10
+
+
+/*
+ * Latencies are accounted in microseconds, in log-linear buckets: two
+ * bucket of a same power of two range are at most 1/HISTOGRAM_SUB apart.
+ */
+#define HISTOGRAM_SUB 16
+#define HISTOGRAM_SIZE (64 * HISTOGRAM_SUB + 2 * HISTOGRAM_SUB)
+
+
+int sink_LTX_prelude_plugin_version(void);
+int sink_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *data);
+
+
+typedef struct {
+        uint64_t count;
+        uint64_t max;
+        uint64_t bucket[HISTOGRAM_SIZE];
+} histogram_t;
+
+
+typedef struct {
+        char *logfile;
+        prelude_io_t *fd;
+        unsigned int interval;
+        time_t last_report;
+        uint64_t untimed;
+        histogram_t current;
+        histogram_t total;
+} sink_plugin_t;
+
+
+
+static unsigned int get_bucket(uint64_t usec)
+{
+        unsigned int shift = 0;
+
+        while ( (usec >> shift) >= 2 * HISTOGRAM_SUB )
+                shift++;
+
+        return shift * HISTOGRAM_SUB + (usec >> shift);
+}
+
+
+
+static uint64_t get_bucket_value(unsigned int bucket)
+{
+        unsigned int shift;
+
+        if ( bucket < 2 * HISTOGRAM_SUB )
+                return bucket;
+
+        shift = bucket / HISTOGRAM_SUB - 1;
+
+        return (uint64_t) (bucket - shift * HISTOGRAM_SUB) << shift;
+}
+
+
+
+static void histogram_add(histogram_t *histogram, uint64_t usec)
+{
+        histogram->count++;
+        histogram->bucket[get_bucket(usec)]++;
+
+        if ( usec > histogram->max )
+                histogram->max = usec;
+}
+
+
+
+static uint64_t histogram_get_percentile(histogram_t *histogram, unsigned int permil)
+{
+        unsigned int i;
+        uint64_t seen = 0, wanted = (histogram->count * permil + 999) / 1000;
+
+        for ( i = 0; i < HISTOGRAM_SIZE; i++ ) {
+                seen += histogram->bucket[i];
+                if ( seen >= wanted && seen > 0 )
+                        return get_bucket_value(i);
+        }
+
+        return histogram->max;
+}
+
+
+
+static void histogram_print(sink_plugin_t *plugin, const char *name, histogram_t *histogram, unsigned int elapsed)
+{
+        int ret;
+        prelude_string_t *out;
+
+        ret = prelude_string_new(&out);
+        if ( ret < 0 )
+                return;
+
+        prelude_string_sprintf(out, "sink %s: %" PRELUDE_PRIu64 " messages", name, histogram->count);
+
+        if ( elapsed )
+                prelude_string_sprintf(out, " (%" PRELUDE_PRIu64 " msgs/s)", histogram->count / elapsed);
+
+        if ( histogram->count )
+                prelude_string_sprintf(out, ", latency us p50=%" PRELUDE_PRIu64 " p90=%" PRELUDE_PRIu64
+                                       " p99=%" PRELUDE_PRIu64 " p99.9=%" PRELUDE_PRIu64 " max=%" PRELUDE_PRIu64,
+                                       histogram_get_percentile(histogram, 500),
+                                       histogram_get_percentile(histogram, 900),
+                                       histogram_get_percentile(histogram, 990),
+                                       histogram_get_percentile(histogram, 999), histogram->max);
+
+        prelude_string_sprintf(out, ", %" PRELUDE_PRIu64 " without timestamp.\n", plugin->untimed);
+
+        prelude_io_write(plugin->fd, prelude_string_get_string(out), prelude_string_get_len(out));
+        prelude_string_destroy(out);
+}
+
+
+
+static idmef_additional_data_t *get_next_additional_data(idmef_message_t *msg, idmef_additional_data_t *ad)
+{
+        idmef_alert_t *alert;
+        idmef_heartbeat_t *heartbeat;
+
+        alert = idmef_message_get_alert(msg);
+        if ( alert )
+                return idmef_alert_get_next_additional_data(alert, ad);
+
+        heartbeat = idmef_message_get_heartbeat(msg);
+        if ( heartbeat )
+                return idmef_heartbeat_get_next_additional_data(heartbeat, ad);
+
+        return NULL;
+}
+
+
+
+static int get_timestamp(idmef_message_t *msg, uint64_t *timestamp)
+{
+        idmef_data_t *data;
+        prelude_string_t *meaning;
+        idmef_additional_data_t *ad = NULL;
+
+        while ( (ad = get_next_additional_data(msg, ad)) ) {
+                meaning = idmef_additional_data_get_meaning(ad);
+                if ( ! meaning || strcmp(prelude_string_get_string_or_default(meaning, ""), SINK_TIMESTAMP_MEANING) != 0 )
+                        continue;
+
+                data = idmef_additional_data_get_data(ad);
+                if ( ! data || idmef_data_get_len(data) != sizeof(*timestamp) )
+                        return -1;
+
+                memcpy(timestamp, idmef_data_get_data(data), sizeof(*timestamp));
+                return 0;
+        }
+
+        return -1;
+}
+
+
+
+static int sink_run(prelude_plugin_instance_t *pi, idmef_message_t *msg)
+{
+        int ret;
+        uint64_t now, timestamp;
+        struct timespec ts;
+        sink_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(pi);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+        ret = get_timestamp(msg, &timestamp);
+        if ( ret < 0 || timestamp > now )
+                plugin->untimed++;
+        else {
+                histogram_add(&plugin->current, (now - timestamp) / 1000);
+                histogram_add(&plugin->total, (now - timestamp) / 1000);
+        }
+
+        if ( plugin->interval && ts.tv_sec - plugin->last_report >= plugin->interval ) {
+                histogram_print(plugin, "interval", &plugin->current, ts.tv_sec - plugin->last_report);
+                memset(&plugin->current, 0, sizeof(plugin->current));
+                plugin->last_report = ts.tv_sec;
+        }
+
+        return 0;
+}
+
+
+
+static int sink_set_interval(prelude_option_t *option, const char *arg, prelude_string_t *err, void *context)
+{
+        sink_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        plugin->interval = atoi(arg);
+
+        return 0;
+}
+
+
+
+static int sink_get_interval(prelude_option_t *opt, prelude_string_t *out, void *context)
+{
+        sink_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+        return prelude_string_sprintf(out, "%u", plugin->interval);
+}
+
+
+
+static int sink_set_logfile(prelude_option_t *option, const char *arg, prelude_string_t *err, void *context)
+{
+        FILE *fd;
+        char *old;
+        sink_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        if ( strcmp(arg, "-") == 0 )
+                fd = stdout;
+
+        else {
+                fd = fopen(arg, "a+");
+                if ( ! fd ) {
+                        prelude_string_sprintf(err, "error opening %s for writing: %s", arg, strerror(errno));
+                        return -1;
+                }
+        }
+
+        old = plugin->logfile;
+        plugin->logfile = strdup(arg);
+        if ( ! plugin->logfile ) {
+                if ( fd != stdout )
+                        fclose(fd);
+
+                return prelude_error_from_errno(errno);
+        }
+
+        if ( old )
+                free(old);
+
+        if ( prelude_io_get_fdptr(plugin->fd) != stdout )
+                fclose(prelude_io_get_fdptr(plugin->fd));
+
+        prelude_io_set_file_io(plugin->fd, fd);
+
+        return 0;
+}
+
+
+
+static int sink_get_logfile(prelude_option_t *opt, prelude_string_t *out, void *context)
+{
+        sink_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+        return prelude_string_set_ref(out, plugin->logfile);
+}
+
+
+
+static int sink_new(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+        struct timespec ts;
+        sink_plugin_t *new;
+
+        new = calloc(1, sizeof(*new));
+        if ( ! new )
+                return prelude_error_from_errno(errno);
+
+        ret = prelude_io_new(&new->fd);
+        if ( ret < 0 ) {
+                free(new);
+                return ret;
+        }
+
+        new->logfile = strdup("-");
+        if ( ! new->logfile ) {
+                prelude_io_destroy(new->fd);
+                free(new);
+                return prelude_error_from_errno(errno);
+        }
+
+        prelude_io_set_file_io(new->fd, stdout);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        new->last_report = ts.tv_sec;
+        new->interval = DEFAULT_INTERVAL;
+
+        prelude_plugin_instance_set_plugin_data(context, new);
+
+        /*
+         * Only the timestamp is used.
+         */
+        manager_idmef_require_none(context);
+        manager_idmef_require_path(context, "alert.additional_data");
+
+        return 0;
+}
+
+
+
+static void sink_destroy(prelude_plugin_instance_t *pi, prelude_string_t *err)
+{
+        sink_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(pi);
+
+        histogram_print(plugin, "total", &plugin->total, 0);
+
+        if ( prelude_io_get_fdptr(plugin->fd) != stdout )
+                prelude_io_close(plugin->fd);
+
+        prelude_io_destroy(plugin->fd);
+        manager_idmef_require_all(pi);
+
+        free(plugin->logfile);
+        free(plugin);
+}
+
+
+
+int sink_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *rootopt)
+{
+        int ret;
+        prelude_option_t *opt;
+        static manager_report_plugin_t sink_plugin;
+        int hook = PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG|PRELUDE_OPTION_TYPE_WIDE;
+
+        ret = prelude_option_add(rootopt, &opt, hook, 0, "sink", "Option for the sink plugin",
+                                 PRELUDE_OPTION_ARGUMENT_OPTIONAL, sink_new, NULL);
+        if ( ret < 0 )
+                return ret;
+
+        prelude_plugin_set_activation_option(pe, opt, NULL);
+
+        ret = prelude_option_add(opt, NULL, hook, 'i', "interval",
+                                 "Interval between latency reports, in seconds (0 to only report on exit)",
+                                 PRELUDE_OPTION_ARGUMENT_REQUIRED, sink_set_interval, sink_get_interval);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_option_add(opt, NULL, hook, 'l', "logfile",
+                                 "Specify output file to use (default to stdout)",
+                                 PRELUDE_OPTION_ARGUMENT_REQUIRED, sink_set_logfile, sink_get_logfile);
+        if ( ret < 0 )
+                return ret;
+
+        prelude_plugin_set_name(&sink_plugin, "Sink");
+        prelude_plugin_set_destroy_func(&sink_plugin, sink_destroy);
+        manager_report_plugin_set_running_func(&sink_plugin, sink_run);
+
+        prelude_plugin_entry_set_plugin(pe, (void *) &sink_plugin);
+
+        return 0;
+}
+
+
+
+int sink_LTX_prelude_plugin_version(void)
+{
+        return PRELUDE_PLUGIN_API_VERSION;
+}
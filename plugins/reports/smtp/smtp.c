@@ -70,6 +70,7 @@ typedef struct {
 
         char *fixed;
         idmef_path_t *path;
+        int path_id;
 
         mail_format_type_t type;
 } mail_format_t;
@@ -293,7 +294,7 @@ static int build_dynamic_string(prelude_string_t *str, prelude_list_t *head, idm
                         if ( ret < 0 )
                                 return ret;
                 } else {
-                        ret = idmef_path_get(fmt->path, idmef, &value);
+                        ret = manager_idmef_path_get(idmef, fmt->path, fmt->path_id, &value);
                         if ( ret <= 0 ) {
                                 if ( fmt->type == MAIL_FORMAT_TYPE_IF )
                                         continue;
@@ -957,11 +958,34 @@ static int parse_path(smtp_plugin_t *plugin, mail_format_t **fmt,
 
         *fmt = new_mail_format(head);
         (*fmt)->path = path;
+        (*fmt)->path_id = manager_idmef_path_register(path);
 
         return 0;
 }
 
 
+static void destroy_mail_format(prelude_list_t *head)
+{
+        mail_format_t *format;
+        prelude_list_t *tmp, *bkp;
+
+        prelude_list_for_each_safe(head, tmp, bkp) {
+                format = prelude_list_entry(tmp, mail_format_t, list);
+
+                destroy_mail_format(&format->sublist);
+
+                if ( format->path )
+                        idmef_path_destroy(format->path);
+
+                if ( format->fixed )
+                        free(format->fixed);
+
+                prelude_list_del(&format->list);
+                free(format);
+        }
+}
+
+
 static int set_formated_text(smtp_plugin_t *plugin, prelude_list_t *content_list, const char *input)
 {
         int ret;
@@ -1026,6 +1050,12 @@ static int set_formated_text(smtp_plugin_t *plugin, prelude_list_t *content_list
 static int smtp_set_subject(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
 {
         smtp_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        /*
+         * On reload, the option is set again: replace the previous subject.
+         */
+        destroy_mail_format(&plugin->subject_content);
+
         return set_formated_text(plugin, &plugin->subject_content, arg);
 }
 
@@ -1055,6 +1085,7 @@ static int set_template(smtp_plugin_t *plugin, const char *fname, prelude_list_t
 
         fclose(fd);
 
+        destroy_mail_format(content);
         ret = set_formated_text(plugin, content, prelude_string_get_string(str));
         prelude_string_destroy(str);
 
@@ -1085,25 +1116,6 @@ static int smtp_get_keepalive(prelude_option_t *opt, prelude_string_t *out, void
 
 
 
-static void destroy_mail_format(prelude_list_t *head)
-{
-        mail_format_t *format;
-        prelude_list_t *tmp, *bkp;
-
-        prelude_list_for_each_safe(head, tmp, bkp) {
-                format = prelude_list_entry(tmp, mail_format_t, list);
-
-                destroy_mail_format(&format->sublist);
-
-                if ( format->path )
-                        idmef_path_destroy(format->path);
-
-                if ( format->fixed )
-                        free(format->fixed);
-
-                prelude_list_del(&format->list);
-        }
-}
 
 
 
@@ -0,0 +1,300 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libprelude/prelude.h>
+
+#include "prelude-manager.h"
+
+
+#define IPV4_MAPPED_PREFIX "::ffff:"
+
+
+
+static int get_hex_value(char c)
+{
+        if ( c >= '0' && c <= '9' )
+                return c - '0';
+
+        if ( c >= 'a' && c <= 'f' )
+                return c - 'a' + 10;
+
+        if ( c >= 'A' && c <= 'F' )
+                return c - 'A' + 10;
+
+        return -1;
+}
+
+
+
+/*
+ * Dotted quad, without leading sign or spaces, each part up to 255.
+ * *end is set to the first character following the address.
+ */
+static int parse_ipv4(const char *str, const char **end, unsigned char *out)
+{
+        unsigned int i, value, digits;
+
+        for ( i = 0; i < 4; i++ ) {
+                if ( i > 0 && *str++ != '.' )
+                        return -1;
+
+                value = digits = 0;
+
+                while ( *str >= '0' && *str <= '9' ) {
+                        value = value * 10 + (*str++ - '0');
+                        if ( ++digits > 3 || value > 255 )
+                                return -1;
+                }
+
+                if ( ! digits )
+                        return -1;
+
+                out[i] = value;
+        }
+
+        *end = str;
+
+        return 0;
+}
+
+
+
+/*
+ * Groups of up to four hexadecimal digits, at most one "::", an
+ * optional trailing dotted quad and an optional "%zone" suffix.
+ */
+static int parse_ipv6(const char *str, unsigned char *out)
+{
+        const char *ptr;
+        int i = 0, compress = -1, hex;
+        unsigned int value, digits;
+
+        if ( *str == ':' ) {
+                if ( *++str != ':' )
+                        return -1;
+
+                compress = 0;
+                if ( *++str == '\0' || *str == '%' )
+                        goto out;
+        }
+
+        while ( 1 ) {
+                if ( i <= 12 ) {
+                        for ( ptr = str; get_hex_value(*ptr) >= 0; ptr++ );
+
+                        if ( *ptr == '.' ) {
+                                if ( parse_ipv4(str, &str, out + i) < 0 )
+                                        return -1;
+
+                                i += 4;
+                                break;
+                        }
+                }
+
+                value = digits = 0;
+
+                while ( (hex = get_hex_value(*str)) >= 0 ) {
+                        value = (value << 4) | hex;
+                        if ( ++digits > 4 )
+                                return -1;
+                        str++;
+                }
+
+                if ( ! digits || i == 16 )
+                        return -1;
+
+                out[i++] = value >> 8;
+                out[i++] = value & 0xff;
+
+                if ( *str != ':' )
+                        break;
+
+                if ( *++str == ':' ) {
+                        if ( compress >= 0 )
+                                return -1;
+
+                        compress = i;
+                        if ( *++str == '\0' || *str == '%' )
+                                break;
+                }
+        }
+
+ out:
+        if ( *str == '%' )
+                str += (str[1] != '\0') ? strlen(str) : 0;
+
+        if ( *str != '\0' )
+                return -1;
+
+        if ( compress < 0 )
+                return (i == 16) ? 0 : -1;
+
+        if ( i == 16 )
+                return -1;
+
+        memmove(out + 16 - (i - compress), out + compress, i - compress);
+        memset(out + compress, 0, 16 - i);
+
+        return 0;
+}
+
+
+
+/*
+ * A non empty local part, followed by '@' and a non empty domain.
+ */
+static prelude_bool_t is_email(const char *str)
+{
+        const char *at = strchr(str, '@');
+
+        return (at && at != str && at[1] != '\0' && at[1] != ' ' && at[1] != '\t') ? TRUE : FALSE;
+}
+
+
+
+/*
+ * Classify str in a single pass, computing the binary form of IPv4
+ * and IPv6 addresses. IPv4 addresses, including the IPv4 mapped IPv6
+ * ones written as "::ffff:a.b.c.d", have their binary form in the
+ * first four bytes of out->addr.
+ *
+ * Return 0 for an IPv4 or IPv6 address, -1 otherwise: out->category
+ * then tell whether str is an e-mail address.
+ */
+int manager_address_parse(manager_address_t *out, const char *str)
+{
+        const char *end;
+
+        out->ipv4_mapped = FALSE;
+        out->category = IDMEF_ADDRESS_CATEGORY_UNKNOWN;
+
+        if ( strncmp(str, IPV4_MAPPED_PREFIX, sizeof(IPV4_MAPPED_PREFIX) - 1) == 0 &&
+             parse_ipv4(str + sizeof(IPV4_MAPPED_PREFIX) - 1, &end, out->addr) == 0 && *end == '\0' ) {
+                out->ipv4_mapped = TRUE;
+                out->category = IDMEF_ADDRESS_CATEGORY_IPV4_ADDR;
+                return 0;
+        }
+
+        if ( parse_ipv4(str, &end, out->addr) == 0 && *end == '\0' ) {
+                out->category = IDMEF_ADDRESS_CATEGORY_IPV4_ADDR;
+                return 0;
+        }
+
+        if ( strchr(str, ':') && parse_ipv6(str, out->addr) == 0 ) {
+                out->category = IDMEF_ADDRESS_CATEGORY_IPV6_ADDR;
+                return 0;
+        }
+
+        if ( is_email(str) )
+                out->category = IDMEF_ADDRESS_CATEGORY_E_MAIL;
+
+        return -1;
+}
+
+
+
+/*
+ * Parse an address optionally followed by "/length", str being
+ * modified. Bits beyond the prefix length are cleared.
+ */
+int manager_address_parse_prefix(manager_address_t *addr, char *str, unsigned int *bits)
+{
+        int ret;
+        char *end, *len;
+        unsigned int i, max;
+
+        len = strchr(str, '/');
+        if ( len )
+                *len++ = 0;
+
+        ret = manager_address_parse(addr, str);
+        if ( ret < 0 )
+                return -1;
+
+        /*
+         * The length of an IPv4 mapped prefix counts the 96 bits of the
+         * "::ffff:" part.
+         */
+        max = (addr->category == IDMEF_ADDRESS_CATEGORY_IPV4_ADDR && ! addr->ipv4_mapped) ? 32 : 128;
+
+        if ( ! len )
+                *bits = max;
+        else {
+                *bits = strtoul(len, &end, 10);
+                if ( *end || end == len || *bits > max )
+                        return -1;
+        }
+
+        /*
+         * An IPv4 mapped IPv6 prefix is stored with the IPv4 blocks, since
+         * this is where lookup for mapped addresses happen.
+         */
+        if ( addr->ipv4_mapped && max == 128 ) {
+                if ( *bits < 96 )
+                        return -1;
+
+                *bits -= 96;
+                addr->category = IDMEF_ADDRESS_CATEGORY_IPV4_ADDR;
+                max = 32;
+        }
+
+        for ( i = *bits; i < max; i++ )
+                addr->addr[i / 8] &= ~(0x80 >> (i % 8));
+
+        return 0;
+}
+
+
+
+/*
+ * Write the canonical dotted quad form of the IPv4 address in addr to
+ * buf, which should hold at least 16 bytes. Return the written length.
+ */
+size_t manager_address_ipv4_to_string(const unsigned char *addr, char *buf)
+{
+        unsigned int i;
+        char *ptr = buf;
+
+        for ( i = 0; i < 4; i++ ) {
+                if ( i > 0 )
+                        *ptr++ = '.';
+
+                if ( addr[i] >= 100 )
+                        *ptr++ = '0' + addr[i] / 100;
+
+                if ( addr[i] >= 10 )
+                        *ptr++ = '0' + addr[i] / 10 % 10;
+
+                *ptr++ = '0' + addr[i] % 10;
+        }
+
+        *ptr = '\0';
+
+        return ptr - buf;
+}
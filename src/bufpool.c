@@ -28,6 +28,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
 
 #include <assert.h>
 
@@ -35,10 +37,16 @@
 #include <libprelude/prelude-failover.h>
 
 #include "glthread/lock.h"
+#include "journal.h"
+#include "memory-governor.h"
 #include "bufpool.h"
 
 #define DISK_THRESHOLD_DEFAULT 1 * (1024 * 1024)
 
+#ifndef MIN
+# define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
 
 struct bufpool {
         prelude_list_t list;
@@ -48,9 +56,27 @@ struct bufpool {
         char *filename;
 
         gl_lock_t mutex;
+        journal_cursor_t cursor;
+
+        /*
+         * Messages recovered from a previous run failover, which are
+         * not part of the journal. They are the oldest of the pool.
+         */
+        size_t unjournaled;
+
+        /*
+         * Messages for which disk_filter() return TRUE are dropped
+         * instead of being written to the failover.
+         */
+        prelude_bool_t (*disk_filter)(prelude_msg_t *msg);
+        size_t disk_dropped;
 
         size_t len;
+        size_t dlen;
         size_t count;
+
+        size_t mem_limit;
+        size_t disk_limit;
 };
 
 
@@ -81,17 +107,25 @@ static inline void inc_dlen(bufpool_t *bp, size_t len)
         disk_msgcount++;
         gl_lock_unlock(mutex);
 
+        bp->dlen += len;
         bp->count++;
 }
 
 
 static inline void dec_dlen(bufpool_t *bp, size_t len)
 {
+        /*
+         * The disk usage of a pool recovered from a previous run is an
+         * estimate: make sure it never wrap.
+         */
+        len = MIN(len, bp->dlen);
+
         gl_lock_lock(mutex);
         disk_msglen -= len;
         disk_msgcount--;
         gl_lock_unlock(mutex);
 
+        bp->dlen -= len;
         bp->count--;
 }
 
@@ -102,6 +136,8 @@ static inline void inc_len(bufpool_t *bp, size_t len)
         mem_msgcount++;
         gl_lock_unlock(mutex);
 
+        memory_governor_add(MEMORY_ACCOUNT_BUFPOOL, len);
+
         bp->len += len;
         bp->count++;
 }
@@ -115,15 +151,35 @@ static inline void dec_len(bufpool_t *bp, size_t len)
         mem_msgcount--;
         gl_lock_unlock(mutex);
 
+        memory_governor_sub(MEMORY_ACCOUNT_BUFPOOL, len);
+
         bp->len -= len;
         bp->count--;
 }
 
 
 
+/*
+ * Drop a message being flushed, index being its position within the
+ * journal cursor: the messages already written come first.
+ */
+static void flush_drop_message(bufpool_t *bp, prelude_msg_t *msg, size_t index)
+{
+        dec_len(bp, prelude_msg_get_len(msg));
+        prelude_msg_destroy(msg);
+
+        if ( journal_is_enabled() )
+                journal_complete(journal_dequeue_at(&bp->cursor, index));
+
+        bp->disk_dropped++;
+}
+
+
+
 static int flush_bufpool_to_disk(bufpool_t *bp)
 {
         int ret;
+        size_t written = 0;
         prelude_msg_t *msg;
         prelude_list_t *tmp, *bkp;
 
@@ -135,6 +191,11 @@ static int flush_bufpool_to_disk(bufpool_t *bp)
                 msg = prelude_linked_object_get_object(tmp);
                 prelude_linked_object_del((prelude_linked_object_t *) msg);
 
+                if ( bp->disk_filter && bp->disk_filter(msg) ) {
+                        flush_drop_message(bp, msg, written);
+                        continue;
+                }
+
                 ret = prelude_failover_save_msg(bp->failover, msg);
                 if ( ret < 0 ) {
                         prelude_log(PRELUDE_LOG_ERR, "failover write failure: %s.\n", prelude_strerror(ret));
@@ -142,6 +203,7 @@ static int flush_bufpool_to_disk(bufpool_t *bp)
                         break;
                 }
 
+                written++;
                 inc_dlen(bp, prelude_msg_get_len(msg));
                 dec_len(bp, prelude_msg_get_len(msg));
                 prelude_msg_destroy(msg);
@@ -222,14 +284,41 @@ int bufpool_add_message(bufpool_t *bp, prelude_msg_t *msg)
         bufpool_t *evicted;
         size_t len = prelude_msg_get_len(msg);
 
-        while ( get_total_mem() + len >= on_disk_threshold ) {
+        /*
+         * Memory pressure from other manager buffers, as reported by the
+         * memory governor, also trigger eviction.
+         */
+        while ( get_total_mem() + len >= on_disk_threshold ||
+                (get_total_mem() > 0 && memory_governor_get_state() >= MEMORY_GOVERNOR_STATE_SPILL) ) {
                 evicted = evict_from_memory();
-                if ( evicted == bp )
+                if ( ! evicted || evicted == bp )
                         break;
         }
 
         gl_lock_lock(bp->mutex);
 
+        /*
+         * Once a pool reach its own memory limit, it is flushed to disk.
+         */
+        if ( ! bp->failover && bp->mem_limit && bp->len + len > bp->mem_limit )
+                flush_bufpool_to_disk(bp);
+
+        if ( bp->failover && bp->disk_filter && bp->disk_filter(msg) ) {
+                bp->disk_dropped++;
+                gl_lock_unlock(bp->mutex);
+                prelude_msg_destroy(msg);
+                return 0;
+        }
+
+        if ( journal_is_enabled() ) {
+                ret = journal_append(&bp->cursor, msg);
+                if ( ret < 0 ) {
+                        gl_lock_unlock(bp->mutex);
+                        prelude_msg_destroy(msg);
+                        return ret;
+                }
+        }
+
         if ( ! bp->failover ) {
                 prelude_linked_object_add_tail(&bp->msglist, (prelude_linked_object_t *) msg);
                 inc_len(bp, len);
@@ -237,6 +326,9 @@ int bufpool_add_message(bufpool_t *bp, prelude_msg_t *msg)
 
         else {
                 ret = prelude_failover_save_msg(bp->failover, msg);
+                if ( ret < 0 && journal_is_enabled() )
+                        journal_cancel(&bp->cursor);
+
                 inc_dlen(bp, prelude_msg_get_len(msg));
                 prelude_msg_destroy(msg);
         }
@@ -251,6 +343,7 @@ static void failover_destroy(bufpool_t *bp)
 {
         prelude_failover_destroy(bp->failover);
         bp->failover = NULL;
+        bp->unjournaled = 0;
 
         gl_lock_lock(mutex);
         prelude_list_add_tail(&pool_list, &bp->list);
@@ -259,12 +352,34 @@ static void failover_destroy(bufpool_t *bp)
 
 
 
-int bufpool_get_message(bufpool_t *bp, prelude_msg_t **out)
+/*
+ * Must be called with the pool lock held, once msg has been taken out
+ * of the pool.
+ */
+static journal_run_t *dequeue_journal_run(bufpool_t *bp)
+{
+        if ( bp->unjournaled ) {
+                bp->unjournaled--;
+                return NULL;
+        }
+
+        return journal_is_enabled() ? journal_dequeue(&bp->cursor) : NULL;
+}
+
+
+
+/*
+ * The returned run should be given to bufpool_message_processed() once
+ * the message has been processed.
+ */
+int bufpool_get_message(bufpool_t *bp, prelude_msg_t **out, journal_run_t **run)
 {
         int ret;
         prelude_list_t *tmp;
         prelude_msg_t *msg = NULL;
 
+        *run = NULL;
+
         gl_lock_lock(bp->mutex);
 
         prelude_list_for_each(&bp->msglist, tmp) {
@@ -294,6 +409,9 @@ int bufpool_get_message(bufpool_t *bp, prelude_msg_t **out)
                         dec_dlen(bp, prelude_msg_get_len(msg));
         }
 
+        if ( msg )
+                *run = dequeue_journal_run(bp);
+
         assert(msg || bp->count == 0);
         gl_lock_unlock(bp->mutex);
 
@@ -303,16 +421,23 @@ int bufpool_get_message(bufpool_t *bp, prelude_msg_t **out)
 
 
 
-int bufpool_new(bufpool_t **bp, const char *filename)
+static int bufpool_alloc(bufpool_t **bp, const char *filename)
 {
         *bp = malloc(sizeof(**bp));
         if ( ! *bp )
                 return -1;
 
         (*bp)->len = 0;
+        (*bp)->dlen = 0;
         (*bp)->count = 0;
+        (*bp)->unjournaled = 0;
+        (*bp)->disk_filter = NULL;
+        (*bp)->disk_dropped = 0;
+        (*bp)->mem_limit = 0;
+        (*bp)->disk_limit = 0;
         (*bp)->failover = NULL;
         prelude_list_init(&(*bp)->msglist);
+        prelude_list_init(&(*bp)->list);
 
         (*bp)->filename = strdup(filename);
         if ( ! (*bp)->filename ) {
@@ -321,6 +446,19 @@ int bufpool_new(bufpool_t **bp, const char *filename)
         }
 
         gl_lock_init((*bp)->mutex);
+        journal_cursor_init(&(*bp)->cursor);
+
+        return 0;
+}
+
+
+int bufpool_new(bufpool_t **bp, const char *filename)
+{
+        int ret;
+
+        ret = bufpool_alloc(bp, filename);
+        if ( ret < 0 )
+                return ret;
 
         gl_lock_lock(mutex);
         prelude_list_add_tail(&pool_list, &(*bp)->list);
@@ -330,6 +468,68 @@ int bufpool_new(bufpool_t **bp, const char *filename)
 }
 
 
+static size_t get_failover_size(const char *dirname)
+{
+        DIR *dir;
+        struct stat st;
+        size_t size = 0;
+        struct dirent *de;
+        char filename[PATH_MAX];
+
+        dir = opendir(dirname);
+        if ( ! dir )
+                return 0;
+
+        while ( (de = readdir(dir)) ) {
+                snprintf(filename, sizeof(filename), "%s/%s", dirname, de->d_name);
+
+                if ( stat(filename, &st) == 0 && S_ISREG(st.st_mode) )
+                        size += st.st_size;
+        }
+
+        closedir(dir);
+
+        return size;
+}
+
+
+/*
+ * Create a pool out of a failover left by a previous run. The pool
+ * start in the on-disk state, and its disk usage is estimated from the
+ * failover files size.
+ */
+int bufpool_new_from_failover(bufpool_t **bp, const char *filename)
+{
+        int ret;
+        size_t dlen;
+        unsigned long count;
+
+        ret = bufpool_alloc(bp, filename);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_failover_new(&(*bp)->failover, filename);
+        if ( ret < 0 ) {
+                bufpool_destroy(*bp);
+                return ret;
+        }
+
+        count = prelude_failover_get_available_msg_count((*bp)->failover);
+        dlen = get_failover_size(filename);
+
+        (*bp)->count = count;
+        (*bp)->unjournaled = count;
+        (*bp)->dlen = dlen;
+
+        gl_lock_lock(mutex);
+        disk_msglen += dlen;
+        disk_msgcount += count;
+        gl_lock_unlock(mutex);
+
+        return 0;
+}
+
+
 void bufpool_destroy(bufpool_t *bp)
 {
         gl_lock_lock(destroy_prevention);
@@ -343,6 +543,8 @@ void bufpool_destroy(bufpool_t *bp)
         if ( bp->failover )
                 prelude_failover_destroy(bp->failover);
 
+        journal_cursor_destroy(&bp->cursor);
+
         gl_lock_unlock(bp->mutex);
         gl_lock_destroy(bp->mutex);
 
@@ -351,6 +553,192 @@ void bufpool_destroy(bufpool_t *bp)
 }
 
 
+/*
+ * Called once a message returned by bufpool_get_message() has been
+ * processed, so that it can be released from the journal.
+ */
+void bufpool_message_processed(bufpool_t *bp, journal_run_t *run)
+{
+        journal_complete(run);
+}
+
+
+/*
+ * Write the in-memory messages of the pool to its failover, which is
+ * left on disk when the pool is destroyed.
+ */
+int bufpool_persist(bufpool_t *bp)
+{
+        int ret = 0;
+
+        gl_lock_lock(bp->mutex);
+
+        if ( ! bp->failover && ! prelude_list_is_empty(&bp->msglist) )
+                ret = flush_bufpool_to_disk(bp);
+
+        gl_lock_unlock(bp->mutex);
+
+        return ret;
+}
+
+
+/*
+ * Called once the pool content has been stored by bufpool_persist(): the
+ * journal no longer need to be replayed for the queued messages.
+ */
+void bufpool_release_journal(bufpool_t *bp)
+{
+        gl_lock_lock(bp->mutex);
+        journal_cursor_release(&bp->cursor);
+        bp->unjournaled = bp->count;
+        gl_lock_unlock(bp->mutex);
+}
+
+
+
+const char *bufpool_get_filename(bufpool_t *bp)
+{
+        return bp->filename;
+}
+
+
+
+void bufpool_set_limits(bufpool_t *bp, size_t mem_limit, size_t disk_limit)
+{
+        gl_lock_lock(bp->mutex);
+        bp->mem_limit = mem_limit;
+        bp->disk_limit = disk_limit;
+        gl_lock_unlock(bp->mutex);
+}
+
+
+/*
+ * Messages for which match() return TRUE are never written to disk: they
+ * are dropped when the pool is flushed, or when added to a pool already
+ * on disk. Pass NULL to store every message.
+ */
+void bufpool_set_disk_filter(bufpool_t *bp, prelude_bool_t (*match)(prelude_msg_t *msg))
+{
+        gl_lock_lock(bp->mutex);
+        bp->disk_filter = match;
+        gl_lock_unlock(bp->mutex);
+}
+
+
+
+/*
+ * Return the number of messages dropped by the disk filter since the
+ * last call.
+ */
+size_t bufpool_get_disk_dropped(bufpool_t *bp)
+{
+        size_t count;
+
+        gl_lock_lock(bp->mutex);
+        count = bp->disk_dropped;
+        bp->disk_dropped = 0;
+        gl_lock_unlock(bp->mutex);
+
+        return count;
+}
+
+
+
+/*
+ * Return the number of bytes by which adding a message of len bytes
+ * would exceed the pool disk limit, 0 if the message fit.
+ */
+size_t bufpool_get_overflow(bufpool_t *bp, size_t len)
+{
+        size_t ondisk = 0, over = 0;
+
+        gl_lock_lock(bp->mutex);
+
+        if ( bp->failover )
+                ondisk = bp->dlen + len;
+
+        else if ( bp->mem_limit && bp->len + len > bp->mem_limit )
+                ondisk = bp->len + len;
+
+        if ( bp->disk_limit && ondisk > bp->disk_limit )
+                over = ondisk - bp->disk_limit;
+
+        gl_lock_unlock(bp->mutex);
+
+        return over;
+}
+
+
+/*
+ * Drop the oldest message from the pool. Return 1 if a message was
+ * dropped, 0 if the pool is empty.
+ */
+int bufpool_drop_oldest(bufpool_t *bp, size_t *len)
+{
+        int ret;
+        prelude_msg_t *msg;
+        journal_run_t *run;
+
+        ret = bufpool_get_message(bp, &msg, &run);
+        if ( ret <= 0 )
+                return ret;
+
+        *len = prelude_msg_get_len(msg);
+
+        prelude_msg_destroy(msg);
+        bufpool_message_processed(bp, run);
+
+        return 1;
+}
+
+
+/*
+ * Drop the oldest in-memory message for which match() return TRUE.
+ * Messages already flushed to disk are not considered.
+ */
+int bufpool_drop_matching(bufpool_t *bp, prelude_bool_t (*match)(prelude_msg_t *msg), size_t *len)
+{
+        size_t index = 0;
+        prelude_list_t *tmp;
+        prelude_msg_t *msg = NULL;
+        journal_run_t *run = NULL;
+
+        gl_lock_lock(bp->mutex);
+
+        prelude_list_for_each(&bp->msglist, tmp) {
+                msg = prelude_linked_object_get_object(tmp);
+                if ( match(msg) )
+                        break;
+
+                msg = NULL;
+                index++;
+        }
+
+        if ( msg ) {
+                prelude_linked_object_del((prelude_linked_object_t *) msg);
+                dec_len(bp, prelude_msg_get_len(msg));
+
+                /*
+                 * In-memory messages are the oldest of the pool, the
+                 * message position is the same within the journal cursor.
+                 */
+                if ( journal_is_enabled() )
+                        run = journal_dequeue_at(&bp->cursor, index);
+        }
+
+        gl_lock_unlock(bp->mutex);
+
+        if ( ! msg )
+                return 0;
+
+        *len = prelude_msg_get_len(msg);
+        prelude_msg_destroy(msg);
+        journal_complete(run);
+
+        return 1;
+}
+
+
 void bufpool_set_disk_threshold(size_t threshold)
 {
         on_disk_threshold = threshold;
@@ -24,6 +24,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -31,14 +32,132 @@
 #include <libprelude/prelude.h>
 #include <libprelude/prelude-log.h>
 
+#include "glthread/lock.h"
 #include "prelude-manager.h"
 #include "decode-plugins.h"
+#include "manager-options.h"
 
 
 #define MANAGER_PLUGIN_SYMBOL "manager_plugin_init"
 
 
+#define DECODE_TABLE_SIZE 256
+
+
+/*
+ * Decode plugins indexed by decode id. Several plugins might handle
+ * the same id, in which case they are run in subscription order.
+ *
+ * Chains might be modified on configuration reload while messages are
+ * decoded: a chain is never modified, but replaced by a new one, and the
+ * previous one released once no message processing can use it.
+ */
+typedef struct {
+        size_t count;
+        prelude_plugin_instance_t *instance[];
+} decode_chain_t;
+
+
 static PRELUDE_LIST(decode_plugins_instance);
+static decode_chain_t *decode_table[DECODE_TABLE_SIZE];
+static gl_lock_t decode_table_lock = gl_lock_initializer;
+
+
+
+static void chain_publish(unsigned int id, decode_chain_t *new)
+{
+        decode_chain_t *old;
+
+        gl_lock_lock(decode_table_lock);
+        old = decode_table[id];
+        decode_table[id] = new;
+        gl_lock_unlock(decode_table_lock);
+
+        if ( old )
+                manager_defer_free(free, old);
+}
+
+
+
+static int get_order(prelude_plugin_instance_t *pi)
+{
+        return ((manager_decode_plugin_t *) prelude_plugin_instance_get_plugin(pi))->order;
+}
+
+
+
+/*
+ * The instance is inserted after every instance with the same or a
+ * lower order.
+ */
+static int chain_add(unsigned int id, prelude_plugin_instance_t *pi)
+{
+        size_t i, pos, count;
+        decode_chain_t *new, *old = decode_table[id];
+
+        count = (old) ? old->count : 0;
+
+        new = malloc(sizeof(*new) + (count + 1) * sizeof(*new->instance));
+        if ( ! new ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        for ( pos = 0; pos < count && get_order(old->instance[pos]) <= get_order(pi); pos++ )
+                new->instance[pos] = old->instance[pos];
+
+        new->instance[pos] = pi;
+
+        for ( i = pos; i < count; i++ )
+                new->instance[i + 1] = old->instance[i];
+
+        new->count = count + 1;
+
+        chain_publish(id, new);
+
+        return 0;
+}
+
+
+
+static void chain_del(unsigned int id, prelude_plugin_instance_t *pi)
+{
+        size_t i;
+        decode_chain_t *new = NULL, *old = decode_table[id];
+
+        if ( ! old )
+                return;
+
+        if ( old->count > 1 ) {
+                new = malloc(sizeof(*new) + (old->count - 1) * sizeof(*new->instance));
+                if ( ! new ) {
+                        prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                        return;
+                }
+
+                new->count = 0;
+                for ( i = 0; i < old->count; i++ ) {
+                        if ( old->instance[i] != pi )
+                                new->instance[new->count++] = old->instance[i];
+                }
+        }
+
+        chain_publish(id, new);
+}
+
+
+
+static decode_chain_t *chain_get(unsigned int id)
+{
+        decode_chain_t *ret;
+
+        gl_lock_lock(decode_table_lock);
+        ret = decode_table[id];
+        gl_lock_unlock(decode_table_lock);
+
+        return ret;
+}
+
 
 
 /*
@@ -46,55 +165,83 @@ static PRELUDE_LIST(decode_plugins_instance);
  */
 static int subscribe(prelude_plugin_instance_t *pi)
 {
-        prelude_plugin_generic_t *plugin = prelude_plugin_instance_get_plugin(pi);
+        int ret;
+        manager_decode_plugin_t *plugin = (manager_decode_plugin_t *) prelude_plugin_instance_get_plugin(pi);
+
+        if ( plugin->decode_id >= DECODE_TABLE_SIZE ) {
+                prelude_log(PRELUDE_LOG_ERR, "%s: invalid decode id %u.\n", plugin->name, plugin->decode_id);
+                return -1;
+        }
 
         prelude_log(PRELUDE_LOG_INFO, "Subscribing %s to active decoding plugins.\n", plugin->name);
 
+        ret = chain_add(plugin->decode_id, pi);
+        if ( ret < 0 )
+                return ret;
+
         return prelude_plugin_instance_add(pi, &decode_plugins_instance);
 }
 
 
 static void unsubscribe(prelude_plugin_instance_t *pi)
 {
-        prelude_plugin_generic_t *plugin = prelude_plugin_instance_get_plugin(pi);
+        manager_decode_plugin_t *plugin = (manager_decode_plugin_t *) prelude_plugin_instance_get_plugin(pi);
 
         prelude_log(PRELUDE_LOG_DEBUG, "Unsubscribing %s from active decoding plugins.\n", plugin->name);
 
+        chain_del(plugin->decode_id, pi);
         prelude_plugin_instance_del(pi);
 }
 
 
 
+prelude_bool_t decode_plugins_reload_safe(void)
+{
+        prelude_list_t *tmp;
+        prelude_plugin_instance_t *pi;
+
+        prelude_list_for_each(&decode_plugins_instance, tmp) {
+                pi = prelude_linked_object_get_object(tmp);
+
+                if ( ! manager_plugin_is_reload_safe(pi) )
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+
+
 /*
- *
+ * Run every plugin handling plugin_id, stopping at the first failure.
+ * Called from message processing, the chain stay valid until it ends.
  */
 int decode_plugins_run(unsigned int plugin_id, prelude_msg_t *msg, idmef_message_t *idmef)
 {
         int ret;
+        size_t i;
+        decode_chain_t *chain;
         manager_decode_plugin_t *p;
-        prelude_list_t *tmp;
         prelude_plugin_instance_t *pi;
 
-        prelude_list_for_each(&decode_plugins_instance, tmp) {
-
-                pi = prelude_linked_object_get_object(tmp);
+        chain = (plugin_id < DECODE_TABLE_SIZE) ? chain_get(plugin_id) : NULL;
+        if ( ! chain ) {
+                prelude_log(PRELUDE_LOG_WARN, "No decode plugin for handling sensor id %u.\n", plugin_id);
+                return -1;
+        }
 
-                p = (manager_decode_plugin_t *) prelude_plugin_instance_get_plugin(pi);
-                if ( p->decode_id != plugin_id )
-                        continue;
+        for ( i = 0; i < chain->count; i++ ) {
+                pi = chain->instance[i];
 
                 ret = prelude_plugin_run(pi, manager_decode_plugin_t, run, msg, idmef);
                 if ( ret < 0 ) {
+                        p = (manager_decode_plugin_t *) prelude_plugin_instance_get_plugin(pi);
                         prelude_log(PRELUDE_LOG_WARN, "%s couldn't decode sensor data.\n", p->name);
                         return -1;
                 }
-
-                return 0;
         }
 
-        prelude_log(PRELUDE_LOG_WARN, "No decode plugin for handling sensor id %u.\n", plugin_id);
-
-        return -1;
+        return 0;
 }
 
 
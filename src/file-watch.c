@@ -0,0 +1,322 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "glthread/thread.h"
+#include "glthread/lock.h"
+#include "glthread/cond.h"
+#include "prelude-manager.h"
+
+
+/*
+ * Watched files are checked by a single thread, started with the first
+ * watch. A watch is only checked by one thread at a time: lock is held
+ * while reloading, and running while the watcher thread use it, so
+ * that it is not destroyed under it.
+ */
+struct manager_file_watch {
+        prelude_list_t list;
+
+        char *filename;
+        unsigned int interval;
+        time_t next_check;
+        prelude_bool_t running;
+
+        gl_lock_t lock;
+        struct stat st;
+
+        int (*reload)(const char *filename, void *data);
+        void *data;
+};
+
+
+static PRELUDE_LIST(watch_list);
+static gl_lock_t watch_list_lock = gl_lock_initializer;
+static gl_cond_t watch_cond = gl_cond_initializer;
+
+static gl_thread_t thread;
+static prelude_bool_t thread_started = FALSE;
+
+
+
+static prelude_bool_t stat_changed(struct stat *old, struct stat *new)
+{
+        return new->st_mtime != old->st_mtime || new->st_size != old->st_size ||
+               new->st_ino != old->st_ino || new->st_dev != old->st_dev;
+}
+
+
+
+/*
+ * Must be called with the watch lock held. On failure, the file is
+ * considered unchanged, and is reloaded again on the next check.
+ */
+static int reload_if_changed(manager_file_watch_t *watch, prelude_bool_t force)
+{
+        int ret;
+        struct stat st;
+
+        ret = stat(watch->filename, &st);
+        if ( ret < 0 ) {
+                if ( ! force )
+                        return 0;
+
+                prelude_log(PRELUDE_LOG_WARN, "could not stat '%s': %s.\n", watch->filename, strerror(errno));
+                return -1;
+        }
+
+        if ( ! force && ! stat_changed(&watch->st, &st) )
+                return 0;
+
+        ret = watch->reload(watch->filename, watch->data);
+        if ( ret < 0 )
+                return ret;
+
+        watch->st = st;
+
+        return 0;
+}
+
+
+
+/*
+ * Must be called with watch_list_lock held.
+ */
+static manager_file_watch_t *get_due_watch(time_t now)
+{
+        prelude_list_t *tmp;
+        manager_file_watch_t *watch;
+
+        prelude_list_for_each(&watch_list, tmp) {
+                watch = prelude_list_entry(tmp, manager_file_watch_t, list);
+
+                if ( watch->interval && now >= watch->next_check )
+                        return watch;
+        }
+
+        return NULL;
+}
+
+
+
+static void *file_watcher(void *arg)
+{
+        int ret;
+        sigset_t set;
+        struct timeval now;
+        struct timespec ts;
+        manager_file_watch_t *watch;
+
+        sigfillset(&set);
+
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
+
+        gl_lock_lock(watch_list_lock);
+
+        while ( 1 ) {
+                gettimeofday(&now, NULL);
+
+                watch = get_due_watch(now.tv_sec);
+                if ( ! watch ) {
+                        ts.tv_sec = now.tv_sec + 1;
+                        ts.tv_nsec = now.tv_usec * 1000;
+
+                        glthread_cond_timedwait(&watch_cond, &watch_list_lock, &ts);
+                        continue;
+                }
+
+                watch->next_check = now.tv_sec + watch->interval;
+                watch->running = TRUE;
+                gl_lock_unlock(watch_list_lock);
+
+                gl_lock_lock(watch->lock);
+                reload_if_changed(watch, FALSE);
+                gl_lock_unlock(watch->lock);
+
+                gl_lock_lock(watch_list_lock);
+                watch->running = FALSE;
+                gl_cond_broadcast(watch_cond);
+        }
+
+        gl_lock_unlock(watch_list_lock);
+
+        return NULL;
+}
+
+
+
+/*
+ * Must be called with watch_list_lock held.
+ */
+static int start_watcher(void)
+{
+        int ret;
+
+        if ( thread_started )
+                return 0;
+
+        ret = glthread_create(&thread, &file_watcher, NULL);
+        if ( ret != 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't create file watcher thread.\n");
+                return -1;
+        }
+
+        thread_started = TRUE;
+
+        return 0;
+}
+
+
+
+/*
+ * The file is loaded through reload() before being watched, the error
+ * being returned if it could not be.
+ */
+int manager_file_watch_new(manager_file_watch_t **watch, const char *filename, unsigned int interval,
+                           int (*reload)(const char *filename, void *data), void *data)
+{
+        int ret;
+        manager_file_watch_t *new;
+
+        new = calloc(1, sizeof(*new));
+        if ( ! new )
+                return prelude_error_from_errno(errno);
+
+        new->filename = strdup(filename);
+        if ( ! new->filename ) {
+                free(new);
+                return prelude_error_from_errno(errno);
+        }
+
+        new->reload = reload;
+        new->data = data;
+        new->interval = interval;
+        gl_lock_init(new->lock);
+
+        ret = reload_if_changed(new, TRUE);
+        if ( ret < 0 )
+                goto err;
+
+        gl_lock_lock(watch_list_lock);
+
+        ret = (interval) ? start_watcher() : 0;
+        if ( ret == 0 ) {
+                new->next_check = time(NULL) + interval;
+                prelude_list_add_tail(&watch_list, &new->list);
+        }
+
+        gl_lock_unlock(watch_list_lock);
+
+        if ( ret < 0 )
+                goto err;
+
+        *watch = new;
+
+        return 0;
+
+ err:
+        gl_lock_destroy(new->lock);
+        free(new->filename);
+        free(new);
+
+        return ret;
+}
+
+
+
+/*
+ * Reload the file now if it changed since it was last loaded.
+ */
+int manager_file_watch_check(manager_file_watch_t *watch)
+{
+        int ret;
+
+        gl_lock_lock(watch->lock);
+        ret = reload_if_changed(watch, FALSE);
+        gl_lock_unlock(watch->lock);
+
+        return ret;
+}
+
+
+
+/*
+ * 0 disable periodic checks.
+ */
+int manager_file_watch_set_interval(manager_file_watch_t *watch, unsigned int interval)
+{
+        int ret = 0;
+
+        gl_lock_lock(watch_list_lock);
+
+        if ( interval )
+                ret = start_watcher();
+
+        if ( ret == 0 ) {
+                watch->interval = interval;
+                watch->next_check = time(NULL) + interval;
+        }
+
+        gl_lock_unlock(watch_list_lock);
+
+        return ret;
+}
+
+
+
+/*
+ * Wait for a check in progress to complete: reload() is not called
+ * anymore once this return.
+ */
+void manager_file_watch_destroy(manager_file_watch_t *watch)
+{
+        gl_lock_lock(watch_list_lock);
+
+        while ( watch->running )
+                gl_cond_wait(watch_cond, watch_list_lock);
+
+        prelude_list_del(&watch->list);
+
+        gl_lock_unlock(watch_list_lock);
+
+        gl_lock_destroy(watch->lock);
+        free(watch->filename);
+        free(watch);
+}
@@ -30,17 +30,31 @@
 #include <dirent.h>
 #include <errno.h>
 #include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include <libprelude/prelude.h>
 #include <libprelude/prelude-log.h>
 
+#include "ev.h"
 #include "prelude-manager.h"
 #include "filter-plugins.h"
+#include "manager-options.h"
+#include "report-plugins.h"
+#include "plugin-lock.h"
+#include "idmef-projection.h"
 
 
 #define MANAGER_PLUGIN_SYMBOL "manager_plugin_init"
 
 
+/*
+ * Statistics are updated with the filter plugin lock held, and read
+ * without it when reordering or printing them: they are approximate.
+ * Run time is only measured for reorderable hooks while reordering is
+ * enabled.
+ */
 struct manager_filter_hook {
         prelude_list_t list;
 
@@ -48,11 +62,63 @@ struct manager_filter_hook {
         prelude_plugin_instance_t *filter;
         prelude_plugin_instance_t *filtered_plugin;
 
+        prelude_bool_t reorderable;
+        uint64_t run_count;
+        uint64_t pass_count;
+        uint64_t timed_count;
+        uint64_t run_nsec;
+};
+
+
+/*
+ * Filters hooked on a plugin, or on another filter, are compiled into a
+ * chain per filtered instance: the instance is accepted if any of the
+ * alternatives accept the message, an alternative being a filter and
+ * the chain of the filters hooked on it.
+ */
+typedef struct {
+        manager_filter_hook_t *hook;
+        filter_chain_t *sub;
+} filter_alternative_t;
+
+
+struct filter_chain {
+        prelude_plugin_instance_t *target;
+        size_t count;
+        filter_alternative_t *alt;
+};
+
+
+/*
+ * Immutable snapshot of the hooks, used by the processing threads.
+ */
+struct filter_graph {
+        prelude_bool_t need_additional_data;
+        size_t count[MANAGER_FILTER_CATEGORY_END];
+        manager_filter_hook_t **hook[MANAGER_FILTER_CATEGORY_END];
+
+        size_t chain_count;
+        filter_chain_t *chain;
+        filter_alternative_t *alt;
 };
 
 
+/*
+ * Hooks as registered by the plugins, only accessed from option callbacks
+ * and from the reorder timer, both run by the main event loop.
+ */
 static prelude_list_t filter_category_list[MANAGER_FILTER_CATEGORY_END];
 
+extern struct ev_loop *manager_event_loop;
+
+static ev_timer reorder_timer;
+static prelude_bool_t reorder_timer_initialized = FALSE;
+static unsigned int reorder_interval = 0;
+
+static const char *category_name[MANAGER_FILTER_CATEGORY_END] = {
+        "reporting", "reverse-relaying", "plugin"
+};
+
 
 
 static int add_filter_entry(manager_filter_hook_t **entry,
@@ -71,8 +137,11 @@ static int add_filter_entry(manager_filter_hook_t **entry,
         new->data = data;
         new->filter = filter;
         new->filtered_plugin = filtered_plugin_instance;
+        new->reorderable = FALSE;
+        new->run_count = new->pass_count = new->timed_count = new->run_nsec = 0;
 
         prelude_list_add_tail(&filter_category_list[cat], &new->list);
+        report_plugins_update_graph();
 
         plugin = prelude_plugin_instance_get_plugin(filter);
 
@@ -99,10 +168,16 @@ static void unsubscribe(prelude_plugin_instance_t *pi)
 
 
 
+/*
+ * Must not wait for the hook to be out of use: this might be called
+ * while an option request hold the plugin lock.
+ */
 void manager_filter_destroy_hook(manager_filter_hook_t *entry)
 {
         prelude_list_del(&entry->list);
-        free(entry);
+
+        report_plugins_publish_graph();
+        manager_defer_free(free, entry);
 }
 
 
@@ -117,17 +192,212 @@ int manager_filter_new_hook(manager_filter_hook_t **entry,
 
 
 
+/*
+ * Locks of the filter instances whose options can not be changed while
+ * they are running.
+ */
+uint32_t filter_plugins_get_reload_lock_mask(void)
+{
+        int i;
+        uint32_t mask = 0;
+        prelude_list_t *tmp;
+        manager_filter_hook_t *entry;
+
+        for ( i = 0; i < MANAGER_FILTER_CATEGORY_END; i++ ) {
+                prelude_list_for_each(&filter_category_list[i], tmp) {
+                        entry = prelude_list_entry(tmp, manager_filter_hook_t, list);
+
+                        if ( ! manager_plugin_is_reload_safe(entry->filter) )
+                                mask |= plugin_lock_get_mask(entry->filter);
+                }
+        }
+
+        return mask;
+}
+
+
+
+void manager_filter_hook_set_reorderable(manager_filter_hook_t *entry, prelude_bool_t reorderable)
+{
+        entry->reorderable = reorderable;
+}
+
+
 
-int filter_plugins_run_by_category(idmef_message_t *msg, manager_filter_category_t cat)
+static uint64_t get_nsec(void)
+{
+#if _POSIX_TIMERS - 0 > 0
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (uint64_t) tv.tv_sec * 1000000000 + (uint64_t) tv.tv_usec * 1000;
+#endif
+}
+
+
+
+
+static int run_filter(manager_filter_hook_t *entry, idmef_message_t *msg)
 {
         int ret;
+        uint64_t start;
+
+        plugin_lock(entry->filter);
+
+        if ( reorder_interval && entry->reorderable ) {
+                start = get_nsec();
+                ret = prelude_plugin_run(entry->filter, manager_filter_plugin_t, run, msg, entry->data);
+
+                entry->run_nsec += get_nsec() - start;
+                entry->timed_count++;
+        } else
+                ret = prelude_plugin_run(entry->filter, manager_filter_plugin_t, run, msg, entry->data);
+
+        entry->run_count++;
+        if ( ret >= 0 )
+                entry->pass_count++;
+
+        plugin_unlock(entry->filter);
+
+        return ret;
+}
+
+
+
+/*
+ * Expected cost of the filter for each message it reject: filters are
+ * run by increasing rank. A filter that was not timed yet, or never
+ * rejected anything, is run last.
+ */
+static double get_rank(manager_filter_hook_t *entry)
+{
+        uint64_t rejected = entry->run_count - entry->pass_count;
+
+        if ( ! rejected || ! entry->timed_count )
+                return HUGE_VAL;
+
+        return (double) entry->run_nsec / entry->timed_count * entry->run_count / rejected;
+}
+
+
+
+/*
+ * Filters of a category are AND'ed, any order give the same result
+ * for filters without side effects, which are flagged reorderable by
+ * their plugin. Other filters stay in place and split the list into
+ * independently sorted segments.
+ */
+static prelude_bool_t reorder_hooks(manager_filter_hook_t **hook, double *rank, size_t count)
+{
+        size_t i, j;
+        double tmp;
+        manager_filter_hook_t *entry;
+        prelude_bool_t changed = FALSE;
+
+        for ( i = 0; i < count; i++ ) {
+                rank[i] = get_rank(hook[i]);
+
+                if ( ! hook[i]->reorderable )
+                        continue;
+
+                for ( j = i; j > 0 && hook[j - 1]->reorderable && rank[j - 1] > rank[j]; j-- ) {
+                        entry = hook[j];
+                        hook[j] = hook[j - 1];
+                        hook[j - 1] = entry;
+
+                        tmp = rank[j];
+                        rank[j] = rank[j - 1];
+                        rank[j - 1] = tmp;
+
+                        changed = TRUE;
+                }
+        }
+
+        return changed;
+}
+
+
+
+/*
+ * Reorder the registered hooks of a category, the new order being
+ * used by the next published graph.
+ */
+static prelude_bool_t reorder_category(manager_filter_category_t cat)
+{
+        size_t i, count = 0;
+        double *rank;
         prelude_list_t *tmp;
+        prelude_bool_t changed;
+        manager_filter_hook_t **hook;
+
+        prelude_list_for_each(&filter_category_list[cat], tmp)
+                count++;
+
+        if ( count < 2 )
+                return FALSE;
+
+        hook = malloc(count * (sizeof(*hook) + sizeof(*rank)));
+        if ( ! hook ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return FALSE;
+        }
+
+        rank = (double *) (hook + count);
+
+        i = 0;
+        prelude_list_for_each(&filter_category_list[cat], tmp)
+                hook[i++] = prelude_list_entry(tmp, manager_filter_hook_t, list);
+
+        changed = reorder_hooks(hook, rank, count);
+        if ( changed ) {
+                prelude_list_init(&filter_category_list[cat]);
+
+                for ( i = 0; i < count; i++ )
+                        prelude_list_add_tail(&filter_category_list[cat], &hook[i]->list);
+
+                prelude_log_debug(1, "reordered %s filters, '%s' now run first.\n", category_name[cat],
+                                  prelude_plugin_instance_get_name(hook[0]->filter));
+        }
+
+        free(hook);
+
+        return changed;
+}
+
+
+
+/*
+ * Filters hooked on plugins are left in configuration order: they are
+ * alternatives, evaluated until one accept the message.
+ */
+static void reorder_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+        prelude_bool_t changed;
+
+        changed = reorder_category(MANAGER_FILTER_CATEGORY_REPORTING);
+        changed |= reorder_category(MANAGER_FILTER_CATEGORY_REVERSE_RELAYING);
+
+        if ( changed )
+                report_plugins_update_graph();
+}
+
+
+
+int filter_plugins_run_by_category(filter_graph_t *graph, idmef_message_t *msg, manager_filter_category_t cat)
+{
+        int ret;
+        size_t i;
         manager_filter_hook_t *entry;
 
-        prelude_list_for_each(&filter_category_list[cat], tmp) {
-                entry = prelude_list_entry(tmp, manager_filter_hook_t, list);
+        for ( i = 0; i < graph->count[cat]; i++ ) {
+                entry = graph->hook[cat][i];
 
-                ret = prelude_plugin_run(entry->filter, manager_filter_plugin_t, run, msg, entry->data);
+                ret = run_filter(entry, msg);
                 if ( ret < 0 )
                         return -1;
         }
@@ -138,41 +408,222 @@ int filter_plugins_run_by_category(idmef_message_t *msg, manager_filter_category
 
 
 
-int filter_plugins_run_by_plugin(idmef_message_t *msg, prelude_plugin_instance_t *plugin)
+/*
+ * Filters hooked on a filter are handled as a AND: if a sub-filter
+ * fail, we continue with the next alternative. A NULL chain accept
+ * every message.
+ */
+int filter_plugins_run_chain(filter_chain_t *chain, idmef_message_t *msg)
 {
         int ret;
-        prelude_list_t *tmp;
-        manager_filter_hook_t *entry;
-        prelude_bool_t filter_failed = FALSE;
+        size_t i;
+        filter_alternative_t *alt;
 
-        prelude_list_for_each(&filter_category_list[MANAGER_FILTER_CATEGORY_PLUGIN], tmp) {
+        if ( ! chain )
+                return 0;
 
-                entry = prelude_list_entry(tmp, manager_filter_hook_t, list);
+        for ( i = 0; i < chain->count; i++ ) {
+                alt = &chain->alt[i];
 
-                if ( entry->filtered_plugin != plugin )
+                ret = run_filter(alt->hook, msg);
+                if ( ret < 0 ) {
+                        prelude_log_debug(3, "filter '%s': failed.\n", prelude_plugin_instance_get_name(alt->hook->filter));
                         continue;
+                }
 
-                ret = prelude_plugin_run(entry->filter, manager_filter_plugin_t, run, msg, entry->data);
-                if ( ret >= 0 ) {
-                        prelude_log_debug(3, "filter '%s': match.\n", prelude_plugin_instance_get_name(entry->filter));
-
-                        /*
-                         * Check filters hooked on this filter plugin. This is handled as a AND,
-                         * so if a sub-filter fail, it mean we will continue with the main OR of
-                         * filter list.
-                         */
-                        ret = filter_plugins_run_by_plugin(msg, entry->filter);
-                        if ( ret >= 0 )
-                                return ret;
-                        else
-                                filter_failed = TRUE;
-                } else {
-                        filter_failed = TRUE;
-                        prelude_log_debug(3, "filter '%s': failed.\n", prelude_plugin_instance_get_name(entry->filter));
+                prelude_log_debug(3, "filter '%s': match.\n", prelude_plugin_instance_get_name(alt->hook->filter));
+
+                ret = filter_plugins_run_chain(alt->sub, msg);
+                if ( ret >= 0 )
+                        return 0;
+        }
+
+        return -1;
+}
+
+
+
+filter_chain_t *filter_plugins_get_chain(filter_graph_t *graph, prelude_plugin_instance_t *pi)
+{
+        size_t i;
+
+        for ( i = 0; i < graph->chain_count; i++ ) {
+                if ( graph->chain[i].target == pi )
+                        return &graph->chain[i];
+        }
+
+        return NULL;
+}
+
+
+
+/*
+ * A filter hooked on itself, directly or through other filters, would
+ * make the chain evaluation loop: such links are dropped.
+ */
+static prelude_bool_t chain_reach(filter_chain_t *chain, filter_chain_t *target, size_t depth)
+{
+        size_t i;
+
+        if ( chain == target )
+                return TRUE;
+
+        if ( ! chain || depth == 0 )
+                return FALSE;
+
+        for ( i = 0; i < chain->count; i++ ) {
+                if ( chain_reach(chain->alt[i].sub, target, depth - 1) )
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+
+
+static int build_chains(filter_graph_t *graph)
+{
+        size_t i, j, n, *chain_index, *offset;
+        manager_filter_hook_t **hook = graph->hook[MANAGER_FILTER_CATEGORY_PLUGIN];
+        filter_chain_t *chain, *sub;
+        filter_alternative_t *alt;
+
+        n = graph->count[MANAGER_FILTER_CATEGORY_PLUGIN];
+        graph->chain_count = 0;
+
+        if ( ! n )
+                return 0;
+
+        graph->chain = calloc(n, sizeof(*graph->chain));
+        graph->alt = calloc(n, sizeof(*graph->alt));
+        chain_index = calloc(n, sizeof(*chain_index));
+        offset = calloc(n, sizeof(*offset));
+
+        if ( ! graph->chain || ! graph->alt || ! chain_index || ! offset ) {
+                free(chain_index);
+                free(offset);
+                return -1;
+        }
+
+        for ( i = 0; i < n; i++ ) {
+                for ( j = 0; j < graph->chain_count; j++ ) {
+                        if ( graph->chain[j].target == hook[i]->filtered_plugin )
+                                break;
+                }
+
+                if ( j == graph->chain_count )
+                        graph->chain[graph->chain_count++].target = hook[i]->filtered_plugin;
+
+                graph->chain[j].count++;
+                chain_index[i] = j;
+        }
+
+        for ( i = 0, j = 0; i < graph->chain_count; i++ ) {
+                graph->chain[i].alt = graph->alt + j;
+                j += graph->chain[i].count;
+        }
+
+        /*
+         * Alternatives keep the hooks configuration order.
+         */
+        for ( i = 0; i < n; i++ ) {
+                chain = &graph->chain[chain_index[i]];
+
+                alt = &chain->alt[offset[chain_index[i]]++];
+                alt->hook = hook[i];
+                alt->sub = filter_plugins_get_chain(graph, hook[i]->filter);
+        }
+
+        for ( i = 0; i < graph->chain_count; i++ ) {
+                chain = &graph->chain[i];
+
+                for ( j = 0; j < chain->count; j++ ) {
+                        alt = &chain->alt[j];
+
+                        sub = alt->sub;
+                        if ( sub && chain_reach(sub, chain, n) ) {
+                                prelude_log(PRELUDE_LOG_WARN, "filter '%s' is hooked on itself, ignoring its filters.\n",
+                                            prelude_plugin_instance_get_name(alt->hook->filter));
+                                alt->sub = NULL;
+                        }
+                }
+        }
+
+        free(chain_index);
+        free(offset);
+
+        return 0;
+}
+
+
+
+/*
+ * Build a snapshot of the currently registered hooks.
+ */
+filter_graph_t *filter_plugins_new_graph(void)
+{
+        int i;
+        size_t total = 0;
+        prelude_list_t *tmp;
+        filter_graph_t *graph;
+        manager_filter_hook_t **hook, *entry;
+
+        for ( i = 0; i < MANAGER_FILTER_CATEGORY_END; i++ ) {
+                prelude_list_for_each(&filter_category_list[i], tmp)
+                        total++;
+        }
+
+        graph = malloc(sizeof(*graph) + total * sizeof(*hook));
+        if ( ! graph ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return NULL;
+        }
+
+        hook = (manager_filter_hook_t **) (graph + 1);
+        graph->need_additional_data = FALSE;
+
+        for ( i = 0; i < MANAGER_FILTER_CATEGORY_END; i++ ) {
+                graph->hook[i] = hook;
+                graph->count[i] = 0;
+
+                prelude_list_for_each(&filter_category_list[i], tmp) {
+                        entry = prelude_list_entry(tmp, manager_filter_hook_t, list);
+
+                        if ( idmef_projection_need_additional_data(entry->filter) )
+                                graph->need_additional_data = TRUE;
+
+                        graph->hook[i][graph->count[i]++] = entry;
                 }
+
+                hook += graph->count[i];
         }
 
-        return (filter_failed) ? -1 : 0;
+        graph->chain = NULL;
+        graph->alt = NULL;
+
+        if ( build_chains(graph) < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                filter_plugins_destroy_graph(graph);
+                return NULL;
+        }
+
+        return graph;
+}
+
+
+
+prelude_bool_t filter_plugins_need_additional_data(filter_graph_t *graph)
+{
+        return graph->need_additional_data;
+}
+
+
+
+void filter_plugins_destroy_graph(filter_graph_t *graph)
+{
+        free(graph->chain);
+        free(graph->alt);
+        free(graph);
 }
 
 
@@ -210,14 +661,78 @@ int filter_plugins_init(const char *dirname, void *data)
                 return -1;
         }
 
+        report_plugins_publish_graph();
+
         return ret;
 }
 
 
 
 
-prelude_bool_t filter_plugins_available(manager_filter_category_t cat)
+prelude_bool_t filter_plugins_available(filter_graph_t *graph, manager_filter_category_t cat)
 {
-        return prelude_list_is_empty(&filter_category_list[cat]);
+        return (graph->count[cat] == 0);
 }
 
+
+
+/*
+ * Number of seconds between two reordering, 0 disable reordering. Must
+ * be called from the main event loop.
+ */
+void filter_plugins_set_reorder_interval(unsigned int interval)
+{
+        reorder_interval = interval;
+
+        if ( ! reorder_timer_initialized ) {
+                ev_init(&reorder_timer, reorder_timer_cb);
+                reorder_timer_initialized = TRUE;
+        }
+
+        reorder_timer.repeat = interval;
+        ev_timer_again(manager_event_loop, &reorder_timer);
+}
+
+
+
+int filter_plugins_get_stats(prelude_string_t *out)
+{
+        int i, ret;
+        prelude_list_t *tmp;
+        manager_filter_hook_t *entry;
+
+        for ( i = 0; i < MANAGER_FILTER_CATEGORY_END; i++ ) {
+                prelude_list_for_each(&filter_category_list[i], tmp) {
+                        entry = prelude_list_entry(tmp, manager_filter_hook_t, list);
+
+                        ret = prelude_string_sprintf(out, "filter %s[%s]: run=%" PRELUDE_PRIu64 " pass=%" PRELUDE_PRIu64
+                                                     " avg_nsec=%" PRELUDE_PRIu64 "%s\n", category_name[i],
+                                                     prelude_plugin_instance_get_name(entry->filter),
+                                                     entry->run_count, entry->pass_count,
+                                                     entry->timed_count ? entry->run_nsec / entry->timed_count : 0,
+                                                     entry->reorderable ? " (reorderable)" : "");
+                        if ( ret < 0 )
+                                return ret;
+                }
+        }
+
+        return 0;
+}
+
+
+
+void filter_plugins_print_stats(void)
+{
+        int ret;
+        prelude_string_t *str;
+
+        ret = prelude_string_new(&str);
+        if ( ret < 0 )
+                return;
+
+        ret = filter_plugins_get_stats(str);
+        if ( ret == 0 && ! prelude_string_is_empty(str) )
+                prelude_log(PRELUDE_LOG_INFO, "%s", prelude_string_get_string(str));
+
+        prelude_string_destroy(str);
+}
@@ -52,6 +52,7 @@
 #include <libprelude/prelude-log.h>
 #include <libprelude/prelude-timer.h>
 #include <libprelude/prelude-error.h>
+#include <libprelude/idmef-message-id.h>
 
 #include "glthread/thread.h"
 #include "glthread/lock.h"
@@ -63,9 +64,14 @@
 #include "report-plugins.h"
 #include "manager-options.h"
 #include "reverse-relaying.h"
-#include "pmsg-to-idmef.h"
+#include "idmef-projection.h"
 #include "idmef-message-scheduler.h"
 #include "bufpool.h"
+#include "journal.h"
+#include "memory-governor.h"
+#include "rcu.h"
+#include "path-memo.h"
+#include "pmsg-index.h"
 
 
 /*
@@ -101,16 +107,67 @@
 #endif
 
 #define QUEUE_STATE_DESTROYED 0x01
+#define QUEUE_STATE_RECOVERY  0x02
+#define QUEUE_STATE_JOURNAL   0x04
+#define QUEUE_STATE_PERSISTED 0x08
+
+/*
+ * Buffers holding messages that are not part of the journal, which are
+ * always recovered on startup.
+ */
+#define RECOVERY_BUFFER_PREFIX "recovery-buffer."
+
+#define RECOVERY_REPORT_INTERVAL 10
+
+#define DROP_REPORT_INTERVAL 10
+
+/*
+ * Rough ratio between the size of a decoded IDMEF message and the size
+ * of its serialized form, used to account in-flight decoding.
+ */
+#define DECODE_MEMORY_FACTOR 4
+
+
+/*
+ * Overload statistics of a queue priority, only modified from the
+ * ingest thread.
+ */
+typedef struct {
+        uint64_t count[SCHED_DROP_END];
+        uint64_t shed;
+        uint64_t write_failure;
+} drop_stats_t;
 
 
 struct idmef_queue {
         prelude_list_t list;
 
         int state;
+        uint64_t id;
 
         bufpool_t *high;
         bufpool_t *mid;
         bufpool_t *low;
+
+        /*
+         * Failover left by a previous run, removed once recovered.
+         */
+        char *recovery_filename;
+
+        /*
+         * Subtrees shared between the messages of this queue, only
+         * accessed from the processing thread.
+         */
+        intern_cache_t *intern_cache;
+
+        drop_stats_t drop[SCHED_PRIORITY_END];
+        time_t last_drop_report;
+
+        /*
+         * Set by the processing thread when a message of the queue could
+         * not be decoded, the sensor connection is then closed.
+         */
+        volatile sig_atomic_t invalid_message;
 };
 
 
@@ -127,6 +184,31 @@ static unsigned int sched_process_medium =  30;
 static unsigned int sched_process_low    =  20;
 static unsigned int sched_process        = 100;
 
+/*
+ * Number of entries of the per queue intern cache, 0 to disable it.
+ */
+static size_t intern_cache_size = 0;
+
+/*
+ * Per priority queue limits, and the policy applied when a queue
+ * reach its disk limit. A limit of 0 mean unlimited.
+ */
+static size_t sched_memory_limit[SCHED_PRIORITY_END];
+static size_t sched_disk_limit[SCHED_PRIORITY_END];
+static sched_drop_policy_t sched_drop_policy[SCHED_PRIORITY_END];
+
+/*
+ * Recovery of messages left by a previous run: only used from the
+ * processing thread once it is started.
+ */
+static unsigned int recovery_rate = 0;
+static unsigned int recovery_budget = 0;
+static time_t recovery_budget_time = 0;
+static prelude_bool_t recovery_throttled = FALSE;
+static unsigned int recovery_queue_count = 0;
+static uint64_t recovery_total = 0, recovery_done = 0;
+static time_t recovery_last_report = 0;
+
 
 /*
  * Thread controling stuff.
@@ -134,6 +216,14 @@ static unsigned int sched_process        = 100;
 static gl_thread_t thread;
 static volatile sig_atomic_t stop_processing = 0;
 
+/*
+ * When set, stopping does not wait for queued messages to be processed:
+ * they are stored to disk and recovered on the next start.
+ */
+static prelude_bool_t fast_stop = FALSE;
+
+#define fast_stop_requested() (stop_processing && fast_stop)
+
 
 
 static void signal_input_available(void)
@@ -200,6 +290,12 @@ static void wait_for_message(struct timespec *last_wakeup)
                         prelude_timer_wake_up();
                         last_wakeup->tv_sec = ts.tv_sec;
                         last_wakeup->tv_nsec = ts.tv_nsec;
+
+                        /*
+                         * Rate limited recovery get a new budget every second.
+                         */
+                        if ( recovery_throttled )
+                                break;
                 }
         }
 
@@ -217,46 +313,173 @@ static void wait_for_message(struct timespec *last_wakeup)
 
 
 
-static int process_message(prelude_msg_t *msg)
+/*
+ * process_mutex is only held while entering the read section, so that
+ * idmef_message_scheduler_stop_processing() can prevent new messages
+ * from being processed.
+ */
+static unsigned int enter_processing(void)
+{
+        unsigned int rcu;
+
+        gl_lock_lock(process_mutex);
+        rcu = rcu_read_lock();
+        gl_lock_unlock(process_mutex);
+
+        return rcu;
+}
+
+
+
+static int process_idmef(report_graph_t *graph, idmef_message_t *idmef, idmef_projection_share_t *share);
+
+
+static intern_cache_t *queue_get_intern_cache(idmef_queue_t *queue)
 {
         int ret;
+
+        if ( ! intern_cache_size )
+                return NULL;
+
+        if ( ! queue->intern_cache ) {
+                ret = intern_cache_new(&queue->intern_cache, intern_cache_size);
+                if ( ret < 0 )
+                        return NULL;
+        }
+
+        return queue->intern_cache;
+}
+
+
+
+static int process_message(idmef_queue_t *queue, prelude_msg_t *msg)
+{
+        int ret;
+        unsigned int rcu;
+        report_graph_t *graph;
         idmef_message_t *idmef;
+        idmef_projection_share_t share;
+        size_t len = prelude_msg_get_len(msg) * DECODE_MEMORY_FACTOR;
 
-        ret = pmsg_to_idmef(&idmef, msg);
+        memory_governor_add(MEMORY_ACCOUNT_DECODE, len);
+
+        /*
+         * The message is decoded within the read section, according to
+         * the paths used by the plugins it is going to be processed by.
+         */
+        rcu = enter_processing();
+        graph = report_plugins_get_graph();
+
+        ret = idmef_projection_decode(&idmef, msg, report_plugins_skip_additional_data(graph),
+                                      queue_get_intern_cache(queue), &share);
         if ( ret < 0 ) {
+                rcu_read_unlock(rcu);
+                memory_governor_sub(MEMORY_ACCOUNT_DECODE, len);
                 prelude_msg_destroy(msg);
 
-                /*
-                 * FIXME: need a way to close connection on invalid message.
-                 */
+                queue->invalid_message = 1;
                 prelude_log(PRELUDE_LOG_ERR, "Invalid message received.\n");
+
                 return ret;
         }
 
         /*
          * prelude-msg is usefull for report plugin failover.
          * We don't need to call prelude_msg_destroy(), as
-         * idmef_message_destroy() will consequently do this for us.
+         * idmef_projection_release() will consequently do this for us.
          */
-        idmef_message_set_pmsg(idmef, msg);
-        idmef_message_process(idmef);
+        ret = process_idmef(graph, idmef, &share);
+        rcu_read_unlock(rcu);
 
-        idmef_message_destroy(idmef);
+        if ( ret == 0 )
+                reverse_relay_send_receiver(idmef);
+
+        idmef_projection_release(idmef);
+        memory_governor_sub(MEMORY_ACCOUNT_DECODE, len);
 
         return 0;
 }
 
 
 
+static int failover_unlink(const char *dirname);
+static int is_queue_dirty(idmef_queue_t *queue);
+static uint64_t get_unique_id(void);
+
+
+
+/*
+ * The failover of a pool whose content was persisted out of the journal
+ * is renamed with the RECOVERY_BUFFER_PREFIX, so that it is recovered on
+ * the next start, even if a journal is.
+ */
+static void queue_destroy_pool(idmef_queue_t *queue, bufpool_t *pool)
+{
+        int ret;
+        const char *ptr;
+        char filename[PATH_MAX], newname[PATH_MAX];
+
+        if ( ! (queue->state & QUEUE_STATE_PERSISTED) ) {
+                bufpool_destroy(pool);
+                return;
+        }
+
+        snprintf(filename, sizeof(filename), "%s", bufpool_get_filename(pool));
+        bufpool_destroy(pool);
+
+        ptr = strrchr(filename, '/');
+        if ( ! ptr )
+                return;
+
+        snprintf(newname, sizeof(newname), "%.*s/" RECOVERY_BUFFER_PREFIX "%" PRELUDE_PRIu64,
+                 (int) (ptr - filename), filename, get_unique_id());
+
+        ret = rename(filename, newname);
+        if ( ret < 0 && errno != ENOENT )
+                prelude_log(PRELUDE_LOG_ERR, "could not rename failover '%s': %s.\n", filename, strerror(errno));
+}
+
+
 static void queue_destroy(idmef_queue_t *queue)
 {
+        int ret;
+
         gl_lock_lock(queue_list_mutex);
         prelude_list_del(&queue->list);
         gl_lock_unlock(queue_list_mutex);
 
-        bufpool_destroy(queue->high);
-        bufpool_destroy(queue->mid);
-        bufpool_destroy(queue->low);
+        /*
+         * Recovery queues only use their low priority pool.
+         */
+        if ( queue->high )
+                queue_destroy_pool(queue, queue->high);
+
+        if ( queue->mid )
+                queue_destroy_pool(queue, queue->mid);
+
+        /*
+         * A recovered failover that still hold messages is kept for
+         * the next run.
+         */
+        if ( queue->recovery_filename && ! is_queue_dirty(queue) ) {
+                ret = failover_unlink(queue->recovery_filename);
+                if ( ret < 0 )
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't remove failover '%s': %s.\n",
+                                    queue->recovery_filename, prelude_strerror(ret));
+        }
+
+        /*
+         * Same for the journal segments replayed into this queue, unless
+         * the remaining messages were persisted.
+         */
+        if ( queue->state & QUEUE_STATE_JOURNAL && (! is_queue_dirty(queue) || queue->state & QUEUE_STATE_PERSISTED) )
+                journal_release_recovered();
+
+        queue_destroy_pool(queue, queue->low);
+        free(queue->recovery_filename);
+
+        if ( queue->intern_cache )
+                intern_cache_destroy(queue->intern_cache);
 
         free(queue);
 }
@@ -265,6 +488,9 @@ static void queue_destroy(idmef_queue_t *queue)
 
 static int is_queue_dirty(idmef_queue_t *queue)
 {
+        if ( queue->state & QUEUE_STATE_RECOVERY )
+                return bufpool_get_message_count(queue->low);
+
         return bufpool_get_message_count(queue->high) +
                bufpool_get_message_count(queue->mid)  +
                bufpool_get_message_count(queue->low);
@@ -272,15 +498,17 @@ static int is_queue_dirty(idmef_queue_t *queue)
 
 
 
-static size_t read_message_scheduled_from_pool(bufpool_t *pool, size_t count)
+static size_t read_message_scheduled_from_pool(idmef_queue_t *queue, bufpool_t *pool, size_t count)
 {
         size_t proc = 0;
         prelude_msg_t *msg;
+        journal_run_t *run;
 
-        while ( count-- ) {
-                prelude_return_val_if_fail(bufpool_get_message(pool, &msg) == 1, proc);
+        while ( count-- && ! fast_stop_requested() ) {
+                prelude_return_val_if_fail(bufpool_get_message(pool, &msg, &run) == 1, proc);
 
-                process_message(msg);
+                process_message(queue, msg);
+                bufpool_message_processed(pool, run);
                 proc++;
         }
 
@@ -293,7 +521,9 @@ static void read_message_scheduled(idmef_queue_t *queue)
 {
         unsigned int j;
         int ret, i = 0;
+        bufpool_t *pool;
         prelude_msg_t *msg;
+        journal_run_t *run;
         size_t total, hlen, mlen, llen, proc;
         bufpool_t *btbl[] = { queue->high, queue->mid, queue->low };
         const size_t btbl_size = sizeof(btbl) / sizeof(*btbl);
@@ -302,19 +532,22 @@ static void read_message_scheduled(idmef_queue_t *queue)
         mlen = bufpool_get_message_count(queue->mid);
         llen = bufpool_get_message_count(queue->low);
 
-        proc  = read_message_scheduled_from_pool(queue->high, MIN(hlen, sched_process_high));
-        proc += read_message_scheduled_from_pool(queue->mid, MIN(mlen, sched_process_medium));
-        proc += read_message_scheduled_from_pool(queue->low, MIN(llen, sched_process_low));
+        proc  = read_message_scheduled_from_pool(queue, queue->high, MIN(hlen, sched_process_high));
+        proc += read_message_scheduled_from_pool(queue, queue->mid, MIN(mlen, sched_process_medium));
+        proc += read_message_scheduled_from_pool(queue, queue->low, MIN(llen, sched_process_low));
 
         total = MIN(hlen + mlen + llen - proc, sched_process - proc);
 
-        while ( total ) {
+        while ( total && ! fast_stop_requested() ) {
                 ret = 0;
 
                 for ( j = 0; j < btbl_size; j++ ) {
-                        ret = bufpool_get_message(btbl[i++ % btbl_size], &msg);
+                        pool = btbl[i++ % btbl_size];
+
+                        ret = bufpool_get_message(pool, &msg, &run);
                         if ( ret == 1 ) {
-                                process_message(msg);
+                                process_message(queue, msg);
+                                bufpool_message_processed(pool, run);
                                 break;
                         }
                 }
@@ -325,7 +558,110 @@ static void read_message_scheduled(idmef_queue_t *queue)
                 total--;
         }
 
-        prelude_return_if_fail(total == 0);
+        prelude_return_if_fail(total == 0 || fast_stop_requested());
+}
+
+
+
+static uint64_t persisted_count = 0;
+
+/*
+ * Store the in-memory content of the queue to its buffers, that will be
+ * recovered on the next start.
+ *
+ * Once every queued message is stored, the journal entries of these
+ * messages are released: the journal segments would otherwise be
+ * replayed in full, including the messages already processed. If the
+ * queue could not be stored, the journal is kept and replayed instead.
+ */
+static void queue_persist(idmef_queue_t *queue)
+{
+        int ret;
+        unsigned int i;
+        prelude_bool_t failed = FALSE;
+        bufpool_t *btbl[] = { queue->high, queue->mid, queue->low };
+
+        for ( i = 0; i < sizeof(btbl) / sizeof(*btbl); i++ ) {
+                if ( ! btbl[i] )
+                        continue;
+
+                persisted_count += bufpool_get_message_count(btbl[i]);
+
+                ret = bufpool_persist(btbl[i]);
+                if ( ret < 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "could not store queued messages: %s.\n", prelude_strerror(ret));
+                        failed = TRUE;
+                }
+        }
+
+        /*
+         * A recovered failover is kept as is, its messages are not part
+         * of the journal.
+         */
+        if ( failed || queue->recovery_filename )
+                return;
+
+        for ( i = 0; i < sizeof(btbl) / sizeof(*btbl); i++ ) {
+                if ( btbl[i] )
+                        bufpool_release_journal(btbl[i]);
+        }
+
+        queue->state |= QUEUE_STATE_PERSISTED;
+}
+
+
+
+static void report_recovery_progress(time_t now, prelude_bool_t force)
+{
+        if ( ! force && now - recovery_last_report < RECOVERY_REPORT_INTERVAL )
+                return;
+
+        recovery_last_report = now;
+        prelude_log(PRELUDE_LOG_INFO, "recovery: %" PRELUDE_PRIu64 "/%" PRELUDE_PRIu64 " messages from a previous run processed.\n",
+                    recovery_done, recovery_total);
+}
+
+
+
+/*
+ * Messages recovered from a previous run are processed alongside live
+ * traffic, within the limit of recovery_rate messages per second.
+ */
+static void read_recovery_queue(idmef_queue_t *queue)
+{
+        size_t count, proc;
+        time_t now = time(NULL);
+
+        count = MIN(bufpool_get_message_count(queue->low), sched_process);
+
+        if ( recovery_rate ) {
+                if ( now != recovery_budget_time ) {
+                        recovery_budget = recovery_rate;
+                        recovery_budget_time = now;
+                }
+
+                count = MIN(count, recovery_budget);
+        }
+
+        proc = read_message_scheduled_from_pool(queue, queue->low, count);
+
+        if ( recovery_rate )
+                recovery_budget -= proc;
+
+        recovery_done += proc;
+        report_recovery_progress(now, FALSE);
+}
+
+
+
+static void recovery_queue_destroy(idmef_queue_t *queue)
+{
+        queue_destroy(queue);
+
+        if ( --recovery_queue_count == 0 ) {
+                report_recovery_progress(time(NULL), TRUE);
+                prelude_log(PRELUDE_LOG_INFO, "recovery: completed.\n");
+        }
 }
 
 
@@ -338,15 +674,45 @@ static void schedule_queued_message(struct timespec *last_wakeup)
 
         do {
                 any_queue_dirty = 0;
+                recovery_throttled = FALSE;
 
                 while ( 1 ) {
                         gl_lock_lock(queue_list_mutex);
                         queue = prelude_list_get_next_safe(&message_queue, queue, bkp, idmef_queue_t, list);
                         gl_lock_unlock(queue_list_mutex);
 
-                        if ( ! queue )
+                        if ( ! queue || fast_stop_requested() )
                                 break;
 
+                        if ( queue->state & QUEUE_STATE_RECOVERY ) {
+                                /*
+                                 * On stop, the recovery backlog is left for
+                                 * the next run.
+                                 */
+                                if ( stop_processing )
+                                        continue;
+
+                                read_recovery_queue(queue);
+
+                                dirty = is_queue_dirty(queue);
+                                if ( ! dirty ) {
+                                        recovery_queue_destroy(queue);
+                                        continue;
+                                }
+
+                                /*
+                                 * A queue waiting for its next budget should not
+                                 * keep us busy.
+                                 */
+                                if ( recovery_rate && recovery_budget == 0 ) {
+                                        recovery_throttled = TRUE;
+                                        continue;
+                                }
+
+                                any_queue_dirty += dirty;
+                                continue;
+                        }
+
                         read_message_scheduled(queue);
 
                         dirty = is_queue_dirty(queue);
@@ -361,7 +727,7 @@ static void schedule_queued_message(struct timespec *last_wakeup)
                         last_wakeup->tv_sec = end.tv_sec;
                         last_wakeup->tv_nsec = end.tv_nsec;
                 }
-        } while ( any_queue_dirty );
+        } while ( any_queue_dirty && ! fast_stop_requested() );
 }
 
 
@@ -393,38 +759,219 @@ static void *message_reader(void *arg)
         }
 
         /*
-         * make sure we don't miss some.
+         * make sure we don't miss some. Recovery queues are kept on
+         * disk for the next run.
          */
-        schedule_queued_message(&last_wakeup);
+        if ( ! fast_stop )
+                schedule_queued_message(&last_wakeup);
 
         return NULL;
 }
 
 
+static bufpool_t *queue_get_pool(idmef_queue_t *queue, sched_priority_t priority)
+{
+        if ( priority == SCHED_PRIORITY_HIGH )
+                return queue->high;
+
+        else if ( priority == SCHED_PRIORITY_MEDIUM )
+                return queue->mid;
+
+        return queue->low;
+}
+
+
+
+/*
+ * Look at the first IDMEF tag of the message, skipping the version tag,
+ * without consuming the message.
+ */
+static prelude_bool_t msg_is_heartbeat(prelude_msg_t *msg)
+{
+        uint32_t tlen;
+        size_t i = PMSG_HEADER_SIZE, len = prelude_msg_get_len(msg);
+        const unsigned char *data = prelude_msg_get_message_data(msg);
+
+        while ( i + sizeof(uint8_t) + sizeof(uint32_t) <= len ) {
+                if ( data[i] == IDMEF_MSG_HEARTBEAT_TAG )
+                        return TRUE;
+
+                if ( data[i] != IDMEF_MSG_MESSAGE_VERSION )
+                        break;
+
+                memcpy(&tlen, data + i + sizeof(uint8_t), sizeof(tlen));
+                i += sizeof(uint8_t) + sizeof(uint32_t) + ntohl(tlen);
+        }
+
+        return FALSE;
+}
+
+
+
+static void report_drop(idmef_queue_t *queue, uint64_t *counter, uint64_t count)
+{
+        int i;
+        time_t now;
+        drop_stats_t *stats;
+        static const char *priority_name[] = { "high", "medium", "low" };
+
+        *counter += count;
+
+        now = time(NULL);
+        if ( now - queue->last_drop_report < DROP_REPORT_INTERVAL )
+                return;
+
+        queue->last_drop_report = now;
+
+        for ( i = 0; i < SCHED_PRIORITY_END; i++ ) {
+                stats = &queue->drop[i];
+
+                if ( ! (stats->count[SCHED_DROP_NEWEST] || stats->count[SCHED_DROP_OLDEST] ||
+                        stats->count[SCHED_DROP_LOW_PRIORITY] || stats->count[SCHED_DROP_HEARTBEAT] ||
+                        stats->shed || stats->write_failure) )
+                        continue;
+
+                prelude_log(PRELUDE_LOG_WARN, "queue %" PRELUDE_PRIu64 " overload: %s priority dropped %" PRELUDE_PRIu64 " newest, %"
+                            PRELUDE_PRIu64 " oldest, %" PRELUDE_PRIu64 " low priority, %" PRELUDE_PRIu64 " heartbeat, %"
+                            PRELUDE_PRIu64 " shed messages, %" PRELUDE_PRIu64 " write failures.\n", queue->id, priority_name[i],
+                            stats->count[SCHED_DROP_NEWEST], stats->count[SCHED_DROP_OLDEST], stats->count[SCHED_DROP_LOW_PRIORITY],
+                            stats->count[SCHED_DROP_HEARTBEAT], stats->shed, stats->write_failure);
+        }
+}
+
+
+
+/*
+ * Apply the drop policy of the given priority until msg fit within the
+ * queue limits. Return FALSE if msg itself has to be dropped.
+ *
+ * With the low priority policy, the limits of a sensor queue are shared:
+ * room freed in lower priority pools is borrowed by the higher priority
+ * pool, so that the queue total stay within the sum of its limits.
+ */
+static prelude_bool_t make_room(idmef_queue_t *queue, sched_priority_t priority, prelude_msg_t *msg)
+{
+        int i;
+        size_t dlen, borrowed = 0, len = prelude_msg_get_len(msg);
+        bufpool_t *pool = queue_get_pool(queue, priority);
+        sched_drop_policy_t policy = sched_drop_policy[priority];
+
+        while ( bufpool_get_overflow(pool, len) > borrowed ) {
+
+                if ( policy == SCHED_DROP_OLDEST ) {
+                        if ( bufpool_drop_oldest(pool, &dlen) > 0 ) {
+                                report_drop(queue, &queue->drop[priority].count[SCHED_DROP_OLDEST], 1);
+                                continue;
+                        }
+                }
+
+                else if ( policy == SCHED_DROP_LOW_PRIORITY ) {
+                        for ( i = SCHED_PRIORITY_LOW; i > (int) priority; i-- ) {
+                                if ( bufpool_drop_oldest(queue_get_pool(queue, i), &dlen) > 0 )
+                                        break;
+                        }
+
+                        if ( i > (int) priority ) {
+                                borrowed += dlen;
+                                report_drop(queue, &queue->drop[i].count[SCHED_DROP_LOW_PRIORITY], 1);
+                                continue;
+                        }
+
+                        if ( bufpool_drop_oldest(pool, &dlen) > 0 ) {
+                                report_drop(queue, &queue->drop[priority].count[SCHED_DROP_OLDEST], 1);
+                                continue;
+                        }
+                }
+
+                else if ( policy == SCHED_DROP_HEARTBEAT ) {
+                        if ( msg_is_heartbeat(msg) ) {
+                                report_drop(queue, &queue->drop[priority].count[SCHED_DROP_HEARTBEAT], 1);
+                                return FALSE;
+                        }
+
+                        for ( i = SCHED_PRIORITY_LOW; i >= SCHED_PRIORITY_HIGH; i-- ) {
+                                if ( bufpool_drop_matching(queue_get_pool(queue, i), msg_is_heartbeat, &dlen) > 0 )
+                                        break;
+                        }
+
+                        if ( i >= SCHED_PRIORITY_HIGH ) {
+                                if ( i != (int) priority )
+                                        borrowed += dlen;
+
+                                report_drop(queue, &queue->drop[i].count[SCHED_DROP_HEARTBEAT], 1);
+                                continue;
+                        }
+                }
+
+                report_drop(queue, &queue->drop[priority].count[SCHED_DROP_NEWEST], 1);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+
+
 int idmef_message_schedule(idmef_queue_t *queue, prelude_msg_t *msg)
 {
         int ret;
-        bufpool_t *mqueue;
+        bufpool_t *pool;
+        size_t dropped;
+        sched_priority_t priority;
 
         if ( ! queue )
                 return -1;
 
+        /*
+         * Close the connection of a sensor that sent an invalid message,
+         * the message being given back to the caller.
+         */
+        if ( queue->invalid_message )
+                return prelude_error_verbose(PRELUDE_ERROR_GENERIC, "invalid IDMEF message previously received");
+
         switch (prelude_msg_get_priority(msg)) {
 
         case PRELUDE_MSG_PRIORITY_HIGH:
-                mqueue = queue->high;
+                priority = SCHED_PRIORITY_HIGH;
                 break;
 
         case PRELUDE_MSG_PRIORITY_MID:
-                mqueue = queue->mid;
+                priority = SCHED_PRIORITY_MEDIUM;
                 break;
 
         default:
-                mqueue = queue->low;
+                priority = SCHED_PRIORITY_LOW;
                 break;
         }
 
-        ret = bufpool_add_message(mqueue, msg);
+        /*
+         * Under global memory pressure, low priority messages are shed.
+         */
+        if ( priority == SCHED_PRIORITY_LOW && memory_governor_get_state() == MEMORY_GOVERNOR_STATE_SHED ) {
+                report_drop(queue, &queue->drop[priority].shed, 1);
+                prelude_msg_destroy(msg);
+                return 0;
+        }
+
+        if ( ! make_room(queue, priority, msg) ) {
+                prelude_msg_destroy(msg);
+                return 0;
+        }
+
+        pool = queue_get_pool(queue, priority);
+
+        ret = bufpool_add_message(pool, msg);
+        if ( ret < 0 )
+                report_drop(queue, &queue->drop[priority].write_failure, 1);
+
+        /*
+         * Heartbeats dropped instead of being written to disk, either
+         * now or while the pool was being flushed.
+         */
+        dropped = bufpool_get_disk_dropped(pool);
+        if ( dropped )
+                report_drop(queue, &queue->drop[priority].count[SCHED_DROP_HEARTBEAT], dropped);
+
         signal_input_available();
 
         return ret;
@@ -432,6 +979,19 @@ int idmef_message_schedule(idmef_queue_t *queue, prelude_msg_t *msg)
 
 
 
+/*
+ * With the drop-heartbeat policy, heartbeats are kept out of the disk
+ * failover, where they could not be looked for when the queue reach its
+ * disk limit.
+ */
+static void set_disk_filter(idmef_queue_t *queue, sched_priority_t priority)
+{
+        bufpool_set_disk_filter(queue_get_pool(queue, priority),
+                                (sched_drop_policy[priority] == SCHED_DROP_HEARTBEAT) ? msg_is_heartbeat : NULL);
+}
+
+
+
 static uint64_t get_unique_id(void)
 {
         unsigned int id;
@@ -494,6 +1054,16 @@ idmef_queue_t *idmef_message_scheduler_queue_new(prelude_client_t *client)
                 return NULL;
         }
 
+        queue->id = id;
+
+        bufpool_set_limits(queue->high, sched_memory_limit[SCHED_PRIORITY_HIGH], sched_disk_limit[SCHED_PRIORITY_HIGH]);
+        bufpool_set_limits(queue->mid, sched_memory_limit[SCHED_PRIORITY_MEDIUM], sched_disk_limit[SCHED_PRIORITY_MEDIUM]);
+        bufpool_set_limits(queue->low, sched_memory_limit[SCHED_PRIORITY_LOW], sched_disk_limit[SCHED_PRIORITY_LOW]);
+
+        set_disk_filter(queue, SCHED_PRIORITY_HIGH);
+        set_disk_filter(queue, SCHED_PRIORITY_MEDIUM);
+        set_disk_filter(queue, SCHED_PRIORITY_LOW);
+
         gl_lock_lock(queue_list_mutex);
         prelude_list_add_tail(&message_queue, &queue->list);
         gl_lock_unlock(queue_list_mutex);
@@ -516,29 +1086,112 @@ void idmef_message_scheduler_queue_destroy(idmef_queue_t *queue)
 extern prelude_client_t *manager_client;
 
 
-static int flush_failover(prelude_failover_t *failover, const char *name)
+static idmef_queue_t *recovery_queue_new(bufpool_t *pool, const char *filename)
+{
+        idmef_queue_t *queue;
+
+        queue = calloc(1, sizeof(*queue));
+        if ( ! queue ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return NULL;
+        }
+
+        if ( filename ) {
+                queue->recovery_filename = strdup(filename);
+                if ( ! queue->recovery_filename ) {
+                        prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                        free(queue);
+                        return NULL;
+                }
+        }
+
+        queue->low = pool;
+        queue->state = QUEUE_STATE_RECOVERY;
+
+        recovery_queue_count++;
+
+        gl_lock_lock(queue_list_mutex);
+        prelude_list_add_tail(&message_queue, &queue->list);
+        gl_lock_unlock(queue_list_mutex);
+
+        return queue;
+}
+
+
+
+static int journal_replay_cb(prelude_msg_t *msg, void *data)
 {
         int ret;
-        prelude_msg_t *msg;
-        unsigned long available;
+        bufpool_t **pool = data;
+        char buf[PATH_MAX], bdir[PATH_MAX];
 
-        available = prelude_failover_get_available_msg_count(failover);
+        if ( ! *pool ) {
+                prelude_client_profile_get_backup_dirname(prelude_client_get_profile(manager_client), bdir, sizeof(bdir));
+                snprintf(buf, sizeof(buf), "%s/journal-buffer.%" PRELUDE_PRIu64, bdir, get_unique_id());
 
-        if ( available == 0 )
-                return 0;
+                ret = bufpool_new(pool, buf);
+                if ( ret < 0 ) {
+                        prelude_msg_destroy(msg);
+                        return ret;
+                }
+        }
 
-        prelude_log(PRELUDE_LOG_INFO, "%s: flushing %lu buffered messages from a previous run.\n",
-                    name, available);
+        recovery_total++;
+        return bufpool_add_message(*pool, msg);
+}
 
-        do {
-                ret = prelude_failover_get_saved_msg(failover, &msg);
-                if ( ret <= 0 )
-                        break;
 
-                process_message(msg);
-        } while ( 1 );
 
-        return ret;
+/*
+ * Recovered failovers are not part of the journal, and are kept for the
+ * next run if they are not completly processed: they are renamed with the
+ * RECOVERY_BUFFER_PREFIX, so that they are always recovered, even when a
+ * journal is.
+ */
+static prelude_bool_t is_recovery_buffer(const char *name)
+{
+        return strncmp(name, RECOVERY_BUFFER_PREFIX, sizeof(RECOVERY_BUFFER_PREFIX) - 1) == 0;
+}
+
+
+
+static int recover_failover(const char *bdir, const char *name)
+{
+        int ret;
+        bufpool_t *pool;
+        unsigned long count;
+        char filename[PATH_MAX], oldname[PATH_MAX];
+
+        if ( is_recovery_buffer(name) )
+                snprintf(filename, sizeof(filename), "%s/%s", bdir, name);
+        else {
+                snprintf(oldname, sizeof(oldname), "%s/%s", bdir, name);
+                snprintf(filename, sizeof(filename), "%s/" RECOVERY_BUFFER_PREFIX "%" PRELUDE_PRIu64, bdir, get_unique_id());
+
+                ret = rename(oldname, filename);
+                if ( ret < 0 )
+                        return prelude_error_from_errno(errno);
+        }
+
+        ret = bufpool_new_from_failover(&pool, filename);
+        if ( ret < 0 )
+                return ret;
+
+        count = bufpool_get_message_count(pool);
+        if ( count == 0 ) {
+                bufpool_destroy(pool);
+                return failover_unlink(filename);
+        }
+
+        if ( ! recovery_queue_new(pool, filename) ) {
+                bufpool_destroy(pool);
+                return -1;
+        }
+
+        prelude_log(PRELUDE_LOG_INFO, "%s: %lu buffered messages from a previous run queued for recovery.\n", name, count);
+        recovery_total += count;
+
+        return 0;
 }
 
 
@@ -566,20 +1219,21 @@ static int failover_unlink(const char *dirname)
 
 
 
-int idmef_message_scheduler_init(void)
+/*
+ * Return the list of buffers left in dirname by a previous run.
+ */
+static int get_leftover_buffers(const char *dirname, char ***out, size_t *count)
 {
-        int ret;
         DIR *dir;
+        char **tbl;
         struct dirent *de;
-        char bdir[PATH_MAX];
-        char filename[PATH_MAX];
-        prelude_failover_t *failover;
 
-        prelude_client_profile_get_backup_dirname(prelude_client_get_profile(manager_client), bdir, sizeof(bdir));
+        *out = NULL;
+        *count = 0;
 
-        dir = opendir(bdir);
+        dir = opendir(dirname);
         if ( ! dir ) {
-                prelude_log(PRELUDE_LOG_ERR, "error opening directory '%s': %s.\n", bdir, strerror(errno));
+                prelude_log(PRELUDE_LOG_ERR, "error opening directory '%s': %s.\n", dirname, strerror(errno));
                 return -1;
         }
 
@@ -587,22 +1241,94 @@ int idmef_message_scheduler_init(void)
                 if ( ! strstr(de->d_name, "buffer") )
                         continue;
 
-                snprintf(filename, sizeof(filename), "%s/%s", bdir, de->d_name);
+                tbl = realloc(*out, (*count + 1) * sizeof(*tbl));
+                if ( ! tbl )
+                        break;
 
-                ret = prelude_failover_new(&failover, filename);
-                if ( ret < 0 )
-                        return ret;
+                *out = tbl;
 
-                flush_failover(failover, de->d_name);
-                prelude_failover_destroy(failover);
+                tbl[*count] = strdup(de->d_name);
+                if ( ! tbl[*count] )
+                        break;
 
-                ret = failover_unlink(filename);
-                if ( ret < 0 )
-                        prelude_log(PRELUDE_LOG_ERR, "couldn't remove failover '%s': %s.\n", filename, prelude_strerror(ret));
+                (*count)++;
         }
 
         closedir(dir);
 
+        return 0;
+}
+
+
+
+int idmef_message_scheduler_init(void)
+{
+        int ret;
+        size_t i, count;
+        char **buffers;
+        char bdir[PATH_MAX];
+        char filename[PATH_MAX];
+        idmef_queue_t *queue;
+        bufpool_t *journal_pool = NULL;
+        prelude_bool_t journal_recovered;
+
+        prelude_client_profile_get_backup_dirname(prelude_client_get_profile(manager_client), bdir, sizeof(bdir));
+
+        /*
+         * The list of leftover buffers is retrieved first, so that the
+         * buffer used for the journal recovery is not part of it.
+         */
+        ret = get_leftover_buffers(bdir, &buffers, &count);
+        if ( ret < 0 )
+                return ret;
+
+        ret = journal_init(bdir);
+        if ( ret < 0 )
+                return ret;
+
+        /*
+         * Every message that reached a queue buffer was first written to
+         * the journal: if a journal was recovered, these buffers content is
+         * already queued for recovery and is only removed. Recovered
+         * failovers left by the previous run were never journaled.
+         */
+        ret = journal_recover(bdir, journal_replay_cb, &journal_pool);
+        if ( ret < 0 )
+                return ret;
+
+        journal_recovered = (ret > 0) ? TRUE : FALSE;
+
+        if ( ! journal_pool )
+                journal_release_recovered();
+
+        else {
+                queue = recovery_queue_new(journal_pool, NULL);
+                if ( ! queue )
+                        bufpool_destroy(journal_pool);
+                else
+                        queue->state |= QUEUE_STATE_JOURNAL;
+        }
+
+        for ( i = 0; i < count; i++ ) {
+                snprintf(filename, sizeof(filename), "%s/%s", bdir, buffers[i]);
+
+                if ( ! journal_recovered || is_recovery_buffer(buffers[i]) )
+                        ret = recover_failover(bdir, buffers[i]);
+                else
+                        ret = failover_unlink(filename);
+
+                if ( ret < 0 )
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't recover failover '%s': %s.\n", filename, prelude_strerror(ret));
+
+                free(buffers[i]);
+        }
+
+        free(buffers);
+
+        if ( recovery_queue_count )
+                prelude_log(PRELUDE_LOG_INFO, "recovery: %" PRELUDE_PRIu64 " messages from a previous run will be processed in the background.\n",
+                            recovery_total);
+
         ret = glthread_create(&thread, &message_reader, NULL);
         if ( ret < 0 )
                 prelude_log(PRELUDE_LOG_ERR, "couldn't create message processing thread.\n");
@@ -612,7 +1338,6 @@ int idmef_message_scheduler_init(void)
 
 
 
-
 void idmef_message_scheduler_exit(void)
 {
         idmef_queue_t *queue;
@@ -625,7 +1350,11 @@ void idmef_message_scheduler_exit(void)
 
         gl_lock_unlock(input_mutex);
 
-        prelude_log(PRELUDE_LOG_INFO, "Waiting queued message to be processed.\n");
+        if ( fast_stop )
+                prelude_log(PRELUDE_LOG_INFO, "Waiting for the message being processed.\n");
+        else
+                prelude_log(PRELUDE_LOG_INFO, "Waiting queued message to be processed.\n");
+
         gl_thread_join(thread, NULL);
 
         gl_cond_destroy(input_cond);
@@ -633,35 +1362,72 @@ void idmef_message_scheduler_exit(void)
 
         prelude_list_for_each_safe(&message_queue, tmp, bkp) {
                 queue = prelude_list_entry(tmp, idmef_queue_t, list);
+
+                if ( fast_stop || queue->state & QUEUE_STATE_RECOVERY )
+                        queue_persist(queue);
+
                 queue_destroy(queue);
         }
+
+        if ( persisted_count )
+                prelude_log(PRELUDE_LOG_INFO, "%" PRELUDE_PRIu64 " queued messages stored for the next run.\n", persisted_count);
+
+        journal_exit();
 }
 
 
 
 
-void idmef_message_process(idmef_message_t *idmef)
+/*
+ * share, when not NULL, hold the subtrees of idmef shared with previous
+ * messages, attached once decode plugins have run.
+ */
+static int process_idmef(report_graph_t *graph, idmef_message_t *idmef, idmef_projection_share_t *share)
 {
         int ret = 0;
+        path_memo_t *memo;
+        filter_graph_t *filters;
         prelude_bool_t relay_filter_available = 0;
 
-        gl_lock_lock(process_mutex);
+        filters = report_plugins_get_filters(graph);
 
         /*
          * run normalization plugin.
          */
         decode_plugins_run(0, NULL, idmef);
 
+        if ( share )
+                idmef_projection_share(idmef, share);
+
+        /*
+         * The message is not modified anymore, path values can be shared.
+         */
+        memo = path_memo_begin(idmef);
+
         /*
          * run simple reporting plugin.
          */
-        report_plugins_run(idmef);
+        report_plugins_run(graph, idmef);
 
-        relay_filter_available = filter_plugins_available(MANAGER_FILTER_CATEGORY_REVERSE_RELAYING);
+        relay_filter_available = filter_plugins_available(filters, MANAGER_FILTER_CATEGORY_REVERSE_RELAYING);
         if ( relay_filter_available )
-                ret = filter_plugins_run_by_category(idmef, MANAGER_FILTER_CATEGORY_REVERSE_RELAYING);
+                ret = filter_plugins_run_by_category(filters, idmef, MANAGER_FILTER_CATEGORY_REVERSE_RELAYING);
 
-        gl_lock_unlock(process_mutex);
+        path_memo_end(memo);
+
+        return ret;
+}
+
+
+
+void idmef_message_process(idmef_message_t *idmef)
+{
+        int ret;
+        unsigned int rcu;
+
+        rcu = enter_processing();
+        ret = process_idmef(report_plugins_get_graph(), idmef, NULL);
+        rcu_read_unlock(rcu);
 
         if ( ret == 0 )
                 reverse_relay_send_receiver(idmef);
@@ -669,9 +1435,14 @@ void idmef_message_process(idmef_message_t *idmef)
 
 
 
+/*
+ * Wait for the message being processed, and prevent further processing
+ * until idmef_message_scheduler_start_processing() is called.
+ */
 void idmef_message_scheduler_stop_processing(void)
 {
         gl_lock_lock(process_mutex);
+        rcu_synchronize();
 }
 
 
@@ -690,3 +1461,59 @@ void idmef_message_scheduler_set_priority(unsigned int high, unsigned int medium
         sched_process_low = low;
         sched_process = high + medium + low;
 }
+
+
+
+void idmef_message_scheduler_set_memory_limit(sched_priority_t priority, size_t limit)
+{
+        sched_memory_limit[priority] = limit;
+}
+
+
+
+void idmef_message_scheduler_set_disk_limit(sched_priority_t priority, size_t limit)
+{
+        sched_disk_limit[priority] = limit;
+}
+
+
+
+void idmef_message_scheduler_set_fast_stop(prelude_bool_t enabled)
+{
+        fast_stop = enabled;
+}
+
+
+
+void idmef_message_scheduler_set_intern_cache_size(size_t size)
+{
+        intern_cache_size = size;
+}
+
+
+
+void idmef_message_scheduler_set_recovery_rate(unsigned int rate)
+{
+        recovery_rate = rate;
+}
+
+
+
+void idmef_message_scheduler_set_drop_policy(sched_priority_t priority, sched_drop_policy_t policy)
+{
+        prelude_list_t *tmp;
+        idmef_queue_t *queue;
+
+        sched_drop_policy[priority] = policy;
+
+        gl_lock_lock(queue_list_mutex);
+
+        prelude_list_for_each(&message_queue, tmp) {
+                queue = prelude_list_entry(tmp, idmef_queue_t, list);
+
+                if ( ! (queue->state & QUEUE_STATE_RECOVERY) )
+                        set_disk_filter(queue, priority);
+        }
+
+        gl_lock_unlock(queue_list_mutex);
+}
@@ -0,0 +1,1004 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+#include <libprelude/idmef-message-id.h>
+#include <libprelude/idmef-message-read.h>
+
+#include "glthread/lock.h"
+#include "prelude-manager.h"
+#include "report-plugins.h"
+#include "pmsg-to-idmef.h"
+#include "pmsg-index.h"
+#include "intern-cache.h"
+#include "idmef-projection.h"
+
+
+/*
+ * Plugin instances declare the IDMEF paths they use, so that subtrees
+ * nobody use are not decoded. Instances that did not declare anything
+ * are assumed to use the whole message.
+ *
+ * Only additional_data is currently skipped: it is the one subtree
+ * carrying large payloads, and it can be skipped with only knowledge
+ * of the few classes it might contain.
+ */
+typedef struct {
+        prelude_list_t list;
+        prelude_plugin_instance_t *pi;
+        prelude_bool_t need_additional_data;
+} declaration_t;
+
+
+/*
+ * Messages decoded without additional_data, from which a full message
+ * can be decoded on demand.
+ */
+typedef struct {
+        prelude_list_t list;
+        idmef_message_t *idmef;
+        idmef_message_t *full;
+        prelude_msg_t *msg;
+} projection_t;
+
+
+/*
+ * Additional data meanings decoded even when additional_data is
+ * otherwise skipped, registered at plugin initialization.
+ */
+#define KEPT_MEANING_MAX 8
+
+static size_t kept_meaning_count = 0;
+static const char *kept_meaning[KEPT_MEANING_MAX];
+
+typedef struct {
+        const char *meaning;
+        prelude_bool_t (*cond)(idmef_message_t *idmef);
+} relay_stamp_t;
+
+static size_t relay_stamp_count = 0;
+static relay_stamp_t relay_stamp[KEPT_MEANING_MAX];
+
+static PRELUDE_LIST(declaration_list);
+
+static PRELUDE_LIST(projection_list);
+static gl_lock_t projection_mutex = gl_lock_initializer;
+
+
+
+static declaration_t *get_declaration(prelude_plugin_instance_t *pi)
+{
+        prelude_list_t *tmp;
+        declaration_t *decl;
+
+        prelude_list_for_each(&declaration_list, tmp) {
+                decl = prelude_list_entry(tmp, declaration_t, list);
+                if ( decl->pi == pi )
+                        return decl;
+        }
+
+        return NULL;
+}
+
+
+
+static prelude_bool_t is_additional_data_path(const char *path)
+{
+        if ( strncmp(path, "alert.", 6) == 0 )
+                path += 6;
+
+        else if ( strncmp(path, "heartbeat.", 10) == 0 )
+                path += 10;
+
+        else
+                return TRUE;
+
+        return (strncmp(path, "additional_data", 15) == 0) ? TRUE : FALSE;
+}
+
+
+
+/*
+ * The instance use none of the message content, until paths are added
+ * through manager_idmef_require_path().
+ */
+int manager_idmef_require_none(prelude_plugin_instance_t *pi)
+{
+        declaration_t *decl;
+
+        decl = get_declaration(pi);
+        if ( ! decl ) {
+                decl = malloc(sizeof(*decl));
+                if ( ! decl )
+                        return prelude_error_from_errno(errno);
+
+                decl->pi = pi;
+                prelude_list_add_tail(&declaration_list, &decl->list);
+        }
+
+        decl->need_additional_data = FALSE;
+        report_plugins_update_graph();
+
+        return 0;
+}
+
+
+
+int manager_idmef_require_path(prelude_plugin_instance_t *pi, const char *path)
+{
+        int ret;
+        declaration_t *decl;
+
+        decl = get_declaration(pi);
+        if ( ! decl ) {
+                ret = manager_idmef_require_none(pi);
+                if ( ret < 0 )
+                        return ret;
+
+                decl = get_declaration(pi);
+        }
+
+        if ( decl->need_additional_data || ! is_additional_data_path(path) )
+                return 0;
+
+        decl->need_additional_data = TRUE;
+        report_plugins_update_graph();
+
+        return 0;
+}
+
+
+
+/*
+ * Drop the instance declaration: it is assumed to use the whole message.
+ */
+void manager_idmef_require_all(prelude_plugin_instance_t *pi)
+{
+        declaration_t *decl;
+
+        decl = get_declaration(pi);
+        if ( ! decl )
+                return;
+
+        prelude_list_del(&decl->list);
+        free(decl);
+
+        report_plugins_update_graph();
+}
+
+
+
+prelude_bool_t idmef_projection_need_additional_data(prelude_plugin_instance_t *pi)
+{
+        declaration_t *decl;
+
+        decl = get_declaration(pi);
+        if ( ! decl )
+                return TRUE;
+
+        return decl->need_additional_data;
+}
+
+
+
+static prelude_bool_t is_class_tag(uint8_t tag)
+{
+        return tag == IDMEF_MSG_ANALYZER_TAG || tag == IDMEF_MSG_NODE_TAG ||
+               tag == IDMEF_MSG_ADDRESS_TAG || tag == IDMEF_MSG_PROCESS_TAG ||
+               tag == IDMEF_MSG_CLASSIFICATION_TAG || tag == IDMEF_MSG_REFERENCE_TAG ||
+               tag == IDMEF_MSG_ADDITIONAL_DATA_TAG;
+}
+
+
+
+/*
+ * Returns the index following the subtree starting at i, which should
+ * only contain the classes known to is_class_tag(), or 0 if the subtree
+ * is not terminated.
+ */
+static size_t get_subtree_end(pmsg_index_t *index, size_t i)
+{
+        unsigned int depth = 0;
+
+        for ( ; i < index->count; i++ ) {
+                if ( is_class_tag(index->tlv[i].tag) )
+                        depth++;
+
+                else if ( index->tlv[i].tag == IDMEF_MSG_END_OF_TAG && --depth == 0 )
+                        return i + 1;
+        }
+
+        return 0;
+}
+
+
+
+static void mark_subtree(pmsg_index_t *index, size_t start, size_t end)
+{
+        for ( ; start < end; start++ )
+                index->tlv[start].mark = 1;
+}
+
+
+
+/*
+ * Raw bytes of the TLVs from start to end, TLVs being contiguous.
+ */
+static const unsigned char *get_subtree_data(pmsg_index_t *index, size_t start, size_t end, size_t *len)
+{
+        const unsigned char *data = index->tlv[start].value - sizeof(uint8_t) - sizeof(uint32_t);
+
+        *len = (index->tlv[end - 1].value + index->tlv[end - 1].len) - data;
+
+        return data;
+}
+
+
+
+/*
+ * Copy the TLVs of msg having the given mark into *out.
+ */
+static int copy_marked(prelude_msg_t *msg, pmsg_index_t *index, uint8_t mark, prelude_msg_t **out)
+{
+        int ret;
+        size_t i, count = 0, kept = 0;
+
+        for ( i = 0; i < index->count; i++ ) {
+                if ( index->tlv[i].mark != mark )
+                        continue;
+
+                count++;
+                kept += index->tlv[i].len;
+        }
+
+        ret = prelude_msg_new(out, count, kept, prelude_msg_get_tag(msg), prelude_msg_get_priority(msg));
+        if ( ret < 0 )
+                return ret;
+
+        for ( i = 0; i < index->count; i++ ) {
+                if ( index->tlv[i].mark == mark )
+                        prelude_msg_set(*out, index->tlv[i].tag, index->tlv[i].len, index->tlv[i].value);
+        }
+
+        prelude_msg_mark_end(*out);
+
+        return 0;
+}
+
+
+
+typedef struct {
+        size_t count;
+        idmef_analyzer_t *analyzer[1];
+} analyzer_chain_t;
+
+
+static void analyzer_chain_destroy(void *data)
+{
+        size_t i;
+        analyzer_chain_t *chain = data;
+
+        for ( i = 0; i < chain->count; i++ )
+                idmef_analyzer_destroy(chain->analyzer[i]);
+
+        free(chain);
+}
+
+
+static void classification_destroy(void *data)
+{
+        idmef_classification_destroy(data);
+}
+
+
+
+/*
+ * Sensor analyzers of a decoded message, the first analyzer being ours.
+ */
+static idmef_analyzer_t *get_next_analyzer(idmef_message_t *idmef, idmef_analyzer_t *cur)
+{
+        if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT )
+                return idmef_alert_get_next_analyzer(idmef_message_get_alert(idmef), cur);
+
+        return idmef_heartbeat_get_next_analyzer(idmef_message_get_heartbeat(idmef), cur);
+}
+
+
+
+static void add_analyzer(idmef_message_t *idmef, idmef_analyzer_t *analyzer)
+{
+        if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT )
+                idmef_alert_set_analyzer(idmef_message_get_alert(idmef), idmef_analyzer_ref(analyzer), IDMEF_LIST_APPEND);
+        else
+                idmef_heartbeat_set_analyzer(idmef_message_get_heartbeat(idmef), idmef_analyzer_ref(analyzer), IDMEF_LIST_APPEND);
+}
+
+
+
+static void intern_analyzer_chain(intern_cache_t *cache, idmef_message_t *idmef, const unsigned char *key, size_t len)
+{
+        int ret;
+        size_t count = 0;
+        analyzer_chain_t *chain;
+        idmef_analyzer_t *analyzer, *first;
+
+        first = get_next_analyzer(idmef, NULL);
+        if ( ! first )
+                return;
+
+        for ( analyzer = get_next_analyzer(idmef, first); analyzer; analyzer = get_next_analyzer(idmef, analyzer) )
+                count++;
+
+        if ( count == 0 )
+                return;
+
+        chain = malloc(sizeof(*chain) + (count - 1) * sizeof(*chain->analyzer));
+        if ( ! chain )
+                return;
+
+        /*
+         * Decoded objects reference the message buffer, the cache hold
+         * copies.
+         */
+        chain->count = 0;
+        for ( analyzer = get_next_analyzer(idmef, first); analyzer; analyzer = get_next_analyzer(idmef, analyzer) ) {
+                ret = idmef_analyzer_clone(analyzer, &chain->analyzer[chain->count]);
+                if ( ret < 0 ) {
+                        analyzer_chain_destroy(chain);
+                        return;
+                }
+
+                chain->count++;
+        }
+
+        intern_cache_set(cache, IDMEF_MSG_ANALYZER_TAG, key, len, chain, analyzer_chain_destroy);
+}
+
+
+
+static void intern_classification(intern_cache_t *cache, idmef_message_t *idmef, const unsigned char *key, size_t len)
+{
+        int ret;
+        idmef_classification_t *classification, *copy;
+
+        if ( idmef_message_get_type(idmef) != IDMEF_MESSAGE_TYPE_ALERT )
+                return;
+
+        classification = idmef_alert_get_classification(idmef_message_get_alert(idmef));
+        if ( ! classification )
+                return;
+
+        ret = idmef_classification_clone(classification, &copy);
+        if ( ret < 0 )
+                return;
+
+        intern_cache_set(cache, IDMEF_MSG_CLASSIFICATION_TAG, key, len, copy, classification_destroy);
+}
+
+
+
+int manager_idmef_keep_additional_data(const char *meaning)
+{
+        if ( kept_meaning_count == KEPT_MEANING_MAX )
+                return -1;
+
+        kept_meaning[kept_meaning_count++] = meaning;
+
+        return 0;
+}
+
+
+
+int manager_idmef_add_relay_stamp(const char *meaning, prelude_bool_t (*cond)(idmef_message_t *idmef))
+{
+        int ret;
+
+        if ( relay_stamp_count == KEPT_MEANING_MAX )
+                return -1;
+
+        ret = manager_idmef_keep_additional_data(meaning);
+        if ( ret < 0 )
+                return ret;
+
+        relay_stamp[relay_stamp_count].meaning = meaning;
+        relay_stamp[relay_stamp_count].cond = cond;
+        relay_stamp_count++;
+
+        return 0;
+}
+
+
+
+static idmef_additional_data_t *get_next_additional_data(idmef_message_t *idmef, idmef_additional_data_t *ad)
+{
+        if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT )
+                return idmef_alert_get_next_additional_data(idmef_message_get_alert(idmef), ad);
+
+        return idmef_heartbeat_get_next_additional_data(idmef_message_get_heartbeat(idmef), ad);
+}
+
+
+
+static prelude_bool_t has_stamp(idmef_message_t *idmef, const char *stamp)
+{
+        prelude_string_t *meaning;
+        idmef_additional_data_t *ad = NULL;
+
+        while ( (ad = get_next_additional_data(idmef, ad)) ) {
+                meaning = idmef_additional_data_get_meaning(ad);
+                if ( meaning && strcmp(prelude_string_get_string_or_default(meaning, ""), stamp) == 0 )
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+
+
+static int add_stamp(idmef_message_t *idmef, const char *stamp, idmef_additional_data_t **ad)
+{
+        int ret;
+        prelude_string_t *meaning;
+
+        if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT )
+                ret = idmef_alert_new_additional_data(idmef_message_get_alert(idmef), ad, IDMEF_LIST_APPEND);
+        else
+                ret = idmef_heartbeat_new_additional_data(idmef_message_get_heartbeat(idmef), ad, IDMEF_LIST_APPEND);
+
+        if ( ret < 0 )
+                return ret;
+
+        ret = idmef_additional_data_new_meaning(*ad, &meaning);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_string_set_constant(meaning, stamp);
+        if ( ret < 0 )
+                return ret;
+
+        return idmef_additional_data_set_boolean(*ad, TRUE);
+}
+
+
+
+/*
+ * The message might be shared with other report plugins: the stamps it
+ * does not already carry are only added for the time of the write.
+ */
+int manager_idmef_message_write_relayed(idmef_message_t *idmef, prelude_msgbuf_t *msgbuf)
+{
+        int ret = 0;
+        size_t i, count = 0;
+        idmef_message_type_t type = idmef_message_get_type(idmef);
+        idmef_additional_data_t *added[KEPT_MEANING_MAX];
+
+        for ( i = 0; i < relay_stamp_count; i++ ) {
+                if ( type != IDMEF_MESSAGE_TYPE_ALERT && type != IDMEF_MESSAGE_TYPE_HEARTBEAT )
+                        break;
+
+                if ( relay_stamp[i].cond && ! relay_stamp[i].cond(idmef) )
+                        continue;
+
+                if ( has_stamp(idmef, relay_stamp[i].meaning) )
+                        continue;
+
+                added[count] = NULL;
+
+                ret = add_stamp(idmef, relay_stamp[i].meaning, &added[count]);
+                if ( added[count] )
+                        count++;
+
+                if ( ret < 0 )
+                        break;
+        }
+
+        if ( ret >= 0 ) {
+                ret = idmef_message_write(idmef, msgbuf);
+                prelude_msgbuf_mark_end(msgbuf);
+        }
+
+        for ( i = 0; i < count; i++ )
+                idmef_additional_data_destroy(added[i]);
+
+        return ret;
+}
+
+
+
+/*
+ * Whether the additional_data subtree from start to end has one of the
+ * kept meanings. String values include their terminating nul byte.
+ */
+static prelude_bool_t is_kept_additional_data(pmsg_index_t *index, size_t start, size_t end)
+{
+        size_t i, j;
+
+        for ( i = start + 1; i < end && kept_meaning_count; i++ ) {
+                if ( index->tlv[i].tag != IDMEF_MSG_ADDITIONAL_DATA_MEANING || index->tlv[i].len == 0 )
+                        continue;
+
+                for ( j = 0; j < kept_meaning_count; j++ ) {
+                        if ( strlen(kept_meaning[j]) == index->tlv[i].len - 1 &&
+                             memcmp(kept_meaning[j], index->tlv[i].value, index->tlv[i].len - 1) == 0 )
+                                return TRUE;
+                }
+        }
+
+        return FALSE;
+}
+
+
+
+/*
+ * Subtrees of the message that are either dropped, or shared with
+ * previous messages of the same sensor.
+ */
+typedef struct {
+        prelude_bool_t dropped_additional_data;
+
+        size_t analyzer_start, analyzer_end;
+        analyzer_chain_t *chain;
+
+        size_t classification_start, classification_end;
+        idmef_classification_t *classification;
+} projection_plan_t;
+
+
+
+static void plan_projection(projection_plan_t *plan, pmsg_index_t *index,
+                            prelude_bool_t skip_additional_data, intern_cache_t *cache)
+{
+        size_t i, end, len;
+        const unsigned char *data;
+        prelude_bool_t split = FALSE;
+
+        memset(plan, 0, sizeof(*plan));
+
+        for ( i = 0; i < index->count; ) {
+                if ( index->tlv[i].tag == IDMEF_MSG_ADDITIONAL_DATA_TAG && skip_additional_data ) {
+                        end = get_subtree_end(index, i);
+                        if ( ! end )
+                                break;
+
+                        if ( ! is_kept_additional_data(index, i, end) ) {
+                                mark_subtree(index, i, end);
+                                plan->dropped_additional_data = TRUE;
+                        }
+                }
+
+                else if ( index->tlv[i].tag == IDMEF_MSG_ANALYZER_TAG && cache ) {
+                        end = get_subtree_end(index, i);
+                        if ( ! end )
+                                break;
+
+                        /*
+                         * Only a contiguous analyzer chain is shared.
+                         */
+                        if ( ! plan->analyzer_end && ! split ) {
+                                plan->analyzer_start = i;
+                                plan->analyzer_end = end;
+                        }
+
+                        else if ( plan->analyzer_end == i )
+                                plan->analyzer_end = end;
+
+                        else {
+                                plan->analyzer_end = 0;
+                                split = TRUE;
+                        }
+                }
+
+                else if ( index->tlv[i].tag == IDMEF_MSG_CLASSIFICATION_TAG && cache ) {
+                        end = get_subtree_end(index, i);
+                        if ( ! end )
+                                break;
+
+                        plan->classification_start = i;
+                        plan->classification_end = end;
+                }
+
+                else {
+                        i++;
+                        continue;
+                }
+
+                i = end;
+        }
+
+        if ( plan->analyzer_end ) {
+                data = get_subtree_data(index, plan->analyzer_start, plan->analyzer_end, &len);
+
+                plan->chain = intern_cache_get(cache, IDMEF_MSG_ANALYZER_TAG, data, len);
+                if ( plan->chain )
+                        mark_subtree(index, plan->analyzer_start, plan->analyzer_end);
+        }
+
+        if ( plan->classification_end ) {
+                data = get_subtree_data(index, plan->classification_start, plan->classification_end, &len);
+
+                plan->classification = intern_cache_get(cache, IDMEF_MSG_CLASSIFICATION_TAG, data, len);
+                if ( plan->classification )
+                        mark_subtree(index, plan->classification_start, plan->classification_end);
+        }
+}
+
+
+
+/*
+ * Record the shared subtrees, and the keys of the ones to be interned,
+ * for idmef_projection_share(). Keys point within the original message.
+ */
+static void plan_share(projection_plan_t *plan, pmsg_index_t *index, idmef_projection_share_t *share)
+{
+        if ( plan->chain )
+                share->chain = plan->chain;
+
+        else if ( plan->analyzer_end )
+                share->analyzer_key = get_subtree_data(index, plan->analyzer_start, plan->analyzer_end, &share->analyzer_len);
+
+        if ( plan->classification )
+                share->classification = plan->classification;
+
+        else if ( plan->classification_end )
+                share->classification_key = get_subtree_data(index, plan->classification_start,
+                                                             plan->classification_end, &share->classification_len);
+}
+
+
+
+/*
+ * Attach the shared subtrees to idmef, or intern its own, once decode
+ * plugins have run: the cache hold the subtrees as modified by decode
+ * plugins, and decode plugins never modify shared objects.
+ */
+void idmef_projection_share(idmef_message_t *idmef, idmef_projection_share_t *share)
+{
+        size_t i;
+        analyzer_chain_t *chain = share->chain;
+
+        if ( chain ) {
+                for ( i = 0; i < chain->count; i++ )
+                        add_analyzer(idmef, chain->analyzer[i]);
+        }
+
+        else if ( share->analyzer_key )
+                intern_analyzer_chain(share->cache, idmef, share->analyzer_key, share->analyzer_len);
+
+        if ( share->classification )
+                idmef_alert_set_classification(idmef_message_get_alert(idmef), idmef_classification_ref(share->classification));
+
+        else if ( share->classification_key )
+                intern_classification(share->cache, idmef, share->classification_key, share->classification_len);
+
+        if ( share->msg )
+                prelude_msg_destroy(share->msg);
+
+        memset(share, 0, sizeof(*share));
+}
+
+
+
+static int register_projection(idmef_message_t *idmef, prelude_msg_t *msg)
+{
+        projection_t *proj;
+
+        proj = malloc(sizeof(*proj));
+        if ( ! proj )
+                return prelude_error_from_errno(errno);
+
+        proj->idmef = idmef;
+        proj->full = NULL;
+        proj->msg = msg;
+
+        gl_lock_lock(projection_mutex);
+        prelude_list_add_tail(&projection_list, &proj->list);
+        gl_lock_unlock(projection_mutex);
+
+        return 0;
+}
+
+
+
+/*
+ * Decode msg into *idmef, which take ownership of msg on success. The
+ * returned message should be released with idmef_projection_release().
+ *
+ * With a cache, the sensor analyzer chain and the classification are
+ * shared with the previous messages carrying the exact same subtrees:
+ * on success, idmef_projection_share() should be called with share once
+ * decode plugins have run. Shared subtrees are missing from the message
+ * until then.
+ */
+int idmef_projection_decode(idmef_message_t **idmef, prelude_msg_t *msg,
+                            prelude_bool_t skip_additional_data, intern_cache_t *cache,
+                            idmef_projection_share_t *share)
+{
+        int ret;
+        pmsg_index_t index;
+        projection_plan_t plan;
+        prelude_msg_t *trimmed;
+
+        memset(share, 0, sizeof(*share));
+        share->cache = cache;
+
+        if ( ! skip_additional_data && ! cache )
+                goto decode;
+
+        ret = pmsg_index_build_from_msg(&index, msg);
+        if ( ret < 0 )
+                goto decode;
+
+        plan_projection(&plan, &index, skip_additional_data, cache);
+
+        if ( ! plan.dropped_additional_data && ! plan.chain && ! plan.classification ) {
+                ret = pmsg_to_idmef(idmef, msg);
+                if ( ret == 0 ) {
+                        idmef_message_set_pmsg(*idmef, msg);
+                        plan_share(&plan, &index, share);
+                }
+
+                pmsg_index_destroy(&index);
+                return ret;
+        }
+
+        ret = copy_marked(msg, &index, 0, &trimmed);
+        if ( ret < 0 ) {
+                pmsg_index_destroy(&index);
+                return ret;
+        }
+
+        ret = pmsg_to_idmef_from_copy(idmef, trimmed, msg);
+        if ( ret < 0 ) {
+                prelude_msg_destroy(trimmed);
+                pmsg_index_destroy(&index);
+                return ret;
+        }
+
+        /*
+         * The decoded message reference the trimmed copy.
+         */
+        idmef_message_set_pmsg(*idmef, trimmed);
+        plan_share(&plan, &index, share);
+        pmsg_index_destroy(&index);
+
+        /*
+         * Only a message missing additional_data is incomplete, the
+         * original is then kept for a full decode. Otherwise, it is
+         * kept until the keys it hold are interned.
+         */
+        if ( ! plan.dropped_additional_data ) {
+                share->msg = msg;
+                return 0;
+        }
+
+        ret = register_projection(*idmef, msg);
+        if ( ret < 0 ) {
+                memset(share, 0, sizeof(*share));
+                idmef_message_destroy(*idmef);
+                return ret;
+        }
+
+        return 0;
+
+ decode:
+        ret = pmsg_to_idmef(idmef, msg);
+        if ( ret < 0 )
+                return ret;
+
+        idmef_message_set_pmsg(*idmef, msg);
+
+        return 0;
+}
+
+
+
+static projection_t *get_projection(idmef_message_t *idmef)
+{
+        prelude_list_t *tmp;
+        projection_t *proj;
+
+        prelude_list_for_each(&projection_list, tmp) {
+                proj = prelude_list_entry(tmp, projection_t, list);
+                if ( proj->idmef == idmef )
+                        return proj;
+        }
+
+        return NULL;
+}
+
+
+
+void idmef_projection_release(idmef_message_t *idmef)
+{
+        projection_t *proj;
+
+        gl_lock_lock(projection_mutex);
+
+        proj = get_projection(idmef);
+        if ( proj )
+                prelude_list_del(&proj->list);
+
+        gl_lock_unlock(projection_mutex);
+
+        idmef_message_destroy(idmef);
+
+        if ( ! proj )
+                return;
+
+        if ( proj->full )
+                idmef_message_destroy(proj->full);
+        else
+                prelude_msg_destroy(proj->msg);
+
+        free(proj);
+}
+
+
+
+static int new_additional_data(idmef_message_t *idmef, idmef_additional_data_t **ad, int pos)
+{
+        if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT )
+                return idmef_alert_new_additional_data(idmef_message_get_alert(idmef), ad, pos);
+
+        return idmef_heartbeat_new_additional_data(idmef_message_get_heartbeat(idmef), ad, pos);
+}
+
+
+
+/*
+ * Decode the additional_data skipped from msg into full, inserting each
+ * at its position in the original message. The decoded objects reference
+ * *extra, holding a copy of the skipped subtrees.
+ */
+static int decode_skipped_additional_data(idmef_message_t *full, prelude_msg_t *msg, prelude_msg_t **extra)
+{
+        int ret;
+        void *buf;
+        uint8_t tag;
+        uint32_t len;
+        pmsg_index_t index;
+        idmef_additional_data_t *ad;
+        size_t i, end, *pos, count = 0, nth = 0;
+
+        *extra = NULL;
+
+        ret = pmsg_index_build_from_msg(&index, msg);
+        if ( ret < 0 )
+                return ret;
+
+        pos = malloc(index.count * sizeof(*pos));
+        if ( ! pos ) {
+                pmsg_index_destroy(&index);
+                return prelude_error_from_errno(errno);
+        }
+
+        for ( i = 0; i < index.count; ) {
+                if ( index.tlv[i].tag != IDMEF_MSG_ADDITIONAL_DATA_TAG ) {
+                        i++;
+                        continue;
+                }
+
+                end = get_subtree_end(&index, i);
+                if ( ! end )
+                        break;
+
+                if ( ! is_kept_additional_data(&index, i, end) ) {
+                        mark_subtree(&index, i, end);
+                        pos[count++] = nth;
+                }
+
+                nth++;
+                i = end;
+        }
+
+        ret = copy_marked(msg, &index, 1, extra);
+        pmsg_index_destroy(&index);
+
+        for ( i = 0; i < count && ret == 0; i++ ) {
+                ret = prelude_msg_get(*extra, &tag, &len, &buf);
+                if ( ret < 0 )
+                        break;
+
+                if ( tag != IDMEF_MSG_ADDITIONAL_DATA_TAG ) {
+                        ret = -1;
+                        break;
+                }
+
+                ret = new_additional_data(full, &ad, pos[i]);
+                if ( ret < 0 )
+                        break;
+
+                ret = idmef_additional_data_read(ad, *extra);
+        }
+
+        free(pos);
+
+        return ret;
+}
+
+
+
+/*
+ * Retrieve a reference to the fully decoded version of idmef, for use
+ * by consumers needing the whole message (relaying, failover).
+ *
+ * The full message is built on first use from idmef, so that it carry
+ * the changes made by decode plugins, with the skipped additional_data
+ * decoded from the original message and inserted back in place. Decode
+ * plugins are not run again on it.
+ */
+int manager_idmef_message_get_full(idmef_message_t *idmef, idmef_message_t **full)
+{
+        int ret = 0;
+        projection_t *proj;
+        prelude_msg_t *extra;
+
+        gl_lock_lock(projection_mutex);
+
+        proj = get_projection(idmef);
+        if ( ! proj ) {
+                *full = idmef_message_ref(idmef);
+                goto out;
+        }
+
+        if ( ! proj->full ) {
+                ret = idmef_message_clone(idmef, &proj->full);
+                if ( ret < 0 ) {
+                        proj->full = NULL;
+                        goto out;
+                }
+
+                ret = decode_skipped_additional_data(proj->full, proj->msg, &extra);
+                if ( ret < 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "error decoding skipped additional data.\n");
+
+                        if ( extra )
+                                prelude_msg_destroy(extra);
+
+                        idmef_message_destroy(proj->full);
+                        proj->full = NULL;
+                        goto out;
+                }
+
+                /*
+                 * The full message no longer reference the original.
+                 */
+                idmef_message_set_pmsg(proj->full, extra);
+                prelude_msg_destroy(proj->msg);
+                proj->msg = NULL;
+        }
+
+        *full = idmef_message_ref(proj->full);
+
+ out:
+        gl_lock_unlock(projection_mutex);
+        return ret;
+}
@@ -21,6 +21,8 @@
 *
 *****/
 
+#include "journal.h"
+
 typedef struct bufpool bufpool_t;
 
 
@@ -28,12 +30,34 @@ void bufpool_destroy(bufpool_t *bp);
 
 int bufpool_new(bufpool_t **bp, const char *filename);
 
+int bufpool_new_from_failover(bufpool_t **bp, const char *filename);
+
 size_t bufpool_get_message_count(bufpool_t *bp);
 
-int bufpool_get_message(bufpool_t *bp, prelude_msg_t **msg);
+int bufpool_get_message(bufpool_t *bp, prelude_msg_t **msg, journal_run_t **run);
 
 int bufpool_add_message(bufpool_t *bp, prelude_msg_t *msg);
 
+void bufpool_message_processed(bufpool_t *bp, journal_run_t *run);
+
+int bufpool_persist(bufpool_t *bp);
+
+void bufpool_release_journal(bufpool_t *bp);
+
+const char *bufpool_get_filename(bufpool_t *bp);
+
+void bufpool_set_limits(bufpool_t *bp, size_t mem_limit, size_t disk_limit);
+
+void bufpool_set_disk_filter(bufpool_t *bp, prelude_bool_t (*match)(prelude_msg_t *msg));
+
+size_t bufpool_get_disk_dropped(bufpool_t *bp);
+
+size_t bufpool_get_overflow(bufpool_t *bp, size_t len);
+
+int bufpool_drop_oldest(bufpool_t *bp, size_t *len);
+
+int bufpool_drop_matching(bufpool_t *bp, prelude_bool_t (*match)(prelude_msg_t *msg), size_t *len);
+
 void bufpool_set_disk_threshold(size_t threshold);
 
 void bufpool_print_stats(void);
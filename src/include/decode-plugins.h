@@ -28,6 +28,8 @@ int decode_plugins_init(const char *dirname, void *data);
 
 void decode_plugins_free_data(void);
 
+prelude_bool_t decode_plugins_reload_safe(void);
+
 int decode_plugins_run(unsigned plugin_id, prelude_msg_t *pmsg, idmef_message_t *idmef);
 
 #endif /* _MANAGER_PLUGIN_DECODE_H */
@@ -24,13 +24,35 @@
 #ifndef _MANAGER_PLUGIN_FILTER_H
 #define _MANAGER_PLUGIN_FILTER_H
 
-prelude_bool_t filter_plugins_available(manager_filter_category_t type);
+typedef struct filter_graph filter_graph_t;
+
+prelude_bool_t filter_plugins_available(filter_graph_t *graph, manager_filter_category_t type);
 
 int filter_plugins_init(const char *dirname, void *data);
 
-int filter_plugins_run_by_category(idmef_message_t *msg, manager_filter_category_t cat);
+int filter_plugins_run_by_category(filter_graph_t *graph, idmef_message_t *msg, manager_filter_category_t cat);
+
+
+typedef struct filter_chain filter_chain_t;
+
+filter_chain_t *filter_plugins_get_chain(filter_graph_t *graph, prelude_plugin_instance_t *pi);
+
+int filter_plugins_run_chain(filter_chain_t *chain, idmef_message_t *message);
+
+
+uint32_t filter_plugins_get_reload_lock_mask(void);
+
+filter_graph_t *filter_plugins_new_graph(void);
+
+prelude_bool_t filter_plugins_need_additional_data(filter_graph_t *graph);
+
+void filter_plugins_destroy_graph(filter_graph_t *graph);
+
+void filter_plugins_set_reorder_interval(unsigned int interval);
+
+int filter_plugins_get_stats(prelude_string_t *out);
 
-int filter_plugins_run_by_plugin(idmef_message_t *message, prelude_plugin_instance_t *plugin);
+void filter_plugins_print_stats(void);
 
 
 #endif /* _MANAGER_PLUGIN_FILTER_H */
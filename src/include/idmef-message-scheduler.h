@@ -26,6 +26,21 @@
 
 typedef struct idmef_queue idmef_queue_t;
 
+typedef enum {
+        SCHED_PRIORITY_HIGH   = 0,
+        SCHED_PRIORITY_MEDIUM = 1,
+        SCHED_PRIORITY_LOW    = 2,
+        SCHED_PRIORITY_END    = 3
+} sched_priority_t;
+
+typedef enum {
+        SCHED_DROP_NEWEST       = 0,
+        SCHED_DROP_OLDEST       = 1,
+        SCHED_DROP_LOW_PRIORITY = 2,
+        SCHED_DROP_HEARTBEAT    = 3,
+        SCHED_DROP_END          = 4
+} sched_drop_policy_t;
+
 int idmef_message_scheduler_init(void);
 void idmef_message_scheduler_exit(void);
 
@@ -44,4 +59,16 @@ void idmef_message_scheduler_start_processing(void);
 
 void idmef_message_scheduler_set_priority(unsigned int high, unsigned int medium, unsigned int low);
 
+void idmef_message_scheduler_set_memory_limit(sched_priority_t priority, size_t limit);
+
+void idmef_message_scheduler_set_disk_limit(sched_priority_t priority, size_t limit);
+
+void idmef_message_scheduler_set_drop_policy(sched_priority_t priority, sched_drop_policy_t policy);
+
+void idmef_message_scheduler_set_recovery_rate(unsigned int rate);
+
+void idmef_message_scheduler_set_intern_cache_size(size_t size);
+
+void idmef_message_scheduler_set_fast_stop(prelude_bool_t enabled);
+
 #endif /* _MANAGER_IDMEF_MESSAGE_SCHEDULER_H */
@@ -0,0 +1,58 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#ifndef _MANAGER_IDMEF_PROJECTION_H
+#define _MANAGER_IDMEF_PROJECTION_H
+
+#include "intern-cache.h"
+
+/*
+ * Subtrees of a decoded message shared through the intern cache, or to
+ * be interned, attached by idmef_projection_share().
+ */
+typedef struct {
+        intern_cache_t *cache;
+        prelude_msg_t *msg;
+
+        void *chain;
+        const unsigned char *analyzer_key;
+        size_t analyzer_len;
+
+        idmef_classification_t *classification;
+        const unsigned char *classification_key;
+        size_t classification_len;
+} idmef_projection_share_t;
+
+
+prelude_bool_t idmef_projection_need_additional_data(prelude_plugin_instance_t *pi);
+
+int idmef_projection_decode(idmef_message_t **idmef, prelude_msg_t *msg,
+                            prelude_bool_t skip_additional_data, intern_cache_t *cache,
+                            idmef_projection_share_t *share);
+
+void idmef_projection_share(idmef_message_t *idmef, idmef_projection_share_t *share);
+
+void idmef_projection_release(idmef_message_t *idmef);
+
+#endif /* _MANAGER_IDMEF_PROJECTION_H */
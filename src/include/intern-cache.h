@@ -0,0 +1,39 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#ifndef _MANAGER_INTERN_CACHE_H
+#define _MANAGER_INTERN_CACHE_H
+
+typedef struct intern_cache intern_cache_t;
+
+int intern_cache_new(intern_cache_t **cache, size_t size);
+
+void intern_cache_destroy(intern_cache_t *cache);
+
+void *intern_cache_get(intern_cache_t *cache, int kind, const unsigned char *key, size_t len);
+
+int intern_cache_set(intern_cache_t *cache, int kind, const unsigned char *key, size_t len,
+                     void *object, void (*destroy)(void *object));
+
+#endif /* _MANAGER_INTERN_CACHE_H */
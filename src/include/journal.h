@@ -0,0 +1,71 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#ifndef _MANAGER_JOURNAL_H
+#define _MANAGER_JOURNAL_H
+
+/*
+ * Per bufpool position within the journal: a FIFO of runs of
+ * consecutive messages written to the same journal segment.
+ */
+typedef struct {
+        prelude_list_t run_list;
+} journal_cursor_t;
+
+typedef struct journal_run journal_run_t;
+
+
+void journal_cursor_init(journal_cursor_t *cursor);
+
+void journal_cursor_destroy(journal_cursor_t *cursor);
+
+void journal_cursor_release(journal_cursor_t *cursor);
+
+int journal_append(journal_cursor_t *cursor, prelude_msg_t *msg);
+
+void journal_cancel(journal_cursor_t *cursor);
+
+journal_run_t *journal_dequeue(journal_cursor_t *cursor);
+
+journal_run_t *journal_dequeue_at(journal_cursor_t *cursor, size_t index);
+
+void journal_complete(journal_run_t *run);
+
+
+prelude_bool_t journal_is_enabled(void);
+
+void journal_set_enabled(prelude_bool_t enabled);
+
+void journal_set_sync_interval(unsigned int msec);
+
+void journal_set_sync_size(size_t size);
+
+int journal_recover(const char *dirname, int (*cb)(prelude_msg_t *msg, void *data), void *data);
+
+void journal_release_recovered(void);
+
+int journal_init(const char *dirname);
+
+void journal_exit(void);
+
+#endif /* _MANAGER_JOURNAL_H */
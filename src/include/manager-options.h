@@ -30,6 +30,21 @@ int manager_options_init(prelude_option_t *manager_root_optlist, int *argc, char
 
 int manager_options_read(prelude_option_t *manager_root_optlist, int *argc, char **argv);
 
+int manager_options_reload(prelude_option_t *manager_root_optlist);
+
+prelude_bool_t manager_plugin_is_reload_safe(prelude_plugin_instance_t *pi);
+
+typedef enum {
+        MANAGER_RELOAD_HANDOFF_NONE   = 0,
+        MANAGER_RELOAD_HANDOFF_LISTEN = 1,
+        MANAGER_RELOAD_HANDOFF_ALL    = 2
+} manager_reload_handoff_t;
+
+typedef enum {
+        MANAGER_INGEST_CHECK_NONE = 0,
+        MANAGER_INGEST_CHECK_TLV  = 1
+} manager_ingest_check_t;
+
 typedef struct manager_config {
 
         const char *pidfile;
@@ -40,6 +55,10 @@ typedef struct manager_config {
         int dh_regenerate;
         int connection_timeout;
 
+        manager_reload_handoff_t reload_handoff;
+        manager_ingest_check_t ingest_check;
+        prelude_bool_t reloading;
+
         size_t nserver;
         server_generic_t **server;
 } manager_config_t;
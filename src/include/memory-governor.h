@@ -0,0 +1,61 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#ifndef _MANAGER_MEMORY_GOVERNOR_H
+#define _MANAGER_MEMORY_GOVERNOR_H
+
+typedef enum {
+        MEMORY_ACCOUNT_BUFPOOL     = 0,
+        MEMORY_ACCOUNT_INGEST      = 1,
+        MEMORY_ACCOUNT_WRITE_QUEUE = 2,
+        MEMORY_ACCOUNT_RELAY_QUEUE = 3,
+        MEMORY_ACCOUNT_DECODE      = 4,
+        MEMORY_ACCOUNT_END         = 5
+} memory_account_t;
+
+
+/*
+ * States are ordered by severity: each state imply the action of the
+ * previous ones.
+ */
+typedef enum {
+        MEMORY_GOVERNOR_STATE_NORMAL = 0,
+        MEMORY_GOVERNOR_STATE_SPILL  = 1,
+        MEMORY_GOVERNOR_STATE_PAUSE  = 2,
+        MEMORY_GOVERNOR_STATE_SHED   = 3
+} memory_governor_state_t;
+
+
+void memory_governor_add(memory_account_t account, size_t len);
+
+void memory_governor_sub(memory_account_t account, size_t len);
+
+memory_governor_state_t memory_governor_get_state(void);
+
+void memory_governor_set_limit(size_t limit);
+
+void memory_governor_set_resume_callback(void (*cb)(void));
+
+void memory_governor_print_stats(void);
+
+#endif /* _MANAGER_MEMORY_GOVERNOR_H */
@@ -0,0 +1,38 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#ifndef _MANAGER_PLUGIN_LOCK_H
+#define _MANAGER_PLUGIN_LOCK_H
+
+void plugin_lock(prelude_plugin_instance_t *pi);
+
+void plugin_unlock(prelude_plugin_instance_t *pi);
+
+uint32_t plugin_lock_get_mask(prelude_plugin_instance_t *pi);
+
+void plugin_lock_mask(uint32_t mask);
+
+void plugin_unlock_mask(uint32_t mask);
+
+#endif /* _MANAGER_PLUGIN_LOCK_H */
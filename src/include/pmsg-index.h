@@ -0,0 +1,73 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#ifndef _MANAGER_PMSG_INDEX_H
+#define _MANAGER_PMSG_INDEX_H
+
+/*
+ * Size of the header preceding the TLVs in the data of a prelude_msg_t:
+ * version, tag, priority and is_fragment (one byte each), followed by
+ * datalen, tv_sec and tv_usec (four bytes each, network byte order).
+ */
+#define PMSG_HEADER_SIZE 16
+
+
+/*
+ * Number of TLV indexed without allocation.
+ */
+#define PMSG_INDEX_INLINE_SIZE 64
+
+
+/*
+ * mark is left to the index user, and cleared on build.
+ */
+typedef struct {
+        uint8_t tag;
+        uint8_t mark;
+        uint32_t len;
+        const unsigned char *value;
+} pmsg_tlv_t;
+
+
+/*
+ * Offset index of the TLVs of a message, built in a single pass, which
+ * also validate the message TLV structure.
+ */
+typedef struct {
+        size_t count;
+        size_t size;
+        pmsg_tlv_t *tlv;
+        pmsg_tlv_t inline_tlv[PMSG_INDEX_INLINE_SIZE];
+} pmsg_index_t;
+
+
+int pmsg_index_build(pmsg_index_t *index, const unsigned char *data, size_t len);
+
+int pmsg_index_build_from_msg(pmsg_index_t *index, prelude_msg_t *msg);
+
+void pmsg_index_destroy(pmsg_index_t *index);
+
+int pmsg_check(prelude_msg_t *msg);
+
+#endif /* _MANAGER_PMSG_INDEX_H */
@@ -22,3 +22,5 @@
 *****/
 
 int pmsg_to_idmef(idmef_message_t **idmef, prelude_msg_t *msg);
+
+int pmsg_to_idmef_from_copy(idmef_message_t **idmef, prelude_msg_t *copy, prelude_msg_t *orig);
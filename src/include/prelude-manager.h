@@ -43,16 +43,28 @@ typedef struct {
 
 /*
  * Decode plugin entry structure
+ *
+ * decode_id should be lower than 256. Plugins sharing the same
+ * decode_id are run by increasing order, then in subscription order,
+ * until one of them fail. Plugins using decode_id 0 are run on every
+ * message: those adding information to the message should run once it
+ * has been normalized.
  */
+#define MANAGER_DECODE_ORDER_NORMALIZE  0
+#define MANAGER_DECODE_ORDER_ENRICH    10
+
 typedef struct {
         PRELUDE_PLUGIN_GENERIC;
         unsigned int decode_id;
         int (*run)(prelude_msg_t *ac, idmef_message_t *idmef);
+        int order;
 } manager_decode_plugin_t;
 
 
 #define manager_decode_plugin_set_running_func(p, f) (p)->run = (f)
 
+#define manager_decode_plugin_set_order(p, o) (p)->order = (o)
+
 
 
 /*
@@ -86,3 +98,143 @@ int manager_filter_new_hook(manager_filter_hook_t **entry,
 
 
 void manager_filter_destroy_hook(manager_filter_hook_t *entry);
+
+
+/*
+ * When filter-reorder-interval is set, the reorderable filters of a
+ * category are run by increasing cost per rejected message. Only flag
+ * a hook whose result does not depend on the filters run before it,
+ * unlike for example a filter accounting the messages it see.
+ */
+void manager_filter_hook_set_reorderable(manager_filter_hook_t *entry, prelude_bool_t reorderable);
+
+
+
+/*
+ * Plugin data replaced while messages are being processed (for example
+ * from an option callback on configuration reload) should be released
+ * through manager_defer_free(), once no message processing can still
+ * reference it.
+ */
+void manager_defer_free(void (*destroy)(void *data), void *data);
+
+
+/*
+ * Plugins whose option callbacks can run while messages are being
+ * processed, replacing their data through manager_defer_free(), should
+ * declare it at initialization. The instances of other plugins are
+ * locked while the configuration is reloaded, message processing being
+ * paused only when a decode plugin did not declare it.
+ */
+void manager_plugin_set_reload_safe(prelude_plugin_generic_t *plugin);
+
+
+
+/*
+ * Plugin instances may declare the IDMEF paths they use, so that unused
+ * parts of the messages are not decoded. Without declaration, an
+ * instance is assumed to use the whole message.
+ *
+ * Instances needing the whole message only occasionally, for example to
+ * forward it, should declare the paths they use and retrieve the whole
+ * message through manager_idmef_message_get_full().
+ */
+int manager_idmef_require_none(prelude_plugin_instance_t *pi);
+
+int manager_idmef_require_path(prelude_plugin_instance_t *pi, const char *path);
+
+void manager_idmef_require_all(prelude_plugin_instance_t *pi);
+
+int manager_idmef_message_get_full(idmef_message_t *idmef, idmef_message_t **full);
+
+
+/*
+ * Additional data with the given meaning are decoded even when none of
+ * the instances use additional_data, for markers looked up by decode
+ * plugins. Should be called at plugin initialization.
+ */
+int manager_idmef_keep_additional_data(const char *meaning);
+
+
+/*
+ * Boolean additional data with the given meaning are added to the
+ * messages relayed to parent managers, and only to these, where they are
+ * decoded as kept additional data. When cond is not NULL, only messages
+ * for which it return TRUE are stamped. Plugins handling the stamp on the
+ * parent should remove it, so that it is not reported. Should be called
+ * at plugin initialization.
+ */
+int manager_idmef_add_relay_stamp(const char *meaning, prelude_bool_t (*cond)(idmef_message_t *idmef));
+
+int manager_idmef_message_write_relayed(idmef_message_t *idmef, prelude_msgbuf_t *msgbuf);
+
+
+
+/*
+ * Address classification shared by the plugins handling addresses.
+ */
+typedef struct {
+        idmef_address_category_t category;
+        prelude_bool_t ipv4_mapped;
+        unsigned char addr[16];
+} manager_address_t;
+
+int manager_address_parse(manager_address_t *out, const char *str);
+
+int manager_address_parse_prefix(manager_address_t *out, char *str, unsigned int *bits);
+
+size_t manager_address_ipv4_to_string(const unsigned char *addr, char *buf);
+
+
+
+/*
+ * Longest prefix match over binary keys of up to 128 bits, for
+ * example IPv4 or IPv6 addresses in network order.
+ */
+typedef struct manager_radix_trie manager_radix_trie_t;
+
+int manager_radix_trie_new(manager_radix_trie_t **trie, unsigned int max_bits);
+
+int manager_radix_trie_insert(manager_radix_trie_t *trie, const unsigned char *key, unsigned int bits, void *data);
+
+void *manager_radix_trie_lookup(manager_radix_trie_t *trie, const unsigned char *key, unsigned int bits);
+
+size_t manager_radix_trie_get_count(manager_radix_trie_t *trie);
+
+void manager_radix_trie_destroy(manager_radix_trie_t *trie, void (*destroy)(void *data));
+
+
+
+/*
+ * Files checked every interval seconds for a change of modification
+ * time, size or inode. reload() is then called from a dedicated thread,
+ * so that loading a large file does not delay message processing.
+ */
+typedef struct manager_file_watch manager_file_watch_t;
+
+int manager_file_watch_new(manager_file_watch_t **watch, const char *filename, unsigned int interval,
+                           int (*reload)(const char *filename, void *data), void *data);
+
+int manager_file_watch_check(manager_file_watch_t *watch);
+
+int manager_file_watch_set_interval(manager_file_watch_t *watch, unsigned int interval);
+
+void manager_file_watch_destroy(manager_file_watch_t *watch);
+
+
+
+/*
+ * Path values looked up through manager_idmef_path_get() are cached
+ * while the message is being processed, and shared by every plugin
+ * using the same path. Results registered by key, such as criteria
+ * evaluations, are shared the same way.
+ */
+int manager_idmef_path_register(idmef_path_t *path);
+
+int manager_idmef_path_get(idmef_message_t *message, idmef_path_t *path, int id, idmef_value_t **value);
+
+int manager_idmef_result_register(const char *key);
+
+int manager_idmef_result_get(idmef_message_t *message, int id);
+
+void manager_idmef_result_set(idmef_message_t *message, int id, prelude_bool_t result);
@@ -0,0 +1,40 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#ifndef _MANAGER_RCU_H
+#define _MANAGER_RCU_H
+
+unsigned int rcu_read_lock(void);
+
+void rcu_read_unlock(unsigned int token);
+
+void rcu_synchronize(void);
+
+void rcu_update_begin(void);
+
+void rcu_update_end(void);
+
+prelude_bool_t rcu_update_in_progress(void);
+
+#endif /* _MANAGER_RCU_H */
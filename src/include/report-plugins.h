@@ -24,13 +24,31 @@
 #ifndef _MANAGER_PLUGIN_REPORT_H
 #define _MANAGER_PLUGIN_REPORT_H
 
+typedef struct report_graph report_graph_t;
+
 prelude_bool_t report_plugins_available(void);
 
 int report_plugin_activate_failover(const char *plugin);
 
 int report_plugins_init(const char *dirname, void *data);
 
-void report_plugins_run(idmef_message_t *message);
+void report_plugins_run(report_graph_t *graph, idmef_message_t *message);
+
+uint32_t report_plugins_get_reload_lock_mask(void);
+
+void report_plugins_publish_graph(void);
+
+void report_plugins_update_graph(void);
+
+report_graph_t *report_plugins_get_graph(void);
+
+struct filter_graph *report_plugins_get_filters(report_graph_t *graph);
+
+prelude_bool_t report_plugins_skip_additional_data(report_graph_t *graph);
+
+size_t report_plugins_get_count(report_graph_t *graph);
+
+prelude_plugin_instance_t *report_plugins_get_instance(report_graph_t *graph, size_t index);
 
 void report_plugins_close(void);
 
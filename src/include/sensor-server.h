@@ -27,6 +27,8 @@
 #include "idmef-message-scheduler.h"
 #include "reverse-relaying.h"
 
+#define SENSOR_SERVER_HANDOFF_ENV "PRELUDE_MANAGER_CLIENT_FDS"
+
 typedef struct {
         SERVER_GENERIC_OBJECT;
         prelude_list_t list;
@@ -38,6 +40,7 @@ typedef struct {
         reverse_relay_receiver_t *rrr;
 
         uint32_t instance_id;
+        size_t ingest_len;
 } sensor_fd_t;
 
 
@@ -51,4 +54,8 @@ int sensor_server_add_client(server_generic_t *server, server_generic_client_t *
 
 int sensor_server_write_client(server_generic_client_t *dst, prelude_msg_t *msg);
 
+int sensor_server_handoff_clients(void);
+
+int sensor_server_adopt_clients(server_generic_t **server, size_t nserver);
+
 #endif /* _MANAGER_SENSOR_SERVER_H */
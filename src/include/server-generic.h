@@ -34,6 +34,9 @@
 #define SERVER_GENERIC_CLIENT_STATE_FLUSHING       0x04
 #define SERVER_GENERIC_CLIENT_STATE_CLOSING        0x08
 #define SERVER_GENERIC_CLIENT_STATE_CLOSED         0x10
+#define SERVER_GENERIC_CLIENT_STATE_PAUSED         0x20
+
+#define SERVER_GENERIC_HANDOFF_ENV "PRELUDE_MANAGER_LISTEN_FDS"
 
 #ifdef HAVE_IPV6
 # define SERVER_SOCKADDR_TYPE struct sockaddr_in6
@@ -121,6 +124,16 @@ void server_generic_notify_write_enable(server_generic_client_t *client);
 
 void server_generic_notify_write_disable(server_generic_client_t *client);
 
+void server_generic_client_pause_read(server_generic_client_t *client);
+
+void server_generic_client_resume_read(server_generic_client_t *client);
+
+int server_generic_handoff(server_generic_t **server, size_t nserver);
+
+server_generic_t *server_generic_search_client_server(server_generic_t **server, size_t nserver, int fd);
+
+int server_generic_adopt_client(server_generic_t *server, server_generic_client_t *client, int fd);
+
 #endif /* _MANAGER_SERVER_GENERIC_H */
 
 
@@ -0,0 +1,166 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "intern-cache.h"
+
+
+/*
+ * Direct mapped cache of objects keyed by the raw bytes they were
+ * decoded from. On collision, the previous entry is replaced.
+ *
+ * The cache is not locked: it is owned by a single sensor queue, only
+ * accessed from the thread processing that queue.
+ */
+typedef struct {
+        int kind;
+        uint32_t hash;
+        size_t len;
+        unsigned char *key;
+        void *object;
+        void (*destroy)(void *object);
+} intern_entry_t;
+
+
+struct intern_cache {
+        size_t size;
+        intern_entry_t entry[1];
+};
+
+
+
+static uint32_t get_hash(int kind, const unsigned char *key, size_t len)
+{
+        size_t i;
+        uint32_t hash = 2166136261U ^ (uint32_t) kind;
+
+        for ( i = 0; i < len; i++ ) {
+                hash ^= key[i];
+                hash *= 16777619U;
+        }
+
+        return hash;
+}
+
+
+
+static void entry_destroy(intern_entry_t *entry)
+{
+        if ( ! entry->key )
+                return;
+
+        entry->destroy(entry->object);
+        free(entry->key);
+
+        entry->key = NULL;
+}
+
+
+
+int intern_cache_new(intern_cache_t **cache, size_t size)
+{
+        *cache = calloc(1, sizeof(**cache) + (size - 1) * sizeof(intern_entry_t));
+        if ( ! *cache ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        (*cache)->size = size;
+
+        return 0;
+}
+
+
+
+void intern_cache_destroy(intern_cache_t *cache)
+{
+        size_t i;
+
+        for ( i = 0; i < cache->size; i++ )
+                entry_destroy(&cache->entry[i]);
+
+        free(cache);
+}
+
+
+
+/*
+ * Returns the object stored for this exact key, or NULL.
+ */
+void *intern_cache_get(intern_cache_t *cache, int kind, const unsigned char *key, size_t len)
+{
+        intern_entry_t *entry;
+        uint32_t hash = get_hash(kind, key, len);
+
+        entry = &cache->entry[hash % cache->size];
+
+        if ( ! entry->key || entry->hash != hash || entry->kind != kind || entry->len != len )
+                return NULL;
+
+        if ( memcmp(entry->key, key, len) != 0 )
+                return NULL;
+
+        return entry->object;
+}
+
+
+
+/*
+ * The cache take ownership of object, released through destroy once
+ * replaced or when the cache is destroyed.
+ */
+int intern_cache_set(intern_cache_t *cache, int kind, const unsigned char *key, size_t len,
+                     void *object, void (*destroy)(void *object))
+{
+        unsigned char *dup;
+        intern_entry_t *entry;
+        uint32_t hash = get_hash(kind, key, len);
+
+        dup = malloc(len);
+        if ( ! dup ) {
+                destroy(object);
+                return -1;
+        }
+
+        memcpy(dup, key, len);
+
+        entry = &cache->entry[hash % cache->size];
+        entry_destroy(entry);
+
+        entry->kind = kind;
+        entry->hash = hash;
+        entry->len = len;
+        entry->key = dup;
+        entry->object = object;
+        entry->destroy = destroy;
+
+        return 0;
+}
@@ -0,0 +1,865 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+#include <libprelude/prelude-io.h>
+#include <libprelude/prelude-error.h>
+
+#include "glthread/thread.h"
+#include "glthread/lock.h"
+#include "glthread/cond.h"
+
+#include "journal.h"
+
+
+#define JOURNAL_PREFIX "journal."
+
+/*
+ * Segment are rotated once they reach JOURNAL_SEGMENT_SIZE. A segment
+ * which is still the current one is truncated, rather than removed,
+ * once all the message it contain have been processed, provided its
+ * size exceed JOURNAL_TRUNCATE_SIZE.
+ */
+#define JOURNAL_SEGMENT_SIZE  16 * (1024 * 1024)
+#define JOURNAL_TRUNCATE_SIZE 1 * (1024 * 1024)
+
+#define JOURNAL_SYNC_INTERVAL_DEFAULT 100
+#define JOURNAL_SYNC_SIZE_DEFAULT     1 * (1024 * 1024)
+
+
+/*
+ * The journal is a sequential write-ahead log made of numbered
+ * segments. Every message accepted by a bufpool is appended to the
+ * current segment before being queued in memory, and a flusher thread
+ * commit the pending data to disk by group, either every sync_interval
+ * milliseconds, or as soon as sync_size bytes are waiting to be synced.
+ *
+ * Each segment keep track of the number of message it contain that have
+ * not been processed yet. Since a bufpool is a FIFO, each bufpool only
+ * need to remember how many of its queued message live in each segment
+ * (runs), in order. A message taken out of the bufpool is dequeued from
+ * its run, and keep a reference to it until it has been processed:
+ * completing the message then decrement the run and segment pending
+ * count. Once a segment has no pending message, it is removed.
+ *
+ * On startup, any remaining segment is replayed. Since messages are only
+ * dropped from the journal once processed, a message might be replayed
+ * twice if the manager was killed after processing it, but before the
+ * segment was released: delivery is at least once.
+ */
+typedef struct {
+        prelude_list_t list;
+
+        int fd;
+        uint64_t seq;
+
+        size_t size;
+        size_t pending;
+
+        prelude_bool_t dirty;
+        prelude_bool_t busy;
+} journal_segment_t;
+
+
+/*
+ * queued: messages of the run still in the bufpool, the run is part of
+ * the cursor as long as there are some.
+ * pending: messages of the run not completed yet, either queued or being
+ * processed. The run is released once there are none.
+ */
+struct journal_run {
+        prelude_list_t list;
+
+        size_t queued;
+        size_t pending;
+        journal_segment_t *segment;
+};
+
+
+static PRELUDE_LIST(segment_list);
+static journal_segment_t *current = NULL;
+
+static char *journal_dirname = NULL;
+static uint64_t next_seq = 0;
+
+/*
+ * Segments replayed from a previous run, which can only be removed once
+ * the replayed messages are safe.
+ */
+static char *recovered_dirname = NULL;
+static uint64_t *recovered_seq = NULL;
+static size_t recovered_count = 0;
+static size_t unsynced_len = 0;
+
+static prelude_bool_t enabled = FALSE;
+static unsigned int sync_interval = JOURNAL_SYNC_INTERVAL_DEFAULT;
+static size_t sync_size = JOURNAL_SYNC_SIZE_DEFAULT;
+
+static gl_thread_t thread;
+static prelude_bool_t stop_flusher = FALSE;
+static gl_lock_t mutex = gl_lock_initializer;
+static gl_cond_t sync_cond = gl_cond_initializer;
+
+
+
+static void segment_get_filename(char *buf, size_t size, uint64_t seq)
+{
+        snprintf(buf, size, "%s/" JOURNAL_PREFIX "%" PRELUDE_PRIu64, journal_dirname, seq);
+}
+
+
+
+static int segment_new(journal_segment_t **out)
+{
+        int ret;
+        char filename[PATH_MAX];
+        journal_segment_t *segment;
+
+        segment = calloc(1, sizeof(*segment));
+        if ( ! segment )
+                return prelude_error_from_errno(errno);
+
+        segment->seq = next_seq++;
+        segment_get_filename(filename, sizeof(filename), segment->seq);
+
+        segment->fd = open(filename, O_CREAT|O_TRUNC|O_WRONLY|O_APPEND, S_IRUSR|S_IWUSR);
+        if ( segment->fd < 0 ) {
+                ret = prelude_error_from_errno(errno);
+                prelude_log(PRELUDE_LOG_ERR, "could not create journal segment '%s': %s.\n", filename, strerror(errno));
+                free(segment);
+                return ret;
+        }
+
+        fcntl(segment->fd, F_SETFD, fcntl(segment->fd, F_GETFD) | FD_CLOEXEC);
+
+        prelude_list_add_tail(&segment_list, &segment->list);
+        *out = segment;
+
+        return 0;
+}
+
+
+
+/*
+ * Must be called with the journal mutex held.
+ */
+static void segment_release(journal_segment_t *segment)
+{
+        char filename[PATH_MAX];
+
+        if ( segment == current || segment->pending || segment->busy )
+                return;
+
+        segment_get_filename(filename, sizeof(filename), segment->seq);
+
+        if ( unlink(filename) < 0 )
+                prelude_log(PRELUDE_LOG_ERR, "could not remove journal segment '%s': %s.\n", filename, strerror(errno));
+
+        close(segment->fd);
+        prelude_list_del(&segment->list);
+        free(segment);
+}
+
+
+
+/*
+ * Must be called with the journal mutex held.
+ */
+static void segment_reset(journal_segment_t *segment)
+{
+        int ret;
+
+        if ( segment->pending || segment->busy || segment->size < JOURNAL_TRUNCATE_SIZE )
+                return;
+
+        ret = ftruncate(segment->fd, 0);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "could not truncate journal segment: %s.\n", strerror(errno));
+                return;
+        }
+
+        segment->size = 0;
+}
+
+
+
+static int segment_write(journal_segment_t *segment, const unsigned char *data, size_t len)
+{
+        ssize_t ret;
+
+        while ( len ) {
+                ret = write(segment->fd, data, len);
+                if ( ret < 0 ) {
+                        if ( errno == EINTR )
+                                continue;
+
+                        return prelude_error_from_errno(errno);
+                }
+
+                data += ret;
+                len -= ret;
+                segment->size += ret;
+        }
+
+        return 0;
+}
+
+
+
+static int get_current_segment(journal_segment_t **out)
+{
+        int ret;
+        journal_segment_t *old = current;
+
+        if ( current && current->size < JOURNAL_SEGMENT_SIZE ) {
+                *out = current;
+                return 0;
+        }
+
+        ret = segment_new(&current);
+        if ( ret < 0 ) {
+                current = old;
+                return ret;
+        }
+
+        if ( old )
+                segment_release(old);
+
+        *out = current;
+        return 0;
+}
+
+
+
+int journal_append(journal_cursor_t *cursor, prelude_msg_t *msg)
+{
+        int ret;
+        journal_run_t *run;
+        journal_segment_t *segment;
+
+        gl_lock_lock(mutex);
+
+        ret = get_current_segment(&segment);
+        if ( ret < 0 )
+                goto out;
+
+        run = prelude_list_entry(cursor->run_list.prev, journal_run_t, list);
+        if ( prelude_list_is_empty(&cursor->run_list) || run->segment != segment ) {
+                run = malloc(sizeof(*run));
+                if ( ! run ) {
+                        ret = prelude_error_from_errno(errno);
+                        goto out;
+                }
+
+                run->queued = run->pending = 0;
+                run->segment = segment;
+                prelude_list_add_tail(&cursor->run_list, &run->list);
+        }
+
+        ret = segment_write(segment, prelude_msg_get_message_data(msg), prelude_msg_get_len(msg));
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "journal write failure: %s.\n", prelude_strerror(ret));
+
+                if ( run->queued == 0 ) {
+                        prelude_list_del(&run->list);
+                        free(run);
+                }
+
+                goto out;
+        }
+
+        run->queued++;
+        run->pending++;
+        segment->pending++;
+        segment->dirty = TRUE;
+
+        unsynced_len += prelude_msg_get_len(msg);
+        if ( unsynced_len >= sync_size )
+                gl_cond_signal(sync_cond);
+
+ out:
+        gl_lock_unlock(mutex);
+        return ret;
+}
+
+
+
+/*
+ * Must be called with the journal mutex held.
+ */
+static void run_dequeue(journal_run_t *run)
+{
+        if ( --run->queued == 0 )
+                prelude_list_del(&run->list);
+}
+
+
+
+/*
+ * Must be called with the journal mutex held.
+ */
+static void run_complete(journal_run_t *run)
+{
+        journal_segment_t *segment = run->segment;
+
+        segment->pending--;
+
+        if ( --run->pending == 0 )
+                free(run);
+
+        if ( segment->pending == 0 ) {
+                if ( segment == current )
+                        segment_reset(segment);
+                else
+                        segment_release(segment);
+        }
+}
+
+
+
+/*
+ * Called when the oldest message queued in the bufpool associated with
+ * cursor is taken out of it. The returned run should be given to
+ * journal_complete() once the message has been processed.
+ */
+journal_run_t *journal_dequeue(journal_cursor_t *cursor)
+{
+        journal_run_t *run = NULL;
+
+        gl_lock_lock(mutex);
+
+        if ( ! prelude_list_is_empty(&cursor->run_list) ) {
+                run = prelude_list_entry(cursor->run_list.next, journal_run_t, list);
+                run_dequeue(run);
+        }
+
+        gl_lock_unlock(mutex);
+
+        return run;
+}
+
+
+
+/*
+ * Same as journal_dequeue(), for the message at position index among the
+ * messages queued in the bufpool associated with cursor.
+ */
+journal_run_t *journal_dequeue_at(journal_cursor_t *cursor, size_t index)
+{
+        prelude_list_t *tmp;
+        journal_run_t *run;
+
+        gl_lock_lock(mutex);
+
+        prelude_list_for_each(&cursor->run_list, tmp) {
+                run = prelude_list_entry(tmp, journal_run_t, list);
+
+                if ( index < run->queued ) {
+                        run_dequeue(run);
+                        gl_lock_unlock(mutex);
+                        return run;
+                }
+
+                index -= run->queued;
+        }
+
+        gl_lock_unlock(mutex);
+
+        return NULL;
+}
+
+
+
+/*
+ * Called once a message dequeued from run has been processed, or dropped.
+ */
+void journal_complete(journal_run_t *run)
+{
+        if ( ! run )
+                return;
+
+        gl_lock_lock(mutex);
+        run_complete(run);
+        gl_lock_unlock(mutex);
+}
+
+
+
+/*
+ * Called when the latest appended message could not be queued. The
+ * data stay in the journal, but no longer prevent the segment from
+ * being released.
+ */
+void journal_cancel(journal_cursor_t *cursor)
+{
+        journal_run_t *run;
+
+        gl_lock_lock(mutex);
+
+        if ( ! prelude_list_is_empty(&cursor->run_list) ) {
+                run = prelude_list_entry(cursor->run_list.prev, journal_run_t, list);
+                run_dequeue(run);
+                run_complete(run);
+        }
+
+        gl_lock_unlock(mutex);
+}
+
+
+
+void journal_cursor_init(journal_cursor_t *cursor)
+{
+        prelude_list_init(&cursor->run_list);
+}
+
+
+
+void journal_cursor_destroy(journal_cursor_t *cursor)
+{
+        journal_run_t *run;
+        prelude_list_t *tmp, *bkp;
+
+        /*
+         * Remaining runs refer to unprocessed message: the segment
+         * they belong to are kept so that they get replayed. Runs with
+         * messages still being processed are released once these are
+         * completed.
+         */
+        gl_lock_lock(mutex);
+
+        prelude_list_for_each_safe(&cursor->run_list, tmp, bkp) {
+                run = prelude_list_entry(tmp, journal_run_t, list);
+                prelude_list_del(&run->list);
+
+                run->pending -= run->queued;
+                run->queued = 0;
+
+                if ( run->pending == 0 )
+                        free(run);
+        }
+
+        gl_lock_unlock(mutex);
+}
+
+
+
+/*
+ * Complete every message queued in the bufpool associated with cursor,
+ * once these have been stored elsewhere: the segments they belong to are
+ * no longer kept for them.
+ */
+void journal_cursor_release(journal_cursor_t *cursor)
+{
+        journal_run_t *run;
+
+        gl_lock_lock(mutex);
+
+        while ( ! prelude_list_is_empty(&cursor->run_list) ) {
+                run = prelude_list_entry(cursor->run_list.next, journal_run_t, list);
+                run_dequeue(run);
+                run_complete(run);
+        }
+
+        gl_lock_unlock(mutex);
+}
+
+
+
+static void sync_dirty_segments(void)
+{
+        int ret;
+        prelude_list_t *tmp;
+        journal_segment_t *segment;
+
+        do {
+                segment = NULL;
+
+                prelude_list_for_each(&segment_list, tmp) {
+                        segment = prelude_list_entry(tmp, journal_segment_t, list);
+                        if ( segment->dirty && ! segment->busy )
+                                break;
+
+                        segment = NULL;
+                }
+
+                if ( ! segment )
+                        break;
+
+                segment->dirty = FALSE;
+                segment->busy = TRUE;
+
+                /*
+                 * The sync happen without the journal lock held, so that
+                 * appending to the journal is not delayed by the disk.
+                 */
+                gl_lock_unlock(mutex);
+                ret = fdatasync(segment->fd);
+                gl_lock_lock(mutex);
+
+                if ( ret < 0 )
+                        prelude_log(PRELUDE_LOG_ERR, "journal sync failure: %s.\n", strerror(errno));
+
+                segment->busy = FALSE;
+
+                if ( segment->pending == 0 )
+                        segment_release(segment);
+
+        } while ( 1 );
+}
+
+
+
+static void *journal_flusher(void *arg)
+{
+        int ret;
+        sigset_t set;
+        struct timeval now;
+        struct timespec ts;
+
+        sigfillset(&set);
+
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
+
+        gl_lock_lock(mutex);
+
+        while ( ! stop_flusher ) {
+                if ( unsynced_len < sync_size ) {
+                        gettimeofday(&now, NULL);
+
+                        ts.tv_sec = now.tv_sec + sync_interval / 1000;
+                        ts.tv_nsec = (now.tv_usec + (sync_interval % 1000) * 1000) * 1000;
+                        if ( ts.tv_nsec >= 1000000000 ) {
+                                ts.tv_sec++;
+                                ts.tv_nsec -= 1000000000;
+                        }
+
+                        glthread_cond_timedwait(&sync_cond, &mutex, &ts);
+                }
+
+                unsynced_len = 0;
+                sync_dirty_segments();
+        }
+
+        gl_lock_unlock(mutex);
+
+        return NULL;
+}
+
+
+
+static int read_segment(const char *filename, int (*cb)(prelude_msg_t *msg, void *data), void *data)
+{
+        int ret, fd;
+        prelude_io_t *fdi;
+        prelude_msg_t *msg;
+        unsigned long count = 0;
+
+        fd = open(filename, O_RDONLY);
+        if ( fd < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "could not open journal segment '%s': %s.\n", filename, strerror(errno));
+                return prelude_error_from_errno(errno);
+        }
+
+        ret = prelude_io_new(&fdi);
+        if ( ret < 0 ) {
+                close(fd);
+                return ret;
+        }
+
+        prelude_io_set_sys_io(fdi, fd);
+
+        do {
+                msg = NULL;
+
+                ret = prelude_msg_read(&msg, fdi);
+                if ( ret < 0 ) {
+                        if ( msg )
+                                prelude_msg_destroy(msg);
+                        break;
+                }
+
+                count++;
+                cb(msg, data);
+        } while ( 1 );
+
+        /*
+         * A truncated message at the end of the segment is the result of a
+         * write interrupted by the crash, and was never accepted.
+         */
+        if ( prelude_error_get_code(ret) != PRELUDE_ERROR_EOF )
+                prelude_log(PRELUDE_LOG_WARN, "%s: stopped replay on invalid data: %s.\n", filename, prelude_strerror(ret));
+
+        prelude_log(PRELUDE_LOG_INFO, "%s: replayed %lu journaled messages from a previous run.\n", filename, count);
+
+        prelude_io_close(fdi);
+        prelude_io_destroy(fdi);
+
+        return 0;
+}
+
+
+
+static int seqcmp(const void *a, const void *b)
+{
+        const uint64_t *s1 = a, *s2 = b;
+        return (*s1 > *s2) - (*s1 < *s2);
+}
+
+
+
+/*
+ * Remove the segments replayed by journal_recover().
+ */
+void journal_release_recovered(void)
+{
+        size_t i;
+        char filename[PATH_MAX];
+
+        for ( i = 0; i < recovered_count; i++ ) {
+                snprintf(filename, sizeof(filename), "%s/" JOURNAL_PREFIX "%" PRELUDE_PRIu64, recovered_dirname, recovered_seq[i]);
+
+                if ( unlink(filename) < 0 )
+                        prelude_log(PRELUDE_LOG_ERR, "could not remove journal segment '%s': %s.\n", filename, strerror(errno));
+        }
+
+        free(recovered_seq);
+        free(recovered_dirname);
+
+        recovered_seq = NULL;
+        recovered_dirname = NULL;
+        recovered_count = 0;
+}
+
+
+
+/*
+ * Replay, in order, every journal segment left in dirname by a previous
+ * run. Return the number of segment found.
+ *
+ * When called after journal_init() with the journal enabled, the replayed
+ * messages are journaled again by the callback: they are synced, and the
+ * replayed segments removed, before returning. Otherwise, the replayed
+ * messages only live in memory, and the segments are kept until
+ * journal_release_recovered() is called, once these have been processed.
+ */
+int journal_recover(const char *dirname, int (*cb)(prelude_msg_t *msg, void *data), void *data)
+{
+        DIR *dir;
+        char *eptr;
+        struct dirent *de;
+        uint64_t seq, *tbl = NULL, *ntbl;
+        size_t i, count = 0;
+        char filename[PATH_MAX];
+
+        dir = opendir(dirname);
+        if ( ! dir ) {
+                prelude_log(PRELUDE_LOG_ERR, "error opening directory '%s': %s.\n", dirname, strerror(errno));
+                return -1;
+        }
+
+        while ( (de = readdir(dir)) ) {
+                if ( strncmp(de->d_name, JOURNAL_PREFIX, sizeof(JOURNAL_PREFIX) - 1) != 0 )
+                        continue;
+
+                seq = strtoull(de->d_name + sizeof(JOURNAL_PREFIX) - 1, &eptr, 10);
+                if ( *eptr )
+                        continue;
+
+                ntbl = realloc(tbl, (count + 1) * sizeof(*tbl));
+                if ( ! ntbl ) {
+                        closedir(dir);
+                        free(tbl);
+                        return prelude_error_from_errno(errno);
+                }
+
+                tbl = ntbl;
+                tbl[count++] = seq;
+        }
+
+        closedir(dir);
+
+        qsort(tbl, count, sizeof(*tbl), seqcmp);
+
+        /*
+         * Recovered messages might be appended to the journal again, in
+         * new segments that should not collide with the replayed ones.
+         */
+        if ( count && tbl[count - 1] >= next_seq )
+                next_seq = tbl[count - 1] + 1;
+
+        for ( i = 0; i < count; i++ ) {
+                snprintf(filename, sizeof(filename), "%s/" JOURNAL_PREFIX "%" PRELUDE_PRIu64, dirname, tbl[i]);
+                read_segment(filename, cb, data);
+        }
+
+        if ( ! count ) {
+                free(tbl);
+                return 0;
+        }
+
+        recovered_dirname = strdup(dirname);
+        if ( ! recovered_dirname ) {
+                free(tbl);
+                return prelude_error_from_errno(errno);
+        }
+
+        recovered_seq = tbl;
+        recovered_count = count;
+
+        if ( enabled && journal_dirname ) {
+                gl_lock_lock(mutex);
+                unsynced_len = 0;
+                sync_dirty_segments();
+                gl_lock_unlock(mutex);
+
+                journal_release_recovered();
+        }
+
+        return count;
+}
+
+
+
+void journal_set_enabled(prelude_bool_t value)
+{
+        enabled = value;
+}
+
+
+
+prelude_bool_t journal_is_enabled(void)
+{
+        return enabled;
+}
+
+
+
+void journal_set_sync_interval(unsigned int msec)
+{
+        sync_interval = (msec) ? msec : 1;
+}
+
+
+
+void journal_set_sync_size(size_t size)
+{
+        sync_size = size;
+}
+
+
+
+int journal_init(const char *dirname)
+{
+        int ret;
+
+        if ( ! enabled )
+                return 0;
+
+        journal_dirname = strdup(dirname);
+        if ( ! journal_dirname )
+                return prelude_error_from_errno(errno);
+
+        ret = glthread_create(&thread, &journal_flusher, NULL);
+        if ( ret != 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't create journal flusher thread.\n");
+                return -1;
+        }
+
+        prelude_log(PRELUDE_LOG_INFO, "Scheduler journal enabled (sync every %ums or %" PRELUDE_PRIu64 " bytes).\n",
+                    sync_interval, (uint64_t) sync_size);
+
+        return 0;
+}
+
+
+
+/*
+ * Called once every queue has been destroyed: segment still holding
+ * unprocessed message are synced and kept for the next run.
+ */
+void journal_exit(void)
+{
+        journal_segment_t *segment;
+        prelude_list_t *tmp, *bkp;
+
+        if ( ! enabled || ! journal_dirname )
+                return;
+
+        gl_lock_lock(mutex);
+        stop_flusher = TRUE;
+        gl_cond_signal(sync_cond);
+        gl_lock_unlock(mutex);
+
+        gl_thread_join(thread, NULL);
+
+        gl_lock_lock(mutex);
+
+        sync_dirty_segments();
+        current = NULL;
+
+        prelude_list_for_each_safe(&segment_list, tmp, bkp) {
+                segment = prelude_list_entry(tmp, journal_segment_t, list);
+
+                if ( segment->pending == 0 )
+                        segment_release(segment);
+                else {
+                        close(segment->fd);
+                        prelude_list_del(&segment->list);
+                        free(segment);
+                }
+        }
+
+        gl_lock_unlock(mutex);
+
+        free(journal_dirname);
+        journal_dirname = NULL;
+}
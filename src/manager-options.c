@@ -28,6 +28,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
@@ -40,12 +42,21 @@
 #include <libprelude/daemonize.h>
 #include <libprelude/prelude-log.h>
 
+#include "ev.h"
+#include "prelude-manager.h"
 #include "bufpool.h"
+#include "journal.h"
+#include "memory-governor.h"
 #include "server-generic.h"
 #include "sensor-server.h"
 #include "manager-options.h"
 #include "report-plugins.h"
+#include "filter-plugins.h"
+#include "decode-plugins.h"
+#include "plugin-lock.h"
+#include "idmef-message-scheduler.h"
 #include "reverse-relaying.h"
+#include "rcu.h"
 
 
 #define DEFAULT_MANAGER_ADDR "0.0.0.0"
@@ -55,6 +66,28 @@
 manager_config_t config;
 extern prelude_client_t *manager_client;
 
+static size_t reload_safe_count = 0;
+static prelude_plugin_generic_t **reload_safe_plugin = NULL;
+
+extern struct ev_loop *manager_event_loop;
+static prelude_option_t *reload_root_optlist = NULL;
+
+
+/*
+ * Options that are only applied on startup: they are ignored when the
+ * configuration is reloaded, a restart is required to change them.
+ */
+static prelude_bool_t startup_only(prelude_option_t *opt)
+{
+        if ( ! config.reloading )
+                return FALSE;
+
+        prelude_log_debug(1, "option '%s' can not be changed without restart, ignored.\n",
+                          prelude_option_get_longopt(opt));
+
+        return TRUE;
+}
+
 
 static int set_conf_file(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
 {
@@ -74,6 +107,9 @@ static int set_daemon_mode(prelude_option_t *opt, const char *arg, prelude_strin
 {
         int ret;
 
+        if ( startup_only(opt) )
+                return 0;
+
         ret = prelude_daemonize(config.pidfile);
         if ( ret < 0 )
                 return ret;
@@ -101,6 +137,9 @@ static int set_debug_mode(prelude_option_t *opt, const char *arg, prelude_string
 
 static int set_pidfile(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
 {
+        if ( startup_only(opt) )
+                return 0;
+
         config.pidfile = strdup(arg);
         return 0;
 }
@@ -211,6 +250,9 @@ static int set_reverse_relay(prelude_option_t *opt, const char *arg, prelude_str
 {
         int ret;
 
+        if ( startup_only(opt) )
+                return 0;
+
         if ( config.nserver == 0 ) {
                 ret = add_server_default();
                 if ( ret < 0 )
@@ -230,6 +272,9 @@ static int set_listen_address(prelude_option_t *opt, const char *arg, prelude_st
         server_generic_t *server;
         unsigned int port = DEFAULT_MANAGER_PORT;
 
+        if ( startup_only(opt) )
+                return 0;
+
         if ( strncmp(arg, "unix", 4) != 0 ) {
 
                 ptr = strrchr(arg, ':');
@@ -256,6 +301,9 @@ static int set_report_plugin_failover(prelude_option_t *opt, const char *arg, pr
 {
         int ret;
 
+        if ( startup_only(opt) )
+                return 0;
+
         ret = report_plugin_activate_failover(arg);
         if ( ret == 0 )
                 prelude_log(PRELUDE_LOG_INFO, "Failover capability enabled for reporting plugin %s.\n", arg);
@@ -275,6 +323,9 @@ static int set_connection_timeout(prelude_option_t *opt, const char *arg, prelud
 
 static int set_dh_bits(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
 {
+        if ( startup_only(opt) )
+                return 0;
+
         config.dh_bits = atoi(arg);
         return 0;
 }
@@ -289,75 +340,94 @@ static int set_dh_regenerate(prelude_option_t *opt, const char *arg, prelude_str
 
 static int set_tls_options(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
 {
+        if ( startup_only(opt) )
+                return 0;
+
         config.tls_options = strdup(arg);
         return 0;
 }
 
 
-static char *const2char(const char *val)
+/*
+ * Parse a space separated list of priority:value pairs, as used by
+ * the sched-* options, calling cb for each of them.
+ */
+static int parse_priority_list(const char *arg, int (*cb)(sched_priority_t priority, const char *value, void *data), void *data)
 {
-        union {
-                const char *ro;
-                char *rw;
-        } uval;
-
-        uval.ro = val;
+        int ret = 0;
+        unsigned int i;
+        char *name, *value, *ptr, *buf;
+        const char *tbl[] = { "high", "medium", "low" };
 
-        return uval.rw;
-}
+        buf = ptr = strdup(arg);
+        if ( ! buf )
+                return prelude_error_from_errno(errno);
 
+        while ( (name = strsep(&ptr, " ")) ) {
+                if ( ! *name )
+                        continue;
 
-static int set_sched_priority(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
-{
-        unsigned int i;
-        char *name, *prio, *value = const2char(arg);
-        struct {
-                const char *name;
-                unsigned int priority;
-        } tbl[] = {
-                { "high", 5 },
-                { "medium", 3 },
-                { "low", 2 }
-        };
-
-        while ( (name = strsep(&value, " ")) ) {
-                prio = strchr(name, ':');
-                if ( ! prio ) {
+                value = strchr(name, ':');
+                if ( ! value ) {
                         prelude_log(PRELUDE_LOG_ERR, "could not find colon delimiter in: '%s'.\n", name);
-                        return -1;
+                        ret = -1;
+                        break;
                 }
 
-                *prio++ = 0;
+                *value++ = 0;
 
                 for ( i = 0; i < sizeof(tbl) / sizeof(*tbl); i++ ) {
-                        if ( strcmp(name, tbl[i].name) == 0 ) {
-                                tbl[i].priority = atoi(prio);
+                        if ( strcmp(name, tbl[i]) == 0 )
                                 break;
-                        }
                 }
 
                 if ( i == sizeof(tbl) / sizeof(*tbl) ) {
                         prelude_log(PRELUDE_LOG_ERR, "priority '%s' does not exist.\n", name);
-                        *prio = ':';
-                        return -1;
+                        ret = -1;
+                        break;
                 }
 
-                *prio = ':';
+                ret = cb(i, value, data);
+                if ( ret < 0 )
+                        break;
         }
 
-        idmef_message_scheduler_set_priority(tbl[0].priority, tbl[1].priority, tbl[2].priority);
+        free(buf);
+        return ret;
+}
+
+
+static int set_priority_cb(sched_priority_t priority, const char *value, void *data)
+{
+        unsigned int *tbl = data;
+
+        tbl[priority] = atoi(value);
         return 0;
 }
 
 
-static int set_sched_buffer_size(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+static int set_sched_priority(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+        unsigned int tbl[] = { 5, 3, 2 };
+
+        ret = parse_priority_list(arg, set_priority_cb, tbl);
+        if ( ret < 0 )
+                return ret;
+
+        idmef_message_scheduler_set_priority(tbl[SCHED_PRIORITY_HIGH], tbl[SCHED_PRIORITY_MEDIUM], tbl[SCHED_PRIORITY_LOW]);
+        return 0;
+}
+
+
+static int parse_size(const char *arg, size_t *out)
 {
         char *eptr = NULL;
         unsigned long int value;
 
         value = strtoul(arg, &eptr, 10);
         if ( value == ULONG_MAX || eptr == arg ) {
-                prelude_log(PRELUDE_LOG_ERR, "Invalid buffer size specified: '%s'.\n", arg);
+                prelude_log(PRELUDE_LOG_ERR, "Invalid size specified: '%s'.\n", arg);
                 return -1;
         }
 
@@ -370,16 +440,255 @@ static int set_sched_buffer_size(prelude_option_t *opt, const char *arg, prelude
         else if ( *eptr == 'G' || *eptr == 'g' )
                 value = value * 1024 * 1024 * 1024;
 
-        else if ( eptr != arg ) {
-                prelude_log(PRELUDE_LOG_ERR, "Invalid buffer suffix specified: '%s'.\n", arg);
+        else if ( *eptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "Invalid size suffix specified: '%s'.\n", arg);
                 return -1;
         }
 
+        *out = value;
+        return 0;
+}
+
+
+static int set_sched_buffer_size(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+        size_t value;
+
+        ret = parse_size(arg, &value);
+        if ( ret < 0 )
+                return ret;
+
         bufpool_set_disk_threshold(value);
         return 0;
 }
 
 
+static int set_memory_limit_cb(sched_priority_t priority, const char *value, void *data)
+{
+        int ret;
+        size_t size;
+
+        ret = parse_size(value, &size);
+        if ( ret < 0 )
+                return ret;
+
+        idmef_message_scheduler_set_memory_limit(priority, size);
+        return 0;
+}
+
+
+static int set_sched_memory_limit(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        return parse_priority_list(arg, set_memory_limit_cb, NULL);
+}
+
+
+static int set_disk_limit_cb(sched_priority_t priority, const char *value, void *data)
+{
+        int ret;
+        size_t size;
+
+        ret = parse_size(value, &size);
+        if ( ret < 0 )
+                return ret;
+
+        idmef_message_scheduler_set_disk_limit(priority, size);
+        return 0;
+}
+
+
+static int set_sched_disk_limit(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        return parse_priority_list(arg, set_disk_limit_cb, NULL);
+}
+
+
+static int set_drop_policy_cb(sched_priority_t priority, const char *value, void *data)
+{
+        unsigned int i;
+        const char *tbl[] = { "drop-newest", "drop-oldest", "drop-low-priority", "drop-heartbeat" };
+
+        for ( i = 0; i < sizeof(tbl) / sizeof(*tbl); i++ ) {
+                if ( strcmp(value, tbl[i]) == 0 ) {
+                        idmef_message_scheduler_set_drop_policy(priority, i);
+                        return 0;
+                }
+        }
+
+        prelude_log(PRELUDE_LOG_ERR, "drop policy '%s' does not exist.\n", value);
+        return -1;
+}
+
+
+static int set_sched_drop_policy(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        return parse_priority_list(arg, set_drop_policy_cb, NULL);
+}
+
+
+static int set_memory_limit(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+        size_t value;
+
+        ret = parse_size(arg, &value);
+        if ( ret < 0 )
+                return ret;
+
+        memory_governor_set_limit(value);
+        return 0;
+}
+
+
+static int set_sched_fast_stop(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        idmef_message_scheduler_set_fast_stop(TRUE);
+        return 0;
+}
+
+
+static int set_reload_handoff(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        if ( ! arg || strcmp(arg, "listen") == 0 )
+                config.reload_handoff = MANAGER_RELOAD_HANDOFF_LISTEN;
+
+        else if ( strcmp(arg, "all") == 0 )
+                config.reload_handoff = MANAGER_RELOAD_HANDOFF_ALL;
+
+        else {
+                prelude_string_sprintf(err, "invalid reload-handoff mode '%s', expected 'listen' or 'all'", arg);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+static int set_ingest_check(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        if ( strcmp(arg, "none") == 0 )
+                config.ingest_check = MANAGER_INGEST_CHECK_NONE;
+
+        else if ( strcmp(arg, "tlv") == 0 )
+                config.ingest_check = MANAGER_INGEST_CHECK_TLV;
+
+        else {
+                prelude_string_sprintf(err, "invalid ingest-check mode '%s', expected 'none' or 'tlv'", arg);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+static int set_sched_intern_cache(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        idmef_message_scheduler_set_intern_cache_size(strtoul(arg, NULL, 10));
+        return 0;
+}
+
+
+static int set_sched_recovery_rate(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        idmef_message_scheduler_set_recovery_rate(atoi(arg));
+        return 0;
+}
+
+
+static int set_sched_journal(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        if ( startup_only(opt) )
+                return 0;
+
+        journal_set_enabled(TRUE);
+        return 0;
+}
+
+
+/*
+ * Accept sync interval up to a minute: longer interval would only leave
+ * more unsynced data at risk.
+ */
+static int set_sched_journal_sync_interval(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        unsigned long int value;
+
+        errno = 0;
+        value = strtoul(arg, &eptr, 10);
+        if ( errno || eptr == arg || *eptr ) {
+                prelude_string_sprintf(err, "invalid sched-journal-sync-interval '%s', expected a number of milliseconds", arg);
+                return -1;
+        }
+
+        if ( value < 1 || value > 60000 ) {
+                prelude_string_sprintf(err, "sched-journal-sync-interval %lu out of range, expected 1 to 60000 milliseconds", value);
+                return -1;
+        }
+
+        journal_set_sync_interval(value);
+        return 0;
+}
+
+
+static int set_filter_reorder_interval(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        unsigned long int value;
+
+        errno = 0;
+        value = strtoul(arg, &eptr, 10);
+        if ( errno || eptr == arg || *eptr || value > UINT_MAX ) {
+                prelude_string_sprintf(err, "invalid filter-reorder-interval '%s', expected a number of seconds", arg);
+                return -1;
+        }
+
+        filter_plugins_set_reorder_interval(value);
+        return 0;
+}
+
+
+static int get_filter_stats(prelude_option_t *opt, prelude_string_t *out, void *context)
+{
+        return filter_plugins_get_stats(out);
+}
+
+
+
+static void reload_request_cb(int revents, void *arg)
+{
+        manager_options_reload(reload_root_optlist);
+}
+
+
+
+/*
+ * The request is answered before the configuration is re-read: the
+ * reload itself happen from the event loop, once the option request
+ * handling (and the processing pause it might have required) is over.
+ */
+static int set_reload_config(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        ev_once(manager_event_loop, -1, 0, 0, reload_request_cb, NULL);
+        return 0;
+}
+
+
+static int set_sched_journal_sync_size(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+        size_t value;
+
+        ret = parse_size(arg, &value);
+        if ( ret < 0 )
+                return ret;
+
+        journal_set_sync_size(value);
+        return 0;
+}
+
+
 
 #if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
 static int set_user(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
@@ -389,6 +698,9 @@ static int set_user(prelude_option_t *opt, const char *optarg, prelude_string_t
         const char *p;
         struct passwd *pw;
 
+        if ( startup_only(opt) )
+                return 0;
+
         for ( p = optarg; isdigit((int) *p); p++ );
 
         if ( *p == 0 )
@@ -420,6 +732,9 @@ static int set_group(prelude_option_t *opt, const char *optarg, prelude_string_t
         const char *p;
         struct group *grp;
 
+        if ( startup_only(opt) )
+                return 0;
+
         for ( p = optarg; isdigit((int) *p); p++ );
 
         if ( *p == 0 )
@@ -475,6 +790,8 @@ int manager_options_init(prelude_option_t *rootopt, int *argc, char **argv)
         config.config_file = PRELUDE_MANAGER_CONF;
         config.tls_options = NULL;
 
+        reload_root_optlist = rootopt;
+
         prelude_option_new_root(&init_first);
 
         prelude_option_add(init_first, &opt, PRELUDE_OPTION_TYPE_CLI, 'h', "help",
@@ -533,12 +850,72 @@ int manager_options_init(prelude_option_t *rootopt, int *argc, char **argv)
                            "Size of the Diffie Hellman prime (768, 1024, 2048, 3072 or 4096)",
                            PRELUDE_OPTION_ARGUMENT_REQUIRED, set_dh_bits, NULL);
 
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "memory-limit",
+                           "Maximum amount of memory used by the manager buffers",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_memory_limit, NULL);
+
         prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-priority",
                            NULL, PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_priority, NULL);
 
         prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-buffer-size",
                            NULL, PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_buffer_size, NULL);
 
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-memory-limit",
+                           "Per priority memory limit of a sensor queue, beyond which it is stored on disk",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_memory_limit, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-disk-limit",
+                           "Per priority disk limit of a sensor queue, beyond which the drop policy apply",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_disk_limit, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-drop-policy",
+                           "Per priority policy applied when a sensor queue reach its disk limit",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_drop_policy, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG, 0, "sched-fast-stop",
+                           "On exit, store queued messages to disk instead of processing them",
+                           PRELUDE_OPTION_ARGUMENT_NONE, set_sched_fast_stop, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG, 0, "reload-handoff",
+                           "On SIGHUP, hand listening sockets (and idle local connections with 'all') over to the new instance",
+                           PRELUDE_OPTION_ARGUMENT_OPTIONAL, set_reload_handoff, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG, 0, "ingest-check",
+                           "Validate IDMEF messages on reception, closing the connection of senders of invalid messages (none|tlv)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_ingest_check, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-recovery-rate",
+                           "Maximum number of messages per second recovered from a previous run (default unlimited)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_recovery_rate, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-intern-cache",
+                           "Number of analyzer and classification subtrees shared between the events of a sensor (default 0, disabled)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_intern_cache, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-journal",
+                           "Write queued messages to a journal so that they survive a crash",
+                           PRELUDE_OPTION_ARGUMENT_NONE, set_sched_journal, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-journal-sync-interval",
+                           "Maximum number of milliseconds between two journal sync (default 100)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_journal_sync_interval, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-journal-sync-size",
+                           "Amount of unsynced journal data triggering a sync (default 1M)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_journal_sync_size, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "filter-reorder-interval",
+                           "Number of seconds between two reordering of the filters of a category by cost and selectivity (default 0, disabled)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_filter_reorder_interval, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_WIDE, 0, "filter-stats",
+                           "Number of runs, accepted messages and average run time of each filter",
+                           PRELUDE_OPTION_ARGUMENT_NONE, NULL, get_filter_stats);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_WIDE, 0, "reload-config",
+                           "Re-read the configuration file, as on SIGUSR1",
+                           PRELUDE_OPTION_ARGUMENT_NONE, set_reload_config, NULL);
+
         prelude_option_add(rootopt, &opt, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG, 'c', "child-managers",
                            "List of managers address:port pair where messages should be gathered from",
                            PRELUDE_OPTION_ARGUMENT_REQUIRED, set_reverse_relay, NULL);
@@ -608,3 +985,94 @@ int manager_options_read(prelude_option_t *manager_root_optlist, int *argc, char
 
         return ret;
 }
+
+
+
+/*
+ * Called from plugin initialization, before any message is processed.
+ */
+void manager_plugin_set_reload_safe(prelude_plugin_generic_t *plugin)
+{
+        prelude_plugin_generic_t **ptr;
+
+        ptr = realloc(reload_safe_plugin, (reload_safe_count + 1) * sizeof(*ptr));
+        if ( ! ptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return;
+        }
+
+        ptr[reload_safe_count++] = plugin;
+        reload_safe_plugin = ptr;
+}
+
+
+
+prelude_bool_t manager_plugin_is_reload_safe(prelude_plugin_instance_t *pi)
+{
+        size_t i;
+        prelude_plugin_generic_t *plugin = prelude_plugin_instance_get_plugin(pi);
+
+        for ( i = 0; i < reload_safe_count; i++ ) {
+                if ( reload_safe_plugin[i] == plugin )
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+
+
+/*
+ * Re-read the configuration file. Messages keep being processed: plugins
+ * that declared their option callbacks safe are (re)configured while
+ * running, and the resulting filter and report plugin graph replace the
+ * previous one at once, between two messages. Filter and report instances
+ * that did not are paused for the time of the reload through their plugin
+ * lock. Decoding plugins do not run under a plugin lock, if one of them is
+ * not reload safe, the whole processing is paused instead.
+ *
+ * Sections removed from the configuration file are not destroyed, a
+ * restart is required for that.
+ */
+int manager_options_reload(prelude_option_t *manager_root_optlist)
+{
+        uint32_t mask = 0;
+        int ret, argc = 1;
+        prelude_string_t *err;
+        prelude_bool_t paused;
+        char *argv[] = { (char *) "prelude-manager", NULL };
+
+        prelude_log(PRELUDE_LOG_INFO, "reloading configuration from %s.\n", config.config_file);
+
+        paused = ! decode_plugins_reload_safe();
+        if ( paused ) {
+                prelude_log(PRELUDE_LOG_INFO, "some decoding plugins can not be reconfigured while running: processing paused for the reload.\n");
+                idmef_message_scheduler_stop_processing();
+        } else {
+                mask = filter_plugins_get_reload_lock_mask() | report_plugins_get_reload_lock_mask();
+                plugin_lock_mask(mask);
+        }
+
+        config.reloading = TRUE;
+        rcu_update_begin();
+
+        ret = prelude_option_read(manager_root_optlist, &config.config_file, &argc, argv, &err, manager_client);
+        if ( ret < 0 ) {
+                if ( err )
+                        prelude_log(PRELUDE_LOG_WARN, "Option error on reload: %s.\n", prelude_string_get_string(err));
+                else
+                        prelude_perror(ret, "error processing options on reload");
+        }
+
+        report_plugins_publish_graph();
+
+        rcu_update_end();
+        config.reloading = FALSE;
+
+        if ( paused )
+                idmef_message_scheduler_start_processing();
+        else
+                plugin_unlock_mask(mask);
+
+        return (ret < 0) ? ret : 0;
+}
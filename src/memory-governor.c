@@ -0,0 +1,198 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "glthread/lock.h"
+#include "memory-governor.h"
+
+
+/*
+ * Percentage of the memory limit at which each state is entered.
+ */
+#define SPILL_THRESHOLD 60
+#define PAUSE_THRESHOLD 80
+#define SHED_THRESHOLD  95
+
+
+/*
+ * The memory governor account for the memory used by the different
+ * manager buffers, and enforce a single process wide limit:
+ *
+ * - SPILL: queued messages are flushed to disk.
+ * - PAUSE: reading from sensors is suspended until usage decrease.
+ * - SHED: low priority messages are dropped on reception.
+ *
+ * Without limit, usage is accounted but the state stay NORMAL.
+ */
+static size_t memory_limit = 0;
+static size_t total_used = 0;
+static size_t account_used[MEMORY_ACCOUNT_END];
+static size_t account_peak[MEMORY_ACCOUNT_END];
+static memory_governor_state_t state = MEMORY_GOVERNOR_STATE_NORMAL;
+
+static void (*resume_cb)(void) = NULL;
+static gl_lock_t mutex = gl_lock_initializer;
+
+static const char *account_name[MEMORY_ACCOUNT_END] = {
+        "bufpool", "ingest", "write-queue", "relay-queue", "decode"
+};
+
+
+
+static memory_governor_state_t compute_state(size_t used)
+{
+        if ( ! memory_limit )
+                return MEMORY_GOVERNOR_STATE_NORMAL;
+
+        if ( used >= memory_limit / 100 * SHED_THRESHOLD )
+                return MEMORY_GOVERNOR_STATE_SHED;
+
+        if ( used >= memory_limit / 100 * PAUSE_THRESHOLD )
+                return MEMORY_GOVERNOR_STATE_PAUSE;
+
+        if ( used >= memory_limit / 100 * SPILL_THRESHOLD )
+                return MEMORY_GOVERNOR_STATE_SPILL;
+
+        return MEMORY_GOVERNOR_STATE_NORMAL;
+}
+
+
+
+static prelude_bool_t update_state(void)
+{
+        memory_governor_state_t new;
+        prelude_bool_t resume = FALSE;
+
+        new = compute_state(total_used);
+        if ( new == state )
+                return FALSE;
+
+        if ( new > state )
+                prelude_log(PRELUDE_LOG_WARN, "memory usage at %" PRELUDE_PRIu64 " bytes, entering %s state.\n",
+                            (uint64_t) total_used, (new == MEMORY_GOVERNOR_STATE_SHED) ? "shed" :
+                            (new == MEMORY_GOVERNOR_STATE_PAUSE) ? "pause" : "spill");
+
+        else if ( state >= MEMORY_GOVERNOR_STATE_PAUSE && new < MEMORY_GOVERNOR_STATE_PAUSE )
+                resume = TRUE;
+
+        state = new;
+
+        return resume;
+}
+
+
+
+void memory_governor_add(memory_account_t account, size_t len)
+{
+        gl_lock_lock(mutex);
+
+        total_used += len;
+        account_used[account] += len;
+
+        if ( account_used[account] > account_peak[account] )
+                account_peak[account] = account_used[account];
+
+        update_state();
+
+        gl_lock_unlock(mutex);
+}
+
+
+
+void memory_governor_sub(memory_account_t account, size_t len)
+{
+        prelude_bool_t resume;
+
+        gl_lock_lock(mutex);
+
+        total_used -= len;
+        account_used[account] -= len;
+
+        resume = update_state();
+
+        gl_lock_unlock(mutex);
+
+        /*
+         * The callback is called without the lock held, from the thread
+         * that released the memory.
+         */
+        if ( resume && resume_cb )
+                resume_cb();
+}
+
+
+
+memory_governor_state_t memory_governor_get_state(void)
+{
+        memory_governor_state_t ret;
+
+        gl_lock_lock(mutex);
+        ret = state;
+        gl_lock_unlock(mutex);
+
+        return ret;
+}
+
+
+
+void memory_governor_set_limit(size_t limit)
+{
+        gl_lock_lock(mutex);
+        memory_limit = limit;
+        update_state();
+        gl_lock_unlock(mutex);
+}
+
+
+
+/*
+ * cb is called when usage drop back below the pause threshold.
+ */
+void memory_governor_set_resume_callback(void (*cb)(void))
+{
+        resume_cb = cb;
+}
+
+
+
+void memory_governor_print_stats(void)
+{
+        unsigned int i;
+
+        gl_lock_lock(mutex);
+
+        prelude_log(PRELUDE_LOG_INFO, "memory usage: total=%" PRELUDE_PRIu64 " limit=%" PRELUDE_PRIu64 "\n",
+                    (uint64_t) total_used, (uint64_t) memory_limit);
+
+        for ( i = 0; i < MEMORY_ACCOUNT_END; i++ )
+                prelude_log(PRELUDE_LOG_INFO, "%s: used=%" PRELUDE_PRIu64 " peak=%" PRELUDE_PRIu64 "\n",
+                            account_name[i], (uint64_t) account_used[i], (uint64_t) account_peak[i]);
+
+        gl_lock_unlock(mutex);
+}
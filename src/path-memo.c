@@ -0,0 +1,387 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "glthread/lock.h"
+#include "prelude-manager.h"
+#include "path-memo.h"
+
+
+/*
+ * Values retrieved through manager_idmef_path_get() are kept for the
+ * time the message is processed, so that filters and reporting plugins
+ * using the same path share a single lookup. Results recorded through
+ * manager_idmef_result_set() are kept the same way.
+ *
+ * A memo is only filled and read by the thread processing its message,
+ * the lock protect the list of memos in use and the registries.
+ */
+struct path_memo {
+        prelude_list_t list;
+        idmef_message_t *message;
+
+        size_t size;
+        size_t used_count;
+        unsigned int *used;
+        idmef_value_t **value;
+        unsigned char *cached;
+
+        size_t result_size;
+        size_t result_used_count;
+        unsigned int *result_used;
+        unsigned char *result;
+};
+
+
+static PRELUDE_LIST(active_list);
+static PRELUDE_LIST(free_list);
+static gl_lock_t mutex = gl_lock_initializer;
+
+static size_t path_count = 0;
+static char **path_name = NULL;
+
+static size_t result_count = 0;
+static char **result_name = NULL;
+
+
+
+/*
+ * Return the identifier of path, shared by all the paths of the same
+ * name. Identifiers are never released, paths are expected to be
+ * registered at configuration time.
+ */
+int manager_idmef_path_register(idmef_path_t *path)
+{
+        int ret;
+        size_t i;
+        char **tmp;
+        const char *name = idmef_path_get_name(path, -1);
+
+        gl_lock_lock(mutex);
+
+        for ( i = 0; i < path_count; i++ ) {
+                if ( strcmp(path_name[i], name) == 0 ) {
+                        gl_lock_unlock(mutex);
+                        return i;
+                }
+        }
+
+        tmp = realloc(path_name, (path_count + 1) * sizeof(*path_name));
+        if ( ! tmp ) {
+                gl_lock_unlock(mutex);
+                return prelude_error_from_errno(errno);
+        }
+
+        path_name = tmp;
+
+        path_name[path_count] = strdup(name);
+        if ( ! path_name[path_count] ) {
+                gl_lock_unlock(mutex);
+                return prelude_error_from_errno(errno);
+        }
+
+        ret = path_count++;
+        gl_lock_unlock(mutex);
+
+        return ret;
+}
+
+
+
+/*
+ * Same as manager_idmef_path_register(), for results identified by
+ * key. Results of a given key should be the same for a given message,
+ * whatever the plugin computing them.
+ */
+int manager_idmef_result_register(const char *key)
+{
+        int ret;
+        size_t i;
+        char **tmp;
+
+        gl_lock_lock(mutex);
+
+        for ( i = 0; i < result_count; i++ ) {
+                if ( strcmp(result_name[i], key) == 0 ) {
+                        gl_lock_unlock(mutex);
+                        return i;
+                }
+        }
+
+        tmp = realloc(result_name, (result_count + 1) * sizeof(*result_name));
+        if ( ! tmp ) {
+                gl_lock_unlock(mutex);
+                return prelude_error_from_errno(errno);
+        }
+
+        result_name = tmp;
+
+        result_name[result_count] = strdup(key);
+        if ( ! result_name[result_count] ) {
+                gl_lock_unlock(mutex);
+                return prelude_error_from_errno(errno);
+        }
+
+        ret = result_count++;
+        gl_lock_unlock(mutex);
+
+        return ret;
+}
+
+
+
+static path_memo_t *find_memo(idmef_message_t *message)
+{
+        prelude_list_t *tmp;
+        path_memo_t *memo;
+
+        prelude_list_for_each(&active_list, tmp) {
+                memo = prelude_list_entry(tmp, path_memo_t, list);
+                if ( memo->message == message )
+                        return memo;
+        }
+
+        return NULL;
+}
+
+
+
+/*
+ * Same as idmef_path_get(), the returned value should be destroyed by
+ * the caller. id is the value returned by manager_idmef_path_register()
+ * for path, a negative id disable the memoization.
+ */
+int manager_idmef_path_get(idmef_message_t *message, idmef_path_t *path, int id, idmef_value_t **value)
+{
+        int ret;
+        path_memo_t *memo = NULL;
+
+        if ( id >= 0 ) {
+                gl_lock_lock(mutex);
+                memo = find_memo(message);
+                gl_lock_unlock(mutex);
+        }
+
+        if ( memo && (size_t) id < memo->size && memo->cached[id] ) {
+                if ( ! memo->value[id] )
+                        return 0;
+
+                *value = idmef_value_ref(memo->value[id]);
+                return 1;
+        }
+
+        ret = idmef_path_get(path, message, value);
+        if ( ret < 0 || ! memo || (size_t) id >= memo->size )
+                return ret;
+
+        memo->cached[id] = TRUE;
+        memo->value[id] = (ret > 0) ? idmef_value_ref(*value) : NULL;
+        memo->used[memo->used_count++] = id;
+
+        return ret;
+}
+
+
+
+/*
+ * Return the result recorded for id while processing message, or a
+ * negative value if there is none. A negative id disable the
+ * memoization.
+ */
+int manager_idmef_result_get(idmef_message_t *message, int id)
+{
+        unsigned char result;
+        path_memo_t *memo;
+
+        if ( id < 0 )
+                return -1;
+
+        gl_lock_lock(mutex);
+        memo = find_memo(message);
+        gl_lock_unlock(mutex);
+
+        if ( ! memo || (size_t) id >= memo->result_size )
+                return -1;
+
+        result = memo->result[id];
+
+        return (result) ? result - 1 : -1;
+}
+
+
+
+void manager_idmef_result_set(idmef_message_t *message, int id, prelude_bool_t result)
+{
+        path_memo_t *memo;
+
+        if ( id < 0 )
+                return;
+
+        gl_lock_lock(mutex);
+        memo = find_memo(message);
+        gl_lock_unlock(mutex);
+
+        if ( ! memo || (size_t) id >= memo->result_size )
+                return;
+
+        if ( ! memo->result[id] )
+                memo->result_used[memo->result_used_count++] = id;
+
+        memo->result[id] = (result) ? 2 : 1;
+}
+
+
+
+static int memo_resize(path_memo_t *memo, size_t size)
+{
+        void *ptr;
+
+        ptr = realloc(memo->used, size * sizeof(*memo->used));
+        if ( ! ptr )
+                return -1;
+        memo->used = ptr;
+
+        ptr = realloc(memo->value, size * sizeof(*memo->value));
+        if ( ! ptr )
+                return -1;
+        memo->value = ptr;
+
+        ptr = realloc(memo->cached, size * sizeof(*memo->cached));
+        if ( ! ptr )
+                return -1;
+        memo->cached = ptr;
+
+        memset(memo->cached + memo->size, 0, size - memo->size);
+        memo->size = size;
+
+        return 0;
+}
+
+
+
+/*
+ * A zero result is unset, otherwise the result plus one.
+ */
+static int memo_resize_result(path_memo_t *memo, size_t size)
+{
+        void *ptr;
+
+        ptr = realloc(memo->result_used, size * sizeof(*memo->result_used));
+        if ( ! ptr )
+                return -1;
+        memo->result_used = ptr;
+
+        ptr = realloc(memo->result, size * sizeof(*memo->result));
+        if ( ! ptr )
+                return -1;
+        memo->result = ptr;
+
+        memset(memo->result + memo->result_size, 0, size - memo->result_size);
+        memo->result_size = size;
+
+        return 0;
+}
+
+
+
+/*
+ * Memos are recycled, so that processing a message does not allocate
+ * once the registered paths are known.
+ */
+path_memo_t *path_memo_begin(idmef_message_t *message)
+{
+        path_memo_t *memo;
+
+        gl_lock_lock(mutex);
+
+        if ( ! path_count && ! result_count ) {
+                gl_lock_unlock(mutex);
+                return NULL;
+        }
+
+        if ( ! prelude_list_is_empty(&free_list) ) {
+                memo = prelude_list_entry(free_list.next, path_memo_t, list);
+                prelude_list_del(&memo->list);
+        } else {
+                memo = calloc(1, sizeof(*memo));
+                if ( ! memo ) {
+                        gl_lock_unlock(mutex);
+                        return NULL;
+                }
+        }
+
+        if ( (memo->size < path_count && memo_resize(memo, path_count) < 0) ||
+             (memo->result_size < result_count && memo_resize_result(memo, result_count) < 0) ) {
+                prelude_list_add(&free_list, &memo->list);
+                gl_lock_unlock(mutex);
+                return NULL;
+        }
+
+        memo->message = message;
+        prelude_list_add(&active_list, &memo->list);
+
+        gl_lock_unlock(mutex);
+
+        return memo;
+}
+
+
+
+void path_memo_end(path_memo_t *memo)
+{
+        size_t i;
+
+        if ( ! memo )
+                return;
+
+        for ( i = 0; i < memo->used_count; i++ ) {
+                if ( memo->value[memo->used[i]] )
+                        idmef_value_destroy(memo->value[memo->used[i]]);
+
+                memo->cached[memo->used[i]] = FALSE;
+        }
+
+        memo->used_count = 0;
+
+        for ( i = 0; i < memo->result_used_count; i++ )
+                memo->result[memo->result_used[i]] = 0;
+
+        memo->result_used_count = 0;
+
+        gl_lock_lock(mutex);
+
+        prelude_list_del(&memo->list);
+        memo->message = NULL;
+        prelude_list_add(&free_list, &memo->list);
+
+        gl_lock_unlock(mutex);
+}
@@ -0,0 +1,117 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <libprelude/prelude.h>
+
+#include "glthread/lock.h"
+#include "plugin-lock.h"
+
+
+/*
+ * Plugin instances are serialized against option changes through a
+ * small set of locks, selected from the instance address: the
+ * processing threads hold the lock of an instance while running it,
+ * and an option request modifying the instance take the same lock,
+ * pausing this instance (and the few sharing its lock) only.
+ *
+ * The processing threads never hold more than one of these locks at a
+ * time, option requests take them in ascending order.
+ */
+#define PLUGIN_LOCK_COUNT 32
+
+
+static gl_lock_t lock_table[PLUGIN_LOCK_COUNT];
+gl_once_define(static, lock_once)
+
+
+
+static void lock_table_init(void)
+{
+        unsigned int i;
+
+        for ( i = 0; i < PLUGIN_LOCK_COUNT; i++ )
+                gl_lock_init(lock_table[i]);
+}
+
+
+
+static unsigned int get_slot(prelude_plugin_instance_t *pi)
+{
+        unsigned long key = (unsigned long) pi;
+
+        gl_once(lock_once, lock_table_init);
+
+        return (key >> 4 ^ key >> 12) % PLUGIN_LOCK_COUNT;
+}
+
+
+
+void plugin_lock(prelude_plugin_instance_t *pi)
+{
+        gl_lock_lock(lock_table[get_slot(pi)]);
+}
+
+
+
+void plugin_unlock(prelude_plugin_instance_t *pi)
+{
+        gl_lock_unlock(lock_table[get_slot(pi)]);
+}
+
+
+
+uint32_t plugin_lock_get_mask(prelude_plugin_instance_t *pi)
+{
+        return (uint32_t) 1 << get_slot(pi);
+}
+
+
+
+void plugin_lock_mask(uint32_t mask)
+{
+        unsigned int i;
+
+        gl_once(lock_once, lock_table_init);
+
+        for ( i = 0; i < PLUGIN_LOCK_COUNT; i++ ) {
+                if ( mask & ((uint32_t) 1 << i) )
+                        gl_lock_lock(lock_table[i]);
+        }
+}
+
+
+
+void plugin_unlock_mask(uint32_t mask)
+{
+        unsigned int i;
+
+        for ( i = PLUGIN_LOCK_COUNT; i > 0; i-- ) {
+                if ( mask & ((uint32_t) 1 << (i - 1)) )
+                        gl_lock_unlock(lock_table[i - 1]);
+        }
+}
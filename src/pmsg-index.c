@@ -0,0 +1,317 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+#include <libprelude/idmef-message-id.h>
+
+#include "pmsg-index.h"
+
+
+#define TLV_HDR_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+
+
+/*
+ * The position of every TLV depend on the length of the previous one,
+ * so that the walk is inherently serial: it is kept to a single bound
+ * check per TLV, the index being grown geometrically when needed.
+ */
+static int grow_index(pmsg_index_t *index)
+{
+        pmsg_tlv_t *tlv;
+        size_t size = index->size * 2;
+
+        if ( index->tlv == index->inline_tlv ) {
+                tlv = malloc(size * sizeof(*tlv));
+                if ( tlv )
+                        memcpy(tlv, index->inline_tlv, index->count * sizeof(*tlv));
+        } else
+                tlv = realloc(index->tlv, size * sizeof(*tlv));
+
+        if ( ! tlv ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        index->tlv = tlv;
+        index->size = size;
+
+        return 0;
+}
+
+
+
+/*
+ * Index the TLVs found in the len bytes of data, which should not
+ * include the message header. Returns -1 if a TLV does not fit within
+ * data, in which case the index is left empty.
+ */
+int pmsg_index_build(pmsg_index_t *index, const unsigned char *data, size_t len)
+{
+        uint32_t tlen;
+        pmsg_tlv_t *tlv;
+        const unsigned char *end = data + len;
+
+        index->count = 0;
+        index->tlv = index->inline_tlv;
+        index->size = PMSG_INDEX_INLINE_SIZE;
+
+        while ( data != end ) {
+                if ( (size_t) (end - data) < TLV_HDR_SIZE )
+                        goto err;
+
+                memcpy(&tlen, data + sizeof(uint8_t), sizeof(tlen));
+                tlen = ntohl(tlen);
+
+                if ( tlen > (size_t) (end - data) - TLV_HDR_SIZE )
+                        goto err;
+
+                if ( index->count == index->size && grow_index(index) < 0 )
+                        goto err;
+
+                tlv = &index->tlv[index->count++];
+                tlv->tag = *data;
+                tlv->mark = 0;
+                tlv->len = tlen;
+                tlv->value = data + TLV_HDR_SIZE;
+
+                data += TLV_HDR_SIZE + tlen;
+        }
+
+        return 0;
+
+ err:
+        pmsg_index_destroy(index);
+        return -1;
+}
+
+
+
+/*
+ * Index msg, without modifying its read position.
+ */
+int pmsg_index_build_from_msg(pmsg_index_t *index, prelude_msg_t *msg)
+{
+        size_t len = prelude_msg_get_len(msg);
+        const unsigned char *data = prelude_msg_get_message_data(msg);
+
+        if ( len < PMSG_HEADER_SIZE ) {
+                index->count = 0;
+                index->tlv = index->inline_tlv;
+                index->size = PMSG_INDEX_INLINE_SIZE;
+                return -1;
+        }
+
+        return pmsg_index_build(index, data + PMSG_HEADER_SIZE, len - PMSG_HEADER_SIZE);
+}
+
+
+
+/*
+ * Classes that may appear within each IDMEF class, the alert and
+ * heartbeat classes being the top-level ones.
+ */
+#define PMSG_CHECK_MAX_DEPTH 32
+
+static const struct {
+        int parent;
+        int child;
+} class_nesting[] = {
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_ANALYZER_TAG },
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_CLASSIFICATION_TAG },
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_SOURCE_TAG },
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_TARGET_TAG },
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_ASSESSMENT_TAG },
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_ADDITIONAL_DATA_TAG },
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_TOOL_ALERT_TAG },
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_CORRELATION_ALERT_TAG },
+        { IDMEF_MSG_ALERT_TAG, IDMEF_MSG_OVERFLOW_ALERT_TAG },
+        { IDMEF_MSG_HEARTBEAT_TAG, IDMEF_MSG_ANALYZER_TAG },
+        { IDMEF_MSG_HEARTBEAT_TAG, IDMEF_MSG_ADDITIONAL_DATA_TAG },
+        { IDMEF_MSG_ANALYZER_TAG, IDMEF_MSG_NODE_TAG },
+        { IDMEF_MSG_ANALYZER_TAG, IDMEF_MSG_PROCESS_TAG },
+        { IDMEF_MSG_ANALYZER_TAG, IDMEF_MSG_ANALYZER_TAG },
+        { IDMEF_MSG_NODE_TAG, IDMEF_MSG_ADDRESS_TAG },
+        { IDMEF_MSG_SOURCE_TAG, IDMEF_MSG_NODE_TAG },
+        { IDMEF_MSG_SOURCE_TAG, IDMEF_MSG_USER_TAG },
+        { IDMEF_MSG_SOURCE_TAG, IDMEF_MSG_PROCESS_TAG },
+        { IDMEF_MSG_SOURCE_TAG, IDMEF_MSG_SERVICE_TAG },
+        { IDMEF_MSG_TARGET_TAG, IDMEF_MSG_NODE_TAG },
+        { IDMEF_MSG_TARGET_TAG, IDMEF_MSG_USER_TAG },
+        { IDMEF_MSG_TARGET_TAG, IDMEF_MSG_PROCESS_TAG },
+        { IDMEF_MSG_TARGET_TAG, IDMEF_MSG_SERVICE_TAG },
+        { IDMEF_MSG_TARGET_TAG, IDMEF_MSG_FILE_TAG },
+        { IDMEF_MSG_USER_TAG, IDMEF_MSG_USER_ID_TAG },
+        { IDMEF_MSG_SERVICE_TAG, IDMEF_MSG_WEB_SERVICE_TAG },
+        { IDMEF_MSG_SERVICE_TAG, IDMEF_MSG_SNMP_SERVICE_TAG },
+        { IDMEF_MSG_FILE_TAG, IDMEF_MSG_FILE_ACCESS_TAG },
+        { IDMEF_MSG_FILE_TAG, IDMEF_MSG_LINKAGE_TAG },
+        { IDMEF_MSG_FILE_TAG, IDMEF_MSG_INODE_TAG },
+        { IDMEF_MSG_FILE_TAG, IDMEF_MSG_CHECKSUM_TAG },
+        { IDMEF_MSG_FILE_ACCESS_TAG, IDMEF_MSG_USER_ID_TAG },
+        { IDMEF_MSG_LINKAGE_TAG, IDMEF_MSG_FILE_TAG },
+        { IDMEF_MSG_CLASSIFICATION_TAG, IDMEF_MSG_REFERENCE_TAG },
+        { IDMEF_MSG_ASSESSMENT_TAG, IDMEF_MSG_IMPACT_TAG },
+        { IDMEF_MSG_ASSESSMENT_TAG, IDMEF_MSG_ACTION_TAG },
+        { IDMEF_MSG_ASSESSMENT_TAG, IDMEF_MSG_CONFIDENCE_TAG },
+        { IDMEF_MSG_TOOL_ALERT_TAG, IDMEF_MSG_ALERTIDENT_TAG },
+        { IDMEF_MSG_CORRELATION_ALERT_TAG, IDMEF_MSG_ALERTIDENT_TAG },
+};
+
+
+
+static prelude_bool_t is_class_tag(uint8_t tag)
+{
+        size_t i;
+
+        if ( tag == IDMEF_MSG_ALERT_TAG || tag == IDMEF_MSG_HEARTBEAT_TAG )
+                return TRUE;
+
+        for ( i = 0; i < sizeof(class_nesting) / sizeof(*class_nesting); i++ ) {
+                if ( class_nesting[i].child == tag )
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+
+
+static prelude_bool_t can_nest(uint8_t parent, uint8_t child)
+{
+        size_t i;
+
+        for ( i = 0; i < sizeof(class_nesting) / sizeof(*class_nesting); i++ ) {
+                if ( class_nesting[i].parent == parent && class_nesting[i].child == child )
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+
+
+/*
+ * Top-level TLVs, outside of any class.
+ */
+static int check_toplevel_tlv(pmsg_tlv_t *tlv)
+{
+        /*
+         * pmsg_to_idmef() reference the version without copy,
+         * it has to be NUL terminated.
+         */
+        if ( tlv->tag == IDMEF_MSG_MESSAGE_VERSION )
+                return (tlv->len == 0 || tlv->value[tlv->len - 1] != '\0') ? -1 : 0;
+
+        if ( tlv->tag == IDMEF_MSG_OWN_FORMAT )
+                return 0;
+
+        return -1;
+}
+
+
+
+/*
+ * Validate the TLV structure of msg without decoding it, and without
+ * modifying its read position: every TLV should fit within the message,
+ * every class should be opened within a class it belong to and closed by
+ * an END_OF_TAG, and only the top-level tags known to pmsg_to_idmef()
+ * should appear outside of a class. The fields of a class are not checked.
+ *
+ * The content following a proprietary message tag belong to the decode
+ * plugin handling it, and is not checked either.
+ */
+int pmsg_check(prelude_msg_t *msg)
+{
+        int ret = 0;
+        size_t i, depth = 0;
+        pmsg_tlv_t *tlv;
+        pmsg_index_t index;
+        uint8_t stack[PMSG_CHECK_MAX_DEPTH];
+
+        ret = pmsg_index_build_from_msg(&index, msg);
+        if ( ret < 0 || index.count == 0 )
+                return -1;
+
+        for ( i = 0; i < index.count && ret == 0; i++ ) {
+                tlv = &index.tlv[i];
+
+                /*
+                 * END_OF_TAG never carry a value, it close the current
+                 * class, the whole message at the top-level.
+                 */
+                if ( tlv->tag == IDMEF_MSG_END_OF_TAG ) {
+                        if ( tlv->len != 0 )
+                                ret = -1;
+
+                        else if ( depth > 0 )
+                                depth--;
+                }
+
+                else if ( is_class_tag(tlv->tag) ) {
+                        if ( depth == PMSG_CHECK_MAX_DEPTH )
+                                ret = -1;
+
+                        else if ( depth == 0 && tlv->tag != IDMEF_MSG_ALERT_TAG && tlv->tag != IDMEF_MSG_HEARTBEAT_TAG )
+                                ret = -1;
+
+                        else if ( depth > 0 && ! can_nest(stack[depth - 1], tlv->tag) )
+                                ret = -1;
+
+                        else
+                                stack[depth++] = tlv->tag;
+                }
+
+                else if ( depth == 0 ) {
+                        ret = check_toplevel_tlv(tlv);
+                        if ( tlv->tag == IDMEF_MSG_OWN_FORMAT )
+                                break;
+                }
+        }
+
+        if ( depth > 0 )
+                ret = -1;
+
+        pmsg_index_destroy(&index);
+
+        return ret;
+}
+
+
+
+void pmsg_index_destroy(pmsg_index_t *index)
+{
+        if ( index->tlv != index->inline_tlv )
+                free(index->tlv);
+
+        index->count = 0;
+        index->tlv = index->inline_tlv;
+        index->size = PMSG_INDEX_INLINE_SIZE;
+}
@@ -79,7 +79,7 @@ static int get_msg_time(prelude_msg_t *msg, idmef_time_t *create_time, idmef_tim
 
 
 
-static int handle_heartbeat_msg(prelude_msg_t *msg, idmef_message_t *idmef)
+static int handle_heartbeat_msg(prelude_msg_t *msg, prelude_msg_t *orig, idmef_message_t *idmef)
 {
         int ret;
         idmef_time_t *analyzer_time;
@@ -94,7 +94,7 @@ static int handle_heartbeat_msg(prelude_msg_t *msg, idmef_message_t *idmef)
                 return ret;
 
         if ( ! idmef_heartbeat_get_analyzer_time(heartbeat) ) {
-                ret = get_msg_time(msg, idmef_heartbeat_get_create_time(heartbeat), &analyzer_time);
+                ret = get_msg_time(orig, idmef_heartbeat_get_create_time(heartbeat), &analyzer_time);
                 if ( ret < 0 )
                         return ret;
 
@@ -109,7 +109,7 @@ static int handle_heartbeat_msg(prelude_msg_t *msg, idmef_message_t *idmef)
 
 
 
-static int handle_alert_msg(prelude_msg_t *msg, idmef_message_t *idmef)
+static int handle_alert_msg(prelude_msg_t *msg, prelude_msg_t *orig, idmef_message_t *idmef)
 {
         int ret;
         idmef_alert_t *alert;
@@ -124,7 +124,7 @@ static int handle_alert_msg(prelude_msg_t *msg, idmef_message_t *idmef)
                 return ret;
 
         if ( ! idmef_alert_get_analyzer_time(alert) ) {
-                ret = get_msg_time(msg, idmef_alert_get_create_time(alert), &analyzer_time);
+                ret = get_msg_time(orig, idmef_alert_get_create_time(alert), &analyzer_time);
                 if ( ret < 0 )
                         return ret;
 
@@ -158,7 +158,11 @@ static int handle_proprietary_msg(prelude_msg_t *msg, idmef_message_t *idmef, vo
 
 
 
-int pmsg_to_idmef(idmef_message_t **idmef, prelude_msg_t *msg)
+/*
+ * orig is the message as received, from which the reception time is
+ * retrieved, msg the message being decoded.
+ */
+static int decode_message(idmef_message_t **idmef, prelude_msg_t *msg, prelude_msg_t *orig)
 {
         int ret;
         void *buf;
@@ -175,10 +179,10 @@ int pmsg_to_idmef(idmef_message_t **idmef, prelude_msg_t *msg)
         while ( (ret = prelude_msg_get(msg, &tag, &len, &buf)) == 0 ) {
 
                 if ( tag == IDMEF_MSG_ALERT_TAG )
-                        ret = handle_alert_msg(msg, *idmef);
+                        ret = handle_alert_msg(msg, orig, *idmef);
 
                 else if ( tag == IDMEF_MSG_HEARTBEAT_TAG )
-                        ret = handle_heartbeat_msg(msg, *idmef);
+                        ret = handle_heartbeat_msg(msg, orig, *idmef);
 
                 else if ( tag == IDMEF_MSG_OWN_FORMAT )
                         ret = handle_proprietary_msg(msg, *idmef, buf, len);
@@ -213,3 +217,20 @@ int pmsg_to_idmef(idmef_message_t **idmef, prelude_msg_t *msg)
 
         return ret;
 }
+
+
+
+int pmsg_to_idmef(idmef_message_t **idmef, prelude_msg_t *msg)
+{
+        return decode_message(idmef, msg, msg);
+}
+
+
+
+/*
+ * Decode copy, a modified copy of the received message orig.
+ */
+int pmsg_to_idmef_from_copy(idmef_message_t **idmef, prelude_msg_t *copy, prelude_msg_t *orig)
+{
+        return decode_message(idmef, copy, orig);
+}
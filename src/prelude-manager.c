@@ -44,6 +44,7 @@
 #include "idmef-message-scheduler.h"
 #include "reverse-relaying.h"
 #include "manager-auth.h"
+#include "memory-governor.h"
 
 #define MANAGER_MODEL "Prelude Manager"
 #define MANAGER_CLASS "Concentrator"
@@ -79,12 +80,32 @@ static RETSIGTYPE handle_signal(int sig)
 
 
 #if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+static void handoff_manager(void)
+{
+        int ret;
+
+        ret = server_generic_handoff(config.server, config.nserver);
+        if ( ret < 0 )
+                prelude_log(PRELUDE_LOG_WARN, "error handing off listening sockets.\n");
+
+        if ( config.reload_handoff != MANAGER_RELOAD_HANDOFF_ALL )
+                return;
+
+        ret = sensor_server_handoff_clients();
+        if ( ret < 0 )
+                prelude_log(PRELUDE_LOG_WARN, "error handing off established connections.\n");
+}
+
+
 static void restart_manager(void)
 {
         int ret;
 
         prelude_log(PRELUDE_LOG_INFO, "Restarting Prelude Manager (%s).\n", global_argv[0]);
 
+        if ( config.reload_handoff )
+                handoff_manager();
+
         ret = execvp(global_argv[0], global_argv);
         if ( ret < 0 )
                 prelude_log(PRELUDE_LOG_ERR, "Error restarting Prelude Manager (%s).\n", global_argv[0]);
@@ -148,6 +169,23 @@ static void sig_cb(struct ev_loop *loop, struct ev_signal *s, int revent)
 }
 
 
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+static void reload_cb(struct ev_loop *loop, struct ev_signal *s, int revent)
+{
+        manager_options_reload(s->data);
+}
+
+
+static void add_reload_signal(int signo, prelude_option_t *root_optlist)
+{
+        ev_signal *s = malloc(sizeof(*s));
+        ev_signal_init(s, reload_cb, signo);
+        s->data = root_optlist;
+        ev_signal_start(manager_event_loop, s);
+}
+#endif
+
+
 static void add_signal(int signo, struct sigaction *action)
 {
         ev_signal *s = malloc(sizeof(*s));
@@ -293,6 +331,11 @@ int main(int argc, char **argv)
 #if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
         add_signal(SIGQUIT, &action);
         add_signal(SIGHUP, &action);
+        add_reload_signal(SIGUSR1, manager_root_optlist);
+#endif
+
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+        sensor_server_adopt_clients(config.server, config.nserver);
 #endif
 
         server_generic_start(config.server, config.nserver);
@@ -304,7 +347,19 @@ int main(int argc, char **argv)
                 prelude_log(PRELUDE_LOG_WARN, "signal %d received, %s prelude-manager.\n",
                             got_signal, get_restart_string());
 
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+        /*
+         * With reload hand-off, the new instance take over our queues
+         * rather than waiting for them to be processed.
+         */
+        if ( got_signal == SIGHUP && config.reload_handoff )
+                idmef_message_scheduler_set_fast_stop(TRUE);
+#endif
+
         idmef_message_scheduler_exit();
+        memory_governor_print_stats();
+        filter_plugins_print_stats();
+
         prelude_client_destroy(manager_client, PRELUDE_CLIENT_EXIT_STATUS_FAILURE);
 
         report_plugins_close();
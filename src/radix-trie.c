@@ -0,0 +1,256 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+
+#include "prelude-manager.h"
+
+
+#define RADIX_KEY_SIZE 16
+
+
+/*
+ * Path compressed binary trie (Patricia): nodes only exist where a
+ * prefix is stored or where two stored prefixes diverge, so that a
+ * lookup visit at most one node per distinct branching point, and
+ * never more than the number of stored prefixes along the key path.
+ *
+ * Bits beyond a node prefix length are always zero in its key.
+ */
+typedef struct radix_node {
+        struct radix_node *child[2];
+        void *data;
+        prelude_bool_t have_data;
+        unsigned int bits;
+        unsigned char key[RADIX_KEY_SIZE];
+} radix_node_t;
+
+
+struct manager_radix_trie {
+        radix_node_t *root;
+        unsigned int max_bits;
+        size_t count;
+};
+
+
+
+static inline unsigned int get_bit(const unsigned char *key, unsigned int bit)
+{
+        return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+
+
+/*
+ * Number of leading bits, up to max, that a and b have in common.
+ */
+static unsigned int get_common_bits(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+        unsigned int i = 0;
+
+        while ( i + 8 <= max && a[i >> 3] == b[i >> 3] )
+                i += 8;
+
+        while ( i < max && get_bit(a, i) == get_bit(b, i) )
+                i++;
+
+        return i;
+}
+
+
+
+static radix_node_t *node_new(const unsigned char *key, unsigned int bits, void *data, prelude_bool_t have_data)
+{
+        unsigned int len;
+        radix_node_t *node;
+
+        node = calloc(1, sizeof(*node));
+        if ( ! node )
+                return NULL;
+
+        len = (bits + 7) / 8;
+        memcpy(node->key, key, len);
+
+        if ( bits % 8 )
+                node->key[len - 1] &= 0xff << (8 - bits % 8);
+
+        node->bits = bits;
+        node->data = data;
+        node->have_data = have_data;
+
+        return node;
+}
+
+
+
+int manager_radix_trie_new(manager_radix_trie_t **trie, unsigned int max_bits)
+{
+        if ( max_bits > RADIX_KEY_SIZE * 8 )
+                return -1;
+
+        *trie = calloc(1, sizeof(**trie));
+        if ( ! *trie )
+                return prelude_error_from_errno(errno);
+
+        (*trie)->max_bits = max_bits;
+
+        return 0;
+}
+
+
+
+/*
+ * Store data for the prefix made of the first bits of key. Return -1
+ * if the prefix is already stored.
+ */
+int manager_radix_trie_insert(manager_radix_trie_t *trie, const unsigned char *key, unsigned int bits, void *data)
+{
+        unsigned int common;
+        radix_node_t *node, *new, *branch, **link = &trie->root;
+
+        if ( bits > trie->max_bits )
+                return -1;
+
+        while ( (node = *link) ) {
+                common = get_common_bits(node->key, key, (node->bits < bits) ? node->bits : bits);
+
+                if ( common == node->bits && common == bits ) {
+                        if ( node->have_data )
+                                return -1;
+
+                        node->data = data;
+                        node->have_data = TRUE;
+                        trie->count++;
+
+                        return 0;
+                }
+
+                if ( common == node->bits ) {
+                        link = &node->child[get_bit(key, node->bits)];
+                        continue;
+                }
+
+                new = node_new(key, bits, data, TRUE);
+                if ( ! new )
+                        return prelude_error_from_errno(errno);
+
+                /*
+                 * The new prefix cover node.
+                 */
+                if ( common == bits ) {
+                        new->child[get_bit(node->key, bits)] = node;
+                        *link = new;
+                        trie->count++;
+                        return 0;
+                }
+
+                /*
+                 * Both diverge after common bits.
+                 */
+                branch = node_new(key, common, NULL, FALSE);
+                if ( ! branch ) {
+                        free(new);
+                        return prelude_error_from_errno(errno);
+                }
+
+                branch->child[get_bit(key, common)] = new;
+                branch->child[get_bit(node->key, common)] = node;
+                *link = branch;
+                trie->count++;
+
+                return 0;
+        }
+
+        *link = node_new(key, bits, data, TRUE);
+        if ( ! *link )
+                return prelude_error_from_errno(errno);
+
+        trie->count++;
+
+        return 0;
+}
+
+
+
+/*
+ * Longest prefix match of the first bits of key, NULL if no stored
+ * prefix cover it.
+ */
+void *manager_radix_trie_lookup(manager_radix_trie_t *trie, const unsigned char *key, unsigned int bits)
+{
+        void *best = NULL;
+        radix_node_t *node = trie->root;
+
+        while ( node && node->bits <= bits ) {
+                if ( get_common_bits(node->key, key, node->bits) != node->bits )
+                        break;
+
+                if ( node->have_data )
+                        best = node->data;
+
+                if ( node->bits == bits )
+                        break;
+
+                node = node->child[get_bit(key, node->bits)];
+        }
+
+        return best;
+}
+
+
+
+size_t manager_radix_trie_get_count(manager_radix_trie_t *trie)
+{
+        return trie->count;
+}
+
+
+
+static void node_destroy(radix_node_t *node, void (*destroy)(void *data))
+{
+        if ( ! node )
+                return;
+
+        node_destroy(node->child[0], destroy);
+        node_destroy(node->child[1], destroy);
+
+        if ( node->have_data && destroy )
+                destroy(node->data);
+
+        free(node);
+}
+
+
+
+void manager_radix_trie_destroy(manager_radix_trie_t *trie, void (*destroy)(void *data))
+{
+        node_destroy(trie->root, destroy);
+        free(trie);
+}
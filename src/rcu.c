@@ -0,0 +1,281 @@
+/*****
+*
+* Copyright (C) 2010 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "glthread/lock.h"
+#include "glthread/cond.h"
+#include "prelude-manager.h"
+#include "rcu.h"
+
+
+/*
+ * Read-copy-update for the objects shared with the processing threads
+ * (filter hooks, report plugin list, plugin private data):
+ *
+ * - Readers enclose the processing of a message within rcu_read_lock()
+ *   and rcu_read_unlock(), which never wait for a writer.
+ *
+ * - Writers publish a new version of an object, then hand the old one
+ *   to manager_defer_free(). It is destroyed once every reader that
+ *   might still reference it has left its read section.
+ *
+ * Readers are accounted in one of two slots, selected by the parity of
+ * the current generation. The generation can only move forward when
+ * the slot it is about to reuse is empty, so that an object retired
+ * during generation G is no longer referenced once generation G + 2 is
+ * reached.
+ *
+ * Between rcu_update_begin() and rcu_update_end(), retired objects are
+ * held back: the caller is expected to publish the objects replacing
+ * them before ending the update.
+ */
+typedef struct {
+        prelude_list_t list;
+        unsigned int generation;
+        void (*destroy)(void *data);
+        void *data;
+} deferred_t;
+
+
+static gl_lock_t lock = gl_lock_initializer;
+static gl_cond_t cond = gl_cond_initializer;
+
+static unsigned int generation = 0;
+static unsigned int readers[2] = { 0, 0 };
+static unsigned int update_depth = 0;
+
+static PRELUDE_LIST(deferred_list);
+static PRELUDE_LIST(update_list);
+
+
+
+/*
+ * Must be called with the lock held.
+ */
+static prelude_bool_t try_advance(void)
+{
+        if ( readers[(generation + 1) & 1] != 0 )
+                return FALSE;
+
+        generation++;
+        return TRUE;
+}
+
+
+
+/*
+ * Must be called with the lock held: move expired entries to out.
+ */
+static void collect_expired(prelude_list_t *out)
+{
+        deferred_t *entry;
+        unsigned int i;
+        prelude_list_t *tmp, *bkp;
+
+        for ( i = 0; i < 2 && ! prelude_list_is_empty(&deferred_list); i++ ) {
+                if ( ! try_advance() )
+                        break;
+        }
+
+        prelude_list_for_each_safe(&deferred_list, tmp, bkp) {
+                entry = prelude_list_entry(tmp, deferred_t, list);
+
+                if ( generation - entry->generation < 2 )
+                        break;
+
+                prelude_list_del(&entry->list);
+                prelude_list_add_tail(out, &entry->list);
+        }
+}
+
+
+
+static void destroy_expired(prelude_list_t *head)
+{
+        deferred_t *entry;
+        prelude_list_t *tmp, *bkp;
+
+        prelude_list_for_each_safe(head, tmp, bkp) {
+                entry = prelude_list_entry(tmp, deferred_t, list);
+
+                prelude_list_del(&entry->list);
+                entry->destroy(entry->data);
+                free(entry);
+        }
+}
+
+
+
+unsigned int rcu_read_lock(void)
+{
+        unsigned int token;
+
+        gl_lock_lock(lock);
+        token = generation & 1;
+        readers[token]++;
+        gl_lock_unlock(lock);
+
+        return token;
+}
+
+
+
+/*
+ * Leaving a read section is the quiescent point where deferred objects
+ * are destroyed.
+ */
+void rcu_read_unlock(unsigned int token)
+{
+        PRELUDE_LIST(expired);
+
+        gl_lock_lock(lock);
+
+        if ( --readers[token] == 0 )
+                gl_cond_broadcast(cond);
+
+        if ( ! prelude_list_is_empty(&deferred_list) )
+                collect_expired(&expired);
+
+        gl_lock_unlock(lock);
+
+        destroy_expired(&expired);
+}
+
+
+
+/*
+ * Wait for every reader that entered its read section before this call
+ * to leave it. Must not be called from within a read section.
+ */
+void rcu_synchronize(void)
+{
+        unsigned int target;
+        PRELUDE_LIST(expired);
+
+        gl_lock_lock(lock);
+
+        target = generation + 2;
+
+        while ( (int) (generation - target) < 0 ) {
+                if ( ! try_advance() )
+                        gl_cond_wait(cond, lock);
+        }
+
+        collect_expired(&expired);
+        gl_lock_unlock(lock);
+
+        destroy_expired(&expired);
+}
+
+
+
+void manager_defer_free(void (*destroy)(void *data), void *data)
+{
+        deferred_t *entry;
+        PRELUDE_LIST(expired);
+
+        entry = malloc(sizeof(*entry));
+        if ( ! entry ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+
+                if ( ! rcu_update_in_progress() ) {
+                        rcu_synchronize();
+                        destroy(data);
+                }
+
+                return;
+        }
+
+        entry->data = data;
+        entry->destroy = destroy;
+
+        gl_lock_lock(lock);
+
+        if ( update_depth )
+                prelude_list_add_tail(&update_list, &entry->list);
+        else {
+                entry->generation = generation;
+                prelude_list_add_tail(&deferred_list, &entry->list);
+                collect_expired(&expired);
+        }
+
+        gl_lock_unlock(lock);
+
+        destroy_expired(&expired);
+}
+
+
+
+void rcu_update_begin(void)
+{
+        gl_lock_lock(lock);
+        update_depth++;
+        gl_lock_unlock(lock);
+}
+
+
+
+void rcu_update_end(void)
+{
+        deferred_t *entry;
+        prelude_list_t *tmp, *bkp;
+        PRELUDE_LIST(expired);
+
+        gl_lock_lock(lock);
+
+        if ( --update_depth == 0 ) {
+                prelude_list_for_each_safe(&update_list, tmp, bkp) {
+                        entry = prelude_list_entry(tmp, deferred_t, list);
+
+                        entry->generation = generation;
+                        prelude_list_del(&entry->list);
+                        prelude_list_add_tail(&deferred_list, &entry->list);
+                }
+
+                collect_expired(&expired);
+        }
+
+        gl_lock_unlock(lock);
+
+        destroy_expired(&expired);
+}
+
+
+
+prelude_bool_t rcu_update_in_progress(void)
+{
+        prelude_bool_t ret;
+
+        gl_lock_lock(lock);
+        ret = (update_depth > 0);
+        gl_lock_unlock(lock);
+
+        return ret;
+}
@@ -42,6 +42,11 @@
 #include "report-plugins.h"
 #include "filter-plugins.h"
 #include "pmsg-to-idmef.h"
+#include "glthread/lock.h"
+#include "plugin-lock.h"
+#include "idmef-projection.h"
+#include "rcu.h"
+#include "manager-options.h"
 
 
 #define FAILOVER_RETRY_TIMEOUT 10 * 60
@@ -52,6 +57,23 @@ static prelude_msgbuf_t *msgbuf;
 static PRELUDE_LIST(report_plugins_instance);
 
 
+/*
+ * Snapshot of the subscribed report plugins and of the filter hooks,
+ * swapped as a whole so that a message is processed against a single
+ * configuration.
+ */
+struct report_graph {
+        prelude_bool_t skip_additional_data;
+        size_t count;
+        prelude_plugin_instance_t **instance;
+        filter_chain_t **chain;
+        filter_graph_t *filters;
+};
+
+static report_graph_t *graph = NULL;
+static gl_lock_t graph_lock = gl_lock_initializer;
+
+
 typedef struct {
         prelude_bool_t failover_enabled;
         prelude_timer_t timer;
@@ -250,6 +272,7 @@ static int subscribe(prelude_plugin_instance_t *pi)
                     plugin->name, prelude_plugin_instance_get_name(pi));
 
         prelude_plugin_instance_add(pi, &report_plugins_instance);
+        report_plugins_update_graph();
 
         return 0;
 }
@@ -263,6 +286,12 @@ static void unsubscribe(prelude_plugin_instance_t *pi)
                     plugin->name, prelude_plugin_instance_get_name(pi));
 
         prelude_plugin_instance_del(pi);
+
+        /*
+         * The instance is released as soon as we return.
+         */
+        report_plugins_publish_graph();
+        rcu_synchronize();
 }
 
 
@@ -303,12 +332,23 @@ static int save_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
 
 static void save_idmef_message(prelude_failover_t *pf, idmef_message_t *msg)
 {
+        int ret;
+        idmef_message_t *full;
+
+        ret = manager_idmef_message_get_full(msg, &full);
+        if ( ret < 0 ) {
+                prelude_perror(ret, "error decoding message to be saved");
+                return;
+        }
+
         /*
          * this is a message we generated ourself...
          */
         prelude_msgbuf_set_data(msgbuf, pf);
-        idmef_message_write(msg, msgbuf);
+        idmef_message_write(full, msgbuf);
         prelude_msgbuf_mark_end(msgbuf);
+
+        idmef_message_destroy(full);
 }
 
 
@@ -317,7 +357,10 @@ static int report_plugin_run_single(prelude_plugin_instance_t *pi, plugin_failov
 {
         int ret;
 
+        plugin_lock(pi);
         ret = prelude_plugin_run(pi, manager_report_plugin_t, run, pi, idmef);
+        plugin_unlock(pi);
+
         if ( ret < 0 && pf ) {
                 if ( ret == MANAGER_REPORT_PLUGIN_FAILURE_SINGLE )
                         save_idmef_message(pf->failed_failover, idmef);
@@ -335,25 +378,23 @@ static int report_plugin_run_single(prelude_plugin_instance_t *pi, plugin_failov
 /*
  * Start all plugins of kind 'list'.
  */
-void report_plugins_run(idmef_message_t *idmef)
+void report_plugins_run(report_graph_t *graph, idmef_message_t *idmef)
 {
         int ret;
-        prelude_list_t *tmp;
+        size_t i;
         plugin_failover_t *pf;
-        prelude_plugin_generic_t *pg;
         prelude_plugin_instance_t *pi;
 
-        ret = filter_plugins_run_by_category(idmef, MANAGER_FILTER_CATEGORY_REPORTING);
+        ret = filter_plugins_run_by_category(graph->filters, idmef, MANAGER_FILTER_CATEGORY_REPORTING);
         if ( ret < 0 )
                 return;
 
-        prelude_list_for_each(&report_plugins_instance, tmp) {
+        for ( i = 0; i < graph->count; i++ ) {
 
-                pi = prelude_linked_object_get_object(tmp);
-                pg = prelude_plugin_instance_get_plugin(pi);
+                pi = graph->instance[i];
                 pf = prelude_plugin_instance_get_data(pi);
 
-                ret = filter_plugins_run_by_plugin(idmef, pi);
+                ret = filter_plugins_run_chain(graph->chain[i], idmef);
                 if ( ret < 0 )
                         continue;
 
@@ -368,6 +409,155 @@ void report_plugins_run(idmef_message_t *idmef)
 
 
 
+static void destroy_graph(void *data)
+{
+        report_graph_t *old = data;
+
+        filter_plugins_destroy_graph(old->filters);
+        free(old);
+}
+
+
+
+/*
+ * Locks of the report instances whose options can not be changed while
+ * they are running.
+ */
+uint32_t report_plugins_get_reload_lock_mask(void)
+{
+        uint32_t mask = 0;
+        prelude_list_t *tmp;
+        prelude_plugin_instance_t *pi;
+
+        prelude_list_for_each(&report_plugins_instance, tmp) {
+                pi = prelude_linked_object_get_object(tmp);
+
+                if ( ! manager_plugin_is_reload_safe(pi) )
+                        mask |= plugin_lock_get_mask(pi);
+        }
+
+        return mask;
+}
+
+
+
+/*
+ * Swap the graph used by the processing threads with one built from
+ * the current plugin configuration. The previous graph is released
+ * once no message is being processed against it.
+ */
+void report_plugins_publish_graph(void)
+{
+        size_t count = 0;
+        prelude_list_t *tmp;
+        report_graph_t *new, *old;
+
+        prelude_list_for_each(&report_plugins_instance, tmp)
+                count++;
+
+        new = malloc(sizeof(*new) + count * (sizeof(*new->instance) + sizeof(*new->chain)));
+        if ( ! new ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return;
+        }
+
+        new->filters = filter_plugins_new_graph();
+        if ( ! new->filters ) {
+                free(new);
+                return;
+        }
+
+        new->count = 0;
+        new->instance = (prelude_plugin_instance_t **) (new + 1);
+        new->chain = (filter_chain_t **) (new->instance + count);
+        new->skip_additional_data = ! filter_plugins_need_additional_data(new->filters);
+
+        prelude_list_for_each(&report_plugins_instance, tmp) {
+                new->instance[new->count] = prelude_linked_object_get_object(tmp);
+                new->chain[new->count] = filter_plugins_get_chain(new->filters, new->instance[new->count]);
+
+                if ( idmef_projection_need_additional_data(new->instance[new->count]) )
+                        new->skip_additional_data = FALSE;
+
+                new->count++;
+        }
+
+        gl_lock_lock(graph_lock);
+        old = graph;
+        graph = new;
+        gl_lock_unlock(graph_lock);
+
+        if ( old )
+                manager_defer_free(destroy_graph, old);
+}
+
+
+
+/*
+ * Called when the plugin configuration change: while a configuration
+ * update is in progress, publishing is left to its end.
+ */
+void report_plugins_update_graph(void)
+{
+        if ( ! rcu_update_in_progress() )
+                report_plugins_publish_graph();
+}
+
+
+
+/*
+ * Should only be called from within a RCU read section, the graph
+ * remain valid until the section end.
+ */
+report_graph_t *report_plugins_get_graph(void)
+{
+        report_graph_t *ret;
+
+        gl_lock_lock(graph_lock);
+        ret = graph;
+        gl_lock_unlock(graph_lock);
+
+        return ret;
+}
+
+
+
+filter_graph_t *report_plugins_get_filters(report_graph_t *graph)
+{
+        return graph->filters;
+}
+
+
+
+/*
+ * Whether none of the plugins in graph use additional_data, in which
+ * case messages are decoded without it.
+ */
+prelude_bool_t report_plugins_skip_additional_data(report_graph_t *graph)
+{
+        return graph->skip_additional_data;
+}
+
+
+
+
+/*
+ * Access to the report plugin instances of graph, in the order they
+ * are run.
+ */
+size_t report_plugins_get_count(report_graph_t *graph)
+{
+        return graph->count;
+}
+
+
+
+prelude_plugin_instance_t *report_plugins_get_instance(report_graph_t *graph, size_t index)
+{
+        return (index < graph->count) ? graph->instance[index] : NULL;
+}
+
+
 
 /*
  * Close all report plugins.
@@ -36,10 +36,12 @@
 
 #include "glthread/lock.h"
 
+#include "prelude-manager.h"
 #include "reverse-relaying.h"
 #include "server-generic.h"
 #include "sensor-server.h"
 #include "manager-options.h"
+#include "memory-governor.h"
 
 #include "sensor-server.h"
 
@@ -255,6 +257,8 @@ static int send_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
         mq->msg = msg;
         mq->analyzerid = *(uint64_t *) prelude_msgbuf_get_data(msgbuf);
 
+        memory_governor_add(MEMORY_ACCOUNT_RELAY_QUEUE, prelude_msg_get_len(msg));
+
         gl_lock_lock(mqueue_mutex);
         prelude_list_add_tail(&mqueue_list, &mq->list);
         gl_lock_unlock(mqueue_mutex);
@@ -331,6 +335,7 @@ void reverse_relay_send_receiver(idmef_message_t *idmef)
         int ret;
         uint64_t analyzerid;
         prelude_bool_t empty;
+        idmef_message_t *full;
 
         /*
          * If there is no receiver, no need to queue the message.
@@ -357,10 +362,16 @@ void reverse_relay_send_receiver(idmef_message_t *idmef)
          * object will be created, and attached to the list of message
          * to be emited.
          */
+        ret = manager_idmef_message_get_full(idmef, &full);
+        if ( ret < 0 )
+                return;
+
         prelude_msgbuf_set_data(msgbuf, &analyzerid);
-        idmef_message_write(idmef, msgbuf);
+        idmef_message_write(full, msgbuf);
         prelude_msgbuf_mark_end(msgbuf);
 
+        idmef_message_destroy(full);
+
         /*
          * Finally, restart the main server event loop so that it
          * take into account the event to be written, and call
@@ -394,6 +405,8 @@ void reverse_relay_send_prepared(void)
                         }
                 }
 
+                memory_governor_sub(MEMORY_ACCOUNT_RELAY_QUEUE, prelude_msg_get_len(mq->msg));
+
                 prelude_msg_destroy(mq->msg);
                 free(mq);
         }
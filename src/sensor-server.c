@@ -26,7 +26,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <assert.h>
@@ -46,16 +49,25 @@
 #include "idmef-message-scheduler.h"
 #include "manager-options.h"
 #include "reverse-relaying.h"
+#include "memory-governor.h"
+#include "plugin-lock.h"
+#include "pmsg-to-idmef.h"
+#include "pmsg-index.h"
 
 #define TARGET_UNREACHABLE "Destination agent is unreachable"
 #define TARGET_PROHIBITED  "Destination agent is administratively prohibited"
 
 
 extern prelude_client_t *manager_client;
+extern manager_config_t config;
 
 static PRELUDE_LIST(sensors_cnx_list);
 static uint32_t global_instance_id = 0;
 
+extern struct ev_loop *manager_event_loop;
+static struct ev_async resume_event;
+static prelude_bool_t resume_event_initialized = FALSE;
+
 
 static sensor_fd_t *search_client(prelude_list_t *head, uint64_t analyzerid, uint32_t instance_id)
 {
@@ -81,6 +93,7 @@ static int write_client(sensor_fd_t *dst, prelude_msg_t *msg)
         ret = prelude_msg_write(msg, dst->fd);
         if ( ret < 0 && prelude_error_get_code(ret) == PRELUDE_ERROR_EAGAIN ) {
 
+                memory_governor_add(MEMORY_ACCOUNT_WRITE_QUEUE, prelude_msg_get_len(msg));
                 prelude_linked_object_add(&dst->write_msg_list, (prelude_linked_object_t *) msg);
                 server_generic_notify_write_enable((server_generic_client_t *) dst);
 
@@ -254,10 +267,86 @@ static int process_request_cb(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
 
 
 
+/*
+ * Map an option name, such as "plugin[instance].option", to the lock
+ * of the plugin instance it belong to.
+ */
+static int get_option_lock_mask(const char *name, size_t len, uint32_t *mask)
+{
+        int ret;
+        prelude_plugin_instance_t *pi;
+        char pname[256], iname[256];
+
+        if ( len == 0 || name[len - 1] != '\0' )
+                return -1;
+
+        ret = sscanf(name, "%255[^[.][%255[^]]", pname, iname);
+        if ( ret <= 0 )
+                return -1;
+
+        pi = prelude_plugin_search_instance_by_name(NULL, pname, (ret == 2) ? iname : NULL);
+        if ( ! pi )
+                return -1;
+
+        *mask |= plugin_lock_get_mask(pi);
+
+        return 0;
+}
+
+
+
+/*
+ * Find out what an option request require: requests getting, setting or
+ * committing options of existing plugin instances only lock these
+ * instances, returned in mask. Reading an option also need the lock,
+ * since the processing thread might be modifying the instance state.
+ *
+ * Returns -1 if processing should be stopped, when the request destroy
+ * an instance, create one, list every option, or target anything else.
+ */
+static int get_request_lock_mask(prelude_msg_t *msg, uint32_t *mask)
+{
+        size_t i;
+        int ret = 0;
+        pmsg_tlv_t *tlv;
+        pmsg_index_t index;
+        prelude_bool_t need_name = FALSE;
+
+        *mask = 0;
+
+        ret = pmsg_index_build_from_msg(&index, msg);
+        if ( ret < 0 )
+                return -1;
+
+        for ( i = 0; i < index.count && ret == 0; i++ ) {
+                tlv = &index.tlv[i];
+
+                if ( tlv->tag == PRELUDE_MSG_OPTION_DESTROY )
+                        ret = -1;
+
+                else if ( tlv->tag == PRELUDE_MSG_OPTION_SET || tlv->tag == PRELUDE_MSG_OPTION_COMMIT ||
+                          tlv->tag == PRELUDE_MSG_OPTION_GET || tlv->tag == PRELUDE_MSG_OPTION_LIST )
+                        need_name = TRUE;
+
+                else if ( tlv->tag == PRELUDE_MSG_OPTION_NAME && need_name ) {
+                        ret = get_option_lock_mask((const char *) tlv->value, tlv->len, mask);
+                        need_name = FALSE;
+                }
+        }
+
+        pmsg_index_destroy(&index);
+
+        return (ret < 0 || need_name) ? -1 : 0;
+}
+
+
+
 static int process_option_request(prelude_client_t *dst, sensor_fd_t *src, prelude_msg_t *msg)
 {
         int ret;
+        uint32_t mask;
         prelude_msgbuf_t *buf;
+        prelude_bool_t stop_processing;
 
         ret = prelude_msgbuf_new(&buf);
         if ( ret < 0 )
@@ -268,11 +357,22 @@ static int process_option_request(prelude_client_t *dst, sensor_fd_t *src, prelu
         prelude_msgbuf_set_flags(buf, PRELUDE_MSGBUF_FLAGS_ASYNC);
 
         /*
-         * Stop report plugin processing for safety.
+         * Only stop report plugin processing when the request can not be
+         * restricted to the plugin instances it modify.
          */
-        idmef_message_scheduler_stop_processing();
+        stop_processing = (get_request_lock_mask(msg, &mask) < 0);
+
+        if ( stop_processing )
+                idmef_message_scheduler_stop_processing();
+        else
+                plugin_lock_mask(mask);
+
         ret = prelude_option_process_request(dst, msg, buf);
-        idmef_message_scheduler_start_processing();
+
+        if ( stop_processing )
+                idmef_message_scheduler_start_processing();
+        else
+                plugin_unlock_mask(mask);
 
         prelude_msgbuf_destroy(buf);
 
@@ -450,6 +550,17 @@ static int handle_msg(sensor_fd_t *client, prelude_msg_t *msg, uint8_t tag)
                         return -1;
                 }
 
+                /*
+                 * Reject invalid messages before they reach the queue, so
+                 * that they don't cost disk and scheduler time.
+                 */
+                if ( config.ingest_check == MANAGER_INGEST_CHECK_TLV && pmsg_check(msg) < 0 ) {
+                        server_generic_log_client((server_generic_client_t *) client, PRELUDE_LOG_WARN,
+                                                  "invalid IDMEF message received, closing connection.\n");
+                        prelude_msg_destroy(msg);
+                        return -1;
+                }
+
                 ret = idmef_message_schedule(client->queue, msg);
         }
 
@@ -480,6 +591,22 @@ static int handle_msg(sensor_fd_t *client, prelude_msg_t *msg, uint8_t tag)
 
 
 
+/*
+ * Account the memory allocated for the message being read.
+ */
+static void update_ingest_len(sensor_fd_t *cnx, size_t len)
+{
+        if ( len > cnx->ingest_len )
+                memory_governor_add(MEMORY_ACCOUNT_INGEST, len - cnx->ingest_len);
+
+        else if ( len < cnx->ingest_len )
+                memory_governor_sub(MEMORY_ACCOUNT_INGEST, cnx->ingest_len - len);
+
+        cnx->ingest_len = len;
+}
+
+
+
 static int read_connection_cb(server_generic_client_t *client)
 {
         int ret;
@@ -490,8 +617,12 @@ static int read_connection_cb(server_generic_client_t *client)
         if ( ret < 0 ) {
                 prelude_error_code_t code = prelude_error_get_code(ret);
 
-                if ( code == PRELUDE_ERROR_EAGAIN )
+                if ( code == PRELUDE_ERROR_EAGAIN ) {
+                        update_ingest_len(cnx, (cnx->msg) ? prelude_msg_get_len(cnx->msg) : 0);
                         return 0;
+                }
+
+                update_ingest_len(cnx, 0);
 
                 cnx->msg = NULL;
                 if ( code != PRELUDE_ERROR_EOF )
@@ -500,6 +631,8 @@ static int read_connection_cb(server_generic_client_t *client)
                 return -1;
         }
 
+        update_ingest_len(cnx, 0);
+
         msg = cnx->msg;
         cnx->msg = NULL;
 
@@ -507,6 +640,23 @@ static int read_connection_cb(server_generic_client_t *client)
         if ( ret < 0 )
                 return ret;
 
+        /*
+         * Stop reading from this sensor until the memory governor
+         * report that memory usage decreased.
+         */
+        if ( cnx->queue && memory_governor_get_state() >= MEMORY_GOVERNOR_STATE_PAUSE ) {
+                server_generic_client_pause_read(client);
+
+                /*
+                 * Usage might have decreased before we paused, in which
+                 * case the resume notification was already sent.
+                 */
+                if ( memory_governor_get_state() < MEMORY_GOVERNOR_STATE_PAUSE )
+                        server_generic_client_resume_read(client);
+
+                return 0;
+        }
+
         return 1;
 }
 
@@ -522,6 +672,7 @@ static int write_connection_cb(server_generic_client_t *client)
         prelude_list_for_each(&sclient->write_msg_list, tmp) {
                 cur = prelude_linked_object_get_object(tmp);
                 prelude_linked_object_del((prelude_linked_object_t *) cur);
+                memory_governor_sub(MEMORY_ACCOUNT_WRITE_QUEUE, prelude_msg_get_len(cur));
 
                 ret = write_client(sclient, cur);
                 if ( ret < 0 && prelude_error_get_code(ret) == PRELUDE_ERROR_EAGAIN ) {
@@ -602,6 +753,7 @@ static int close_connection_cb(server_generic_client_t *ptr)
         prelude_list_for_each_safe(&cnx->write_msg_list, tmp, bkp) {
                 msg = prelude_linked_object_get_object(tmp);
                 prelude_linked_object_del((prelude_linked_object_t *) msg);
+                memory_governor_sub(MEMORY_ACCOUNT_WRITE_QUEUE, prelude_msg_get_len(msg));
                 prelude_msg_destroy(msg);
         }
 
@@ -613,6 +765,8 @@ static int close_connection_cb(server_generic_client_t *ptr)
         if ( cnx->msg )
                 prelude_msg_destroy(cnx->msg);
 
+        update_ingest_len(cnx, 0);
+
         if ( cnx->queue )
                 idmef_message_scheduler_queue_destroy(cnx->queue);
 
@@ -640,10 +794,45 @@ static int accept_connection_cb(server_generic_client_t *ptr)
 
 
 
+static void resume_event_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+        sensor_fd_t *cnx;
+        prelude_list_t *tmp, *bkp;
+
+        if ( memory_governor_get_state() >= MEMORY_GOVERNOR_STATE_PAUSE )
+                return;
+
+        prelude_list_for_each_safe(&sensors_cnx_list, tmp, bkp) {
+                cnx = prelude_list_entry(tmp, sensor_fd_t, list);
+
+                if ( cnx->state & SERVER_GENERIC_CLIENT_STATE_PAUSED )
+                        server_generic_client_resume_read((server_generic_client_t *) cnx);
+        }
+}
+
+
+
+/*
+ * Called by the memory governor, possibly from the processing thread.
+ */
+static void resume_notify(void)
+{
+        ev_async_send(manager_event_loop, &resume_event);
+}
+
+
+
 server_generic_t *sensor_server_new(void)
 {
         server_generic_t *server;
 
+        if ( ! resume_event_initialized ) {
+                ev_async_init(&resume_event, resume_event_cb);
+                ev_async_start(manager_event_loop, &resume_event);
+                memory_governor_set_resume_callback(resume_notify);
+                resume_event_initialized = TRUE;
+        }
+
         server = server_generic_new(sizeof(sensor_fd_t), accept_connection_cb,
                                     read_connection_cb, write_connection_cb, close_connection_cb);
         if ( ! server ) {
@@ -701,6 +890,151 @@ int sensor_server_add_client(server_generic_t *server, server_generic_client_t *
 }
 
 
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+/*
+ * Only idle, unencrypted connections that were accepted by us, and that
+ * do not receive events, can be handed over: their whole state is the
+ * socket, the peer analyzerid and permission.
+ */
+static prelude_bool_t can_handoff_client(sensor_fd_t *cnx)
+{
+        if ( cnx->we_connected || cnx->rrr || cnx->msg )
+                return FALSE;
+
+        if ( ((struct sockaddr *) &cnx->sa)->sa_family != AF_UNIX )
+                return FALSE;
+
+        if ( ! cnx->fd || prelude_io_get_fdptr(cnx->fd) )
+                return FALSE;
+
+        if ( ! prelude_list_is_empty(&cnx->write_msg_list) )
+                return FALSE;
+
+        return (cnx->state & SERVER_GENERIC_CLIENT_STATE_ACCEPTED) && ! (cnx->state & SERVER_GENERIC_CLIENT_STATE_CLOSING);
+}
+
+
+
+int sensor_server_handoff_clients(void)
+{
+        int ret = 0, fd;
+        sensor_fd_t *cnx;
+        prelude_list_t *tmp;
+        prelude_string_t *out;
+
+        ret = prelude_string_new(&out);
+        if ( ret < 0 )
+                return ret;
+
+        prelude_list_for_each(&sensors_cnx_list, tmp) {
+                cnx = prelude_list_entry(tmp, sensor_fd_t, list);
+
+                if ( ! can_handoff_client(cnx) )
+                        continue;
+
+                fd = prelude_io_get_fd(cnx->fd);
+
+                ret = fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) & ~FD_CLOEXEC);
+                if ( ret < 0 )
+                        continue;
+
+                ret = prelude_string_sprintf(out, "%s%d:%" PRELUDE_PRIu64 ":%d", (prelude_string_is_empty(out)) ? "" : ",",
+                                             fd, cnx->ident, (int) cnx->permission);
+                if ( ret < 0 )
+                        break;
+        }
+
+        if ( ret >= 0 && ! prelude_string_is_empty(out) )
+                ret = setenv(SENSOR_SERVER_HANDOFF_ENV, prelude_string_get_string(out), 1);
+
+        prelude_string_destroy(out);
+
+        return ret;
+}
+
+
+
+static int adopt_client(server_generic_t **server, size_t nserver, int fd, uint64_t ident, int permission)
+{
+        int ret;
+        sensor_fd_t *cdata;
+        server_generic_t *dst;
+
+        dst = server_generic_search_client_server(server, nserver, fd);
+        if ( ! dst )
+                return -1;
+
+        cdata = calloc(1, sizeof(*cdata));
+        if ( ! cdata ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        cdata->ident = ident;
+        cdata->permission = permission;
+
+        ret = server_generic_adopt_client(dst, (server_generic_client_t *) cdata, fd);
+        if ( ret < 0 ) {
+                free(cdata);
+                return ret;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * Take over the connections handed over by a previous instance, see
+ * sensor_server_handoff_clients().
+ */
+int sensor_server_adopt_clients(server_generic_t **server, size_t nserver)
+{
+        uint64_t ident;
+        unsigned int count = 0;
+        int ret, fd, permission;
+        char *env, *ptr, *end;
+
+        env = getenv(SENSOR_SERVER_HANDOFF_ENV);
+        if ( ! env )
+                return 0;
+
+        for ( ptr = env; *ptr; ptr = (*end) ? end + 1 : end ) {
+                fd = strtol(ptr, &end, 10);
+                if ( end == ptr || *end != ':' )
+                        break;
+
+                ident = strtoull(end + 1, &end, 10);
+                if ( *end != ':' )
+                        break;
+
+                permission = strtol(end + 1, &end, 10);
+                if ( *end && *end != ',' )
+                        break;
+
+                if ( fd < 0 || fcntl(fd, F_GETFD) < 0 )
+                        continue;
+
+                ret = adopt_client(server, nserver, fd, ident, permission);
+                if ( ret < 0 ) {
+                        close(fd);
+                        continue;
+                }
+
+                count++;
+        }
+
+        unsetenv(SENSOR_SERVER_HANDOFF_ENV);
+
+        if ( count )
+                prelude_log(PRELUDE_LOG_INFO, "took over %u connection(s) from previous instance.\n", count);
+
+        return count;
+}
+#endif
+
+
+
 int sensor_server_write_client(server_generic_client_t *client, prelude_msg_t *msg)
 {
         int ret;
@@ -710,6 +1044,7 @@ int sensor_server_write_client(server_generic_client_t *client, prelude_msg_t *m
                 ret = write_client(dst, msg);
         else {
                 ret = 0;
+                memory_governor_add(MEMORY_ACCOUNT_WRITE_QUEUE, prelude_msg_get_len(msg));
                 prelude_linked_object_add_tail(&dst->write_msg_list, (prelude_linked_object_t *) msg);
         }
 
@@ -757,6 +757,159 @@ static int resolve_addr(server_generic_t *server, const char *addr, unsigned int
 
 
 
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+
+/*
+ * Listening sockets handed over by a previous manager instance on
+ * reload, see server_generic_handoff().
+ */
+static int *inherited_fd = NULL;
+static size_t inherited_count = 0;
+static prelude_bool_t inherited_loaded = FALSE;
+
+
+static void load_inherited_sockets(void)
+{
+        int fd;
+        void *tmp;
+        char *env, *ptr, *end;
+
+        if ( inherited_loaded )
+                return;
+
+        inherited_loaded = TRUE;
+
+        env = getenv(SERVER_GENERIC_HANDOFF_ENV);
+        if ( ! env )
+                return;
+
+        for ( ptr = env; *ptr; ptr = (*end) ? end + 1 : end ) {
+                fd = strtol(ptr, &end, 10);
+                if ( end == ptr || (*end && *end != ',') )
+                        break;
+
+                if ( fd < 0 || fcntl(fd, F_GETFD) < 0 )
+                        continue;
+
+                tmp = realloc(inherited_fd, sizeof(*inherited_fd) * (inherited_count + 1));
+                if ( ! tmp ) {
+                        close(fd);
+                        continue;
+                }
+
+                inherited_fd = tmp;
+                inherited_fd[inherited_count++] = fd;
+        }
+
+        unsetenv(SERVER_GENERIC_HANDOFF_ENV);
+}
+
+
+
+static prelude_bool_t is_same_address(const struct sockaddr *a, const struct sockaddr *b)
+{
+        if ( a->sa_family != b->sa_family )
+                return FALSE;
+
+        if ( a->sa_family == AF_UNIX )
+                return strcmp(((const struct sockaddr_un *) a)->sun_path, ((const struct sockaddr_un *) b)->sun_path) == 0;
+
+        if ( a->sa_family == AF_INET )
+                return ((const struct sockaddr_in *) a)->sin_port == ((const struct sockaddr_in *) b)->sin_port &&
+                       memcmp(&((const struct sockaddr_in *) a)->sin_addr,
+                              &((const struct sockaddr_in *) b)->sin_addr, sizeof(struct in_addr)) == 0;
+#ifdef HAVE_IPV6
+        if ( a->sa_family == AF_INET6 )
+                return ((const struct sockaddr_in6 *) a)->sin6_port == ((const struct sockaddr_in6 *) b)->sin6_port &&
+                       memcmp(&((const struct sockaddr_in6 *) a)->sin6_addr,
+                              &((const struct sockaddr_in6 *) b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+#endif
+        return FALSE;
+}
+
+
+
+static prelude_bool_t is_socket_bound_to(int fd, const struct sockaddr *sa)
+{
+        int ret;
+        socklen_t len;
+        struct sockaddr_storage ss;
+
+        len = sizeof(ss);
+        memset(&ss, 0, sizeof(ss));
+
+        ret = getsockname(fd, (struct sockaddr *) &ss, &len);
+        if ( ret < 0 )
+                return FALSE;
+
+        return is_same_address((struct sockaddr *) &ss, sa);
+}
+
+
+
+/*
+ * Return an inherited socket already listening on the server address,
+ * or -1 if there is none.
+ */
+static int get_inherited_socket(server_generic_t *server)
+{
+        int fd;
+        size_t i;
+
+        load_inherited_sockets();
+
+        for ( i = 0; i < inherited_count; i++ ) {
+                fd = inherited_fd[i];
+
+                if ( fd < 0 || ! is_socket_bound_to(fd, server->sa) )
+                        continue;
+
+                inherited_fd[i] = -1;
+                return fd;
+        }
+
+        return -1;
+}
+
+
+
+static void close_inherited_sockets(void)
+{
+        size_t i;
+
+        for ( i = 0; i < inherited_count; i++ ) {
+                if ( inherited_fd[i] >= 0 )
+                        close(inherited_fd[i]);
+        }
+
+        free(inherited_fd);
+
+        inherited_fd = NULL;
+        inherited_count = 0;
+}
+
+#endif
+
+
+
+static int server_start(server_generic_t *server)
+{
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+        server->sock = get_inherited_socket(server);
+        if ( server->sock >= 0 ) {
+                prelude_log(PRELUDE_LOG_DEBUG, "using listening socket inherited from previous instance.\n");
+                return 0;
+        }
+
+        if ( server->sa->sa_family == AF_UNIX )
+                return unix_server_start(server);
+#endif
+
+        return inet_server_start(server, server->sa, server->slen);
+}
+
+
+
 static int sg_bind_common(server_generic_t *server, unsigned int port)
 {
         char out[128];
@@ -823,7 +976,7 @@ int server_generic_bind_numeric(server_generic_t *server, struct sockaddr *sa, s
         server->slen = len;
         memcpy(server->sa, sa, len);
 
-        ret = inet_server_start(server, server->sa, server->slen);
+        ret = server_start(server);
         if ( ret < 0 ) {
                 free(server->sa);
                 server->sa = NULL;
@@ -843,13 +996,7 @@ int server_generic_bind(server_generic_t *server, const char *saddr, unsigned in
         if ( ret < 0 )
                 return ret;
 
-#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
-        if ( server->sa->sa_family == AF_UNIX )
-                ret = unix_server_start(server);
-        else
-#endif
-                ret = inet_server_start(server, server->sa, server->slen);
-
+        ret = server_start(server);
         if ( ret < 0 ) {
                 free(server->sa);
                 server->sa = NULL;
@@ -862,11 +1009,101 @@ int server_generic_bind(server_generic_t *server, const char *saddr, unsigned in
 
 void server_generic_start(server_generic_t **server, size_t nserver)
 {
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+        /*
+         * Inherited sockets that are no longer part of the configuration.
+         */
+        close_inherited_sockets();
+#endif
+
         wait_connection(server, nserver);
 }
 
 
 
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+/*
+ * Keep the listening sockets open across execve(), and advertise them
+ * to the new instance through the environment.
+ */
+int server_generic_handoff(server_generic_t **server, size_t nserver)
+{
+        int ret;
+        size_t i;
+        prelude_string_t *out;
+
+        ret = prelude_string_new(&out);
+        if ( ret < 0 )
+                return ret;
+
+        for ( i = 0; i < nserver; i++ ) {
+                ret = fcntl(server[i]->sock, F_SETFD, fcntl(server[i]->sock, F_GETFD) & ~FD_CLOEXEC);
+                if ( ret < 0 ) {
+                        prelude_log(PRELUDE_LOG_WARN, "could not hand off listening socket: %s.\n", strerror(errno));
+                        continue;
+                }
+
+                ret = prelude_string_sprintf(out, "%s%d", (prelude_string_is_empty(out)) ? "" : ",", server[i]->sock);
+                if ( ret < 0 )
+                        break;
+        }
+
+        if ( ret >= 0 && ! prelude_string_is_empty(out) )
+                ret = setenv(SERVER_GENERIC_HANDOFF_ENV, prelude_string_get_string(out), 1);
+
+        prelude_string_destroy(out);
+
+        return ret;
+}
+
+
+
+/*
+ * Return the server an established connection handed over by a
+ * previous instance was accepted on.
+ */
+server_generic_t *server_generic_search_client_server(server_generic_t **server, size_t nserver, int fd)
+{
+        size_t i;
+
+        for ( i = 0; i < nserver; i++ ) {
+                if ( server[i]->sa && is_socket_bound_to(fd, server[i]->sa) )
+                        return server[i];
+        }
+
+        return NULL;
+}
+
+
+
+/*
+ * Register an already authenticated connection, handed over by a
+ * previous instance, as if it had just been accepted on server.
+ */
+int server_generic_adopt_client(server_generic_t *server, server_generic_client_t *client, int fd)
+{
+        int ret;
+
+        ret = setup_client_socket(server, client, fd);
+        if ( ret < 0 )
+                return ret;
+
+        ((struct sockaddr *) &client->sa)->sa_family = server->sa->sa_family;
+        client->state = SERVER_GENERIC_CLIENT_STATE_AUTHENTICATED|SERVER_GENERIC_CLIENT_STATE_ACCEPTED;
+        client->server = server;
+
+        ret = server->accept(client);
+        if ( ret < 0 ) {
+                prelude_io_destroy(client->fd);
+                return ret;
+        }
+
+        return server_generic_process_requests(server, client);
+}
+#endif
+
+
+
 
 void server_generic_stop(server_generic_t *server)
 {
@@ -898,19 +1135,46 @@ void server_generic_notify_event(void)
 }
 
 
-void server_generic_notify_write_enable(server_generic_client_t *client)
+static void set_client_events(server_generic_client_t *client, int events)
 {
+        if ( client->state & SERVER_GENERIC_CLIENT_STATE_PAUSED )
+                events &= ~EV_READ;
+
         ev_io_stop(manager_event_loop, &client->evio);
-        ev_io_set(&client->evio, (int) prelude_io_get_fd(client->fd), EV_READ|EV_WRITE);
-        ev_io_start(manager_event_loop, &client->evio);
+        ev_io_set(&client->evio, (int) prelude_io_get_fd(client->fd), events);
+
+        if ( events )
+                ev_io_start(manager_event_loop, &client->evio);
+}
+
+
+void server_generic_notify_write_enable(server_generic_client_t *client)
+{
+        set_client_events(client, EV_READ|EV_WRITE);
 }
 
 
 void server_generic_notify_write_disable(server_generic_client_t *client)
 {
-        ev_io_stop(manager_event_loop, &client->evio);
-        ev_io_set(&client->evio, (int) prelude_io_get_fd(client->fd), EV_READ);
-        ev_io_start(manager_event_loop, &client->evio);
+        set_client_events(client, EV_READ);
+}
+
+
+/*
+ * Stop watching the client for incoming data, pending write are
+ * still processed.
+ */
+void server_generic_client_pause_read(server_generic_client_t *client)
+{
+        client->state |= SERVER_GENERIC_CLIENT_STATE_PAUSED;
+        set_client_events(client, client->evio.events & EV_WRITE);
+}
+
+
+void server_generic_client_resume_read(server_generic_client_t *client)
+{
+        client->state &= ~SERVER_GENERIC_CLIENT_STATE_PAUSED;
+        set_client_events(client, EV_READ | (client->evio.events & EV_WRITE));
 }
 
 